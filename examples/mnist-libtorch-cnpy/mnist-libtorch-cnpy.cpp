@@ -1,5 +1,4 @@
 #include "fednlib.h"
-#include "../../cnpy/cnpy.h"
 #include <torch/torch.h>
 #include <torch/script.h>
 #include <vector>
@@ -48,12 +47,17 @@ void saveParameters(Net& model, const std::string& out_path) {
         float* fc3_bias = model.fc3->bias.data_ptr<float>();
 
         // Save tensors to NPZ with specific names (without .npy suffix)
-        cnpy::npz_save(out_path, "0", fc1_weight, {64, 784}, "w");  // Write mode for the first file
-        cnpy::npz_save(out_path, "1", fc1_bias, {64}, "a");         // Append mode for the rest
-        cnpy::npz_save(out_path, "2", fc2_weight, {32, 64}, "a");
-        cnpy::npz_save(out_path, "3", fc2_bias, {32}, "a");
-        cnpy::npz_save(out_path, "4", fc3_weight, {10, 32}, "a");
-        cnpy::npz_save(out_path, "5", fc3_bias, {10}, "a");
+        NpzWriter npz;
+        bool saved = npz.open(out_path)
+            && npz.add<float>("0", {64, 784}, fc1_weight)
+            && npz.add<float>("1", {64}, fc1_bias)
+            && npz.add<float>("2", {32, 64}, fc2_weight)
+            && npz.add<float>("3", {32}, fc2_bias)
+            && npz.add<float>("4", {10, 32}, fc3_weight)
+            && npz.add<float>("5", {10}, fc3_bias);
+        if (!npz.finish() || !saved) {
+            throw std::runtime_error("failed to write " + out_path);
+        }
 
         std::cout << "Model parameters saved successfully to " << out_path << std::endl;
 
@@ -62,6 +66,20 @@ void saveParameters(Net& model, const std::string& out_path) {
     }
 }
 
+// Load an array of float32 with the expected number of elements
+std::shared_ptr<NpyArray> loadArray(const NpzReader& npz, const std::string& name, uint64_t elements) {
+    std::shared_ptr<NpyArray> array = npz.load(name);
+    if (!array || array->dtype != DType::F32 || array->elements() != elements) {
+        throw std::runtime_error("array " + name + " is missing or has the wrong dtype or size");
+    }
+    return array;
+}
+
+// torch::from_blob() takes a mutable pointer, the tensors are cloned before they are modified
+float* arrayData(const std::shared_ptr<NpyArray>& array) {
+    return const_cast<float*>(array->get<float>().data());
+}
+
 // Load the model parameters from a binary file
 
 Net loadParameters(const std::string& in_path) {
@@ -79,43 +97,37 @@ Net loadParameters(const std::string& in_path) {
 
     }    
 
-    // Step 1: Create temporary extraction folder
-    std::string extract_dir = in_path + "_extracted";
-    std::filesystem::create_directories(extract_dir);
-
-    // Step 2: Extract the zip file
-    std::string unzip_cmd = "unzip -o " + in_path + " -d " + extract_dir;
-    int unzip_status = system(unzip_cmd.c_str());
-    if (unzip_status != 0) {
-        std::cerr << "Error: Failed to unzip file " << in_path << std::endl;
+    // Step 1: Read the zip central directory, the arrays are read in place
+    std::shared_ptr<NpzReader> npz = NpzReader::open(in_path);
+    if (!npz) {
+        std::cerr << "Error: Failed to read NPZ file " << in_path << std::endl;
         return model;
     }
 
-    // Step 3: Verify extracted files
+    // Step 2: Verify the arrays
     for (int i = 0; i < 6; i++) {
-        std::string file_path = extract_dir + "/" + std::to_string(i) + ".npy";
-        if (!std::filesystem::exists(file_path)) {
-            std::cerr << "Error: Expected file " << file_path << " not found!" << std::endl;
+        if (!npz->contains(std::to_string(i))) {
+            std::cerr << "Error: Expected array " << i << " not found in " << in_path << std::endl;
             return model;
         }
     }
 
-    // Step 4: Load model weights
+    // Step 3: Load model weights
     try {
-        cnpy::NpyArray fc1_weight_arr = cnpy::npy_load(extract_dir + "/0.npy");
-        cnpy::NpyArray fc1_bias_arr = cnpy::npy_load(extract_dir + "/1.npy");
-        cnpy::NpyArray fc2_weight_arr = cnpy::npy_load(extract_dir + "/2.npy");
-        cnpy::NpyArray fc2_bias_arr = cnpy::npy_load(extract_dir + "/3.npy");
-        cnpy::NpyArray fc3_weight_arr = cnpy::npy_load(extract_dir + "/4.npy");
-        cnpy::NpyArray fc3_bias_arr = cnpy::npy_load(extract_dir + "/5.npy");
+        std::shared_ptr<NpyArray> fc1_weight_arr = loadArray(*npz, "0", 784 * 64);
+        std::shared_ptr<NpyArray> fc1_bias_arr = loadArray(*npz, "1", 64);
+        std::shared_ptr<NpyArray> fc2_weight_arr = loadArray(*npz, "2", 64 * 32);
+        std::shared_ptr<NpyArray> fc2_bias_arr = loadArray(*npz, "3", 32);
+        std::shared_ptr<NpyArray> fc3_weight_arr = loadArray(*npz, "4", 32 * 10);
+        std::shared_ptr<NpyArray> fc3_bias_arr = loadArray(*npz, "5", 10);
 
          // 🛠 **FIXED: Transpose the weight matrices**
-        auto fc1_weight = torch::from_blob(fc1_weight_arr.data<float>(), {784, 64}).t().clone();
-        auto fc1_bias = torch::from_blob(fc1_bias_arr.data<float>(), {64}).clone();
-        auto fc2_weight = torch::from_blob(fc2_weight_arr.data<float>(), {64, 32}).t().clone();
-        auto fc2_bias = torch::from_blob(fc2_bias_arr.data<float>(), {32}).clone();
-        auto fc3_weight = torch::from_blob(fc3_weight_arr.data<float>(), {32, 10}).t().clone();
-        auto fc3_bias = torch::from_blob(fc3_bias_arr.data<float>(), {10}).clone();
+        auto fc1_weight = torch::from_blob(arrayData(fc1_weight_arr), {784, 64}).t().clone();
+        auto fc1_bias = torch::from_blob(arrayData(fc1_bias_arr), {64}).clone();
+        auto fc2_weight = torch::from_blob(arrayData(fc2_weight_arr), {64, 32}).t().clone();
+        auto fc2_bias = torch::from_blob(arrayData(fc2_bias_arr), {32}).clone();
+        auto fc3_weight = torch::from_blob(arrayData(fc3_weight_arr), {32, 10}).t().clone();
+        auto fc3_bias = torch::from_blob(arrayData(fc3_bias_arr), {10}).clone();
 
 
 	// Correctly updating model weights
@@ -131,10 +143,6 @@ Net loadParameters(const std::string& in_path) {
         std::cerr << "Error loading model parameters: " << e.what() << std::endl;
     }
 
-    // Step 5: Cleanup extracted directory
-    std::filesystem::remove_all(extract_dir);
-    std::cout << "Cleanup complete: Removed " << extract_dir << std::endl;
-
     return model;
 }
 
@@ -214,6 +222,7 @@ void downloadMNISTData(const std::string& data_path) {
 class CustomGrpcClient : public GrpcClient {
 public:
     CustomGrpcClient(std::shared_ptr<ChannelInterface> channel) : GrpcClient(channel) {}
+    ~CustomGrpcClient() override { stop(); }
 
     void train(const std::string& inModelPath, const std::string& outModelPath) override {
         std::cout << "USER-DEFINED CODE: Training model..." << std::endl;
@@ -1,8 +1,8 @@
 #include "../../include/fednlib.h"
-#include "../../cnpy/cnpy.h"
 #include <torch/torch.h>
 #include <torch/script.h>
 #include <vector>
+#include <algorithm>
 #include <fstream>
 #include <typeinfo>
 #include <filesystem>
@@ -27,63 +27,64 @@ struct Net : torch::nn::Module {
     }
 };
 
-// Save the model parameters to a binary file
+// Save the model parameters to a binary file. The file holds float64 values, which is the
+// format the "binaryhelper" on the server side reads, converted block by block from the
+// float32 parameters instead of widening the whole model in memory first.
 void saveParameters(Net& model, const std::string& out_path) {
-    std::vector<double> parameters_vec;
+    std::vector<double> block(64 * 1024);
+    size_t parameters_size = 0;
 
-    // Iterate over all parameters in the model
+    std::ofstream output_file(out_path, std::ios::out | std::ios::binary);
     for (const auto& param : model.named_parameters()) {
-        auto tensor = param.value().cpu().to(torch::kFloat64);
-        auto flattened = tensor.view(-1);
-        parameters_vec.insert(parameters_vec.end(), 
-                              flattened.data_ptr<double>(),
-                              flattened.data_ptr<double>() + flattened.numel());
+        auto tensor = param.value().detach().cpu().to(torch::kFloat32).contiguous();
+        const float* data = tensor.data_ptr<float>();
+        size_t numel = tensor.numel();
+        for (size_t done = 0; done < numel; done += block.size()) {
+            size_t count = std::min(block.size(), numel - done);
+            convertF32ToF64(data + done, block.data(), count);
+            output_file.write(reinterpret_cast<const char*>(block.data()), count * sizeof(double));
+        }
+        parameters_size += numel;
     }
+    output_file.close();
 
     // Print the size of the concatenated parameters (for debugging)
-    std::cout << "Concatenated parameters size: " << parameters_vec.size() << std::endl;
-
-    // Save the parameters to a binary file
-    std::ofstream output_file(out_path, std::ios::out | std::ios::binary);
-    output_file.write(reinterpret_cast<const char*>(parameters_vec.data()), parameters_vec.size() * sizeof(double));
-    output_file.close();
+    std::cout << "Concatenated parameters size: " << parameters_size << std::endl;
 
     std::cout << "Model parameters saved to: " << out_path << std::endl;
 }
 
-// Load the model parameters from a binary file
+// Load the model parameters from a binary file of float64 values, converted straight into
+// the float32 parameters
 Net loadParameters(const std::string& in_path) {
     Net model;
 
-    // Read the parameters from the binary file
-    std::ifstream input_file(in_path, std::ios::in | std::ios::binary);
-    input_file.seekg(0, std::ios::end);
-    size_t file_size = input_file.tellg();
-    input_file.seekg(0, std::ios::beg);
-
-    std::vector<double> parameters_vec(file_size / sizeof(double));
-    input_file.read(reinterpret_cast<char*>(parameters_vec.data()), file_size);
-    input_file.close();
+    std::shared_ptr<MappedFile> input_file = MappedFile::open(in_path);
+    if (!input_file) {
+        std::cerr << "Error: could not read model file " << in_path << std::endl;
+        return model;
+    }
+    size_t parameters_size = input_file->size() / sizeof(double);
 
     // Print the size of the loaded parameters (for debugging)
-    std::cout << "Loaded parameters size: " << parameters_vec.size() << std::endl;
+    std::cout << "Loaded parameters size: " << parameters_size << std::endl;
 
     // Pointer to the raw data
-    double* param_data = parameters_vec.data();
+    const double* param_data = reinterpret_cast<const double*>(input_file->data());
+    const double* param_end = param_data + parameters_size;
 
     // Iterate over all parameters in the model and load the data
+    torch::NoGradGuard no_grad;
     for (auto& param : model.named_parameters()) {
         auto& tensor = param.value();
         size_t numel = tensor.numel();
-        
-        // Create a new tensor with the loaded data
-        auto new_tensor = torch::from_blob(param_data, {static_cast<long>(numel)}, torch::kFloat64).clone();
-        
-        // Reshape the tensor to match the original shape
-        new_tensor = new_tensor.reshape(tensor.sizes());
-        
-        // Copy the data to the model parameter
-        tensor.data().copy_(new_tensor);
+        if (param_end - param_data < static_cast<std::ptrdiff_t>(numel)) {
+            std::cerr << "Error: model file " << in_path << " is too small for the model" << std::endl;
+            break;
+        }
+
+        // The parameters are contiguous float32 tensors, converted in place
+        convertF64ToF32(param_data, tensor.data_ptr<float>(), numel);
 
         // Move the pointer to the next block of data
         param_data += numel;
@@ -170,6 +171,7 @@ void downloadMNISTData(const std::string& data_path) {
 class CustomGrpcClient : public GrpcClient {
 public:
     CustomGrpcClient(std::shared_ptr<ChannelInterface> channel) : GrpcClient(channel) {}
+    ~CustomGrpcClient() override { stop(); }
 
     void train(const std::string& inModelPath, const std::string& outModelPath) override {
         std::cout << "USER-DEFINED CODE: Training model..." << std::endl;
@@ -3,6 +3,7 @@
 class CustomGrpcClient : public GrpcClient {
 public:
     CustomGrpcClient(std::shared_ptr<ChannelInterface> channel) : GrpcClient(channel) {}
+    ~CustomGrpcClient() override { stop(); }
 
     void train(const std::string& inModelPath, const std::string& outModelPath) override {
 
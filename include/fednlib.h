@@ -5,5 +5,23 @@
 #include "fednlib/grpc.h"
 #include "fednlib/fedn.h"
 #include "fednlib/utils.h"
+#include "fednlib/outbox.h"
+#include "fednlib/rawtransfer.h"
+#include "fednlib/fileio.h"
+#include "fednlib/workspace.h"
+#include "fednlib/tensor.h"
+#include "fednlib/npz.h"
+#include "fednlib/convert.h"
+#include "fednlib/ops.h"
+#include "fednlib/delta.h"
+#include "fednlib/quantize.h"
+#include "fednlib/sparsify.h"
+#include "fednlib/lowrank.h"
+#include "fednlib/codec.h"
+#include "fednlib/dedup.h"
+#include "fednlib/modelcache.h"
+#include "fednlib/partial.h"
+#include "fednlib/privacy.h"
+#include "fednlib/secagg.h"
 
 #endif // FEDNLIB_H
\ No newline at end of file
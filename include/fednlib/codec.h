@@ -0,0 +1,260 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+struct z_stream_s;
+
+/**
+ * Chains of transforms that turn a trained model into the bytes that are uploaded, and back.
+ *
+ * A pipeline has at most one update stage, which must come first, followed by any number of
+ * stream stages:
+ *   delta(mode=xor|arithmetic, word_size=N)  delta against the global model, see delta.h
+ *   quantize(bits=8|4, block_size=N)         quantized update, see quantize.h
+ *   sparsify(ratio=R)                        top-k update, see sparsify.h
+ *   lowrank(rank=N, min_elements=N)          low-rank update, see lowrank.h
+ *   compress(level=N)                        raw deflate
+ *   checksum                                 CRC32C of the bytes at that point, checked on decode
+ *
+ * Update stages work on whole files, one tensor at a time. Stream stages run in one pass over
+ * the output of the update stage, chunk by chunk, without intermediate files, so they need
+ * memory for a chunk per stage only.
+ *
+ * Pipelines are composed at runtime from a specification such as
+ * "quantize(bits=4) | compress(level=3) | checksum", e.g. from client.yaml, see
+ * CodecPipeline::parse(). encode() returns a descriptor of the stages as run, with the
+ * parameters each one needs to be inverted, which is sent in the metadata of the model update;
+ * CodecPipeline::decode() inverts the pipeline from the descriptor alone.
+ *
+ * Stream stages are also available as plain classes that can be chained at compile time with
+ * StreamChain, where every call is resolved statically, e.g.
+ *   StreamChain<DeflateStream, ChecksumStream> chain(DeflateStream(3), ChecksumStream());
+ */
+
+/**
+ * The inputs of an encoding besides the trained model.
+ */
+struct CodecContext {
+    std::string baseModelID;  // The global model the model was trained from
+    std::string basePath;     // Its file
+    uint32_t wordSize = 4;    // Size of the weights in bytes, for deltas
+    std::function<std::string(const std::string& name)> stateFile; // Files kept across rounds, empty for none
+};
+
+/**
+ * A stage that turns a trained model into an update against the base model, file to file.
+ */
+class UpdateStage {
+public:
+    virtual ~UpdateStage() = default;
+    virtual bool encode(const CodecContext& context, const std::string& modelPath, const std::string& updatePath, json& descriptor) = 0;
+    virtual bool decode(const json& descriptor, const std::string& basePath, const std::string& updatePath, const std::string& modelPath) = 0;
+};
+
+/**
+ * A stage that transforms a byte stream chunk by chunk, with a type-erased sink.
+ */
+class StreamStage {
+public:
+    using Sink = std::function<bool(const char* data, size_t size)>;
+    virtual ~StreamStage() = default;
+    virtual bool write(const char* data, size_t size, const Sink& sink) = 0;
+    virtual bool finish(const Sink& sink) = 0;
+    virtual json describe() const = 0;
+};
+
+/**
+ * Compresses a stream with raw deflate.
+ */
+class DeflateStream {
+public:
+    explicit DeflateStream(int level = 1);
+    ~DeflateStream();
+    DeflateStream(DeflateStream&& other) noexcept;
+    DeflateStream(const DeflateStream&) = delete;
+    DeflateStream& operator=(const DeflateStream&) = delete;
+
+    template <typename Sink>
+    bool write(const char* data, size_t size, Sink& sink) {
+        return run(data, size, false) && (buffer.empty() || sink(buffer.data(), buffer.size()));
+    }
+    template <typename Sink>
+    bool finish(Sink& sink) {
+        return run(nullptr, 0, true) && (buffer.empty() || sink(buffer.data(), buffer.size()));
+    }
+    json describe() const;
+
+private:
+    bool run(const char* data, size_t size, bool end);
+    std::unique_ptr<z_stream_s> stream;
+    std::string buffer;
+    int level;
+    uint64_t inSize = 0;
+    uint64_t outSize = 0;
+};
+
+/**
+ * Decompresses a stream written by DeflateStream.
+ */
+class InflateStream {
+public:
+    InflateStream();
+    ~InflateStream();
+    InflateStream(InflateStream&& other) noexcept;
+    InflateStream(const InflateStream&) = delete;
+    InflateStream& operator=(const InflateStream&) = delete;
+
+    // Hands the output on in pieces of at most 1 MB, however well the input compressed
+    template <typename Sink>
+    bool write(const char* data, size_t size, Sink& sink) {
+        do {
+            size_t used = 0;
+            if (!run(data, size, used) || (!buffer.empty() && !sink(buffer.data(), buffer.size()))) {
+                return false;
+            }
+            data += used;
+            size -= used;
+        } while (size > 0 || pending);
+        return true;
+    }
+    template <typename Sink>
+    bool finish(Sink&) { return ended; }
+    json describe() const { return json::object(); }
+
+private:
+    bool run(const char* data, size_t size, size_t& used);
+    std::unique_ptr<z_stream_s> stream;
+    std::string buffer;
+    bool pending = false;
+    bool ended = false;
+};
+
+/**
+ * Passes a stream through, computing its CRC32C and size. With an expected checksum,
+ * finish() fails unless they match.
+ */
+class ChecksumStream {
+public:
+    ChecksumStream() = default;
+    ChecksumStream(uint32_t expectedCrc, uint64_t expectedSize) : expected(true), expectedCrc(expectedCrc), expectedSize(expectedSize) {}
+
+    template <typename Sink>
+    bool write(const char* data, size_t size, Sink& sink) {
+        update(data, size);
+        return sink(data, size);
+    }
+    template <typename Sink>
+    bool finish(Sink&) { return !expected || (crc == expectedCrc && size == expectedSize); }
+    json describe() const { return {{"crc32c", crc}, {"size", size}}; }
+
+private:
+    void update(const char* data, size_t size);
+    bool expected = false;
+    uint32_t expectedCrc = 0;
+    uint64_t expectedSize = 0;
+    uint32_t crc = 0;
+    uint64_t size = 0;
+};
+
+/**
+ * Stream stages chained at compile time: the output of each stage is handed to the next,
+ * and that of the last to the sink.
+ */
+template <typename... Stages>
+class StreamChain {
+public:
+    explicit StreamChain(Stages&&... stages) : stages(std::move(stages)...) {}
+
+    template <typename Sink>
+    bool write(const char* data, size_t size, Sink& sink) { return writeFrom<0>(data, size, sink); }
+    template <typename Sink>
+    bool finish(Sink& sink) { return finishFrom<0>(sink); }
+
+private:
+    template <size_t I, typename Sink>
+    bool writeFrom(const char* data, size_t size, Sink& sink) {
+        if constexpr (I == sizeof...(Stages)) {
+            return sink(data, size);
+        } else {
+            auto next = [&](const char* out, size_t outSize) { return writeFrom<I + 1>(out, outSize, sink); };
+            return std::get<I>(stages).write(data, size, next);
+        }
+    }
+    template <size_t I, typename Sink>
+    bool finishFrom(Sink& sink) {
+        if constexpr (I == sizeof...(Stages)) {
+            return true;
+        } else {
+            auto next = [&](const char* out, size_t outSize) { return writeFrom<I + 1>(out, outSize, sink); };
+            return std::get<I>(stages).finish(next) && finishFrom<I + 1>(sink);
+        }
+    }
+    std::tuple<Stages...> stages;
+};
+
+/**
+ * A stream stage class behind the StreamStage interface, for pipelines composed at runtime.
+ */
+template <typename T>
+class StreamStageAdapter : public StreamStage {
+public:
+    explicit StreamStageAdapter(T&& stage) : stage(std::move(stage)) {}
+    bool write(const char* data, size_t size, const Sink& sink) override { return stage.write(data, size, sink); }
+    bool finish(const Sink& sink) override { return stage.finish(sink); }
+    json describe() const override { return stage.describe(); }
+
+private:
+    T stage;
+};
+
+bool streamFile(const std::string& inPath, const std::string& outPath,
+    const std::function<bool(const char*, size_t, const StreamStage::Sink&)>& write,
+    const std::function<bool(const StreamStage::Sink&)>& finish);
+
+template <typename Chain>
+bool streamFile(const std::string& inPath, const std::string& outPath, Chain& chain) {
+    return streamFile(inPath, outPath,
+        [&](const char* data, size_t size, const StreamStage::Sink& sink) { return chain.write(data, size, sink); },
+        [&](const StreamStage::Sink& sink) { return chain.finish(sink); });
+}
+
+struct CodecBenchmark {
+    uint64_t modelSize = 0;
+    uint64_t updateSize = 0;
+    double encodeSeconds = 0;
+    double decodeSeconds = 0;
+    double relativeError = 0; // L2 error of the decoded float tensors relative to the trained ones, 0 if lossless
+};
+
+class CodecPipeline {
+public:
+    static std::shared_ptr<CodecPipeline> parse(const std::string& spec);
+
+    bool addStage(const std::string& name, const std::map<std::string, std::string>& options = {});
+    bool empty() const { return stages.empty(); }
+    std::string spec() const;
+
+    bool encode(const CodecContext& context, const std::string& modelPath, const std::string& updatePath, json& descriptor) const;
+    static bool decode(const json& descriptor, const std::string& basePath, const std::string& updatePath, const std::string& modelPath);
+    bool benchmark(const CodecContext& context, const std::string& modelPath, const std::string& scratchPrefix, CodecBenchmark& result) const;
+
+private:
+    struct Stage {
+        std::string name;
+        std::map<std::string, std::string> options;
+    };
+    std::vector<Stage> stages;
+};
+
+#endif // CODEC_H
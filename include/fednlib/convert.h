@@ -0,0 +1,32 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "tensor.h"
+
+/**
+ * Conversions between the floating point dtypes float64, float32, bfloat16 and float16.
+ *
+ * Narrowing rounds to nearest even, keeps infinities and NaNs, and produces subnormals
+ * where the target has them. float16 and bfloat16 are passed as raw uint16_t. The kernels
+ * use AVX2 and F16C when the CPU has them, chosen once at startup, and portable code
+ * otherwise.
+ */
+void convertF64ToF32(const double* in, float* out, size_t count);
+void convertF32ToF64(const float* in, double* out, size_t count);
+void convertF32ToBF16(const float* in, uint16_t* out, size_t count);
+void convertBF16ToF32(const uint16_t* in, float* out, size_t count);
+void convertF32ToF16(const float* in, uint16_t* out, size_t count);
+void convertF16ToF32(const uint16_t* in, float* out, size_t count);
+
+bool isFloatDType(DType dtype);
+bool dtypeFromName(const std::string& name, DType& dtype);
+bool convertDType(const void* in, DType from, void* out, DType to, size_t count);
+const char* conversionKernels();
+
+bool convertContainerFile(const std::string& path, DType dtype);
+
+#endif // CONVERT_H
@@ -0,0 +1,82 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+class MappedFile;
+
+/**
+ * Content-defined chunking of model files, so that an upload only carries the chunks the
+ * server does not already hold, e.g. frozen layers, unchanged embedding tables or a model
+ * that is sent back as it was received.
+ *
+ * Chunk boundaries are found with a FastCDC gear hash: a boundary is placed after a byte
+ * where the top bits of the rolling hash of the last 64 bytes are zero, with a stricter mask
+ * below the average chunk size and a looser one above it, so that chunk sizes cluster around
+ * the average. Boundaries depend on the content only, so data that moves within a file still
+ * gives the same chunks. Chunks are identified by their SHA-256.
+ *
+ * The gear table is filled with splitmix64 from seed 0. Both sides must chunk with the same
+ * table and sizes to find common chunks, so they are fixed and not configurable.
+ */
+using ChunkHash = std::array<uint8_t, 32>;
+
+struct ContentChunk {
+    int64_t offset = 0;
+    uint32_t size = 0;
+    ChunkHash hash = {};
+};
+
+constexpr uint32_t kChunkMinSize = 16 * 1024;
+constexpr uint32_t kChunkAverageSize = 64 * 1024;
+constexpr uint32_t kChunkMaxSize = 256 * 1024;
+
+void sha256(const void* data, size_t size, uint8_t digest[32]);
+std::vector<ContentChunk> chunkContent(const char* data, int64_t size);
+std::string chunkHashHex(const ChunkHash& hash);
+
+/**
+ * The chunks of the files held by the receiving side of deduplicated uploads, by hash, e.g.
+ * in a model service or a stand-in for one in tests.
+ *
+ * Files are mapped and their chunks referenced in place, not copied. A file that is replaced
+ * while it is indexed is caught when its chunks are hashed again on use.
+ */
+class ChunkStore {
+public:
+    ChunkStore();
+    ~ChunkStore();
+    ChunkStore(const ChunkStore&) = delete;
+    ChunkStore& operator=(const ChunkStore&) = delete;
+
+    bool add(const std::string& path);
+    void remove(const std::string& path);
+    bool contains(const ChunkHash& hash) const;
+    size_t size() const { return chunks.size(); }
+
+    std::vector<int64_t> missing(const std::vector<ContentChunk>& wanted) const;
+    bool complete(const std::vector<ContentChunk>& wanted, const std::string& path) const;
+
+private:
+    struct Location {
+        std::shared_ptr<MappedFile> file;
+        int64_t offset;
+        uint32_t size;
+    };
+    struct IndexedFile {
+        std::shared_ptr<MappedFile> file;
+        std::vector<ContentChunk> chunks;
+    };
+    std::map<std::string, IndexedFile> files;
+    std::map<ChunkHash, Location> chunks;
+
+    void index(const IndexedFile& indexed);
+};
+
+#endif // DEDUP_H
@@ -0,0 +1,50 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Lossless delta encoding of a model against the model it was trained from.
+ *
+ * The combiner already holds the global model a client trains from, and fine-tuning
+ * changes few bits of most weights between rounds. The encoder takes the difference of
+ * the two files word by word, either as the XOR of the bit patterns or as their integer
+ * difference (zigzag encoded, so that small changes of either sign give small numbers),
+ * splits the words into byte planes so that the high bytes, which are mostly zero, end up
+ * next to each other, and deflates every plane. Planes that do not shrink are stored.
+ *
+ * Layout, little endian:
+ *   header  "FDNDELTA", u32 version, u8 mode, u8 word size, u16 0, u64 model size,
+ *           u32 block size, u32 0
+ *   blocks  one record per byte plane: u32 stored size, u32 flags (1 if stored, 0 if raw
+ *           deflate), data
+ *   trailer u32 CRC32C of the base, u32 CRC32C of the model, "FDNDEND\0"
+ *
+ * The model and the base must be the same size. Bytes past the last whole word of a block
+ * are XORed in either mode and stored at the end of its last plane.
+ */
+enum class DeltaMode : uint8_t {
+    Xor = 1,
+    Arithmetic = 2
+};
+
+struct DeltaInfo {
+    DeltaMode mode = DeltaMode::Xor;
+    uint32_t wordSize = 4;
+    uint64_t modelSize = 0;
+    uint64_t encodedSize = 0;
+    uint32_t baseCrc = 0;
+    uint32_t modelCrc = 0;
+};
+
+const char* deltaModeName(DeltaMode mode);
+bool deltaModeFromName(const std::string& name, DeltaMode& mode);
+bool readDeltaInfo(const char* data, size_t size, DeltaInfo& info);
+
+bool encodeModelDelta(const std::string& modelPath, const std::string& basePath, const std::string& deltaPath,
+    DeltaMode mode, uint32_t wordSize, DeltaInfo* info = nullptr);
+bool decodeModelDelta(const std::string& deltaPath, const std::string& basePath, const std::string& modelPath);
+
+#endif // DELTA_H
@@ -4,6 +4,11 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <future>
+#include <atomic>
 #include <grpcpp/grpcpp.h>
 
 #include "fedn.grpc.pb.h"
@@ -13,6 +18,13 @@
 
 using grpc::ChannelInterface;
 
+struct CombinerCandidate {
+    std::string host;
+    std::shared_ptr<ChannelInterface> channel;
+    bool accepting = false;
+    long rttUs = -1;
+};
+
 class FednClient {
 public:
     FednClient(std::string configFilePath);
@@ -35,6 +47,8 @@ public:
     void setName(std::string name);
     void setPackage(std::string package);
     void setPreferredCombiner(std::string preferredCombiner);
+    void setCombinerCandidates(std::vector<std::string> hosts);
+    void clearAssignmentCache();
 
 private:
     std::shared_ptr<GrpcClient> grpcClient;
@@ -42,8 +56,27 @@ private:
     std::shared_ptr<ChannelInterface> channel;
     std::map<std::string, std::string> controllerConfig;
     std::map<std::string, std::string> combinerConfig;
+    std::chrono::steady_clock::time_point startTime;
+    std::future<json> discovery;
+    std::map<std::string, std::string> discoveryConfig;
+    std::atomic<bool> assignmentFromCache{false};
+    std::atomic<bool> discoveryCancelled{false};
+    std::vector<std::string> combinerCandidates;
+    CombinerCandidate standby;
+    std::mutex standbyMutex;
+    std::future<void> standbySelection;
 
     std::map<std::string, std::string> assignCombiner();
+    json requestAssignment(std::map<std::string, std::string> config);
+    json loadCachedAssignment(std::map<std::string, std::string>& config);
+    void cacheAssignment(std::map<std::string, std::string>& config, const json& assignment);
+    bool waitForChannel(std::shared_ptr<ChannelInterface> channel);
+    std::shared_ptr<ChannelInterface> createChannel(std::map<std::string, std::string> combinerConfig);
+    std::vector<std::string> getCandidateHosts(const std::string& host);
+    CombinerCandidate probeCombiner(std::map<std::string, std::string> combinerConfig, const std::string& host);
+    std::vector<CombinerCandidate> probeCombiners(std::map<std::string, std::string> combinerConfig, const std::vector<std::string>& hosts);
+    bool failover();
+    bool migrate(const fedn::ReassignRequest& reassign);
 };
 
 #endif // FEDNCLIENT_H
\ No newline at end of file
@@ -0,0 +1,109 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <cstdint>
+
+struct FileIOOptions {
+    std::string engine = "auto";    // "auto" (io_uring if the kernel allows it), "io_uring" or "posix"
+    bool directIO = false;          // Write model files with O_DIRECT, bypassing the page cache
+    size_t blockSize = 1024 * 1024; // Size of each read or write submitted
+    unsigned queueDepth = 8;        // Number of reads or writes in flight
+};
+
+void setFileIOOptions(const FileIOOptions& options);
+FileIOOptions getFileIOOptions();
+
+/**
+ * Backend that carries out file reads and writes. Requests are queued with submitRead()
+ * and submitWrite() and reaped with wait(); the buffers must stay valid until then.
+ *
+ * create() returns an engine on io_uring where the kernel allows it, driven through the
+ * raw system calls so liburing is not needed, and otherwise one on pread() and pwrite().
+ */
+class FileIOEngine {
+public:
+    static std::unique_ptr<FileIOEngine> create(const FileIOOptions& options);
+    virtual ~FileIOEngine() = default;
+    virtual const char* name() const = 0;
+    virtual bool submitRead(int fd, char* data, size_t size, int64_t offset, uint64_t tag) = 0;
+    virtual bool submitWrite(int fd, const char* data, size_t size, int64_t offset, uint64_t tag) = 0;
+    virtual bool submitUnlink(const std::string& path, uint64_t tag) = 0;
+    // Hands queued requests to the kernel without waiting for them
+    virtual bool flush() = 0;
+    // Waits for a request to complete. result is the number of bytes transferred or -errno.
+    virtual bool wait(uint64_t& tag, int64_t& result, bool block = true) = 0;
+    virtual size_t inFlight() const = 0;
+};
+
+/**
+ * Writes a model file in blocks through a FileIOEngine.
+ *
+ * Data is staged in aligned blocks that are written while later data is still arriving.
+ * The file is preallocated when its size is known, and with directIO the full blocks are
+ * written with O_DIRECT; the last, partial block always goes through the page cache.
+ */
+class ModelFileWriter {
+public:
+    explicit ModelFileWriter(const FileIOOptions& options = getFileIOOptions());
+    ~ModelFileWriter();
+    ModelFileWriter(const ModelFileWriter&) = delete;
+    ModelFileWriter& operator=(const ModelFileWriter&) = delete;
+
+    bool open(const std::string& path, int64_t expectedSize = -1);
+    void reserve(int64_t size);
+    bool write(const char* data, size_t size, int64_t offset);
+    bool finish(int64_t size);
+
+private:
+    struct Block {
+        char* data;
+        int64_t offset;
+        size_t size;
+    };
+
+    FileIOOptions options;
+    std::unique_ptr<FileIOEngine> engine;
+    std::string path;
+    int fd = -1;
+    int directFd = -1;
+    bool reserved = false;
+    bool failed = false;
+    std::vector<char*> freeBuffers;
+    std::vector<Block> inFlight;
+    Block current = {nullptr, 0, 0};
+
+    bool submitCurrent();
+    bool reap(bool block);
+    void close();
+};
+
+/**
+ * A file mapped read-only into memory, e.g. a model that is read or uploaded. Slices that
+ * RawModelTransfer hands to gRPC keep a reference to the mapping, so it stays valid until
+ * gRPC has sent them.
+ */
+class MappedFile {
+public:
+    static std::shared_ptr<MappedFile> open(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const char* data() const { return data_; }
+    int64_t size() const { return size_; }
+    void release(int64_t offset, int64_t size) const;
+
+private:
+    MappedFile(const char* data, int64_t size) : data_(data), size_(size) {}
+    const char* data_;
+    int64_t size_;
+};
+
+bool readModelFile(const std::string& path, std::string& data, const FileIOOptions& options = getFileIOOptions());
+bool unlinkFileAsync(const std::string& path);
+bool removeDirectoryAsync(const std::string& path);
+
+#endif // FILEIO_H
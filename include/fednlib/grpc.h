@@ -3,10 +3,33 @@
 
 #include <string>
 #include <memory>
+#include <optional>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <atomic>
+#include <cstdint>
 #include <grpcpp/grpcpp.h>
 #include "fedn.grpc.pb.h"
 #include "fedn.pb.h"
 #include "nlohmann/json.hpp"
+#include "outbox.h"
+#include "rawtransfer.h"
+#include "workspace.h"
+#include "tensor.h"
+#include "delta.h"
+#include "quantize.h"
+#include "sparsify.h"
+#include "lowrank.h"
+#include "codec.h"
+#include "dedup.h"
+#include "modelcache.h"
+#include "partial.h"
+#include "privacy.h"
+#include "secagg.h"
 
 using grpc::ChannelInterface;
 using fedn::Connector;
@@ -45,26 +68,60 @@ class GrpcClient {
 private:
     LoggingContext loggingContext;
 
+    struct QueuedTask {
+        TaskRequest task;
+        std::shared_ptr<ChannelInterface> channel; // Set for a channel switch instead of a task
+    };
+
+    // How the server encoded a download, see downloadStream()
+    struct DownloadEncoding {
+        std::string deltaBase; // The cached model the data is a delta against, empty for the model itself
+        std::string modelHash; // SHA-256 of the model, empty if the server did not send it
+    };
+
 public:
     GrpcClient(std::shared_ptr<ChannelInterface> channel);
+    virtual ~GrpcClient();
+    void stop();
+    void setChannel(std::shared_ptr<ChannelInterface> channel);
+    void switchChannel(std::shared_ptr<ChannelInterface> channel);
     void heartBeat();
-    void connectTaskStream();
+    bool connectTaskStream();
+    std::optional<fedn::ReassignRequest> takeReassignRequest();
+    std::optional<fedn::ReconnectRequest> takeReconnectRequest();
     std::string downloadModel(const std::string& modelID);
-    void downloadModelToFile(const std::string& modelID, const std::string& modelPath);
-    void uploadModel(std::string& modelID, std::string& modelData);
-    void uploadModelFromFile(const std::string& modelID, const std::string& modelPath);
+    bool downloadModelToFile(const std::string& modelID, const std::string& modelPath, TaskDirectory* task = nullptr,
+        const std::vector<std::string>& tensorNames = {});
+    bool uploadModel(std::string& modelID, std::string& modelData);
+    bool uploadModelFromFile(const std::string& modelID, const std::string& modelPath);
     virtual void updateLocalModel(const std::string& modelID, const std::string& requestData);
     virtual void train(const std::string& inModelPath, const std::string& outModelPath);
     void validateGlobalModel(const std::string& modelID, TaskRequest& requestData);
     virtual void validate(const std::string& inModelPath, const std::string& outMetricPath);
     virtual void predict(const std::string& modelPath, const std::string& outputPath);
     void predictGlobalModel(const std::string& modelID, TaskRequest& requestData);
-    void sendModelUpdate(const std::string& modelID, std::string& modelUpdateID, const std::string& config);
-    void sendModelValidation(const std::string& modelID, json& metricData, TaskRequest& requestData);
-    void sendModelPrediction(const std::string& modelID, json& predictionData, TaskRequest& requestData);
+    bool sendModelUpdate(const std::string& modelID, std::string& modelUpdateID, const std::string& config, const json& encoding = json(),
+        const json& partial = json(), const json& privacy = json(), const json& secureAggregation = json());
+    bool sendModelValidation(const std::string& modelID, json& metricData, TaskRequest& requestData);
+    bool sendModelPrediction(const std::string& modelID, json& predictionData, TaskRequest& requestData);
     void setName(const std::string& name);
     void setId(const std::string& id);
     void setChunkSize(std::size_t chunkSize);
+    void setTransferRetries(int transferRetries);
+    void setZeroCopyTransfer(bool zeroCopyTransfer);
+    void setDedupUploads(bool dedupUploads);
+    void setPrivacy(std::optional<PrivacyOptions> privacy);
+    void setSecureAggregation(std::optional<SecureAggregationOptions> secureAggregation);
+    void setPartialUpdates(bool partialUpdates);
+    void setModifiedTensors(const std::vector<std::string>& tensorNames);
+    void setRequiredTensors(const std::vector<std::string>& tensorNames);
+    std::vector<std::string> getRequiredTensors();
+    void setModelDType(std::optional<DType> modelDType);
+    void setModelDelta(std::optional<DeltaMode> modelDelta);
+    void setModelQuantization(std::optional<QuantizeOptions> modelQuantization);
+    void setModelSparsification(std::optional<SparsifyOptions> modelSparsification);
+    void setModelLowRank(std::optional<LowRankOptions> modelLowRank);
+    void setUpdatePipeline(std::shared_ptr<CodecPipeline> pipeline);
     bool logMetrics(const std::map<std::string, float>& metrics, const std::optional<int> step=std::nullopt, const bool commit=true);
     bool sendModelMetrics(const std::map<std::string, float>& metrics, 
         const std::string& name, 
@@ -75,14 +132,89 @@ public:
         const int step);
     bool logAttributes(const std::map<std::string, std::string>& attributes);
     size_t getChunkSize();
+    void setOutbox(std::shared_ptr<Outbox> outbox);
+    std::shared_ptr<Outbox> getOutbox();
+    void flushOutbox();
+    void setWorkspace(std::shared_ptr<Workspace> workspace);
+    std::shared_ptr<Workspace> getWorkspace();
+    void setModelCache(std::shared_ptr<ModelCache> modelCache);
+    std::shared_ptr<ModelCache> getModelCache();
+
+protected:
+    std::shared_ptr<Connector::Stub> getConnectorStub();
+    std::shared_ptr<Combiner::Stub> getCombinerStub();
+    std::shared_ptr<Combiner::Stub> getTaskStreamStub();
+    std::shared_ptr<ModelService::Stub> getModelServiceStub();
+    std::shared_ptr<RawModelTransfer> getRawModelTransfer();
 
 private:
-    std::unique_ptr<Connector::Stub> connectorStub_;
-    std::unique_ptr<Combiner::Stub> combinerStub_;
-    std::unique_ptr<ModelService::Stub> modelserviceStub_;
+    std::shared_ptr<Connector::Stub> connectorStub_;
+    std::shared_ptr<Combiner::Stub> combinerStub_;
+    std::shared_ptr<Combiner::Stub> taskStreamStub_;
+    std::shared_ptr<ModelService::Stub> modelserviceStub_;
+    std::shared_ptr<RawModelTransfer> rawModelTransfer_;
+    std::mutex stubMutex_;
+    std::deque<QueuedTask> taskQueue_;
+    std::mutex taskMutex_;
+    std::condition_variable taskCondition_;
+    std::thread taskWorker_;
+    bool stopWorker_ = false;
+    std::optional<fedn::ReassignRequest> reassignRequest_;
+    std::optional<fedn::ReconnectRequest> reconnectRequest_;
+    std::shared_ptr<Outbox> outbox_;
+    std::thread outboxWorker_;
+    std::condition_variable outboxCondition_;
+    bool outboxWakeup_ = false;
+    std::map<std::string, std::pair<int, std::chrono::steady_clock::time_point> > outboxRetries_;
+    bool heartbeatOk_ = false;
+    std::shared_ptr<Workspace> workspace_;
+    std::shared_ptr<ModelCache> modelCache_;
+    std::optional<std::vector<std::string>> modifiedTensors_; // Declared by the train hook, see setModifiedTensors()
+    std::vector<std::string> requiredTensors_; // Download only these tensors, see setRequiredTensors()
+
+    void processTasks();
+    void runTask(TaskRequest& task);
+    bool handleNetworkTask(const TaskRequest& task);
+    void processOutbox();
+    void wakeOutbox(bool resetBackoff);
+    bool deliver(const OutboxEntry& entry);
+    int64_t downloadStream(const std::string& modelID, const std::function<bool(std::string_view, int64_t, int64_t)>& write,
+        const std::vector<std::string>& cachedModelIDs = {}, const std::vector<std::string>& tensorNames = {},
+        DownloadEncoding* encoding = nullptr);
+    bool downloadStreamToFile(const std::string& modelID, const std::string& path, TaskDirectory* task,
+        const std::vector<std::string>& cachedModelIDs, const std::vector<std::string>& tensorNames, DownloadEncoding& encoding);
+    bool applyDownloadedDelta(const std::string& modelID, const std::string& downloadPath, const std::string& modelPath,
+        const DownloadEncoding& encoding, TaskDirectory* task);
+    bool uploadStream(const std::string& modelID, int64_t totalSize, const std::function<bool(int64_t, size_t, std::string&)>& read,
+        std::shared_ptr<MappedFile> file = nullptr);
+    int64_t queryUploadOffset(const std::string& modelID, int64_t totalSize);
+    grpc::Status queryMissingChunks(const std::string& modelID, int64_t totalSize, const std::vector<ContentChunk>& chunks,
+        std::optional<std::vector<int64_t>>& missing);
+    grpc::Status uploadChunks(const std::string& modelID, std::shared_ptr<MappedFile> file, const std::vector<ContentChunk>& chunks,
+        const std::vector<int64_t>& missing, fedn::ModelResponse& response);
+    std::optional<bool> uploadDeduplicated(const std::string& modelID, std::shared_ptr<MappedFile> file);
+    json writePartialUpdate(const std::string& modelID, const std::string& basePath, const std::string& modelPath, TaskDirectory& task);
+    json privatizeTrainedModel(const std::string& basePath, const std::string& modelPath, TaskDirectory& task);
+    json maskTrainedModel(const std::string& modelID, const std::string& modelPath, TaskDirectory& task);
+    json encodeUpdate(const CodecPipeline& pipeline, const std::string& modelID, const std::string& basePath, const std::string& modelPath, TaskDirectory& task);
+    std::vector<std::shared_ptr<CodecPipeline>> updatePipelines() const;
     std::string name_;
     std::string id_;
+    fedn::Client sender_; // Sender identity shared by all outgoing messages, see setName() and setId()
     std::size_t chunkSize; // 1 MB by default, change this to suit your needs
+    int transferRetries_ = 5;
+    bool zeroCopyTransfer_ = true; // Transfer models over RawModelTransfer, see setZeroCopyTransfer()
+    bool dedupUploads_ = false; // Upload only the chunks the server does not hold, see setDedupUploads()
+    std::atomic<bool> dedupUnsupported_{false}; // The server of the current channel does not deduplicate uploads
+    bool partialUpdates_ = false; // Upload only the tensors training modified, see setPartialUpdates()
+    std::optional<DType> modelDType_; // Floating point dtype of uploaded tensor containers, see setModelDType()
+    std::optional<DeltaMode> modelDelta_; // Upload model updates as deltas against the global model, see setModelDelta()
+    std::optional<QuantizeOptions> modelQuantization_; // Upload quantized model updates, see setModelQuantization()
+    std::optional<SparsifyOptions> modelSparsification_; // Upload sparse model updates, see setModelSparsification()
+    std::optional<LowRankOptions> modelLowRank_; // Upload low-rank model updates, see setModelLowRank()
+    std::shared_ptr<CodecPipeline> updatePipeline_; // Encode model updates with a pipeline, see setUpdatePipeline()
+    std::optional<PrivacyOptions> privacy_; // Clip and noise model updates, see setPrivacy()
+    std::optional<SecureAggregationOptions> secureAggregation_; // Mask model updates, see setSecureAggregation()
 };
 
 void sendIntervalHeartBeat(GrpcClient* client, int intervalSeconds);
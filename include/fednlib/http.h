@@ -3,6 +3,7 @@
 
 #include <string>
 #include <map>
+#include <mutex>
 #include <curl/curl.h>
 #include "nlohmann/json.hpp"
 
@@ -12,13 +13,26 @@ class HttpClient {
 public:
     HttpClient(const std::string& apiUrl, const std::string& token);
     ~HttpClient();
+    HttpClient(const HttpClient&) = delete;
+    HttpClient& operator=(const HttpClient&) = delete;
     json assign(std::map<std::string, std::string> controllerConfig);
     std::string getToken();
 
+    void setConnectTimeout(long connectTimeoutMs);
+    void setRequestTimeout(long requestTimeoutMs);
+    void setMaxRetries(int maxRetries);
+
 private:
     CURL* curl;
+    struct curl_slist* headers;
     std::string apiUrl;
     std::string token;
+    long connectTimeoutMs;
+    long requestTimeoutMs;
+    int maxRetries;
+    std::mutex curlMutex;
+
+    bool post(const std::string& url, const std::string& body, std::string& responseData, long& statusCode);
 };
 
 #endif // HTTPCLIENT_H
\ No newline at end of file
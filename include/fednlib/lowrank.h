@@ -0,0 +1,45 @@
+#ifndef LOWRANK_H
+#define LOWRANK_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+struct LowRankOptions {
+    unsigned rank = 4;         // Number of factors per matrix
+    size_t minElements = 4096; // Smaller tensors are sent as they are
+};
+
+struct LowRankReport {
+    size_t factored = 0;       // Number of tensors sent as factors
+    size_t raw = 0;            // Number of tensors sent as they are
+    double relativeError = 0;  // L2 norm of what the factors miss over that of the factored updates
+};
+
+/**
+ * Low-rank compression of model updates, after PowerSGD.
+ *
+ * The update of every matrix, i.e. the trained matrix minus the global one it was trained
+ * from, is approximated by rank pairs of factors with one step of power iteration: P is the
+ * update times the Q of the previous round, orthonormalized, and the new Q is the transposed
+ * update times P. Starting from the previous Q, which is kept locally, a single step per round
+ * tracks the dominant subspace as it drifts. What the factors miss is kept in the same state
+ * file and added to the next update (error feedback). Tensors of more than two dimensions are
+ * treated as matrices of their first dimension by the rest, e.g. the output channels of a
+ * convolution.
+ *
+ * The compressed update is a tensor container. Every factored tensor has its factors in
+ * "<name>.p" (float32, shape [rank, rows]) and "<name>.q" (float32, shape [rank, cols]); the
+ * update is the sum over the factors of the outer products of p and q. 1D tensors, tensors of
+ * fewer than minElements and those the factors would not shrink are stored as float32 updates
+ * under their name. The tensor "__lowrank__" holds a JSON manifest with the dtype, shape and
+ * rank of every such tensor, rank 0 for updates stored as they are. Tensors that are not
+ * floating point or have no counterpart in the global model are stored as they are.
+ *
+ * Only models written as fednlib tensor containers can be compressed.
+ */
+bool lowRankUpdate(const std::string& modelPath, const std::string& basePath, const std::string& statePath,
+    const std::string& updatePath, const LowRankOptions& options, LowRankReport* report = nullptr);
+bool expandLowRankUpdate(const std::string& updatePath, const std::string& basePath, const std::string& modelPath);
+
+#endif // LOWRANK_H
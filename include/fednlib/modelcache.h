@@ -0,0 +1,54 @@
+#ifndef MODELCACHE_H
+#define MODELCACHE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <filesystem>
+#include <cstddef>
+#include <cstdint>
+
+class Workspace;
+
+/**
+ * The last few global models downloaded, kept across rounds and restarts, so that the next
+ * global model can be downloaded as a delta against one of them, see
+ * GrpcClient::downloadModelToFile().
+ *
+ * Every model is a file in the cache directory named after its model ID, and the most
+ * recently used file is the one with the newest modification time. Files are added under a
+ * temporary name and renamed, so a crash never leaves a partial model behind. A model is
+ * hard linked into the cache where it is on the same file system, and copied otherwise.
+ *
+ * With a workspace given, the cached models count against its quota, see
+ * Workspace::reserveState(). The least recently used models are evicted to make room for a
+ * new one, and a model that does not fit on its own is not cached.
+ */
+class ModelCache {
+public:
+    ModelCache(const std::string& directory, size_t capacity, std::shared_ptr<Workspace> workspace = nullptr);
+    ~ModelCache();
+    ModelCache(const ModelCache&) = delete;
+    ModelCache& operator=(const ModelCache&) = delete;
+
+    std::vector<std::string> modelIDs();
+    std::string path(const std::string& modelID);
+    bool insert(const std::string& modelID, const std::string& modelPath);
+    void remove(const std::string& modelID);
+
+private:
+    std::string directory;
+    size_t capacity;
+    std::shared_ptr<Workspace> workspace;
+    uint64_t reservedBytes = 0; // Reserved in the workspace for the cached models
+    std::mutex cacheMutex;
+
+    std::string fileName(const std::string& modelID) const;
+    std::vector<std::filesystem::path> cachedFiles();
+    bool reserve(uint64_t bytes);
+    void removeFile(const std::filesystem::path& file);
+    void evict();
+};
+
+#endif // MODELCACHE_H
@@ -0,0 +1,147 @@
+#ifndef NPZ_H
+#define NPZ_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstdint>
+
+#include "tensor.h"
+
+class MappedFile;
+class ModelFileWriter;
+
+/**
+ * An array read from a NumPy .npy file or an entry of a .npz archive.
+ *
+ * The data is a view into the mapped file when the entry is stored uncompressed and its
+ * data is aligned for the dtype, and a copy otherwise. Either way it stays valid as long
+ * as the array exists.
+ */
+struct NpyArray {
+    std::string name;
+    DType dtype = DType::F32;
+    std::vector<uint64_t> shape;
+    bool fortranOrder = false;
+
+    static std::shared_ptr<NpyArray> fromBuffer(const char* data, size_t size, std::shared_ptr<const void> owner = nullptr);
+
+    uint64_t elements() const;
+    TensorSpan<const uint8_t> bytes() const {
+        return TensorSpan<const uint8_t>(reinterpret_cast<const uint8_t*>(data), size);
+    }
+
+    /**
+     * @brief Returns the elements of the array.
+     *
+     * @throws std::runtime_error If the dtype of the array does not match T.
+     */
+    template <typename T>
+    TensorSpan<const T> get() const {
+        if (!dtypeMatches<T>(dtype)) {
+            throw std::runtime_error("Array " + name + " has dtype " + dtypeName(dtype));
+        }
+        return TensorSpan<const T>(reinterpret_cast<const T*>(data), size / sizeof(T));
+    }
+
+private:
+    friend class NpzReader;
+
+    const char* data = nullptr;
+    size_t size = 0;
+    std::shared_ptr<const void> owner; // Keeps the mapped file or the copy alive
+};
+
+/**
+ * Reads a NumPy .npz archive, as written by numpy.savez() and numpy.savez_compressed(),
+ * without extracting it.
+ *
+ * The zip central directory is read from the mapped file when the reader is opened.
+ * Arrays are read with load(): stored entries are returned in place, deflated entries are
+ * inflated straight into the memory of the array. Zip64 archives are supported.
+ */
+class NpzReader {
+public:
+    static std::shared_ptr<NpzReader> open(const std::string& path);
+    static std::shared_ptr<NpzReader> fromBuffer(const char* data, size_t size);
+
+    const std::vector<std::string>& names() const { return entryNames; }
+    bool contains(const std::string& name) const { return entries.count(name) > 0; }
+    std::shared_ptr<NpyArray> load(const std::string& name, bool verify = true) const;
+
+private:
+    struct Entry {
+        uint16_t flags;
+        uint16_t method;
+        uint32_t crc;
+        uint64_t compressedSize;
+        uint64_t uncompressedSize;
+        uint64_t localOffset;
+    };
+
+    NpzReader() = default;
+    bool parse();
+    std::shared_ptr<NpyArray> inflateEntry(const std::string& name, const Entry& entry, const char* start, bool verify) const;
+
+    std::shared_ptr<MappedFile> file;
+    const char* data = nullptr;
+    size_t size = 0;
+    std::vector<std::string> entryNames;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+/**
+ * Writes a NumPy .npz archive that numpy.load() reads, e.g. with the FEDn numpy helpers
+ * on the server side.
+ *
+ * Arrays are written from the caller's memory in the order they are added. Stored entries
+ * are padded so that their data is 64 byte aligned in the archive, which lets NpzReader
+ * return them in place.
+ */
+class NpzWriter {
+public:
+    explicit NpzWriter(bool compress = false);
+    ~NpzWriter();
+    NpzWriter(const NpzWriter&) = delete;
+    NpzWriter& operator=(const NpzWriter&) = delete;
+
+    bool open(const std::string& path);
+    void openBuffer(std::string& buffer);
+    bool add(const std::string& name, DType dtype, const std::vector<uint64_t>& shape, const void* data, size_t size, bool fortranOrder = false);
+    bool finish();
+
+    template <typename T>
+    bool add(const std::string& name, const std::vector<uint64_t>& shape, const T* data) {
+        TensorInfo info;
+        info.shape = shape;
+        return add(name, dtypeOf<T>(), shape, data, info.elements() * sizeof(T));
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        uint16_t flags;
+        uint16_t method;
+        uint32_t crc;
+        uint64_t compressedSize;
+        uint64_t uncompressedSize;
+        uint64_t localOffset;
+    };
+
+    bool compress;
+    std::unique_ptr<ModelFileWriter> fileWriter;
+    std::string* buffer = nullptr;
+    uint64_t position = 0;
+    bool failed = false;
+    std::vector<Entry> entries;
+
+    bool emit(const void* data, size_t size);
+    bool deflateEntry(const std::string& header, const void* data, size_t size, uint64_t& compressedSize);
+};
+
+std::shared_ptr<NpyArray> loadNpy(const std::string& path);
+bool saveNpy(const std::string& path, DType dtype, const std::vector<uint64_t>& shape, const void* data, size_t size);
+
+#endif // NPZ_H
@@ -0,0 +1,108 @@
+#ifndef OPS_H
+#define OPS_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#include "tensor.h"
+
+/**
+ * Elementwise arithmetic and reductions over flat float32 buffers, e.g. the tensors of a
+ * model read with TensorReader: deltas against the global model, norm clipping, weighted
+ * averages of checkpoints, momentum buffers, Gaussian noise, fixed-point encoding and
+ * masking of int32 buffers, and screening for NaN and Inf before upload.
+ *
+ * The kernels use AVX-512, AVX2 or NEON when the CPU has them, chosen once at startup, and
+ * portable code otherwise. Buffers of a million elements or more are split in fixed chunks
+ * that run on a small pool of threads, see setThreads().
+ *
+ * Results do not depend on the kernels or the number of threads: elementwise operations
+ * round every multiplication and addition separately, and reductions accumulate in double
+ * in a fixed order (16 interleaved sums per chunk, combined in chunk order). A model
+ * checked on one machine gives the same bits on another.
+ */
+namespace fednlib {
+namespace ops {
+
+struct Stats {
+    double sumSquares = 0;  // Sum of the squares, Inf or NaN if there are non-finite values
+    float maxAbs = 0;       // Largest absolute value, not counting NaNs
+    uint64_t nonFinite = 0; // Number of NaNs and infinities
+};
+
+void axpy(float a, const float* x, float* y, size_t count);
+void axpby(float a, const float* x, float b, float* y, size_t count);
+void scale(float a, float* x, size_t count);
+void sub(const float* x, const float* y, float* out, size_t count);
+void clamp(float* x, size_t count, float low, float high);
+void weightedSum(const float* const* inputs, const float* weights, size_t inputCount, float* out, size_t count);
+
+Stats stats(const float* x, size_t count);
+double l2Norm(const float* x, size_t count);
+float maxAbs(const float* x, size_t count);
+bool allFinite(const float* x, size_t count);
+double clipL2(float* x, size_t count, double maxNorm);
+double dot(const float* x, const float* y, size_t count);
+double squaredDistance(const float* x, const float* y, size_t count);
+void addGaussianNoise(float* x, size_t count, float stddev, uint64_t seed, uint64_t stream, uint64_t first = 0);
+void toFixedPoint(const float* x, int32_t* out, size_t count, float scale, float limit);
+void addMask(int32_t* x, size_t count, const uint8_t key[32], uint64_t nonce, bool subtract, uint64_t first = 0);
+
+void multiply(const float* a, size_t rows, size_t cols, const float* x, size_t vectors, float* y);
+void multiplyTransposed(const float* a, size_t rows, size_t cols, const float* x, size_t vectors, float* y);
+void addOuter(float alpha, const float* p, const float* q, size_t vectors, float* a, size_t rows, size_t cols);
+
+bool quantize(const float* x, float* error, size_t count, unsigned bits, size_t blockSize, uint32_t seed,
+    uint8_t* codes, float* params);
+bool dequantize(const uint8_t* codes, const float* params, size_t count, unsigned bits, size_t blockSize, float* out);
+
+size_t topK(const float* x, size_t count, size_t k, uint32_t seed, uint64_t* indices);
+
+inline size_t quantizedSize(size_t count, unsigned bits) { return bits == 4 ? (count + 1) / 2 : count; }
+inline size_t quantizedBlocks(size_t count, size_t blockSize) {
+    return blockSize > 0 ? (count + blockSize - 1) / blockSize : (count > 0 ? 1 : 0);
+}
+
+void setThreads(unsigned threads);
+bool setKernels(const std::string& name);
+const char* kernels();
+
+// The same operations on spans, whose sizes must match
+
+inline void checkSizes(size_t a, size_t b) {
+    if (a != b) {
+        throw std::runtime_error("ops: buffers of " + std::to_string(a) + " and " + std::to_string(b) + " elements");
+    }
+}
+
+inline void axpy(float a, TensorSpan<const float> x, TensorSpan<float> y) {
+    checkSizes(x.size(), y.size());
+    axpy(a, x.data(), y.data(), x.size());
+}
+
+inline void axpby(float a, TensorSpan<const float> x, float b, TensorSpan<float> y) {
+    checkSizes(x.size(), y.size());
+    axpby(a, x.data(), b, y.data(), x.size());
+}
+
+inline void scale(float a, TensorSpan<float> x) { scale(a, x.data(), x.size()); }
+
+inline void sub(TensorSpan<const float> x, TensorSpan<const float> y, TensorSpan<float> out) {
+    checkSizes(x.size(), y.size());
+    checkSizes(x.size(), out.size());
+    sub(x.data(), y.data(), out.data(), x.size());
+}
+
+inline void clamp(TensorSpan<float> x, float low, float high) { clamp(x.data(), x.size(), low, high); }
+inline Stats stats(TensorSpan<const float> x) { return stats(x.data(), x.size()); }
+inline double l2Norm(TensorSpan<const float> x) { return l2Norm(x.data(), x.size()); }
+inline float maxAbs(TensorSpan<const float> x) { return maxAbs(x.data(), x.size()); }
+inline bool allFinite(TensorSpan<const float> x) { return allFinite(x.data(), x.size()); }
+inline double clipL2(TensorSpan<float> x, double maxNorm) { return clipL2(x.data(), x.size(), maxNorm); }
+
+} // namespace ops
+} // namespace fednlib
+
+#endif // OPS_H
@@ -0,0 +1,65 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <ctime>
+#include <cstdio>
+
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+struct OutboxEntry {
+    std::string id;
+    std::string kind;       // "update", "validation", "prediction" or "metrics"
+    std::string sessionId;
+    std::string roundId;
+    std::string blobPath;   // File delivered with the entry, empty if none
+    json payload;           // Everything else needed to redo the RPCs
+    std::time_t createdAt = 0;
+};
+
+/**
+ * Durable store for results that could not be delivered to the combiner.
+ *
+ * Entries are recorded in an append-only journal in the outbox directory, and files
+ * that belong to an entry (the model update) are moved to blobs/ next to it, so the
+ * outbox survives a restart of the client. The journal is compacted as entries are
+ * delivered, so it stays proportional to the pending entries.
+ */
+class Outbox {
+public:
+    Outbox(const std::string& directory, long ttlSeconds);
+    ~Outbox();
+    Outbox(const Outbox&) = delete;
+    Outbox& operator=(const Outbox&) = delete;
+
+    std::string put(const std::string& kind, const std::string& sessionId, const std::string& roundId,
+        const json& payload, const std::string& filePath = "");
+    void update(const std::string& id, const json& payload);
+    void complete(const std::string& id);
+    void drop(const std::string& id, const std::string& reason);
+    void expire(const std::string& sessionId, const std::string& roundId);
+    std::vector<OutboxEntry> pending();
+    size_t size();
+
+private:
+    std::string directory;
+    std::string journalPath;
+    long ttl;
+    FILE* journal;
+    size_t journalRecords = 0; // Records in the journal, pending or not
+    std::map<std::string, OutboxEntry> entries;
+    std::mutex outboxMutex;
+
+    void load();
+    void compact();
+    void compactIfNeeded();
+    void append(const json& record);
+    void remove(const std::string& id);
+};
+
+#endif // OUTBOX_H
\ No newline at end of file
@@ -0,0 +1,32 @@
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <cstddef>
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+/**
+ * Partial models, a subset of the named tensors of a model, for clients that train only some
+ * tensors, e.g. the last layers when fine-tuning, and for clients that need only some tensors
+ * of the global model.
+ *
+ * A partial model is a tensor container with the tensors it carries and a U8 manifest tensor
+ * named "__partial__" holding JSON:
+ *   {"version": 1, "base_model_id": "...", "tensors": ["fc.weight", ...], "model_tensors": N}
+ * where tensors lists the tensors carried, in container order, and model_tensors is the number
+ * of tensors of the whole model. Every other tensor is the one of the base model, so the
+ * receiver merges a partial model into the base model to get the whole model, see
+ * mergePartialModel(). Models that are not tensor containers cannot be partial.
+ */
+extern const char kPartialManifestTensor[];
+
+bool writePartialModel(const std::string& modelPath, const std::vector<std::string>& tensorNames,
+    const std::string& baseModelID, const std::string& partialPath, json* manifest = nullptr, size_t modelTensors = 0);
+std::optional<json> readPartialManifest(const std::string& path);
+bool mergePartialModel(const std::string& basePath, const std::string& partialPath, const std::string& modelPath);
+
+#endif // PARTIAL_H
@@ -0,0 +1,36 @@
+#ifndef PRIVACY_H
+#define PRIVACY_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+struct PrivacyOptions {
+    double clipNorm = 1.0;        // Largest L2 norm of an update, over all its tensors
+    double noiseMultiplier = 1.0; // Standard deviation of the noise as a multiple of clipNorm
+    uint64_t seed = 0;            // Seed of the noise, a new random one for every update
+};
+
+/**
+ * Differentially private model updates with the Gaussian mechanism, applied on the client
+ * before the update is encoded or uploaded.
+ *
+ * The update, i.e. the trained model minus the global model it was trained from, is scaled
+ * down to an L2 norm of at most clipNorm, taken over all its floating point tensors, and
+ * Gaussian noise of standard deviation noiseMultiplier * clipNorm is added to every element,
+ * see fednlib::ops::addGaussianNoise(). The result is written as a model, the global model
+ * plus the private update, in the dtypes of the trained model, so codecs and receivers
+ * handle it like any trained model.
+ *
+ * Tensors are streamed in blocks, two passes over the model: one for the norm, one to clip,
+ * add noise and write. The arithmetic is in float32, so float64 tensors keep float32
+ * precision only. Tensors that are not floating point, e.g. step counters, are copied
+ * as trained and are not protected. A floating point tensor without a counterpart of the same
+ * size in the global model counts as an update against zeros.
+ *
+ * Only models written as fednlib tensor containers can be made private.
+ */
+bool privatizeUpdate(const std::string& modelPath, const std::string& basePath, const std::string& privatePath,
+    const PrivacyOptions& options, double* norm = nullptr);
+
+#endif // PRIVACY_H
@@ -0,0 +1,36 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+struct QuantizeOptions {
+    unsigned bits = 8;      // 8 or 4 bits per value
+    size_t blockSize = 256; // Values that share a scale and an offset, a multiple of 16, 0 for one per tensor
+    uint32_t seed = 0;      // Seed of the stochastic rounding, use a new one for every update
+};
+
+/**
+ * Lossy compression of model updates to 8 or 4 bits per weight.
+ *
+ * The update, i.e. the trained model minus the global model it was trained from, is
+ * quantized per block with stochastic rounding, see fednlib::ops::quantize(). What the
+ * codes fail to represent is kept in a residual file and added to the next update (error
+ * feedback), so the rounding errors do not build up over the rounds.
+ *
+ * The quantized update is a tensor container. Every quantized tensor is stored under its
+ * name as uint8 codes, with its scales and offsets in "<name>.qparams" (float32, shape
+ * [blocks, 2]). The tensor "__quantization__" holds a JSON manifest with the bits, the block
+ * size and the dtype and shape of every quantized tensor. Tensors that are not floating
+ * point or have no counterpart in the global model are stored as they are.
+ *
+ * Only models written as fednlib tensor containers can be quantized.
+ */
+bool quantizationFromName(const std::string& name, unsigned& bits);
+
+bool quantizeUpdate(const std::string& modelPath, const std::string& basePath, const std::string& residualPath,
+    const std::string& updatePath, const QuantizeOptions& options);
+bool dequantizeUpdate(const std::string& updatePath, const std::string& basePath, const std::string& modelPath);
+
+#endif // QUANTIZE_H
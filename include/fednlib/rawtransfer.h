@@ -0,0 +1,51 @@
+#ifndef RAWTRANSFER_H
+#define RAWTRANSFER_H
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/generic/generic_stub.h>
+#include "fedn.pb.h"
+#include "fileio.h"
+
+/**
+ * A ModelResponse as seen by the transfer code. The views point into the received
+ * message and are only valid while the handler it is passed to runs.
+ */
+struct ModelChunk {
+    std::string_view id;
+    fedn::ModelStatus status = fedn::ModelStatus::OK;
+    std::string_view message;
+    int64_t offset = 0;
+    int64_t totalSize = 0;
+    std::vector<std::string_view> data; // The data field, in one piece per received slice
+    std::string_view deltaBase;         // The cached model the data is a delta against, empty for the model itself
+    std::string_view modelHash;         // SHA-256 of the model, empty if the server does not send it
+};
+
+/**
+ * ModelService transfers over the generic stub, without copying model data into or out of
+ * protobuf messages.
+ *
+ * Messages are framed by hand and are wire-compatible with ModelRequest and ModelResponse,
+ * so the combiner does not need to know about this path. Outgoing chunks reference the
+ * mapped model file, and incoming chunks are handed over as views of the received slices.
+ */
+class RawModelTransfer {
+public:
+    explicit RawModelTransfer(std::shared_ptr<grpc::ChannelInterface> channel);
+
+    grpc::Status download(grpc::ClientContext& context, const fedn::ModelRequest& request,
+        const std::function<bool(const ModelChunk&)>& onChunk);
+    grpc::Status upload(grpc::ClientContext& context, const std::string& modelID, const fedn::Client& sender,
+        std::shared_ptr<MappedFile> file, int64_t& offset, size_t chunkSize, fedn::ModelResponse& response);
+
+private:
+    grpc::GenericStub stub_;
+};
+
+#endif // RAWTRANSFER_H
\ No newline at end of file
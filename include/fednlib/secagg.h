@@ -0,0 +1,97 @@
+#ifndef SECAGG_H
+#define SECAGG_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <array>
+#include <memory>
+#include <optional>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Secure aggregation with pairwise masks (Bonawitz et al., "Practical Secure Aggregation for
+ * Privacy-Preserving Machine Learning"), so the combiner sees the sum of the updates of a
+ * round but none of them in the clear.
+ *
+ * Every client of a round draws an X25519 key pair and publishes the public key through a
+ * KeyExchange. Every two clients agree on a secret, derive a mask key from it with
+ * HKDF-SHA256 and expand the key into a mask with ChaCha20, see fednlib::ops::addMask(). The
+ * client with the smaller ID adds the mask and the other one subtracts it, so the masks cancel
+ * in the sum of the models.
+ *
+ * The floating point tensors of a model are encoded in fixed point with fractionalBits bits
+ * after the point, masked, and written as int32 tensors of the same names and shapes, with a
+ * U8 manifest tensor named "__secure_aggregation__" holding JSON:
+ *   {"version": 1, "fractional_bits": 16, "tensors": {"fc.weight": "float32", ...}}
+ * The sum of the masked models of all the clients modulo 2^32, divided by 2^fractionalBits,
+ * is the sum of their models, see sumMaskedModels(). Values are clamped to
+ * (2^31 - 1) / clients / 2^fractionalBits in absolute value, so the sum cannot overflow.
+ * Tensors that are not floating point, e.g. step counters, are copied in the clear.
+ *
+ * All the clients of a round must upload masked models with the same tensors. There is no
+ * recovery of the masks of a client that drops out after the key exchange, the sum of the
+ * round cannot be unmasked without it.
+ */
+extern const char kMaskManifestTensor[];
+
+/**
+ * Publishes the public keys of the clients of a round, e.g. over a shared directory or a key
+ * service of the deployment.
+ */
+class KeyExchange {
+public:
+    virtual ~KeyExchange() = default;
+
+    /**
+     * @brief Publishes the public key of a client for a round and returns the public keys of
+     * all the clients of the round, its own included, by client ID. All the clients of a
+     * round must get the same keys.
+     *
+     * @return The keys, std::nullopt if they are not all known in time.
+     */
+    virtual std::optional<std::map<std::string, std::string>> exchange(const std::string& roundID, const std::string& clientID,
+        const std::string& publicKey) = 0;
+};
+
+/**
+ * A KeyExchange over a directory the clients share, e.g. on a network file system, or on
+ * local disk for clients on one machine. A client writes its key to a file of its own in a
+ * directory of the round and waits until the expected number of clients have written theirs.
+ * A published key is never replaced, and the directories of old rounds are removed.
+ */
+class DirectoryKeyExchange : public KeyExchange {
+public:
+    DirectoryKeyExchange(const std::string& directory, size_t clients, std::chrono::milliseconds timeout);
+    std::optional<std::map<std::string, std::string>> exchange(const std::string& roundID, const std::string& clientID,
+        const std::string& publicKey) override;
+
+private:
+    std::string directory_;
+    size_t clients_;
+    std::chrono::milliseconds timeout_;
+
+    void removeOldRounds(const std::string& currentRound);
+};
+
+struct SecureAggregationOptions {
+    std::shared_ptr<KeyExchange> keyExchange;
+    int fractionalBits = 16; // Bits after the point of the fixed-point encoding, 0 to 30
+};
+
+// The key of the mask a client shares with another client of the round
+struct MaskKey {
+    std::string peerID;
+    std::array<uint8_t, 32> key;
+    bool subtract = false; // The client with the larger ID subtracts the mask
+};
+
+void x25519(uint8_t out[32], const uint8_t scalar[32], const uint8_t point[32]);
+std::array<uint8_t, 32> hkdfSha256(const std::string& secret, const std::string& salt, const std::string& info);
+std::optional<std::vector<MaskKey>> agreeMaskKeys(KeyExchange& exchange, const std::string& roundID, const std::string& clientID);
+bool maskModel(const std::string& modelPath, const std::string& maskedPath, const std::vector<MaskKey>& keys, int fractionalBits);
+bool sumMaskedModels(const std::vector<std::string>& paths, const std::string& sumPath);
+
+#endif // SECAGG_H
@@ -0,0 +1,34 @@
+#ifndef SPARSIFY_H
+#define SPARSIFY_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+struct SparsifyOptions {
+    double ratio = 0.01; // Fraction of the weights of every tensor to send, in (0, 1]
+};
+
+/**
+ * Top-k sparsification of model updates.
+ *
+ * Of the update, i.e. the trained model minus the global model it was trained from, only
+ * the largest entries of every tensor by magnitude are sent, see fednlib::ops::topK().
+ * The entries that are not sent are kept in a residual file and added to the next update,
+ * so small but steady changes get through over a few rounds.
+ *
+ * The sparse update is a tensor container. Every sparse tensor is stored under its name as
+ * uint8 positions, the gaps between consecutive positions as LEB128 varints (the first
+ * counted from -1, so that every gap is at least 1 and stored as gap - 1), with the values
+ * in "<name>.values" (float32, shape [k]). The tensor "__sparsification__" holds a JSON
+ * manifest with the ratio and the dtype, shape and number of entries k of every sparse
+ * tensor. Tensors that are not floating point or have no counterpart in the global model
+ * are stored as they are.
+ *
+ * Only models written as fednlib tensor containers can be sparsified.
+ */
+bool sparsifyUpdate(const std::string& modelPath, const std::string& basePath, const std::string& residualPath,
+    const std::string& updatePath, const SparsifyOptions& options);
+bool densifyUpdate(const std::string& updatePath, const std::string& basePath, const std::string& modelPath);
+
+#endif // SPARSIFY_H
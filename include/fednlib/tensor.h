@@ -0,0 +1,229 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#if __has_include(<version>)
+#include <version>
+#endif
+#if defined(__cpp_lib_span)
+#include <span>
+#endif
+
+class MappedFile;
+class ModelFileWriter;
+
+#if defined(__cpp_lib_span)
+template <typename T>
+using TensorSpan = std::span<T>;
+#else
+/**
+ * View of contiguous elements, the subset of std::span used by fednlib for C++17 builds.
+ */
+template <typename T>
+class TensorSpan {
+public:
+    TensorSpan() = default;
+    TensorSpan(T* data, size_t size) : data_(data), size_(size) {}
+    T* data() const { return data_; }
+    size_t size() const { return size_; }
+    size_t size_bytes() const { return size_ * sizeof(T); }
+    bool empty() const { return size_ == 0; }
+    T* begin() const { return data_; }
+    T* end() const { return data_ + size_; }
+    T& operator[](size_t i) const { return data_[i]; }
+    TensorSpan subspan(size_t offset, size_t count) const { return TensorSpan(data_ + offset, count); }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+};
+#endif
+
+enum class DType : uint8_t {
+    F64 = 0,
+    F32 = 1,
+    F16 = 2,
+    BF16 = 3,
+    I64 = 4,
+    I32 = 5,
+    I16 = 6,
+    I8 = 7,
+    U8 = 8
+};
+
+size_t dtypeSize(DType dtype);
+const char* dtypeName(DType dtype);
+
+// Whether elements of a dtype can be accessed as T. F16 and BF16 are accessed as raw uint16_t.
+template <typename T> inline bool dtypeMatches(DType dtype) { return false; }
+template <> inline bool dtypeMatches<double>(DType dtype) { return dtype == DType::F64; }
+template <> inline bool dtypeMatches<float>(DType dtype) { return dtype == DType::F32; }
+template <> inline bool dtypeMatches<uint16_t>(DType dtype) { return dtype == DType::F16 || dtype == DType::BF16; }
+template <> inline bool dtypeMatches<int64_t>(DType dtype) { return dtype == DType::I64; }
+template <> inline bool dtypeMatches<int32_t>(DType dtype) { return dtype == DType::I32; }
+template <> inline bool dtypeMatches<int16_t>(DType dtype) { return dtype == DType::I16; }
+template <> inline bool dtypeMatches<int8_t>(DType dtype) { return dtype == DType::I8; }
+template <> inline bool dtypeMatches<uint8_t>(DType dtype) { return dtype == DType::U8; }
+
+template <typename T> DType dtypeOf();
+template <> inline DType dtypeOf<double>() { return DType::F64; }
+template <> inline DType dtypeOf<float>() { return DType::F32; }
+template <> inline DType dtypeOf<int64_t>() { return DType::I64; }
+template <> inline DType dtypeOf<int32_t>() { return DType::I32; }
+template <> inline DType dtypeOf<int16_t>() { return DType::I16; }
+template <> inline DType dtypeOf<int8_t>() { return DType::I8; }
+template <> inline DType dtypeOf<uint8_t>() { return DType::U8; }
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+// Version of the JSON manifests that encodings of a model keep in a tensor of the container,
+// e.g. quantize.h, sparsify.h, lowrank.h, partial.h and secagg.h
+constexpr int kManifestVersion = 1;
+
+struct TensorInfo {
+    std::string name;
+    DType dtype = DType::F32;
+    std::vector<uint64_t> shape;
+    uint64_t offset = 0;   // Offset of the data in the container, a multiple of 64
+    uint64_t size = 0;     // Size of the data in bytes
+    bool hasChecksum = false;
+    uint32_t checksum = 0; // CRC32C of the data
+
+    uint64_t elements() const;
+};
+
+/**
+ * Reads a fednlib tensor container without copying the tensors.
+ *
+ * A container holds named tensors, each with a dtype and a shape. All numbers are little
+ * endian and the layout is:
+ *
+ *   header (64 bytes): "FEDNTNSR", u32 version, u32 flags, zero padding
+ *   tensor data, each tensor starting at a multiple of 64 bytes
+ *   index: per tensor u16 name length, name, u8 dtype, u8 rank, u8 has checksum, u8 0,
+ *          u32 checksum, u64 offset, u64 size, u64 dimensions[rank]
+ *   footer (32 bytes): u64 index offset, u64 index size, u32 tensor count, u32 CRC32C of the index, "FEDNTEND"
+ *
+ * The index follows the data, so containers can be written one tensor at a time, see
+ * TensorWriter. Opened from a file, the container is mapped into memory and the views
+ * returned stay valid as long as the reader exists.
+ */
+class TensorReader {
+public:
+    static std::shared_ptr<TensorReader> open(const std::string& path);
+    static std::shared_ptr<TensorReader> openIfContainer(const std::string& path);
+    static std::shared_ptr<TensorReader> fromBuffer(const char* data, size_t size);
+    static bool isContainer(const char* data, size_t size);
+
+    const std::vector<TensorInfo>& tensors() const { return index; }
+    const TensorInfo* find(const std::string& name) const;
+    TensorSpan<const uint8_t> bytes(const TensorInfo& tensor) const;
+    bool verify(const TensorInfo& tensor) const;
+    bool verify() const;
+    bool convert(const TensorInfo& tensor, DType dtype, void* out) const;
+    bool readFloats(const TensorInfo& tensor, std::vector<float>& values) const;
+    const float* readBlock(const TensorInfo& tensor, size_t begin, size_t count, std::vector<float>& scratch) const;
+
+    /**
+     * @brief Returns the elements of a tensor.
+     *
+     * @throws std::runtime_error If there is no tensor with the name, its dtype does not match T,
+     *         or its data is not aligned for T (only for containers read from an unaligned buffer).
+     */
+    template <typename T>
+    TensorSpan<const T> get(const std::string& name) const {
+        const TensorInfo* tensor = find(name);
+        if (!tensor) {
+            throw std::runtime_error("No tensor named " + name);
+        }
+        if (!dtypeMatches<T>(tensor->dtype)) {
+            throw std::runtime_error("Tensor " + name + " has dtype " + dtypeName(tensor->dtype));
+        }
+        const char* start = data + tensor->offset;
+        if (reinterpret_cast<uintptr_t>(start) % alignof(T) != 0) {
+            throw std::runtime_error("Tensor " + name + " is not aligned");
+        }
+        return TensorSpan<const T>(reinterpret_cast<const T*>(start), tensor->size / sizeof(T));
+    }
+
+    /**
+     * @brief Returns a copy of the elements of a tensor, converted from the dtype it is stored in,
+     *        e.g. float32 from a model uploaded as bfloat16.
+     *
+     * @throws std::runtime_error If there is no tensor with the name or its dtype cannot be converted to T.
+     */
+    template <typename T>
+    std::vector<T> read(const std::string& name) const {
+        const TensorInfo* tensor = find(name);
+        if (!tensor) {
+            throw std::runtime_error("No tensor named " + name);
+        }
+        std::vector<T> values(tensor->elements());
+        if (!convert(*tensor, dtypeOf<T>(), values.data())) {
+            throw std::runtime_error("Tensor " + name + " of dtype " + dtypeName(tensor->dtype) + " cannot be read as " + dtypeName(dtypeOf<T>()));
+        }
+        return values;
+    }
+
+private:
+    TensorReader() = default;
+    bool parse();
+
+    std::shared_ptr<MappedFile> file;
+    const char* data = nullptr;
+    size_t size = 0;
+    std::vector<TensorInfo> index;
+    std::unordered_map<std::string, size_t> byName;
+};
+
+/**
+ * Writes a fednlib tensor container, see TensorReader for the layout.
+ *
+ * Tensors are written in the order they are added, either at once with add() or in pieces
+ * with begin(), write() and end(), so a model never has to be held in memory twice.
+ */
+class TensorWriter {
+public:
+    explicit TensorWriter(bool checksums = true);
+    ~TensorWriter();
+    TensorWriter(const TensorWriter&) = delete;
+    TensorWriter& operator=(const TensorWriter&) = delete;
+
+    bool open(const std::string& path);
+    void openBuffer(std::string& buffer);
+    bool add(const std::string& name, DType dtype, const std::vector<uint64_t>& shape, const void* data, size_t size);
+    bool begin(const std::string& name, DType dtype, const std::vector<uint64_t>& shape);
+    bool write(const void* data, size_t size);
+    bool end();
+    bool finish();
+
+    template <typename T>
+    bool add(const std::string& name, const std::vector<uint64_t>& shape, const T* data) {
+        TensorInfo info;
+        info.shape = shape;
+        return add(name, dtypeOf<T>(), shape, data, info.elements() * sizeof(T));
+    }
+
+private:
+    bool checksums;
+    std::unique_ptr<ModelFileWriter> fileWriter;
+    std::string* buffer = nullptr;
+    uint64_t position = 0;
+    bool failed = false;
+    bool inTensor = false;
+    TensorInfo current;
+    std::vector<TensorInfo> index;
+    std::unordered_map<std::string, size_t> byName;
+
+    bool start();
+    bool emit(const void* data, size_t size);
+    bool pad();
+};
+
+#endif // TENSOR_H
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <yaml-cpp/yaml.h>
 
 #include "nlohmann/json.hpp"
@@ -13,10 +14,12 @@ size_t writeHttpResponseToString(void* contents, size_t size, size_t nmemb, std:
 void saveModelToFile(const std::string& modelData, const std::string& modelPath);
 void saveMetricsToFile(const json& metrics, const std::string& metricPath);
 std::string loadModelFromFile(const std::string& modelPath);
+bool copyModelFile(const std::string& inModelPath, const std::string& outModelPath);
 json loadMetricsFromFile(const std::string& metricPath);
 void deleteFileFromDisk(const std::string& path);
 std::string generateRandomUUID();
 std::map<std::string, std::string> readCombinerConfig(YAML::Node configFile);
+std::vector<std::string> readCombinerCandidates(YAML::Node configFile);
 std::map<std::string, std::string> readControllerConfig(YAML::Node config);
 
 #endif // UTILS_H
\ No newline at end of file
@@ -0,0 +1,93 @@
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+class TaskDirectory;
+
+struct WorkspaceOptions {
+    std::string root = "./.fedn-workspace"; // Directory for the files of tasks
+    uint64_t quota = 0;                     // Bytes that tasks may reserve under root, 0 for no limit
+    std::string ramRoot;                    // Directory in memory, e.g. /dev/shm, empty to always use root
+    uint64_t ramQuota = 0;                  // Bytes that tasks may reserve under ramRoot, 0 for no limit
+    uint64_t ramThreshold = 256 * 1024 * 1024; // Largest model placed in ramRoot
+};
+
+/**
+ * Scratch space for the files of tasks: downloaded models, trained models, metrics and
+ * predictions.
+ *
+ * Every task gets its own directory, which is removed with everything in it when the task
+ * is done. A task holds a lock on its directory, so directories left by a client that
+ * crashed are recognised and removed when the next client starts, even if several clients
+ * share the root. Tasks reserve the space they need before writing large files, see
+ * TaskDirectory::reserve(), and are turned away if the quota or the disk is full.
+ *
+ * Small models are placed in memory (ramRoot) and large ones on disk. The size of a task's
+ * model is not known when its directory is created, so the size of the last model reserved
+ * with TaskDirectory::reserveModel() is used; the global model rarely changes size between rounds.
+ */
+class Workspace : public std::enable_shared_from_this<Workspace> {
+public:
+    explicit Workspace(const WorkspaceOptions& options);
+    Workspace(const Workspace&) = delete;
+    Workspace& operator=(const Workspace&) = delete;
+
+    std::unique_ptr<TaskDirectory> createTask(const std::string& kind);
+    std::string stateFile(const std::string& name);
+    bool reserveState(uint64_t bytes);
+    void releaseState(uint64_t bytes);
+    void sweep();
+
+private:
+    friend class TaskDirectory;
+
+    struct Root {
+        std::string path;
+        uint64_t quota;
+        uint64_t reserved = 0;
+    };
+
+    WorkspaceOptions options;
+    Root disk;
+    Root ram;
+    int64_t lastModelSize = -1;
+    std::mutex workspaceMutex;
+
+    bool admit(Root& root, uint64_t bytes, const std::string& taskPath);
+    void release(Root& root, uint64_t bytes);
+};
+
+/**
+ * The directory of one task in a Workspace. It is removed when the object is destroyed.
+ */
+class TaskDirectory {
+public:
+    ~TaskDirectory();
+    TaskDirectory(const TaskDirectory&) = delete;
+    TaskDirectory& operator=(const TaskDirectory&) = delete;
+
+    const std::string& path() const { return directory; }
+    std::string file(const std::string& name) const;
+    bool inMemory() const { return root == &workspace->ram; }
+    bool reserve(uint64_t bytes);
+    bool reserveModel(uint64_t bytes);
+    uint64_t reserved() const { return reservedBytes; }
+    uint64_t modelSize() const { return modelBytes; } // 0 until reserveModel()
+
+private:
+    friend class Workspace;
+    TaskDirectory(std::shared_ptr<Workspace> workspace, Workspace::Root* root, const std::string& directory, int lockFd);
+
+    std::shared_ptr<Workspace> workspace;
+    Workspace::Root* root;
+    std::string directory;
+    int lockFd;
+    uint64_t reservedBytes = 0;
+    uint64_t modelBytes = 0;
+};
+
+#endif // WORKSPACE_H
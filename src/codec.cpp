@@ -0,0 +1,655 @@
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <filesystem>
+#include <zlib.h>
+
+#include "../include/fednlib/codec.h"
+#include "../include/fednlib/delta.h"
+#include "../include/fednlib/quantize.h"
+#include "../include/fednlib/sparsify.h"
+#include "../include/fednlib/lowrank.h"
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/convert.h"
+#include "../include/fednlib/fileio.h"
+
+namespace {
+
+const size_t kStreamChunk = 1024 * 1024;
+const int kDescriptorVersion = 1;
+
+using Options = std::map<std::string, std::string>;
+
+// Reads the option key as T if it is set, and fails on values that are not a whole T
+template <typename T>
+bool readOption(const Options& options, const std::string& key, T& value) {
+    auto it = options.find(key);
+    if (it == options.end()) {
+        return true;
+    }
+    std::istringstream stream(it->second);
+    stream >> value;
+    return !stream.fail() && stream.eof();
+}
+
+bool checkKeys(const std::string& stage, const Options& options, std::initializer_list<const char*> keys) {
+    for (const auto& option : options) {
+        if (std::find_if(keys.begin(), keys.end(), [&](const char* key) { return option.first == key; }) == keys.end()) {
+            std::cerr << "Unknown option " << option.first << " of codec stage " << stage << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string stateFile(const CodecContext& context, const std::string& name) {
+    return context.stateFile ? context.stateFile(name) : "";
+}
+
+class DeltaStage : public UpdateStage {
+public:
+    bool configure(const Options& options) {
+        std::string mode = "xor";
+        if (!checkKeys("delta", options, {"mode", "word_size"}) || !readOption(options, "mode", mode)
+                || !deltaModeFromName(mode, this->mode) || !readOption(options, "word_size", wordSize)) {
+            return false;
+        }
+        return wordSize == 0 || wordSize == 1 || wordSize == 2 || wordSize == 4 || wordSize == 8;
+    }
+
+    bool encode(const CodecContext& context, const std::string& modelPath, const std::string& updatePath, json& descriptor) override {
+        DeltaInfo info;
+        if (!encodeModelDelta(modelPath, context.basePath, updatePath, mode, wordSize > 0 ? wordSize : context.wordSize, &info)) {
+            return false;
+        }
+        if (info.encodedSize >= info.modelSize) {
+            std::cout << "The delta of the model update is not smaller than the model" << std::endl;
+            std::remove(updatePath.c_str());
+            return false;
+        }
+        descriptor["mode"] = deltaModeName(info.mode);
+        descriptor["word_size"] = info.wordSize;
+        descriptor["base_crc32c"] = info.baseCrc;
+        descriptor["model_size"] = info.modelSize;
+        descriptor["model_crc32c"] = info.modelCrc;
+        return true;
+    }
+
+    bool decode(const json&, const std::string& basePath, const std::string& updatePath, const std::string& modelPath) override {
+        return decodeModelDelta(updatePath, basePath, modelPath);
+    }
+
+private:
+    DeltaMode mode = DeltaMode::Xor;
+    uint32_t wordSize = 0; // 0 for the size of the weights of the model
+};
+
+class QuantizeStage : public UpdateStage {
+public:
+    bool configure(const Options& options) {
+        return checkKeys("quantize", options, {"bits", "block_size"}) && readOption(options, "bits", this->options.bits)
+            && readOption(options, "block_size", this->options.blockSize)
+            && (this->options.bits == 8 || this->options.bits == 4) && this->options.blockSize % 16 == 0;
+    }
+
+    bool encode(const CodecContext& context, const std::string& modelPath, const std::string& updatePath, json& descriptor) override {
+        // A new seed every round, so the rounding errors of the rounds are independent
+        QuantizeOptions round = options;
+        round.seed = std::random_device()();
+        std::string residualPath = stateFile(context, "quantization-residual.bin");
+        if (!quantizeUpdate(modelPath, context.basePath, residualPath, updatePath, round)) {
+            return false;
+        }
+        descriptor["bits"] = options.bits;
+        descriptor["block_size"] = options.blockSize;
+        descriptor["stochastic_rounding"] = true;
+        descriptor["error_feedback"] = !residualPath.empty();
+        return true;
+    }
+
+    bool decode(const json&, const std::string& basePath, const std::string& updatePath, const std::string& modelPath) override {
+        return dequantizeUpdate(updatePath, basePath, modelPath);
+    }
+
+private:
+    QuantizeOptions options;
+};
+
+class SparsifyStage : public UpdateStage {
+public:
+    bool configure(const Options& options) {
+        return checkKeys("sparsify", options, {"ratio"}) && readOption(options, "ratio", this->options.ratio)
+            && this->options.ratio > 0 && this->options.ratio <= 1;
+    }
+
+    bool encode(const CodecContext& context, const std::string& modelPath, const std::string& updatePath, json& descriptor) override {
+        std::string residualPath = stateFile(context, "sparsification-residual.bin");
+        if (!sparsifyUpdate(modelPath, context.basePath, residualPath, updatePath, options)) {
+            return false;
+        }
+        descriptor["ratio"] = options.ratio;
+        descriptor["error_feedback"] = !residualPath.empty();
+        return true;
+    }
+
+    bool decode(const json&, const std::string& basePath, const std::string& updatePath, const std::string& modelPath) override {
+        return densifyUpdate(updatePath, basePath, modelPath);
+    }
+
+private:
+    SparsifyOptions options;
+};
+
+class LowRankStage : public UpdateStage {
+public:
+    bool configure(const Options& options) {
+        return checkKeys("lowrank", options, {"rank", "min_elements"}) && readOption(options, "rank", this->options.rank)
+            && readOption(options, "min_elements", this->options.minElements) && this->options.rank > 0;
+    }
+
+    bool encode(const CodecContext& context, const std::string& modelPath, const std::string& updatePath, json& descriptor) override {
+        std::string statePath = stateFile(context, "lowrank-state.bin");
+        LowRankReport report;
+        if (!lowRankUpdate(modelPath, context.basePath, statePath, updatePath, options, &report)) {
+            return false;
+        }
+        std::error_code error;
+        uint64_t modelSize = std::filesystem::file_size(modelPath, error);
+        uint64_t updateSize = std::filesystem::file_size(updatePath, error);
+        descriptor["rank"] = options.rank;
+        descriptor["min_elements"] = options.minElements;
+        descriptor["error_feedback"] = !statePath.empty();
+        descriptor["factored_tensors"] = report.factored;
+        descriptor["raw_tensors"] = report.raw;
+        descriptor["compression"] = updateSize > 0 ? double(modelSize) / updateSize : 0;
+        descriptor["relative_error"] = report.relativeError;
+        return true;
+    }
+
+    bool decode(const json&, const std::string& basePath, const std::string& updatePath, const std::string& modelPath) override {
+        return expandLowRankUpdate(updatePath, basePath, modelPath);
+    }
+
+private:
+    LowRankOptions options;
+};
+
+std::unique_ptr<UpdateStage> makeUpdateStage(const std::string& name, const Options& options, bool& known) {
+    known = true;
+    if (name == "delta") {
+        auto stage = std::make_unique<DeltaStage>();
+        return stage->configure(options) ? std::move(stage) : nullptr;
+    } else if (name == "quantize") {
+        auto stage = std::make_unique<QuantizeStage>();
+        return stage->configure(options) ? std::move(stage) : nullptr;
+    } else if (name == "sparsify") {
+        auto stage = std::make_unique<SparsifyStage>();
+        return stage->configure(options) ? std::move(stage) : nullptr;
+    } else if (name == "lowrank") {
+        auto stage = std::make_unique<LowRankStage>();
+        return stage->configure(options) ? std::move(stage) : nullptr;
+    }
+    known = false;
+    return nullptr;
+}
+
+std::unique_ptr<StreamStage> makeEncoder(const std::string& name, const Options& options, bool& known) {
+    known = true;
+    if (name == "compress") {
+        int level = 1;
+        if (!checkKeys(name, options, {"level"}) || !readOption(options, "level", level) || level < 0 || level > 9) {
+            return nullptr;
+        }
+        return std::make_unique<StreamStageAdapter<DeflateStream>>(DeflateStream(level));
+    } else if (name == "checksum") {
+        if (!checkKeys(name, options, {})) {
+            return nullptr;
+        }
+        return std::make_unique<StreamStageAdapter<ChecksumStream>>(ChecksumStream());
+    }
+    known = false;
+    return nullptr;
+}
+
+std::unique_ptr<StreamStage> makeDecoder(const json& stage) {
+    std::string name = stage.at("name").get<std::string>();
+    if (name == "compress") {
+        return std::make_unique<StreamStageAdapter<InflateStream>>(InflateStream());
+    } else if (name == "checksum") {
+        return std::make_unique<StreamStageAdapter<ChecksumStream>>(
+            ChecksumStream(stage.at("crc32c").get<uint32_t>(), stage.at("size").get<uint64_t>()));
+    }
+    throw std::runtime_error("unknown stage " + name);
+}
+
+// Stream stages chained at runtime, see StreamChain
+class DynamicChain {
+public:
+    explicit DynamicChain(std::vector<std::unique_ptr<StreamStage>>& stages) : stages(stages) {}
+
+    bool write(const char* data, size_t size, const StreamStage::Sink& sink) { return writeFrom(0, data, size, sink); }
+    bool finish(const StreamStage::Sink& sink) {
+        for (size_t i = 0; i < stages.size(); i++) {
+            StreamStage::Sink next = [&, i](const char* out, size_t outSize) { return writeFrom(i + 1, out, outSize, sink); };
+            if (!stages[i]->finish(next)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    bool writeFrom(size_t i, const char* data, size_t size, const StreamStage::Sink& sink) {
+        if (i == stages.size()) {
+            return sink(data, size);
+        }
+        StreamStage::Sink next = [&, i](const char* out, size_t outSize) { return writeFrom(i + 1, out, outSize, sink); };
+        return stages[i]->write(data, size, next);
+    }
+    std::vector<std::unique_ptr<StreamStage>>& stages;
+};
+
+bool isUpdateStage(const std::string& name) {
+    return name == "delta" || name == "quantize" || name == "sparsify" || name == "lowrank";
+}
+
+std::string trim(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return begin == std::string::npos ? "" : text.substr(begin, end - begin + 1);
+}
+
+// L2 error of the float tensors of a decoded model relative to the trained one, or 0 and 1
+// for files that are or are not the same bytes
+double decodingError(const std::string& modelPath, const std::string& decodedPath) {
+    std::shared_ptr<TensorReader> model = TensorReader::open(modelPath);
+    std::shared_ptr<TensorReader> decoded = model ? TensorReader::open(decodedPath) : nullptr;
+    if (!model || !decoded) {
+        std::string a;
+        std::string b;
+        return readModelFile(modelPath, a) && readModelFile(decodedPath, b) && a == b ? 0 : 1;
+    }
+    double error = 0;
+    double norm = 0;
+    std::vector<float> x;
+    std::vector<float> y;
+    for (const TensorInfo& tensor : model->tensors()) {
+        const TensorInfo* other = decoded->find(tensor.name);
+        if (!isFloatDType(tensor.dtype) || !other || !isFloatDType(other->dtype) || other->elements() != tensor.elements()) {
+            continue;
+        }
+        x.resize(tensor.elements());
+        y.resize(tensor.elements());
+        if (!model->convert(tensor, DType::F32, x.data()) || !decoded->convert(*other, DType::F32, y.data())) {
+            return 1;
+        }
+        for (size_t i = 0; i < x.size(); i++) {
+            double d = double(x[i]) - double(y[i]);
+            error += d * d;
+            norm += double(x[i]) * double(x[i]);
+        }
+    }
+    return norm > 0 ? std::sqrt(error / norm) : std::sqrt(error);
+}
+
+} // namespace
+
+/**
+ * @brief Creates a deflate stream at the given zlib level, 0 (stored) to 9.
+ */
+DeflateStream::DeflateStream(int level) : stream(new z_stream_s()), level(level) {
+    if (deflateInit2(stream.get(), level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        stream.reset();
+    }
+}
+
+DeflateStream::DeflateStream(DeflateStream&& other) noexcept
+    : stream(std::move(other.stream)), buffer(std::move(other.buffer)), level(other.level), inSize(other.inSize), outSize(other.outSize) {}
+
+DeflateStream::~DeflateStream() {
+    if (stream) {
+        deflateEnd(stream.get());
+    }
+}
+
+// Compresses the data into the buffer, all that is left with end
+bool DeflateStream::run(const char* data, size_t size, bool end) {
+    buffer.clear();
+    if (!stream) {
+        return false;
+    }
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream->avail_in = static_cast<uInt>(size);
+    int result = Z_OK;
+    do {
+        size_t offset = buffer.size();
+        buffer.resize(offset + std::max<size_t>(64 * 1024, size / 2));
+        stream->next_out = reinterpret_cast<Bytef*>(&buffer[offset]);
+        stream->avail_out = static_cast<uInt>(buffer.size() - offset);
+        result = deflate(stream.get(), end ? Z_FINISH : Z_NO_FLUSH);
+        buffer.resize(buffer.size() - stream->avail_out);
+        if (result == Z_STREAM_ERROR) {
+            return false;
+        }
+    } while (stream->avail_in > 0 || (end && result != Z_STREAM_END));
+    inSize += size;
+    outSize += buffer.size();
+    return true;
+}
+
+json DeflateStream::describe() const {
+    return {{"level", level}, {"size", inSize}, {"compressed_size", outSize}};
+}
+
+InflateStream::InflateStream() : stream(new z_stream_s()) {
+    if (inflateInit2(stream.get(), -15) != Z_OK) {
+        stream.reset();
+    }
+}
+
+InflateStream::InflateStream(InflateStream&& other) noexcept
+    : stream(std::move(other.stream)), buffer(std::move(other.buffer)), pending(other.pending), ended(other.ended) {}
+
+InflateStream::~InflateStream() {
+    if (stream) {
+        inflateEnd(stream.get());
+    }
+}
+
+// Decompresses at most 1 MB of the data into the buffer, pending if there is more to come
+bool InflateStream::run(const char* data, size_t size, size_t& used) {
+    buffer.clear();
+    if (!stream || (ended && size > 0)) {
+        return false;
+    }
+    buffer.resize(kStreamChunk);
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream->avail_in = static_cast<uInt>(size);
+    stream->next_out = reinterpret_cast<Bytef*>(&buffer[0]);
+    stream->avail_out = static_cast<uInt>(buffer.size());
+    int result = inflate(stream.get(), Z_NO_FLUSH);
+    used = size - stream->avail_in;
+    buffer.resize(buffer.size() - stream->avail_out);
+    if (result != Z_OK && result != Z_STREAM_END && !(result == Z_BUF_ERROR && used == 0 && buffer.empty())) {
+        return false;
+    }
+    ended = result == Z_STREAM_END;
+    pending = !ended && stream->avail_out == 0;
+    // Data past the end of the stream is not part of it
+    return !(ended && stream->avail_in > 0);
+}
+
+void ChecksumStream::update(const char* data, size_t size) {
+    crc = crc32c(crc, data, size);
+    this->size += size;
+}
+
+/**
+ * @brief Streams a file through stream stages into another file, in chunks of 1 MB.
+ *
+ * The pages of the input are released as they are consumed, so memory use is bounded by
+ * the stages.
+ *
+ * @return true if the output was written, false otherwise, in which case it is removed.
+ */
+bool streamFile(const std::string& inPath, const std::string& outPath,
+        const std::function<bool(const char*, size_t, const StreamStage::Sink&)>& write,
+        const std::function<bool(const StreamStage::Sink&)>& finish) {
+    std::shared_ptr<MappedFile> in = MappedFile::open(inPath);
+    ModelFileWriter writer;
+    if (!in || !writer.open(outPath)) {
+        return false;
+    }
+    int64_t offset = 0;
+    StreamStage::Sink sink = [&](const char* data, size_t size) {
+        bool written = writer.write(data, size, offset);
+        offset += size;
+        return written;
+    };
+    bool ok = true;
+    for (int64_t position = 0; ok && position < in->size(); position += kStreamChunk) {
+        size_t size = static_cast<size_t>(std::min<int64_t>(kStreamChunk, in->size() - position));
+        ok = write(in->data() + position, size, sink);
+        in->release(position, size);
+    }
+    ok = ok && finish(sink);
+    ok = writer.finish(offset) && ok;
+    if (!ok) {
+        std::remove(outPath.c_str());
+    }
+    return ok;
+}
+
+/**
+ * @brief Parses a pipeline specification, stages separated by "|" with options in
+ * parentheses, e.g. "sparsify(ratio=0.01) | compress(level=6) | checksum".
+ *
+ * @return The pipeline, nullptr if the specification is invalid.
+ */
+std::shared_ptr<CodecPipeline> CodecPipeline::parse(const std::string& spec) {
+    auto pipeline = std::make_shared<CodecPipeline>();
+    std::istringstream stream(spec);
+    std::string part;
+    while (std::getline(stream, part, '|')) {
+        part = trim(part);
+        std::string name = part;
+        Options options;
+        size_t open = part.find('(');
+        if (open != std::string::npos) {
+            if (part.back() != ')') {
+                std::cerr << "Invalid codec stage " << part << std::endl;
+                return nullptr;
+            }
+            name = trim(part.substr(0, open));
+            std::istringstream list(part.substr(open + 1, part.size() - open - 2));
+            std::string option;
+            while (std::getline(list, option, ',')) {
+                size_t equals = option.find('=');
+                if (equals == std::string::npos) {
+                    std::cerr << "Invalid option " << option << " of codec stage " << name << ", expected key=value" << std::endl;
+                    return nullptr;
+                }
+                options[trim(option.substr(0, equals))] = trim(option.substr(equals + 1));
+            }
+        }
+        if (!pipeline->addStage(name, options)) {
+            return nullptr;
+        }
+    }
+    if (pipeline->empty()) {
+        std::cerr << "Empty codec pipeline" << std::endl;
+        return nullptr;
+    }
+    return pipeline;
+}
+
+/**
+ * @brief Appends a stage to the pipeline.
+ *
+ * @return false if the stage is unknown, its options are invalid, or it is an update stage
+ *         that does not come first.
+ */
+bool CodecPipeline::addStage(const std::string& name, const std::map<std::string, std::string>& options) {
+    bool known = false;
+    bool valid = isUpdateStage(name) ? makeUpdateStage(name, options, known) != nullptr : makeEncoder(name, options, known) != nullptr;
+    if (!known) {
+        std::cerr << "Unknown codec stage " << name << std::endl;
+        return false;
+    }
+    if (!valid) {
+        std::cerr << "Invalid options for codec stage " << name << std::endl;
+        return false;
+    }
+    if (isUpdateStage(name) && !stages.empty()) {
+        std::cerr << "Codec stage " << name << " must come first, the update stages work on the model itself" << std::endl;
+        return false;
+    }
+    stages.push_back({name, options});
+    return true;
+}
+
+/**
+ * @brief Returns the specification of the pipeline, which parse() reads back.
+ */
+std::string CodecPipeline::spec() const {
+    std::string spec;
+    for (const Stage& stage : stages) {
+        spec += spec.empty() ? "" : " | ";
+        spec += stage.name;
+        if (!stage.options.empty()) {
+            std::string list;
+            for (const auto& option : stage.options) {
+                list += (list.empty() ? "" : ",") + option.first + "=" + option.second;
+            }
+            spec += "(" + list + ")";
+        }
+    }
+    return spec;
+}
+
+/**
+ * @brief Encodes a trained model.
+ *
+ * @param context The global model and the files kept across rounds.
+ * @param modelPath The path to the trained model.
+ * @param updatePath The path to write the encoded model to.
+ * @param descriptor Set to the descriptor to send with the encoded model, see decode().
+ * @return true if the model was encoded, false otherwise.
+ */
+bool CodecPipeline::encode(const CodecContext& context, const std::string& modelPath, const std::string& updatePath, json& descriptor) const {
+    descriptor = {
+        {"version", kDescriptorVersion},
+        {"pipeline", spec()},
+        {"base_model_id", context.baseModelID},
+        {"stages", json::array()}
+    };
+    std::string input = modelPath;
+    std::string stagePath = updatePath + ".stage";
+    size_t first = 0;
+    bool known = false;
+    if (!stages.empty() && isUpdateStage(stages[0].name)) {
+        bool streams = stages.size() > 1;
+        json stage = {{"name", stages[0].name}};
+        std::unique_ptr<UpdateStage> update = makeUpdateStage(stages[0].name, stages[0].options, known);
+        if (!update || !update->encode(context, modelPath, streams ? stagePath : updatePath, stage)) {
+            std::remove(stagePath.c_str());
+            return false;
+        }
+        descriptor["stages"].push_back(stage);
+        input = stagePath;
+        first = 1;
+    }
+    if (first < stages.size()) {
+        std::vector<std::unique_ptr<StreamStage>> encoders;
+        for (size_t i = first; i < stages.size(); i++) {
+            encoders.push_back(makeEncoder(stages[i].name, stages[i].options, known));
+        }
+        DynamicChain chain(encoders);
+        bool ok = streamFile(input, updatePath, chain);
+        if (first > 0) {
+            std::remove(stagePath.c_str());
+        }
+        if (!ok) {
+            return false;
+        }
+        for (size_t i = first; i < stages.size(); i++) {
+            json stage = encoders[i - first]->describe();
+            stage["name"] = stages[i].name;
+            descriptor["stages"].push_back(stage);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Reconstructs a model from its encoding, e.g. on the server side or in tests.
+ *
+ * @param descriptor The descriptor returned by encode().
+ * @param basePath The path to the global model the model was trained from, needed for
+ *        update stages.
+ * @param updatePath The path to the encoded model.
+ * @param modelPath The path to write the model to.
+ * @return true if the model was written, false otherwise, e.g. if a checksum fails.
+ */
+bool CodecPipeline::decode(const json& descriptor, const std::string& basePath, const std::string& updatePath, const std::string& modelPath) {
+    std::unique_ptr<UpdateStage> update;
+    json updateDescriptor;
+    std::vector<std::unique_ptr<StreamStage>> decoders;
+    try {
+        if (descriptor.at("version").get<int>() != kDescriptorVersion) {
+            throw std::runtime_error("unknown version");
+        }
+        const json& stages = descriptor.at("stages");
+        for (size_t i = 0; i < stages.size(); i++) {
+            std::string name = stages[i].at("name").get<std::string>();
+            if (isUpdateStage(name)) {
+                bool known = false;
+                if (i != 0 || !(update = makeUpdateStage(name, {}, known))) {
+                    throw std::runtime_error("misplaced stage " + name);
+                }
+                updateDescriptor = stages[i];
+            } else {
+                decoders.insert(decoders.begin(), makeDecoder(stages[i]));
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Invalid codec descriptor (" << e.what() << ")" << std::endl;
+        return false;
+    }
+
+    std::string input = updatePath;
+    std::string stagePath = modelPath + ".stage";
+    if (!decoders.empty()) {
+        DynamicChain chain(decoders);
+        std::string output = update ? stagePath : modelPath;
+        if (!streamFile(input, output, chain)) {
+            std::cerr << "Failed to decode " << updatePath << std::endl;
+            return false;
+        }
+        input = output;
+    }
+    bool ok = !update || update->decode(updateDescriptor, basePath, input, modelPath);
+    if (update && !decoders.empty()) {
+        std::remove(stagePath.c_str());
+    }
+    return ok;
+}
+
+/**
+ * @brief Encodes and decodes a model, timing both, e.g. to pick a pipeline for a model and a
+ * link. Files kept across rounds are not touched.
+ *
+ * @param context The global model.
+ * @param modelPath The path to the trained model.
+ * @param scratchPrefix The prefix of the files written, which are removed afterwards.
+ * @param result Set to the sizes, the times and the error of the decoded model.
+ * @return true if the model was encoded and decoded, false otherwise.
+ */
+bool CodecPipeline::benchmark(const CodecContext& context, const std::string& modelPath, const std::string& scratchPrefix, CodecBenchmark& result) const {
+    CodecContext scratch = context;
+    scratch.stateFile = nullptr;
+    std::string updatePath = scratchPrefix + ".update";
+    std::string decodedPath = scratchPrefix + ".decoded";
+    json descriptor;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = encode(scratch, modelPath, updatePath, descriptor);
+    auto encoded = std::chrono::steady_clock::now();
+    ok = ok && decode(descriptor, context.basePath, updatePath, decodedPath);
+    auto decoded = std::chrono::steady_clock::now();
+    if (ok) {
+        std::error_code error;
+        result.modelSize = std::filesystem::file_size(modelPath, error);
+        result.updateSize = std::filesystem::file_size(updatePath, error);
+        result.encodeSeconds = std::chrono::duration<double>(encoded - start).count();
+        result.decodeSeconds = std::chrono::duration<double>(decoded - encoded).count();
+        result.relativeError = decodingError(modelPath, decodedPath);
+    }
+    std::remove(updatePath.c_str());
+    std::remove(decodedPath.c_str());
+    return ok;
+}
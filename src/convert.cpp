@@ -0,0 +1,392 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "../include/fednlib/convert.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define FEDNLIB_X86_KERNELS
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+namespace {
+
+const size_t kBlockElements = 4096;
+const size_t kFileBlockElements = 64 * 1024;
+
+uint32_t floatBits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+float bitsFloat(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// The float16 conversions scale in float arithmetic so that the FPU does the rounding,
+// see Marat Dukhan's FP16 library
+uint16_t floatToHalf(float value) {
+    const float scaleToInf = 0x1.0p+112f;
+    const float scaleToZero = 0x1.0p-110f;
+    float base = (std::abs(value) * scaleToInf) * scaleToZero;
+    uint32_t w = floatBits(value);
+    uint32_t shl1 = w + w;
+    uint32_t sign = w & 0x80000000u;
+    uint32_t bias = shl1 & 0xff000000u;
+    if (bias < 0x71000000u) {
+        bias = 0x71000000u;
+    }
+    base = bitsFloat((bias >> 1) + 0x07800000u) + base;
+    uint32_t bits = floatBits(base);
+    uint32_t exponent = (bits >> 13) & 0x00007c00u;
+    uint32_t mantissa = bits & 0x00000fffu;
+    uint32_t nonSign = exponent + mantissa;
+    return (sign >> 16) | (shl1 > 0xff000000u ? 0x7e00 : nonSign);
+}
+
+float halfToFloat(uint16_t half) {
+    uint32_t w = (uint32_t) half << 16;
+    uint32_t sign = w & 0x80000000u;
+    uint32_t twoW = w + w;
+    float normalized = bitsFloat((twoW >> 4) + (0xe0u << 23)) * 0x1.0p-112f;
+    float denormalized = bitsFloat((twoW >> 17) | (126u << 23)) - 0.5f;
+    uint32_t bits = twoW < (1u << 27) ? floatBits(denormalized) : floatBits(normalized);
+    return bitsFloat(sign | bits);
+}
+
+uint16_t floatToBFloat(float value) {
+    uint32_t bits = floatBits(value);
+    if ((bits & 0x7fffffffu) > 0x7f800000u) {
+        return (bits >> 16) | 0x0040; // Keep NaNs quiet, rounding could turn them into infinities
+    }
+    return (bits + 0x7fffu + ((bits >> 16) & 1)) >> 16;
+}
+
+float bfloatToFloat(uint16_t bfloat) {
+    return bitsFloat((uint32_t) bfloat << 16);
+}
+
+void f64ToF32Scalar(const double* in, float* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = (float) in[i];
+    }
+}
+
+void f32ToF64Scalar(const float* in, double* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = in[i];
+    }
+}
+
+void f32ToBF16Scalar(const float* in, uint16_t* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = floatToBFloat(in[i]);
+    }
+}
+
+void bf16ToF32Scalar(const uint16_t* in, float* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = bfloatToFloat(in[i]);
+    }
+}
+
+void f32ToF16Scalar(const float* in, uint16_t* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = floatToHalf(in[i]);
+    }
+}
+
+void f16ToF32Scalar(const uint16_t* in, float* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = halfToFloat(in[i]);
+    }
+}
+
+#ifdef FEDNLIB_X86_KERNELS
+// Compiled for AVX2 and F16C with function attributes, so the rest of the library keeps
+// running on any x86-64 CPU. The tails are left to the portable code.
+
+__attribute__((target("avx2")))
+void f64ToF32Avx2(const double* in, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128 low = _mm256_cvtpd_ps(_mm256_loadu_pd(in + i));
+        __m128 high = _mm256_cvtpd_ps(_mm256_loadu_pd(in + i + 4));
+        _mm256_storeu_ps(out + i, _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1));
+    }
+    f64ToF32Scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void f32ToF64Avx2(const float* in, double* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 values = _mm256_loadu_ps(in + i);
+        _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm256_castps256_ps128(values)));
+        _mm256_storeu_pd(out + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(values, 1)));
+    }
+    f32ToF64Scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+__m256i roundToBFloat(__m256 values) {
+    __m256i bits = _mm256_castps_si256(values);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    __m256i rounded = _mm256_add_epi32(bits, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7fff)));
+    __m256i quietNaN = _mm256_or_si256(bits, _mm256_set1_epi32(0x00400000));
+    __m256 isNaN = _mm256_cmp_ps(values, values, _CMP_UNORD_Q);
+    return _mm256_srli_epi32(_mm256_blendv_epi8(rounded, quietNaN, _mm256_castps_si256(isNaN)), 16);
+}
+
+__attribute__((target("avx2")))
+void f32ToBF16Avx2(const float* in, uint16_t* out, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i low = roundToBFloat(_mm256_loadu_ps(in + i));
+        __m256i high = roundToBFloat(_mm256_loadu_ps(in + i + 8));
+        // packus works per 128 bit lane, the permute puts the halves back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), packed);
+    }
+    f32ToBF16Scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void bf16ToF32Avx2(const uint16_t* in, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i values = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+        _mm256_storeu_ps(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(values, 16)));
+    }
+    bf16ToF32Scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void f32ToF16F16c(const float* in, uint16_t* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i halves = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), halves);
+    }
+    f32ToF16Scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void f16ToF32F16c(const uint16_t* in, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+    }
+    f16ToF32Scalar(in + i, out + i, count - i);
+}
+#endif
+
+struct Kernels {
+    const char* name;
+    void (*f64ToF32)(const double*, float*, size_t);
+    void (*f32ToF64)(const float*, double*, size_t);
+    void (*f32ToBF16)(const float*, uint16_t*, size_t);
+    void (*bf16ToF32)(const uint16_t*, float*, size_t);
+    void (*f32ToF16)(const float*, uint16_t*, size_t);
+    void (*f16ToF32)(const uint16_t*, float*, size_t);
+};
+
+Kernels selectKernels() {
+    Kernels kernels = {"scalar", f64ToF32Scalar, f32ToF64Scalar, f32ToBF16Scalar, bf16ToF32Scalar, f32ToF16Scalar, f16ToF32Scalar};
+#ifdef FEDNLIB_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.name = "avx2";
+        kernels.f64ToF32 = f64ToF32Avx2;
+        kernels.f32ToF64 = f32ToF64Avx2;
+        kernels.f32ToBF16 = f32ToBF16Avx2;
+        kernels.bf16ToF32 = bf16ToF32Avx2;
+        // Not every compiler's __builtin_cpu_supports() knows F16C
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_F16C)) {
+            kernels.name = "avx2+f16c";
+            kernels.f32ToF16 = f32ToF16F16c;
+            kernels.f16ToF32 = f16ToF32F16c;
+        }
+    }
+#endif
+    return kernels;
+}
+
+const Kernels& kernels() {
+    static const Kernels selected = selectKernels();
+    return selected;
+}
+
+// Converts any supported float dtype to float32
+void toFloat(const void* in, DType from, float* out, size_t count) {
+    switch (from) {
+        case DType::F64: kernels().f64ToF32(static_cast<const double*>(in), out, count); break;
+        case DType::F32: memcpy(out, in, count * sizeof(float)); break;
+        case DType::BF16: kernels().bf16ToF32(static_cast<const uint16_t*>(in), out, count); break;
+        case DType::F16: kernels().f16ToF32(static_cast<const uint16_t*>(in), out, count); break;
+        default: break;
+    }
+}
+
+// Converts float32 to any supported float dtype
+void fromFloat(const float* in, void* out, DType to, size_t count) {
+    switch (to) {
+        case DType::F64: kernels().f32ToF64(in, static_cast<double*>(out), count); break;
+        case DType::F32: memcpy(out, in, count * sizeof(float)); break;
+        case DType::BF16: kernels().f32ToBF16(in, static_cast<uint16_t*>(out), count); break;
+        case DType::F16: kernels().f32ToF16(in, static_cast<uint16_t*>(out), count); break;
+        default: break;
+    }
+}
+
+} // namespace
+
+void convertF64ToF32(const double* in, float* out, size_t count) { kernels().f64ToF32(in, out, count); }
+void convertF32ToF64(const float* in, double* out, size_t count) { kernels().f32ToF64(in, out, count); }
+void convertF32ToBF16(const float* in, uint16_t* out, size_t count) { kernels().f32ToBF16(in, out, count); }
+void convertBF16ToF32(const uint16_t* in, float* out, size_t count) { kernels().bf16ToF32(in, out, count); }
+void convertF32ToF16(const float* in, uint16_t* out, size_t count) { kernels().f32ToF16(in, out, count); }
+void convertF16ToF32(const uint16_t* in, float* out, size_t count) { kernels().f16ToF32(in, out, count); }
+
+/**
+ * @brief Returns whether a dtype is one of the floating point dtypes the conversions support.
+ */
+bool isFloatDType(DType dtype) {
+    return dtype == DType::F64 || dtype == DType::F32 || dtype == DType::BF16 || dtype == DType::F16;
+}
+
+/**
+ * @brief Parses the name of a dtype, as returned by dtypeName(), e.g. "float16".
+ *
+ * @return true if the name is known, false otherwise.
+ */
+bool dtypeFromName(const std::string& name, DType& dtype) {
+    for (DType candidate : {DType::F64, DType::F32, DType::F16, DType::BF16, DType::I64, DType::I32,
+                            DType::I16, DType::I8, DType::U8}) {
+        if (name == dtypeName(candidate)) {
+            dtype = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Converts elements between floating point dtypes.
+ *
+ * Conversions that do not involve float32 go through float32 in blocks, so float64 to
+ * float16 is rounded twice, which can differ from a direct conversion in the last bit.
+ *
+ * @param in The elements to convert.
+ * @param from The dtype of the input.
+ * @param out The converted elements, must not overlap the input.
+ * @param to The dtype of the output.
+ * @param count The number of elements.
+ * @return true if the elements were converted, false if a dtype is not a floating point dtype.
+ */
+bool convertDType(const void* in, DType from, void* out, DType to, size_t count) {
+    if (from == to) {
+        memcpy(out, in, count * dtypeSize(from));
+        return true;
+    }
+    if (!isFloatDType(from) || !isFloatDType(to)) {
+        return false;
+    }
+    if (from == DType::F32) {
+        fromFloat(static_cast<const float*>(in), out, to, count);
+        return true;
+    }
+    if (to == DType::F32) {
+        toFloat(in, from, static_cast<float*>(out), count);
+        return true;
+    }
+    float block[kBlockElements];
+    const char* input = static_cast<const char*>(in);
+    char* output = static_cast<char*>(out);
+    for (size_t done = 0; done < count; done += kBlockElements) {
+        size_t n = std::min(kBlockElements, count - done);
+        toFloat(input + done * dtypeSize(from), from, block, n);
+        fromFloat(block, output + done * dtypeSize(to), to, n);
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the name of the kernels in use, e.g. "avx2+f16c" or "scalar".
+ */
+const char* conversionKernels() {
+    return kernels().name;
+}
+
+/**
+ * @brief Rewrites the floating point tensors of a tensor container in another dtype.
+ *
+ * The container records the dtype of every tensor, so readers convert back as needed, see
+ * TensorReader::read(). Integer tensors are copied as they are. Files that are not
+ * containers are left alone, since their format is only known to the user's code.
+ *
+ * @param path The path to the file, which is replaced by the converted container.
+ * @param dtype The floating point dtype to store.
+ * @return true if the file was converted or needed no conversion, false otherwise.
+ */
+bool convertContainerFile(const std::string& path, DType dtype) {
+    char head[96] = {};
+    std::ifstream file(path, std::ios::binary);
+    if (!isFloatDType(dtype) || !file || !file.read(head, sizeof(head))
+            || !TensorReader::isContainer(head, sizeof(head))) {
+        return isFloatDType(dtype);
+    }
+    file.close();
+
+    std::shared_ptr<TensorReader> reader = TensorReader::open(path);
+    if (!reader) {
+        return false;
+    }
+    bool needed = false;
+    for (const TensorInfo& tensor : reader->tensors()) {
+        needed = needed || (isFloatDType(tensor.dtype) && tensor.dtype != dtype);
+    }
+    if (!needed) {
+        return true;
+    }
+
+    std::string convertedPath = path + ".convert";
+    TensorWriter writer;
+    bool ok = writer.open(convertedPath);
+    std::vector<char> block(kFileBlockElements * sizeof(double));
+    for (const TensorInfo& tensor : reader->tensors()) {
+        if (!ok) {
+            break;
+        }
+        TensorSpan<const uint8_t> bytes = reader->bytes(tensor);
+        if (!isFloatDType(tensor.dtype) || tensor.dtype == dtype) {
+            ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+        ok = writer.begin(tensor.name, dtype, tensor.shape);
+        size_t inSize = dtypeSize(tensor.dtype);
+        size_t count = tensor.size / inSize;
+        for (size_t done = 0; ok && done < count; done += kFileBlockElements) {
+            size_t n = std::min(kFileBlockElements, count - done);
+            convertDType(bytes.data() + done * inSize, tensor.dtype, block.data(), dtype, n);
+            ok = writer.write(block.data(), n * dtypeSize(dtype));
+        }
+        ok = ok && writer.end();
+    }
+    ok = writer.finish() && ok;
+    if (!ok || std::rename(convertedPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to convert model " << path << " to " << dtypeName(dtype) << std::endl;
+        std::remove(convertedPath.c_str());
+        return false;
+    }
+    return true;
+}
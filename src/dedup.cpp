@@ -0,0 +1,358 @@
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../include/fednlib/dedup.h"
+#include "../include/fednlib/fileio.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define FEDNLIB_SHA_NI
+#endif
+
+namespace {
+
+const uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t rotr(uint32_t x, unsigned n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void compressScalar(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    uint32_t w[64];
+    for (; blocks > 0; --blocks, data += 64) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = uint32_t(data[4 * i]) << 24 | uint32_t(data[4 * i + 1]) << 16 | uint32_t(data[4 * i + 2]) << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kRoundConstants[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef FEDNLIB_SHA_NI
+// The SHA extensions keep the state as ABEF and CDGH and do two rounds per instruction
+__attribute__((target("sha,sse4.1,ssse3")))
+void compressShaNi(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; blocks > 0; --blocks, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+        for (int i = 0; i < 4; i++) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), byteSwap);
+        }
+        // Four rounds per step, the message schedule runs up to three steps ahead
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; g++) {
+            __m128i message = _mm_add_epi32(w[g % 4], _mm_loadu_si128(reinterpret_cast<const __m128i*>(kRoundConstants + 4 * g)));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+            if (g >= 3 && g <= 14) {
+                __m128i& next = w[(g + 1) % 4];
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[g % 4], w[(g + 3) % 4], 4));
+                next = _mm_sha256msg2_epu32(next, w[g % 4]);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(message, 0x0e));
+            if (g >= 1 && g <= 12) {
+                w[(g + 3) % 4] = _mm_sha256msg1_epu32(w[(g + 3) % 4], w[g % 4]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+}
+#endif
+
+using CompressFunction = void (*)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+CompressFunction selectCompress() {
+#ifdef FEDNLIB_SHA_NI
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        return compressShaNi;
+    }
+#endif
+    return compressScalar;
+}
+
+const CompressFunction compress = selectCompress();
+
+struct GearTable {
+    uint64_t table[256];
+    GearTable() {
+        uint64_t seed = 0;
+        for (uint64_t& entry : table) {
+            // splitmix64
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            entry = z ^ (z >> 31);
+        }
+    }
+};
+
+const GearTable gear;
+
+// Masks on the top bits of the gear hash, two bits stricter and looser than the average size
+constexpr uint64_t topBits(unsigned bits) {
+    return ~uint64_t(0) << (64 - bits);
+}
+constexpr unsigned kAverageBits = 16;
+static_assert(kChunkAverageSize == 1u << kAverageBits, "the masks assume the average chunk size");
+constexpr uint64_t kMaskSmall = topBits(kAverageBits + 2);
+constexpr uint64_t kMaskLarge = topBits(kAverageBits - 2);
+
+// Returns the size of the chunk at the start of data
+size_t cutPoint(const uint8_t* data, size_t size) {
+    if (size <= kChunkMinSize) {
+        return size;
+    }
+    size_t end = std::min<size_t>(size, kChunkMaxSize);
+    size_t normal = std::min<size_t>(end, kChunkAverageSize);
+    uint64_t hash = 0;
+    size_t i = kChunkMinSize;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear.table[data[i]];
+        if (!(hash & kMaskSmall)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear.table[data[i]];
+        if (!(hash & kMaskLarge)) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+ChunkHash hashOf(const char* data, size_t size) {
+    ChunkHash hash;
+    sha256(data, size, hash.data());
+    return hash;
+}
+
+} // namespace
+
+/**
+ * @brief Computes the SHA-256 digest of data, with the SHA extensions where the CPU has them.
+ */
+void sha256(const void* data, size_t size, uint8_t digest[32]) {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    compress(state, p, size / 64);
+
+    // The last partial block, the 0x80 terminator and the length in bits take one or two blocks
+    uint8_t tail[128] = {};
+    size_t rest = size % 64;
+    memcpy(tail, p + size - rest, rest);
+    tail[rest] = 0x80;
+    size_t tailSize = rest < 56 ? 64 : 128;
+    uint64_t bits = uint64_t(size) * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tailSize - 1 - i] = uint8_t(bits >> (8 * i));
+    }
+    compress(state, tail, tailSize / 64);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = uint8_t(state[i] >> 24);
+        digest[4 * i + 1] = uint8_t(state[i] >> 16);
+        digest[4 * i + 2] = uint8_t(state[i] >> 8);
+        digest[4 * i + 3] = uint8_t(state[i]);
+    }
+}
+
+/**
+ * @brief Splits data into content-defined chunks and hashes them.
+ *
+ * @param data The data, e.g. a mapped model file.
+ * @param size The size of the data.
+ * @return The chunks, in order, covering all of the data.
+ */
+std::vector<ContentChunk> chunkContent(const char* data, int64_t size) {
+    std::vector<ContentChunk> chunks;
+    chunks.reserve(size / kChunkAverageSize + 1);
+    for (int64_t offset = 0; offset < size; ) {
+        ContentChunk chunk;
+        chunk.offset = offset;
+        chunk.size = static_cast<uint32_t>(cutPoint(reinterpret_cast<const uint8_t*>(data) + offset, size - offset));
+        chunk.hash = hashOf(data + offset, chunk.size);
+        chunks.push_back(chunk);
+        offset += chunk.size;
+    }
+    return chunks;
+}
+
+/**
+ * @brief Returns a hash in hexadecimal, for logs.
+ */
+std::string chunkHashHex(const ChunkHash& hash) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (uint8_t byte : hash) {
+        hex += digits[byte >> 4];
+        hex += digits[byte & 0xf];
+    }
+    return hex;
+}
+
+ChunkStore::ChunkStore() = default;
+ChunkStore::~ChunkStore() = default;
+
+/**
+ * @brief Indexes the chunks of a file, replacing an earlier index of the same path.
+ *
+ * @return true if the file was indexed, false if it could not be mapped.
+ */
+bool ChunkStore::add(const std::string& path) {
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file) {
+        return false;
+    }
+    remove(path);
+    IndexedFile& indexed = files[path];
+    indexed.file = file;
+    indexed.chunks = chunkContent(file->data(), file->size());
+    index(indexed);
+    return true;
+}
+
+/**
+ * @brief Forgets the chunks of a file. Chunks that other files also hold are kept.
+ */
+void ChunkStore::remove(const std::string& path) {
+    auto found = files.find(path);
+    if (found == files.end()) {
+        return;
+    }
+    std::shared_ptr<MappedFile> file = found->second.file;
+    files.erase(found);
+    for (auto it = chunks.begin(); it != chunks.end(); ) {
+        it = it->second.file == file ? chunks.erase(it) : std::next(it);
+    }
+    for (const auto& entry : files) {
+        index(entry.second);
+    }
+}
+
+void ChunkStore::index(const IndexedFile& indexed) {
+    for (const ContentChunk& chunk : indexed.chunks) {
+        chunks.emplace(chunk.hash, Location{indexed.file, chunk.offset, chunk.size});
+    }
+}
+
+/**
+ * @brief Returns true if a chunk with the hash is held.
+ */
+bool ChunkStore::contains(const ChunkHash& hash) const {
+    return chunks.count(hash) > 0;
+}
+
+/**
+ * @brief Returns the chunks of a list that are not held, as runs of consecutive chunks.
+ *
+ * @return Pairs of the index of the first chunk of a run and the number of chunks in it.
+ */
+std::vector<int64_t> ChunkStore::missing(const std::vector<ContentChunk>& wanted) const {
+    std::vector<int64_t> runs;
+    for (size_t i = 0; i < wanted.size(); i++) {
+        auto found = chunks.find(wanted[i].hash);
+        if (found != chunks.end() && found->second.size == wanted[i].size) {
+            continue;
+        }
+        if (!runs.empty() && runs[runs.size() - 2] + runs.back() == int64_t(i)) {
+            runs.back()++;
+        } else {
+            runs.push_back(i);
+            runs.push_back(1);
+        }
+    }
+    return runs;
+}
+
+/**
+ * @brief Completes a file that was received with only the chunks that were not held.
+ *
+ * Every chunk of the file is checked against its hash; chunks that do not match, because
+ * they were not sent, are copied from the files that hold them.
+ *
+ * @param wanted The chunks of the whole file, in order.
+ * @param path The received file, which is extended to its full size if needed.
+ * @return true if every chunk of the file matches, false otherwise.
+ */
+bool ChunkStore::complete(const std::vector<ContentChunk>& wanted, const std::string& path) const {
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error opening file " << path << " for writing" << std::endl;
+        return false;
+    }
+    bool ok = true;
+    int64_t expected = 0;
+    std::vector<char> buffer(kChunkMaxSize);
+    for (const ContentChunk& chunk : wanted) {
+        ok = chunk.offset == expected;
+        expected += chunk.size;
+        if (!ok) {
+            break;
+        }
+        buffer.resize(chunk.size);
+        if (pread(fd, buffer.data(), chunk.size, chunk.offset) == ssize_t(chunk.size) && hashOf(buffer.data(), chunk.size) == chunk.hash) {
+            continue;
+        }
+        auto found = chunks.find(chunk.hash);
+        ok = found != chunks.end() && found->second.size == chunk.size
+            && found->second.offset + chunk.size <= found->second.file->size()
+            && hashOf(found->second.file->data() + found->second.offset, chunk.size) == chunk.hash
+            && pwrite(fd, found->second.file->data() + found->second.offset, chunk.size, chunk.offset) == ssize_t(chunk.size);
+        if (!ok) {
+            std::cerr << "Chunk " << chunkHashHex(chunk.hash) << " at " << chunk.offset << " of " << path
+                      << " was neither received nor held" << std::endl;
+            break;
+        }
+    }
+    ok = ok && ftruncate(fd, expected) == 0;
+    close(fd);
+    return ok;
+}
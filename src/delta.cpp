@@ -0,0 +1,390 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <vector>
+#include <zlib.h>
+
+#include "../include/fednlib/delta.h"
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/fileio.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The fednlib delta encoding is only implemented for little endian hosts"
+#endif
+
+namespace {
+
+const char kMagic[8] = {'F', 'D', 'N', 'D', 'E', 'L', 'T', 'A'};
+const char kTrailerMagic[8] = {'F', 'D', 'N', 'D', 'E', 'N', 'D', '\0'};
+const uint32_t kVersion = 1;
+const size_t kHeaderSize = 32;
+const size_t kBlockHeaderSize = 8;
+const size_t kTrailerSize = 16;
+const uint32_t kBlockSize = 1024 * 1024;
+const uint32_t kMaxBlockSize = 64 * 1024 * 1024;
+const uint32_t kFlagStored = 1;
+// Run-length matches only: the planes are runs of zeros and skewed bytes rather than repeated
+// strings, and this is several times faster than searching for longer matches
+const int kLevel = Z_BEST_SPEED;
+const int kStrategy = Z_RLE;
+
+template <typename T>
+T readLE(const char* p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void appendLE(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename W>
+W zigzag(W value) {
+    const W top = W(value >> (sizeof(W) * 8 - 1));
+    return W(W(value << 1) ^ W(W(0) - top));
+}
+
+template <typename W>
+W unzigzag(W value) {
+    return W(W(value >> 1) ^ W(W(0) - W(value & 1)));
+}
+
+/**
+ * @brief Writes the delta of the whole words of a block as byte planes: byte k of word i
+ * goes to planes[k * words + i].
+ */
+template <typename W>
+void encodeWords(const char* model, const char* base, size_t words, DeltaMode mode, uint8_t* planes) {
+    for (size_t i = 0; i < words; i++) {
+        W m = readLE<W>(model + i * sizeof(W));
+        W b = readLE<W>(base + i * sizeof(W));
+        W d = mode == DeltaMode::Xor ? W(m ^ b) : zigzag<W>(W(m - b));
+        for (size_t k = 0; k < sizeof(W); k++) {
+            planes[k * words + i] = uint8_t(d >> (8 * k));
+        }
+    }
+}
+
+template <typename W>
+void decodeWords(const uint8_t* planes, const char* base, size_t words, DeltaMode mode, char* model) {
+    for (size_t i = 0; i < words; i++) {
+        W d = 0;
+        for (size_t k = 0; k < sizeof(W); k++) {
+            d = W(d | W(W(planes[k * words + i]) << (8 * k)));
+        }
+        W b = readLE<W>(base + i * sizeof(W));
+        W m = mode == DeltaMode::Xor ? W(d ^ b) : W(b + unzigzag<W>(d));
+        memcpy(model + i * sizeof(W), &m, sizeof(W));
+    }
+}
+
+void encodeBlock(const char* model, const char* base, size_t size, DeltaMode mode, uint32_t wordSize, uint8_t* planes) {
+    size_t words = size / wordSize;
+    switch (wordSize) {
+        case 1: encodeWords<uint8_t>(model, base, words, mode, planes); break;
+        case 2: encodeWords<uint16_t>(model, base, words, mode, planes); break;
+        case 4: encodeWords<uint32_t>(model, base, words, mode, planes); break;
+        default: encodeWords<uint64_t>(model, base, words, mode, planes); break;
+    }
+    for (size_t i = words * wordSize; i < size; i++) {
+        planes[i] = uint8_t(model[i] ^ base[i]);
+    }
+}
+
+void decodeBlock(const uint8_t* planes, const char* base, size_t size, DeltaMode mode, uint32_t wordSize, char* model) {
+    size_t words = size / wordSize;
+    switch (wordSize) {
+        case 1: decodeWords<uint8_t>(planes, base, words, mode, model); break;
+        case 2: decodeWords<uint16_t>(planes, base, words, mode, model); break;
+        case 4: decodeWords<uint32_t>(planes, base, words, mode, model); break;
+        default: decodeWords<uint64_t>(planes, base, words, mode, model); break;
+    }
+    for (size_t i = words * wordSize; i < size; i++) {
+        model[i] = char(planes[i] ^ uint8_t(base[i]));
+    }
+}
+
+// The size of byte plane k of a block, the bytes past the last whole word are in the last one
+size_t planeSize(size_t blockSize, uint32_t wordSize, uint32_t k) {
+    size_t words = blockSize / wordSize;
+    return k + 1 < wordSize ? words : blockSize - k * words;
+}
+
+size_t deflatePlane(z_stream& stream, const uint8_t* data, size_t size, uint8_t* out, size_t capacity) {
+    deflateReset(&stream);
+    stream.next_in = const_cast<uint8_t*>(data);
+    stream.avail_in = size;
+    stream.next_out = out;
+    stream.avail_out = capacity;
+    return deflate(&stream, Z_FINISH) == Z_STREAM_END ? capacity - stream.avail_out : 0;
+}
+
+bool inflatePlane(z_stream& stream, const uint8_t* data, size_t size, uint8_t* out, size_t expected) {
+    inflateReset(&stream);
+    stream.next_in = const_cast<uint8_t*>(data);
+    stream.avail_in = size;
+    stream.next_out = out;
+    stream.avail_out = expected;
+    return inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.avail_in == 0 && stream.avail_out == 0;
+}
+
+bool validWordSize(uint32_t wordSize) {
+    return wordSize == 1 || wordSize == 2 || wordSize == 4 || wordSize == 8;
+}
+
+} // namespace
+
+/**
+ * @brief Returns the name of a delta mode, "xor" or "arithmetic".
+ */
+const char* deltaModeName(DeltaMode mode) {
+    return mode == DeltaMode::Xor ? "xor" : "arithmetic";
+}
+
+/**
+ * @brief Parses the name of a delta mode, as returned by deltaModeName().
+ *
+ * @return true if the name is known, false otherwise.
+ */
+bool deltaModeFromName(const std::string& name, DeltaMode& mode) {
+    for (DeltaMode candidate : {DeltaMode::Xor, DeltaMode::Arithmetic}) {
+        if (name == deltaModeName(candidate)) {
+            mode = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Reads the header and trailer of an encoded delta.
+ *
+ * @return true if the data is an encoded delta, false otherwise.
+ */
+bool readDeltaInfo(const char* data, size_t size, DeltaInfo& info) {
+    if (size < kHeaderSize + kTrailerSize || memcmp(data, kMagic, sizeof(kMagic)) != 0
+            || readLE<uint32_t>(data + 8) != kVersion
+            || memcmp(data + size - sizeof(kTrailerMagic), kTrailerMagic, sizeof(kTrailerMagic)) != 0) {
+        return false;
+    }
+    uint8_t mode = static_cast<uint8_t>(data[12]);
+    if ((mode != uint8_t(DeltaMode::Xor) && mode != uint8_t(DeltaMode::Arithmetic))
+            || !validWordSize(static_cast<uint8_t>(data[13])) || readLE<uint32_t>(data + 24) == 0
+            || readLE<uint32_t>(data + 24) > kMaxBlockSize) {
+        return false;
+    }
+    info.mode = static_cast<DeltaMode>(mode);
+    info.wordSize = static_cast<uint8_t>(data[13]);
+    info.modelSize = readLE<uint64_t>(data + 16);
+    info.encodedSize = size;
+    info.baseCrc = readLE<uint32_t>(data + size - kTrailerSize);
+    info.modelCrc = readLE<uint32_t>(data + size - kTrailerSize + 4);
+    return true;
+}
+
+/**
+ * @brief Encodes a model as its delta against the model it was trained from.
+ *
+ * Both files are read once, block by block, and the delta is written as it is produced.
+ *
+ * @param modelPath The path to the model.
+ * @param basePath The path to the base model, which must be the same size.
+ * @param deltaPath The path to write the delta to.
+ * @param mode Whether to XOR the words or to subtract them.
+ * @param wordSize The size of the words in bytes, 1, 2, 4 or 8, e.g. 4 for float32 weights.
+ * @param info Set to the sizes and checksums of the delta if not nullptr.
+ * @return true if the delta was written, false otherwise.
+ */
+bool encodeModelDelta(const std::string& modelPath, const std::string& basePath, const std::string& deltaPath,
+        DeltaMode mode, uint32_t wordSize, DeltaInfo* info) {
+    if (!validWordSize(wordSize)) {
+        std::cerr << "Invalid delta word size " << wordSize << std::endl;
+        return false;
+    }
+    std::shared_ptr<MappedFile> model = MappedFile::open(modelPath);
+    std::shared_ptr<MappedFile> base = MappedFile::open(basePath);
+    if (!model || !base) {
+        return false;
+    }
+    if (model->size() != base->size()) {
+        std::cerr << "Cannot encode model " << modelPath << " as a delta, it is " << model->size()
+                  << " bytes and the base " << base->size() << " bytes" << std::endl;
+        return false;
+    }
+    uint64_t size = model->size();
+
+    ModelFileWriter writer;
+    if (!writer.open(deltaPath)) {
+        return false;
+    }
+    std::string header(kMagic, sizeof(kMagic));
+    appendLE<uint32_t>(header, kVersion);
+    appendLE<uint8_t>(header, uint8_t(mode));
+    appendLE<uint8_t>(header, uint8_t(wordSize));
+    appendLE<uint16_t>(header, 0);
+    appendLE<uint64_t>(header, size);
+    appendLE<uint32_t>(header, kBlockSize);
+    appendLE<uint32_t>(header, 0);
+    bool ok = writer.write(header.data(), header.size(), 0);
+    int64_t offset = header.size();
+
+    z_stream stream = {};
+    if (deflateInit2(&stream, kLevel, Z_DEFLATED, -MAX_WBITS, 8, kStrategy) != Z_OK) {
+        std::remove(deltaPath.c_str());
+        return false;
+    }
+    std::vector<uint8_t> planes(kBlockSize);
+    std::vector<uint8_t> packed(kBlockHeaderSize + deflateBound(&stream, kBlockSize));
+    uint32_t baseCrc = 0;
+    uint32_t modelCrc = 0;
+    for (uint64_t done = 0; ok && done < size; done += kBlockSize) {
+        size_t blockSize = std::min<uint64_t>(kBlockSize, size - done);
+        const char* modelBlock = model->data() + done;
+        const char* baseBlock = base->data() + done;
+        modelCrc = crc32c(modelCrc, modelBlock, blockSize);
+        baseCrc = crc32c(baseCrc, baseBlock, blockSize);
+        encodeBlock(modelBlock, baseBlock, blockSize, mode, wordSize, planes.data());
+
+        // Planes that do not shrink, usually the low bytes of the mantissas, are stored
+        const uint8_t* plane = planes.data();
+        for (uint32_t k = 0; ok && k < wordSize; k++) {
+            size_t rawSize = planeSize(blockSize, wordSize, k);
+            uint8_t* out = packed.data() + kBlockHeaderSize;
+            size_t packedSize = deflatePlane(stream, plane, rawSize, out, packed.size() - kBlockHeaderSize);
+            uint32_t flags = 0;
+            if (packedSize == 0 || packedSize >= rawSize) {
+                memcpy(out, plane, rawSize);
+                packedSize = rawSize;
+                flags = kFlagStored;
+            }
+            uint32_t storedSize = packedSize;
+            memcpy(packed.data(), &storedSize, sizeof(storedSize));
+            memcpy(packed.data() + 4, &flags, sizeof(flags));
+            ok = writer.write(reinterpret_cast<const char*>(packed.data()), kBlockHeaderSize + packedSize, offset);
+            offset += kBlockHeaderSize + packedSize;
+            plane += rawSize;
+        }
+        model->release(done, blockSize);
+        base->release(done, blockSize);
+    }
+    deflateEnd(&stream);
+
+    std::string trailer;
+    appendLE<uint32_t>(trailer, baseCrc);
+    appendLE<uint32_t>(trailer, modelCrc);
+    trailer.append(kTrailerMagic, sizeof(kTrailerMagic));
+    ok = ok && writer.write(trailer.data(), trailer.size(), offset);
+    offset += trailer.size();
+    ok = writer.finish(offset) && ok;
+    if (!ok) {
+        std::cerr << "Failed to write delta " << deltaPath << std::endl;
+        std::remove(deltaPath.c_str());
+        return false;
+    }
+    if (info) {
+        info->mode = mode;
+        info->wordSize = wordSize;
+        info->modelSize = size;
+        info->encodedSize = offset;
+        info->baseCrc = baseCrc;
+        info->modelCrc = modelCrc;
+    }
+    return true;
+}
+
+/**
+ * @brief Reconstructs a model from its delta and the base model it was encoded against.
+ *
+ * The checksums of the base and of the reconstructed model are checked, so a delta applied
+ * to the wrong base is detected instead of producing a corrupt model.
+ *
+ * @param deltaPath The path to the delta, written by encodeModelDelta().
+ * @param basePath The path to the base model.
+ * @param modelPath The path to write the model to. It is removed if decoding fails.
+ * @return true if the model was reconstructed, false otherwise.
+ */
+bool decodeModelDelta(const std::string& deltaPath, const std::string& basePath, const std::string& modelPath) {
+    std::shared_ptr<MappedFile> delta = MappedFile::open(deltaPath);
+    std::shared_ptr<MappedFile> base = MappedFile::open(basePath);
+    if (!delta || !base) {
+        return false;
+    }
+    DeltaInfo info;
+    if (!readDeltaInfo(delta->data(), delta->size(), info)) {
+        std::cerr << "Not a model delta: " << deltaPath << std::endl;
+        return false;
+    }
+    if (info.modelSize != uint64_t(base->size())) {
+        std::cerr << "Delta " << deltaPath << " was encoded against a base of " << info.modelSize
+                  << " bytes, " << basePath << " is " << base->size() << " bytes" << std::endl;
+        return false;
+    }
+    uint32_t blockSize = readLE<uint32_t>(delta->data() + 24);
+
+    ModelFileWriter writer;
+    if (!writer.open(modelPath, info.modelSize)) {
+        return false;
+    }
+    const char* data = delta->data();
+    uint64_t end = delta->size() - kTrailerSize;
+    uint64_t position = kHeaderSize;
+    std::vector<uint8_t> planes(blockSize);
+    std::vector<char> block(blockSize);
+    uint32_t baseCrc = 0;
+    uint32_t modelCrc = 0;
+    z_stream stream = {};
+    bool ok = inflateInit2(&stream, -MAX_WBITS) == Z_OK;
+    for (uint64_t done = 0; ok && done < info.modelSize; done += blockSize) {
+        size_t rawBlockSize = std::min<uint64_t>(blockSize, info.modelSize - done);
+        uint8_t* plane = planes.data();
+        for (uint32_t k = 0; ok && k < info.wordSize; k++) {
+            size_t rawSize = planeSize(rawBlockSize, info.wordSize, k);
+            if (end - position < kBlockHeaderSize) {
+                ok = false;
+                break;
+            }
+            uint32_t storedSize = readLE<uint32_t>(data + position);
+            uint32_t flags = readLE<uint32_t>(data + position + 4);
+            position += kBlockHeaderSize;
+            if (storedSize > end - position) {
+                ok = false;
+                break;
+            }
+            const uint8_t* stored = reinterpret_cast<const uint8_t*>(data + position);
+            if (flags == kFlagStored) {
+                ok = storedSize == rawSize;
+                if (ok) {
+                    memcpy(plane, stored, rawSize);
+                }
+            } else {
+                ok = flags == 0 && inflatePlane(stream, stored, storedSize, plane, rawSize);
+            }
+            position += storedSize;
+            plane += rawSize;
+        }
+        if (!ok) {
+            break;
+        }
+        const char* baseBlock = base->data() + done;
+        baseCrc = crc32c(baseCrc, baseBlock, rawBlockSize);
+        decodeBlock(planes.data(), baseBlock, rawBlockSize, info.mode, info.wordSize, block.data());
+        modelCrc = crc32c(modelCrc, block.data(), rawBlockSize);
+        ok = writer.write(block.data(), rawBlockSize, done);
+    }
+    inflateEnd(&stream);
+    ok = writer.finish(info.modelSize) && ok;
+    if (!ok || position != end) {
+        std::cerr << "Invalid model delta " << deltaPath << std::endl;
+    } else if (baseCrc != info.baseCrc) {
+        std::cerr << "Delta " << deltaPath << " was encoded against another base than " << basePath << std::endl;
+    } else if (modelCrc != info.modelCrc) {
+        std::cerr << "Checksum mismatch decoding delta " << deltaPath << std::endl;
+    } else {
+        return true;
+    }
+    std::remove(modelPath.c_str());
+    return false;
+}
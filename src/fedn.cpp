@@ -2,9 +2,28 @@
 #include <yaml-cpp/yaml.h>
 #include <nlohmann/json.hpp>
 #include <thread>
+#include <fstream>
+#include <ctime>
+#include <cstdio>
+#include <grpc/grpc_security.h>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <cctype>
+#include <sstream>
+#include <cmath>
 
 #include "../include/fednlib/fedn.h"
 #include "../include/fednlib/utils.h"
+#include "../include/fednlib/fileio.h"
+#include "../include/fednlib/convert.h"
+#include "../include/fednlib/delta.h"
+#include "../include/fednlib/quantize.h"
+#include "../include/fednlib/sparsify.h"
+#include "../include/fednlib/lowrank.h"
+#include "../include/fednlib/codec.h"
+#include "../include/fednlib/privacy.h"
+#include "../include/fednlib/secagg.h"
 
 using json = nlohmann::json;
 
@@ -42,6 +61,31 @@ private:
     grpc::string value_;
 };
 
+namespace {
+
+/**
+ * @brief Reads a setting that is a whole number of at least zero.
+ *
+ * @param config The configuration the setting is in.
+ * @param key The name of the setting.
+ * @param max The largest value allowed.
+ * @return uint64_t The value of the setting.
+ * @throws std::runtime_error naming the setting if it is not a whole number from 0 to max.
+ */
+uint64_t readCount(std::map<std::string, std::string>& config, const std::string& key, uint64_t max = INT_MAX) {
+    const std::string& text = config[key];
+    char* end = nullptr;
+    errno = 0;
+    uint64_t value = std::strtoull(text.c_str(), &end, 10);
+    // strtoull skips white space and negates "-1" without an error
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0])) || *end != '\0' || errno == ERANGE || value > max) {
+        throw std::runtime_error("Invalid " + key + " " + text + ", expected a whole number from 0 to " + std::to_string(max));
+    }
+    return value;
+}
+
+} // namespace
+
 
 /**
  * @brief Constructs a new FednClient object.
@@ -51,9 +95,13 @@ private:
  * configurations and creates an HTTP client instance with the API URL and token
  * provided in the configuration file.
  * 
+ * If no combiner host is configured, the combiner assignment is started in the
+ * background right away, so that it overlaps with whatever the application does
+ * before calling getCombinerConfig().
+ * 
  * @param configFilePath The path to the YAML configuration file.
  */
-FednClient::FednClient(std::string configFilePath) {
+FednClient::FednClient(std::string configFilePath) : startTime(std::chrono::steady_clock::now()) {
     // Read HTTP configuration from the "client.yaml" file
     YAML::Node config = YAML::LoadFile(configFilePath);
     //TODO: make utility function instead
@@ -66,16 +114,27 @@ FednClient::FednClient(std::string configFilePath) {
     }
     controllerConfig = readControllerConfig(config);
     combinerConfig = readCombinerConfig(config);
+    combinerCandidates = readCombinerCandidates(config);
 
     // Create a Client instance with the API URL and token (if provided)
     httpClient = std::make_shared<HttpClient>(controllerConfig["api_url"], controllerConfig["token"]);
+    httpClient->setConnectTimeout(readCount(controllerConfig, "connect_timeout") * 1000);
+    httpClient->setRequestTimeout(readCount(controllerConfig, "request_timeout") * 1000);
+    httpClient->setMaxRetries(static_cast<int>(readCount(controllerConfig, "max_retries")));
+
+    // Start combiner discovery in the background
+    if (combinerConfig["host"].empty()) {
+        discoveryConfig = controllerConfig;
+        discovery = std::async(std::launch::async, &FednClient::requestAssignment, this, discoveryConfig);
+    }
 }
 
 /**
  * @brief Retrieves the combiner configuration for the FednClient.
  *
  * This function checks if the "host" entry in the combiner configuration is empty.
- * If it is empty, it assigns a new combiner configuration by calling the assignCombiner() method.
+ * If it is empty, it assigns a new combiner configuration by calling the assignCombiner() method,
+ * which waits for the discovery started by the constructor if there is one.
  * The function returns the combiner configuration as a map of string key-value pairs.
  *
  * @return std::map<std::string, std::string> The combiner configuration.
@@ -117,8 +176,14 @@ std::shared_ptr<ChannelInterface> FednClient::getChannel() {
  * @brief Runs the FednClient with a custom gRPC client.
  * 
  * This function sets the name and ID of the gRPC client based on the controller
- * configuration. It then starts the heart beat thread and listens to model update
- * requests from the combiner.
+ * configuration. It then waits until the channel is connected, reports the startup
+ * time, starts the heart beat thread and listens to model update requests from the
+ * combiner. If the task stream is lost, the client fails over to the standby combiner
+ * if there is one, and otherwise reconnects to the same combiner. Reassign and reconnect
+ * requests from the combiner are honored, see FednClient::migrate.
+ * 
+ * If the channel cannot be connected to a combiner that was taken from the assignment
+ * cache, the cache is cleared and the client is assigned a new combiner.
  * 
  * @param customGrpcClient The custom gRPC client to run.
  */
@@ -129,25 +194,264 @@ void FednClient::run(std::shared_ptr<GrpcClient> customGrpcClient) {
     // Set name, id and chunk size
     grpcClient->setName(controllerConfig["name"]);
     grpcClient->setId(controllerConfig["client_id"]);
+    grpcClient->setTransferRetries(static_cast<int>(readCount(combinerConfig, "transfer_retries")));
+    grpcClient->setZeroCopyTransfer(combinerConfig["zero_copy_transfer"] == "true");
+    grpcClient->setDedupUploads(combinerConfig["dedup_uploads"] == "true");
+    grpcClient->setPartialUpdates(combinerConfig["partial_updates"] == "true");
+    std::vector<std::string> requiredTensors;
+    std::istringstream tensorList(combinerConfig["download_tensors"]);
+    for (std::string tensor; std::getline(tensorList, tensor, ',');) {
+        if (!tensor.empty()) {
+            requiredTensors.push_back(tensor);
+        }
+    }
+    grpcClient->setRequiredTensors(requiredTensors);
+
+    // Convert uploaded tensor containers to the configured dtype
+    DType modelDType;
+    if (controllerConfig["model_dtype"].empty()) {
+        grpcClient->setModelDType(std::nullopt);
+    } else if (dtypeFromName(controllerConfig["model_dtype"], modelDType) && isFloatDType(modelDType)) {
+        grpcClient->setModelDType(modelDType);
+        std::cout << "Uploading models as " << controllerConfig["model_dtype"] << ", conversion kernels: " << conversionKernels() << std::endl;
+    } else {
+        std::cerr << "Ignoring model_dtype " << controllerConfig["model_dtype"] << ", expected float64, float32, bfloat16 or float16" << std::endl;
+    }
+
+    // Upload trained models as deltas against the global model they were trained from
+    DeltaMode modelDelta;
+    if (controllerConfig["model_delta"].empty()) {
+        grpcClient->setModelDelta(std::nullopt);
+    } else if (deltaModeFromName(controllerConfig["model_delta"], modelDelta)) {
+        grpcClient->setModelDelta(modelDelta);
+        std::cout << "Uploading models as " << controllerConfig["model_delta"] << " deltas" << std::endl;
+    } else {
+        std::cerr << "Ignoring model_delta " << controllerConfig["model_delta"] << ", expected xor or arithmetic" << std::endl;
+    }
+
+    // A codec pipeline replaces the single codecs below
+    if (!controllerConfig["update_pipeline"].empty()) {
+        std::shared_ptr<CodecPipeline> pipeline = CodecPipeline::parse(controllerConfig["update_pipeline"]);
+        if (pipeline) {
+            std::cout << "Encoding model updates with " << pipeline->spec() << std::endl;
+        } else {
+            std::cerr << "Ignoring update_pipeline " << controllerConfig["update_pipeline"] << std::endl;
+        }
+        grpcClient->setUpdatePipeline(pipeline);
+    }
+
+    // Compress model updates to low-rank factors, tried before the other codecs
+    LowRankOptions lowRankOptions;
+    if (controllerConfig["model_low_rank"].empty()) {
+        grpcClient->setModelLowRank(std::nullopt);
+    } else if ((lowRankOptions.rank = std::strtoul(controllerConfig["model_low_rank"].c_str(), nullptr, 10)) > 0) {
+        lowRankOptions.minElements = readCount(controllerConfig, "low_rank_min_elements", SIZE_MAX);
+        grpcClient->setModelLowRank(lowRankOptions);
+        std::cout << "Uploading models as rank " << lowRankOptions.rank << " updates" << std::endl;
+    } else {
+        std::cerr << "Ignoring model_low_rank " << controllerConfig["model_low_rank"] << ", expected a positive rank" << std::endl;
+    }
+
+    // Sparsify model updates, tried before the quantization and the delta
+    SparsifyOptions sparsifyOptions;
+    if (controllerConfig["model_sparsification"].empty()) {
+        grpcClient->setModelSparsification(std::nullopt);
+    } else if ((sparsifyOptions.ratio = std::strtod(controllerConfig["model_sparsification"].c_str(), nullptr)) > 0
+            && sparsifyOptions.ratio <= 1) {
+        grpcClient->setModelSparsification(sparsifyOptions);
+        std::cout << "Uploading models as the largest " << sparsifyOptions.ratio << " of their updates" << std::endl;
+    } else {
+        std::cerr << "Ignoring model_sparsification " << controllerConfig["model_sparsification"] << ", expected a fraction in (0, 1]" << std::endl;
+    }
+
+    // Quantize model updates, tried before the delta
+    QuantizeOptions quantizeOptions;
+    if (controllerConfig["model_quantization"].empty()) {
+        grpcClient->setModelQuantization(std::nullopt);
+    } else if (quantizationFromName(controllerConfig["model_quantization"], quantizeOptions.bits)) {
+        // The kernels quantize blocks of 16 weights at a time
+        quantizeOptions.blockSize = readCount(controllerConfig, "quantization_block_size", SIZE_MAX);
+        if (quantizeOptions.blockSize % 16 != 0) {
+            throw std::runtime_error("Invalid quantization_block_size " + controllerConfig["quantization_block_size"]
+                + ", expected a multiple of 16 or 0");
+        }
+        grpcClient->setModelQuantization(quantizeOptions);
+        std::cout << "Uploading models as " << controllerConfig["model_quantization"] << " quantized updates" << std::endl;
+    } else {
+        std::cerr << "Ignoring model_quantization " << controllerConfig["model_quantization"] << ", expected int8 or int4" << std::endl;
+    }
+
+    // Make model updates differentially private. A bad setting stops the client rather than
+    // uploading updates without the privacy that was asked for.
+    if (!controllerConfig["dp_clip_norm"].empty()) {
+        PrivacyOptions privacyOptions;
+        char* clipEnd = nullptr;
+        char* noiseEnd = nullptr;
+        privacyOptions.clipNorm = std::strtod(controllerConfig["dp_clip_norm"].c_str(), &clipEnd);
+        privacyOptions.noiseMultiplier = std::strtod(controllerConfig["dp_noise_multiplier"].c_str(), &noiseEnd);
+        if (*clipEnd != '\0' || *noiseEnd != '\0' || !(privacyOptions.clipNorm > 0) || !(privacyOptions.noiseMultiplier >= 0)
+                || !std::isfinite(privacyOptions.clipNorm) || !std::isfinite(privacyOptions.noiseMultiplier)) {
+            throw std::runtime_error("Invalid dp_clip_norm " + controllerConfig["dp_clip_norm"] + " or dp_noise_multiplier "
+                + controllerConfig["dp_noise_multiplier"] + ", expected a positive norm and a non-negative multiplier");
+        }
+        grpcClient->setPrivacy(privacyOptions);
+        std::cout << "Clipping model updates to norm " << privacyOptions.clipNorm << " with noise multiplier "
+                  << privacyOptions.noiseMultiplier << std::endl;
+    }
+
+    // Mask model updates for secure aggregation, likewise stopping on a bad setting rather than
+    // uploading updates in the clear
+    if (!controllerConfig["secagg_key_dir"].empty()) {
+        char* clientsEnd = nullptr;
+        char* timeoutEnd = nullptr;
+        char* bitsEnd = nullptr;
+        long clients = std::strtol(controllerConfig["secagg_clients"].c_str(), &clientsEnd, 10);
+        double timeout = std::strtod(controllerConfig["secagg_timeout"].c_str(), &timeoutEnd);
+        long fractionalBits = std::strtol(controllerConfig["secagg_fractional_bits"].c_str(), &bitsEnd, 10);
+        if (*clientsEnd != '\0' || *timeoutEnd != '\0' || *bitsEnd != '\0' || clients < 2 || !(timeout > 0)
+                || !std::isfinite(timeout) || fractionalBits < 0 || fractionalBits > 30) {
+            throw std::runtime_error("Invalid secagg_clients " + controllerConfig["secagg_clients"] + ", secagg_timeout "
+                + controllerConfig["secagg_timeout"] + " or secagg_fractional_bits " + controllerConfig["secagg_fractional_bits"]
+                + ", expected at least 2 clients, a positive timeout and 0 to 30 bits");
+        }
+        SecureAggregationOptions secureAggregationOptions;
+        secureAggregationOptions.keyExchange = std::make_shared<DirectoryKeyExchange>(controllerConfig["secagg_key_dir"], clients,
+            std::chrono::milliseconds(static_cast<int64_t>(timeout * 1000)));
+        secureAggregationOptions.fractionalBits = static_cast<int>(fractionalBits);
+        grpcClient->setSecureAggregation(secureAggregationOptions);
+        std::cout << "Masking model updates for secure aggregation of " << clients << " clients, keys in "
+                  << controllerConfig["secagg_key_dir"] << std::endl;
+    }
+
+    // Select the engine for model files
+    FileIOOptions fileIOOptions;
+    fileIOOptions.engine = controllerConfig["file_io"];
+    fileIOOptions.directIO = controllerConfig["direct_io"] == "true";
+    setFileIOOptions(fileIOOptions);
+
+    // Open the workspace for the files of tasks, files left by a crashed run are removed
+    try {
+        WorkspaceOptions workspaceOptions;
+        workspaceOptions.root = controllerConfig["workspace"];
+        workspaceOptions.quota = readCount(controllerConfig, "workspace_quota_mb", UINT64_MAX >> 20) << 20;
+        workspaceOptions.ramRoot = controllerConfig["workspace_ram"];
+        workspaceOptions.ramQuota = readCount(controllerConfig, "workspace_ram_quota_mb", UINT64_MAX >> 20) << 20;
+        workspaceOptions.ramThreshold = readCount(controllerConfig, "workspace_ram_threshold_mb", UINT64_MAX >> 20) << 20;
+        std::shared_ptr<Workspace> workspace = std::make_shared<Workspace>(workspaceOptions);
+        grpcClient->setWorkspace(workspace);
+        // Keep the last global models, later ones are downloaded as deltas against them
+        size_t modelCacheSize = readCount(controllerConfig, "model_cache_size");
+        if (modelCacheSize > 0) {
+            grpcClient->setModelCache(std::make_shared<ModelCache>(workspace->stateFile("models"), modelCacheSize, workspace));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to open workspace " << controllerConfig["workspace"] << ": " << e.what() << std::endl;
+    }
+
+    // Open the outbox, results left from a previous run are delivered once connected
+    if (!controllerConfig["outbox"].empty()) {
+        try {
+            grpcClient->setOutbox(std::make_shared<Outbox>(controllerConfig["outbox"], static_cast<long>(readCount(controllerConfig, "outbox_ttl"))));
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to open outbox, undelivered results will be discarded: " << e.what() << std::endl;
+        }
+    }
+
+    // Make sure the channel is connected before opening the task stream
+    if (channel && !waitForChannel(channel) && assignmentFromCache && !discoveryCancelled) {
+        std::cout << "Cached combiner " << combinerConfig["host"] << " is unreachable, requesting new assignment" << std::endl;
+        clearAssignmentCache();
+        combinerConfig["host"] = "";
+        grpcClient->setChannel(setupGrpcChannel(getCombinerConfig()));
+        waitForChannel(channel);
+    }
+    auto startupTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+    std::cout << "Startup time: " << startupTime.count() << " ms" << std::endl;
 
     // Start heart beat thread and listen to model update requests
     std::thread HeartBeatThread(sendIntervalHeartBeat, grpcClient.get(), 10);
-    grpcClient->connectTaskStream();
+    while (true) {
+        grpcClient->connectTaskStream();
+
+        // Requests from the combiner to move to another combiner or to reconnect later
+        std::optional<fedn::ReassignRequest> reassign = grpcClient->takeReassignRequest();
+        std::optional<fedn::ReconnectRequest> reconnect = grpcClient->takeReconnectRequest();
+        if (reassign) {
+            if (!migrate(*reassign)) {
+                // Back off before returning to the combiner that asked the client to leave,
+                // after the delay it asked for if it sent one
+                std::this_thread::sleep_for(std::chrono::seconds(reconnect ? reconnect->reconnect() : 5));
+                std::cout << "Reconnecting to combiner " << combinerConfig["host"] << std::endl;
+                waitForChannel(channel);
+            }
+            continue;
+        }
+        if (reconnect) {
+            std::this_thread::sleep_for(std::chrono::seconds(reconnect->reconnect()));
+            std::cout << "Reconnecting to combiner " << combinerConfig["host"] << std::endl;
+            waitForChannel(channel);
+            continue;
+        }
+
+        // Fail over to the standby combiner, or reconnect to the same combiner
+        if (!failover()) {
+            std::this_thread::sleep_for(std::chrono::seconds(5));
+            std::cout << "Reconnecting to combiner " << combinerConfig["host"] << std::endl;
+            waitForChannel(channel);
+        }
+    }
     HeartBeatThread.join();
 }
 
+/**
+ * @brief Waits until a channel is connected to the combiner.
+ * 
+ * @param channel The channel to wait for.
+ * @return true if the channel connected within the configured combiner_connect_timeout, false otherwise.
+ */
+bool FednClient::waitForChannel(std::shared_ptr<ChannelInterface> channel) {
+    auto connectStart = std::chrono::steady_clock::now();
+    auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(readCount(combinerConfig, "connect_timeout"));
+    bool connected = channel->WaitForConnected(deadline);
+    auto connectTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - connectStart);
+    if (connected) {
+        std::cout << "Connected to combiner in " << connectTime.count() << " ms" << std::endl;
+    } else {
+        std::cerr << "Failed to connect to combiner within " << connectTime.count() << " ms" << std::endl;
+    }
+    return connected;
+}
+
 /**
  * @brief Assigns the client to a combiner.
  * 
- * This function sends an HTTP request to the controller to assign the client to a combiner.
- * It then extracts the host and token from the response and sets the combiner configuration
- * accordingly. The function returns the combiner configuration as a map of string key-value pairs.
+ * This function uses the result of the discovery started by the constructor if the
+ * controller configuration has not been changed since, otherwise it requests a new
+ * assignment. It then extracts the host and token from the response and sets the
+ * combiner configuration accordingly. The function returns the combiner configuration
+ * as a map of string key-value pairs.
  * 
  * @return std::map<std::string, std::string> The combiner configuration.
+ * @throws std::runtime_error If the controller could not assign a combiner.
  */
 std::map<std::string, std::string> FednClient::assignCombiner() {
-    // Request assignment to combiner
-    json httpResponseData = httpClient->assign(controllerConfig);
+    json httpResponseData;
+    if (discovery.valid()) {
+        auto discoveryStart = std::chrono::steady_clock::now();
+        httpResponseData = discovery.get();
+        auto waitTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - discoveryStart);
+        std::cout << "Waited " << waitTime.count() << " ms for combiner discovery" << std::endl;
+        if (discoveryCancelled || discoveryConfig != controllerConfig) {
+            // The host was set or the configuration was changed after discovery was started
+            discoveryCancelled = false;
+            httpResponseData = requestAssignment(controllerConfig);
+        }
+    } else {
+        httpResponseData = requestAssignment(controllerConfig);
+    }
+    if (httpResponseData.empty() || !httpResponseData["host"].is_string()) {
+        throw std::runtime_error("Failed to get combiner assignment from controller.");
+    }
 
     // Pretty print of the response
     std::cout << "Response: " << httpResponseData.dump(4) << std::endl;
@@ -166,22 +470,183 @@ std::map<std::string, std::string> FednClient::assignCombiner() {
     combinerConfig["proxy_host"] = httpResponseData["fqdn"].is_null() ? "" : httpResponseData["fqdn"].get<std::string>();
     combinerConfig["token"] = httpClient->getToken();
 
+    // Other combiners the controller suggests, given as host strings or host/port objects
+    if (httpResponseData["combiners"].is_array()) {
+        for (const json& candidate : httpResponseData["combiners"]) {
+            if (candidate.is_string()) {
+                combinerCandidates.push_back(candidate.get<std::string>());
+            } else if (candidate["host"].is_string()) {
+                std::string host = candidate["host"].get<std::string>();
+                if (combinerConfig["insecure"] == "true" && candidate["port"].is_number_integer()) {
+                    host += ":" + std::to_string(candidate["port"].get<int>());
+                }
+                combinerCandidates.push_back(host);
+            }
+        }
+    }
+
     return combinerConfig;
 }
 
+/**
+ * @brief Requests a combiner assignment, from the cache if possible.
+ * 
+ * This function first looks for a cached assignment from a previous run. If there is no
+ * valid cached assignment, it sends an HTTP request to the controller to assign the client
+ * to a combiner and caches the response. It only reads the configuration passed to it, so
+ * it can run in the background. A discovery cancelled by setCombinerHost() does not request
+ * an assignment.
+ * 
+ * @param config The controller configuration.
+ * @return json The controller response, or an empty JSON object if the assignment failed.
+ */
+json FednClient::requestAssignment(std::map<std::string, std::string> config) {
+    json httpResponseData = loadCachedAssignment(config);
+    assignmentFromCache = !httpResponseData.empty() && !discoveryCancelled;
+    if (httpResponseData.empty() && !discoveryCancelled) {
+        // Request assignment to combiner
+        httpResponseData = httpClient->assign(config);
+        if (!httpResponseData.empty() && httpResponseData["host"].is_string()) {
+            cacheAssignment(config, httpResponseData);
+        }
+    }
+    return httpResponseData;
+}
+
+/**
+ * @brief Loads the combiner assignment cached by a previous run.
+ * 
+ * The cached assignment is only used if it was made for the same controller, client and
+ * preferred combiner, and if it is younger than the configured assignment_ttl.
+ * 
+ * @param config The controller configuration.
+ * @return json The cached controller response, or an empty JSON object if there is no valid cache.
+ */
+json FednClient::loadCachedAssignment(std::map<std::string, std::string>& config) {
+    const std::string& cachePath = config["assignment_cache"];
+    long ttl = static_cast<long>(readCount(config, "assignment_ttl"));
+    if (cachePath.empty() || ttl <= 0) {
+        return json();
+    }
+    std::ifstream inFile(cachePath);
+    if (!inFile) {
+        return json();
+    }
+    try {
+        json cache = json::parse(inFile);
+        long age = (long) std::time(nullptr) - cache.at("assigned_at").get<long>();
+        if (cache.at("api_url") != config["api_url"] ||
+            cache.at("client_id") != config["client_id"] ||
+            cache.at("preferred_combiner") != config["preferred_combiner"] ||
+            age < 0 || age > ttl) {
+            std::cout << "Cached combiner assignment in " << cachePath << " is outdated" << std::endl;
+            return json();
+        }
+        std::cout << "Using cached combiner assignment from " << cachePath << " (" << age << " s old)" << std::endl;
+        return cache.at("response");
+    } catch (const std::exception& e) {
+        std::cerr << "Ignoring invalid combiner assignment cache " << cachePath << ": " << e.what() << std::endl;
+        return json();
+    }
+}
+
+/**
+ * @brief Persists a combiner assignment so that it can be reused on restart.
+ * 
+ * The cache is written to a temporary file that is then renamed, so a crash never leaves
+ * a partially written cache behind.
+ * 
+ * @param config The controller configuration the assignment was made for.
+ * @param assignment The controller response to cache.
+ */
+void FednClient::cacheAssignment(std::map<std::string, std::string>& config, const json& assignment) {
+    const std::string& cachePath = config["assignment_cache"];
+    if (cachePath.empty() || readCount(config, "assignment_ttl") == 0) {
+        return;
+    }
+    json cache = {
+        {"api_url", config["api_url"]},
+        {"client_id", config["client_id"]},
+        {"preferred_combiner", config["preferred_combiner"]},
+        {"assigned_at", (long) std::time(nullptr)},
+        {"response", assignment}
+    };
+    std::string tempPath = cachePath + ".tmp";
+    std::ofstream outFile(tempPath);
+    if (!outFile) {
+        std::cerr << "Error opening file " << tempPath << " for writing" << std::endl;
+        return;
+    }
+    outFile << cache.dump();
+    outFile.close();
+    if (std::rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+        std::cerr << "Error writing combiner assignment cache " << cachePath << std::endl;
+    }
+}
+
+/**
+ * @brief Removes the cached combiner assignment.
+ * 
+ * Call this when the cached combiner turns out to be unusable, so that the next call to
+ * getCombinerConfig() asks the controller for a new assignment.
+ */
+void FednClient::clearAssignmentCache() {
+    const std::string& cachePath = controllerConfig["assignment_cache"];
+    if (!cachePath.empty()) {
+        std::remove(cachePath.c_str());
+    }
+}
+
 /**
  * @brief Sets up the gRPC channel for the FednClient.
  * 
- * This function sets up the gRPC channel based on the combiner configuration provided.
+ * If combiner candidates have been configured, or were returned by the controller, all
+ * candidates are probed and the channel is connected to the accepting combiner with the
+ * lowest round-trip time. The runner-up is kept connected as a warm standby that run()
+ * fails over to if the connection to the combiner is lost. Otherwise the channel is
+ * created to the host in the combiner configuration.
+ * 
+ * @param combinerConfig The combiner configuration.
+ * @return std::shared_ptr<ChannelInterface> The shared pointer to the channel.
+ */
+std::shared_ptr<ChannelInterface> FednClient::setupGrpcChannel(std::map<std::string, std::string> combinerConfig) {
+    std::vector<std::string> hosts = getCandidateHosts(combinerConfig["host"]);
+    if (hosts.size() > 1) {
+        std::vector<CombinerCandidate> ranked = probeCombiners(combinerConfig, hosts);
+        if (ranked[0].accepting) {
+            std::cout << "Selected combiner " << ranked[0].host << std::endl;
+            this->combinerConfig["host"] = ranked[0].host;
+            channel = ranked[0].channel;
+            std::lock_guard<std::mutex> lock(standbyMutex);
+            standby = ranked[1].accepting ? ranked[1] : CombinerCandidate();
+            if (standby.channel) {
+                std::cout << "Standby combiner " << standby.host << std::endl;
+            }
+            return channel;
+        }
+        std::cout << "No combiner candidate is accepting clients, using " << combinerConfig["host"] << std::endl;
+    }
+    channel = createChannel(combinerConfig);
+    return channel;
+}
+
+/**
+ * @brief Creates a gRPC channel to a combiner.
+ * 
+ * This function creates a gRPC channel based on the combiner configuration provided.
  * It initializes the credentials based on the "insecure" flag and the "token" and "auth_scheme"
  * values in the combiner configuration. It then creates a channel using the specified host and
  * credentials. If a proxy host is provided, the host is set to the proxy host and the server host
  * is set in the metadata. The function returns a shared pointer to the ChannelInterface.
  * 
+ * The channel starts connecting immediately instead of on the first RPC, and all secure
+ * channels share one TLS session cache, so reconnects and new channels to a combiner the
+ * client has already talked to can resume the TLS session instead of doing a full handshake.
+ * 
  * @param combinerConfig The combiner configuration.
  * @return std::shared_ptr<ChannelInterface> The shared pointer to the channel.
  */
-std::shared_ptr<ChannelInterface> FednClient::setupGrpcChannel(std::map<std::string, std::string> combinerConfig) {
+std::shared_ptr<ChannelInterface> FednClient::createChannel(std::map<std::string, std::string> combinerConfig) {
     std::cout << "Server host: " << combinerConfig["host"] << std::endl;
 
     // initialize credentials
@@ -240,12 +705,202 @@ std::shared_ptr<ChannelInterface> FednClient::setupGrpcChannel(std::map<std::str
     args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, 60 * 1000 /*20 sec*/);
     args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, 20 * 1000 /*10 sec*/);
     args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+    // Never let the channel go idle, so that a standby channel stays connected
+    args.SetInt(GRPC_ARG_CLIENT_IDLE_TIMEOUT_MS, INT_MAX);
 
-    channel = grpc::CreateCustomChannel(combinerConfig["host"], creds, args);
+    // Share one TLS session cache between all channels in the process
+    static grpc_ssl_session_cache* sessionCache = grpc_ssl_session_cache_create_lru(64);
+    grpc_arg sessionCacheArg = grpc_ssl_session_cache_create_channel_arg(sessionCache);
+    args.SetPointerWithVtable(sessionCacheArg.key, sessionCacheArg.value.pointer.p, sessionCacheArg.value.pointer.vtable);
+
+    std::shared_ptr<ChannelInterface> channel = grpc::CreateCustomChannel(combinerConfig["host"], creds, args);
+
+    // Start connecting in the background, run() waits for the connection
+    channel->GetState(true);
 
     return channel;
 }
 
+/**
+ * @brief Returns the hosts of all combiner candidates.
+ * 
+ * @param host The host the client is assigned to, which is always the first candidate.
+ * @return std::vector<std::string> The candidate hosts without duplicates.
+ */
+std::vector<std::string> FednClient::getCandidateHosts(const std::string& host) {
+    std::vector<std::string> hosts;
+    if (!host.empty()) {
+        hosts.push_back(host);
+    }
+    for (const std::string& candidate : combinerCandidates) {
+        if (std::find(hosts.begin(), hosts.end(), candidate) == hosts.end()) {
+            hosts.push_back(candidate);
+        }
+    }
+    return hosts;
+}
+
+/**
+ * @brief Probes a combiner with the AcceptingClients RPC.
+ * 
+ * This function connects a channel to the combiner and measures the round-trip time of
+ * the AcceptingClients RPC over the established connection. The best of three calls is
+ * used, so the TCP and TLS handshakes are not counted.
+ * 
+ * @param combinerConfig The combiner configuration used to create the channel.
+ * @param host The host of the combiner to probe.
+ * @return CombinerCandidate The connected channel and the result of the probe.
+ */
+CombinerCandidate FednClient::probeCombiner(std::map<std::string, std::string> combinerConfig, const std::string& host) {
+    CombinerCandidate candidate;
+    candidate.host = host;
+    combinerConfig["host"] = host;
+    candidate.channel = createChannel(combinerConfig);
+
+    auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(readCount(combinerConfig, "probe_timeout"));
+    if (!candidate.channel->WaitForConnected(deadline)) {
+        return candidate;
+    }
+    std::unique_ptr<Connector::Stub> stub = Connector::NewStub(candidate.channel);
+    for (int i = 0; i < 3; ++i) {
+        grpc::ClientContext context;
+        context.set_deadline(deadline);
+        fedn::ConnectionRequest request;
+        fedn::ConnectionResponse response;
+        auto start = std::chrono::steady_clock::now();
+        grpc::Status status = stub->AcceptingClients(&context, request, &response);
+        auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        if (!status.ok()) {
+            candidate.accepting = false;
+            return candidate;
+        }
+        candidate.accepting = response.status() == fedn::ACCEPTING;
+        if (candidate.rttUs < 0 || rtt < candidate.rttUs) {
+            candidate.rttUs = rtt;
+        }
+    }
+    return candidate;
+}
+
+/**
+ * @brief Probes combiner candidates concurrently and ranks them.
+ * 
+ * @param combinerConfig The combiner configuration used to create the channels.
+ * @param hosts The hosts of the combiners to probe.
+ * @return std::vector<CombinerCandidate> The candidates, accepting combiners first, ordered by round-trip time.
+ */
+std::vector<CombinerCandidate> FednClient::probeCombiners(std::map<std::string, std::string> combinerConfig, const std::vector<std::string>& hosts) {
+    std::vector<std::future<CombinerCandidate>> probes;
+    for (const std::string& host : hosts) {
+        probes.push_back(std::async(std::launch::async, &FednClient::probeCombiner, this, combinerConfig, host));
+    }
+    std::vector<CombinerCandidate> ranked;
+    for (auto& probe : probes) {
+        ranked.push_back(probe.get());
+        const CombinerCandidate& candidate = ranked.back();
+        std::cout << "Combiner " << candidate.host << ": "
+                  << (candidate.rttUs < 0 ? "unreachable" : (candidate.accepting ? "accepting" : "not accepting"))
+                  << ", rtt " << candidate.rttUs / 1000.0 << " ms" << std::endl;
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), [](const CombinerCandidate& a, const CombinerCandidate& b) {
+        if (a.accepting != b.accepting) {
+            return a.accepting;
+        }
+        return a.rttUs >= 0 && (b.rttUs < 0 || a.rttUs < b.rttUs);
+    });
+    // Always return at least two entries so callers can look at the runner-up
+    ranked.resize(std::max<size_t>(ranked.size(), 2));
+    return ranked;
+}
+
+/**
+ * @brief Migrates the client to the combiner given in a reassign request.
+ * 
+ * The channel to the new combiner is opened and connected first. The task stream and the
+ * heartbeats then move to the new combiner, while tasks already received from the old
+ * combiner, including any upload in progress, are finished on the old channel. The new
+ * assignment is also written to the assignment cache, so a restart goes straight to the
+ * new combiner.
+ * 
+ * @param reassign The reassign request from the combiner.
+ * @return true if the client moved to the new combiner, false if it stays on the current one.
+ */
+bool FednClient::migrate(const fedn::ReassignRequest& reassign) {
+    std::string host = reassign.server();
+    if (reassign.port() != 0) {
+        host += ":" + std::to_string(reassign.port());
+    }
+    if (host == combinerConfig["host"]) {
+        return true;
+    }
+    std::map<std::string, std::string> config = combinerConfig;
+    config["host"] = host;
+    std::shared_ptr<ChannelInterface> newChannel = createChannel(config);
+    if (!waitForChannel(newChannel)) {
+        std::cerr << "Reassignment to combiner " << host << " failed, staying on " << combinerConfig["host"] << std::endl;
+        return false;
+    }
+    std::cout << "Migrating from combiner " << combinerConfig["host"] << " to " << host << std::endl;
+    combinerConfig["host"] = host;
+    channel = newChannel;
+    grpcClient->switchChannel(newChannel);
+
+    json assignment = {
+        {"host", reassign.server()},
+        {"port", reassign.port()},
+        {"fqdn", combinerConfig["proxy_host"].empty() ? json() : json(combinerConfig["proxy_host"])}
+    };
+    cacheAssignment(controllerConfig, assignment);
+    return true;
+}
+
+/**
+ * @brief Fails over to the standby combiner.
+ * 
+ * The standby channel is usually already connected, so the client can reopen the task
+ * stream without a new TLS handshake or combiner assignment. A standby that is neither
+ * ready nor idle, e.g. in transient failure, is given connect_timeout to connect and is
+ * dropped if it does not. A new standby is then selected among the remaining candidates
+ * in the background.
+ * 
+ * @return true if the client switched to the standby combiner, false if there is no usable standby.
+ */
+bool FednClient::failover() {
+    CombinerCandidate next;
+    {
+        std::lock_guard<std::mutex> lock(standbyMutex);
+        std::swap(next, standby);
+    }
+    if (!next.channel) {
+        return false;
+    }
+    grpc_connectivity_state state = next.channel->GetState(true);
+    if (state != GRPC_CHANNEL_READY && state != GRPC_CHANNEL_IDLE
+            && (state == GRPC_CHANNEL_SHUTDOWN || !waitForChannel(next.channel))) {
+        std::cerr << "Standby combiner " << next.host << " is unreachable" << std::endl;
+        return false;
+    }
+    std::cout << "Failing over from combiner " << combinerConfig["host"] << " to standby combiner " << next.host << std::endl;
+    combinerConfig["host"] = next.host;
+    channel = next.channel;
+    grpcClient->setChannel(channel);
+
+    // Select a new standby among the other candidates, including the combiner that was just lost
+    std::vector<std::string> hosts = getCandidateHosts("");
+    hosts.erase(std::remove(hosts.begin(), hosts.end(), next.host), hosts.end());
+    if (!hosts.empty() && (!standbySelection.valid() || standbySelection.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+        standbySelection = std::async(std::launch::async, [this, config = combinerConfig, hosts]() {
+            std::vector<CombinerCandidate> ranked = probeCombiners(config, hosts);
+            std::lock_guard<std::mutex> lock(standbyMutex);
+            if (ranked[0].accepting && !standby.channel) {
+                standby = ranked[0];
+                std::cout << "Standby combiner " << standby.host << std::endl;
+            }
+        });
+    }
+    return true;
+}
+
 
 /**
  * @brief Retrieves the gRPC client instance.
@@ -287,11 +942,17 @@ void FednClient::setAuthScheme(std::string authScheme) {
  * @brief Sets the host address for the combiner configuration.
  * 
  * This function updates the combiner configuration with the specified host address.
+ * A combiner discovery still running in the background is cancelled, its result is
+ * never used in place of the host set here.
  * 
  * @param host A string representing the host address to be set in the combiner configuration.
  */
 void FednClient::setCombinerHost(std::string host) {
     combinerConfig["host"] = host;
+    assignmentFromCache = false;
+    if (discovery.valid()) {
+        discoveryCancelled = true;
+    }
 }
 
 /**
@@ -414,4 +1075,16 @@ void FednClient::setPackage(std::string package) {
  */
 void FednClient::setPreferredCombiner(std::string preferredCombiner) {
     controllerConfig["preferred_combiner"] = preferredCombiner;
+}
+
+/**
+ * @brief Sets the combiner candidates for the FednClient.
+ * 
+ * The candidates are probed by setupGrpcChannel() together with the assigned combiner,
+ * and the client connects to the accepting combiner with the lowest round-trip time.
+ * 
+ * @param hosts The combiner hosts, including the port.
+ */
+void FednClient::setCombinerCandidates(std::vector<std::string> hosts) {
+    combinerCandidates = hosts;
 }
\ No newline at end of file
@@ -0,0 +1,888 @@
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <filesystem>
+
+#ifdef FEDNLIB_HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "../include/fednlib/fileio.h"
+#include "../include/fednlib/utils.h"
+
+namespace {
+
+// Alignment of buffers and offsets for O_DIRECT
+const size_t kDirectAlignment = 4096;
+
+std::mutex optionsMutex;
+FileIOOptions fileIOOptions;
+
+/**
+ * Engine that runs every request at submission with pread(), pwrite() and unlink().
+ */
+class PosixFileIOEngine : public FileIOEngine {
+public:
+    const char* name() const override { return "posix"; }
+
+    bool submitRead(int fd, char* data, size_t size, int64_t offset, uint64_t tag) override {
+        ssize_t result;
+        do {
+            result = pread(fd, data, size, offset);
+        } while (result < 0 && errno == EINTR);
+        completions.emplace_back(tag, result < 0 ? -errno : result);
+        return true;
+    }
+
+    bool submitWrite(int fd, const char* data, size_t size, int64_t offset, uint64_t tag) override {
+        ssize_t result;
+        do {
+            result = pwrite(fd, data, size, offset);
+        } while (result < 0 && errno == EINTR);
+        completions.emplace_back(tag, result < 0 ? -errno : result);
+        return true;
+    }
+
+    bool submitUnlink(const std::string& path, uint64_t tag) override {
+        int result = unlink(path.c_str());
+        completions.emplace_back(tag, result < 0 ? -errno : 0);
+        return true;
+    }
+
+    bool flush() override { return true; }
+
+    // Requests complete when they are submitted, so there is never anything to block on
+    bool wait(uint64_t& tag, int64_t& result, bool) override {
+        if (completions.empty()) {
+            return false;
+        }
+        tag = completions.front().first;
+        result = completions.front().second;
+        completions.pop_front();
+        return true;
+    }
+
+    size_t inFlight() const override { return completions.size(); }
+
+private:
+    std::deque<std::pair<uint64_t, int64_t> > completions;
+};
+
+#ifdef FEDNLIB_HAVE_IO_URING
+/**
+ * Engine on an io_uring instance. Requests are batched: they are handed to the kernel
+ * once half the submission queue is used or when a caller blocks in wait().
+ */
+class UringFileIOEngine : public FileIOEngine {
+public:
+    static std::unique_ptr<FileIOEngine> create(unsigned entries) {
+        std::unique_ptr<UringFileIOEngine> engine(new UringFileIOEngine());
+        return engine->setup(entries) ? std::move(engine) : nullptr;
+    }
+
+    ~UringFileIOEngine() override {
+        // The kernel may still be writing to or reading from the buffers of the caller
+        uint64_t tag;
+        int64_t result;
+        while (pending > 0 && wait(tag, result, true)) {
+        }
+        if (sqes) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (ringFd >= 0) {
+            close(ringFd);
+        }
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    bool submitRead(int fd, char* data, size_t size, int64_t offset, uint64_t tag) override {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = size;
+        sqe->off = offset;
+        sqe->user_data = tag;
+        return commit();
+    }
+
+    bool submitWrite(int fd, const char* data, size_t size, int64_t offset, uint64_t tag) override {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = size;
+        sqe->off = offset;
+        sqe->user_data = tag;
+        return commit();
+    }
+
+    bool submitUnlink(const std::string& path, uint64_t tag) override {
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(path.c_str());
+        sqe->user_data = tag;
+        return commit();
+    }
+
+    bool flush() override {
+        return unsubmitted == 0 || enter(0);
+    }
+
+    bool wait(uint64_t& tag, int64_t& result, bool block) override {
+        if (pending == 0) {
+            return false;
+        }
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            if (!block || !enter(1)) {
+                return false;
+            }
+            if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                return false;
+            }
+        }
+        io_uring_cqe* cqe = &cqes[head & cqMask];
+        tag = cqe->user_data;
+        result = cqe->res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        --pending;
+        return true;
+    }
+
+    size_t inFlight() const override { return pending; }
+
+private:
+    int ringFd = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned unsubmitted = 0;
+    size_t pending = 0;
+
+    UringFileIOEngine() = default;
+
+    bool setup(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd < 0) {
+            return false;
+        }
+        // IORING_OP_READ and IORING_OP_WRITE came with the same kernel as this feature
+        if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            sqRing = nullptr;
+            return false;
+        }
+        if (singleMmap) {
+            cqRing = sqRing;
+        } else {
+            cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) {
+                cqRing = nullptr;
+                return false;
+            }
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* mappedSqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (mappedSqes == MAP_FAILED) {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe*>(mappedSqes);
+
+        char* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Returns a cleared entry at the tail of the submission queue
+    io_uring_sqe* nextSqe() {
+        unsigned tail = *sqTail;
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries && !enter(0)) {
+            return nullptr;
+        }
+        io_uring_sqe* sqe = &sqes[tail & sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Publishes the entry returned by nextSqe()
+    bool commit() {
+        unsigned tail = *sqTail;
+        sqArray[tail & sqMask] = tail & sqMask;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+        ++pending;
+        if (unsubmitted >= std::max(1u, sqEntries / 2)) {
+            return enter(0);
+        }
+        return true;
+    }
+
+    // Submits the queued entries and waits for minComplete completions
+    bool enter(unsigned minComplete) {
+        while (true) {
+            int result = syscall(__NR_io_uring_enter, ringFd, unsubmitted, minComplete,
+                minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (result >= 0) {
+                unsubmitted -= std::min<unsigned>(result, unsubmitted);
+                return true;
+            }
+            if (errno != EINTR) {
+                std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+        }
+    }
+};
+#endif
+
+char* allocateBuffer(size_t size) {
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, kDirectAlignment, size) != 0) {
+        return nullptr;
+    }
+    return static_cast<char*>(buffer);
+}
+
+// Writes the part of a block that the engine did not write
+bool writeFully(int fd, const char* data, size_t size, int64_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+// Reads the part of a block that the engine did not read
+bool readFully(int fd, char* data, size_t size, int64_t offset) {
+    while (size > 0) {
+        ssize_t bytesRead = pread(fd, data, size, offset);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return false;
+        }
+        data += bytesRead;
+        size -= bytesRead;
+        offset += bytesRead;
+    }
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Sets the options used for model files by default, see FileIOOptions.
+ */
+void setFileIOOptions(const FileIOOptions& options) {
+    std::lock_guard<std::mutex> lock(optionsMutex);
+    fileIOOptions = options;
+}
+
+/**
+ * @brief Returns the options used for model files by default.
+ */
+FileIOOptions getFileIOOptions() {
+    std::lock_guard<std::mutex> lock(optionsMutex);
+    return fileIOOptions;
+}
+
+/**
+ * @brief Creates the engine selected in the options.
+ *
+ * An io_uring engine falls back to pread() and pwrite() when io_uring is not built in or the
+ * kernel does not allow it, e.g. in containers that block the io_uring system calls.
+ *
+ * @param options The options, only engine and queueDepth are used.
+ * @return std::unique_ptr<FileIOEngine> The engine.
+ */
+std::unique_ptr<FileIOEngine> FileIOEngine::create(const FileIOOptions& options) {
+#ifdef FEDNLIB_HAVE_IO_URING
+    if (options.engine != "posix") {
+        std::unique_ptr<FileIOEngine> engine = UringFileIOEngine::create(std::max(1u, options.queueDepth));
+        if (engine) {
+            return engine;
+        }
+    }
+#endif
+    if (options.engine == "io_uring") {
+        static std::once_flag warned;
+        std::call_once(warned, []() {
+            std::cerr << "io_uring is not available, using pread/pwrite for model files" << std::endl;
+        });
+    }
+    return std::unique_ptr<FileIOEngine>(new PosixFileIOEngine());
+}
+
+/**
+ * @brief Creates a writer. The file is opened with open().
+ *
+ * @param options The engine, block size and queue depth to use, and whether to use O_DIRECT.
+ */
+ModelFileWriter::ModelFileWriter(const FileIOOptions& options) : options(options) {
+    this->options.blockSize = std::max(kDirectAlignment,
+        (options.blockSize + kDirectAlignment - 1) / kDirectAlignment * kDirectAlignment);
+    this->options.queueDepth = std::max(1u, options.queueDepth);
+}
+
+ModelFileWriter::~ModelFileWriter() {
+    close();
+}
+
+/**
+ * @brief Creates or truncates the file.
+ *
+ * @param path The path of the file.
+ * @param expectedSize The size of the file if known, used to preallocate it, see reserve().
+ * @return true if the file was opened, false otherwise.
+ */
+bool ModelFileWriter::open(const std::string& path, int64_t expectedSize) {
+    close();
+    this->path = path;
+    failed = false;
+    reserved = false;
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error opening file " << path << " for writing" << std::endl;
+        return false;
+    }
+    if (options.directIO) {
+        // Not every file system supports O_DIRECT, e.g. tmpfs
+        directFd = ::open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if (directFd < 0) {
+            std::cout << "O_DIRECT not supported for " << path << ", writing through the page cache" << std::endl;
+        }
+    }
+    engine = FileIOEngine::create(options);
+    for (unsigned i = freeBuffers.size(); i < options.queueDepth; ++i) {
+        char* buffer = allocateBuffer(options.blockSize);
+        if (!buffer) {
+            std::cerr << "Error allocating write buffer for " << path << std::endl;
+            close();
+            return false;
+        }
+        freeBuffers.push_back(buffer);
+    }
+    reserve(expectedSize);
+    return true;
+}
+
+/**
+ * @brief Preallocates the file, so the file system can lay it out in one piece.
+ *
+ * Only the first call with a known size has an effect. File systems that do not support
+ * preallocation are ignored.
+ *
+ * @param size The expected size of the file, -1 if unknown.
+ */
+void ModelFileWriter::reserve(int64_t size) {
+    if (reserved || size <= 0 || fd < 0) {
+        return;
+    }
+    reserved = true;
+    if (fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP) {
+        std::cerr << "Error preallocating " << size << " bytes for " << path << ": " << strerror(errno) << std::endl;
+    }
+}
+
+/**
+ * @brief Writes data at the given offset.
+ *
+ * Consecutive writes are collected into blocks; a write at another offset, e.g. when a
+ * download starts over, first waits for the blocks collected so far to be written.
+ *
+ * @param data The data to write. It is copied, so it can be reused once write() returns.
+ * @param size The size of the data.
+ * @param offset The offset in the file.
+ * @return true if the data was accepted, false if an earlier write failed.
+ */
+bool ModelFileWriter::write(const char* data, size_t size, int64_t offset) {
+    if (fd < 0 || failed) {
+        return false;
+    }
+    if (current.data && offset != current.offset + (int64_t) current.size) {
+        // Writes in flight may complete in any order, so let them finish before data that
+        // may overlap them is written
+        if (!submitCurrent()) {
+            return false;
+        }
+        while (!inFlight.empty() && reap(true)) {
+        }
+    }
+    while (size > 0) {
+        if (!current.data) {
+            while (freeBuffers.empty()) {
+                if (!reap(true)) {
+                    return false;
+                }
+            }
+            current = {freeBuffers.back(), offset, 0};
+            freeBuffers.pop_back();
+        }
+        size_t n = std::min(size, options.blockSize - current.size);
+        memcpy(current.data + current.size, data, n);
+        current.size += n;
+        data += n;
+        size -= n;
+        offset += n;
+        if (current.size == options.blockSize && !submitCurrent()) {
+            return false;
+        }
+    }
+    return !failed;
+}
+
+/**
+ * @brief Submits the block being collected, using O_DIRECT if it is aligned.
+ */
+bool ModelFileWriter::submitCurrent() {
+    if (!current.data) {
+        return true;
+    }
+    Block block = current;
+    current = {nullptr, 0, 0};
+    bool aligned = block.offset % kDirectAlignment == 0 && block.size % kDirectAlignment == 0;
+    int targetFd = directFd >= 0 && aligned ? directFd : fd;
+    if (!engine->submitWrite(targetFd, block.data, block.size, block.offset, reinterpret_cast<uint64_t>(block.data))) {
+        std::cerr << "Error submitting write to " << path << std::endl;
+        freeBuffers.push_back(block.data);
+        failed = true;
+        return false;
+    }
+    inFlight.push_back(block);
+    // Recycle the buffers of writes that are already done
+    while (reap(false)) {
+    }
+    return !failed;
+}
+
+/**
+ * @brief Reaps one completed write and returns its buffer to the free list.
+ *
+ * @param block Whether to wait for a write to complete.
+ * @return true if a write was reaped, false otherwise.
+ */
+bool ModelFileWriter::reap(bool block) {
+    uint64_t tag;
+    int64_t result;
+    if (!engine || !engine->wait(tag, result, block)) {
+        return false;
+    }
+    auto it = std::find_if(inFlight.begin(), inFlight.end(), [tag](const Block& b) {
+        return reinterpret_cast<uint64_t>(b.data) == tag;
+    });
+    if (it == inFlight.end()) {
+        return true;
+    }
+    if (result < 0) {
+        std::cerr << "Error writing " << path << " at offset " << it->offset << ": " << strerror(-result) << std::endl;
+        failed = true;
+    } else if ((size_t) result < it->size && !writeFully(fd, it->data + result, it->size - result, it->offset + result)) {
+        std::cerr << "Error writing " << path << " at offset " << it->offset + result << ": " << strerror(errno) << std::endl;
+        failed = true;
+    }
+    freeBuffers.push_back(it->data);
+    inFlight.erase(it);
+    return true;
+}
+
+/**
+ * @brief Waits for all writes, sets the final size of the file and closes it.
+ *
+ * @param size The size of the file. Preallocated space and data past it are dropped.
+ * @return true if all data was written, false otherwise.
+ */
+bool ModelFileWriter::finish(int64_t size) {
+    if (fd < 0) {
+        return false;
+    }
+    submitCurrent();
+    while (!inFlight.empty() && reap(true)) {
+    }
+    if (!inFlight.empty()) {
+        failed = true;
+    }
+    if (!failed && ftruncate(fd, size) != 0) {
+        std::cerr << "Error truncating " << path << ": " << strerror(errno) << std::endl;
+        failed = true;
+    }
+    if (::close(fd) != 0) {
+        failed = true;
+    }
+    fd = -1;
+    close();
+    return !failed;
+}
+
+/**
+ * @brief Waits for writes still in flight, closes the file and frees the buffers.
+ */
+void ModelFileWriter::close() {
+    // The buffers must not be freed while the kernel may still write from them
+    while (!inFlight.empty() && reap(true)) {
+    }
+    engine.reset();
+    inFlight.clear();
+    if (current.data) {
+        freeBuffers.push_back(current.data);
+        current = {nullptr, 0, 0};
+    }
+    for (char* buffer : freeBuffers) {
+        free(buffer);
+    }
+    freeBuffers.clear();
+    if (directFd >= 0) {
+        ::close(directFd);
+        directFd = -1;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+/**
+ * @brief Reads a whole file into a string, with several blocks in flight at a time.
+ *
+ * @param path The path of the file.
+ * @param data Receives the content of the file.
+ * @param options The engine, block size and queue depth to use.
+ * @return true if the file was read, false otherwise.
+ */
+bool readModelFile(const std::string& path, std::string& data, const FileIOOptions& options) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error opening file " << path << " for reading" << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        std::cerr << "Error reading size of " << path << ": " << strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+    data.resize(st.st_size);
+
+    std::unique_ptr<FileIOEngine> engine = FileIOEngine::create(options);
+    size_t blockSize = std::max<size_t>(options.blockSize, kDirectAlignment);
+    size_t queueDepth = std::max(1u, options.queueDepth);
+    int64_t size = st.st_size;
+    int64_t next = 0;
+    bool ok = true;
+    std::map<uint64_t, size_t> sizes; // Size of every block in flight, by offset
+    while (ok && (next < size || !sizes.empty())) {
+        while (next < size && sizes.size() < queueDepth) {
+            size_t n = std::min<int64_t>(blockSize, size - next);
+            if (!engine->submitRead(fd, &data[next], n, next, next)) {
+                ok = false;
+                break;
+            }
+            sizes[next] = n;
+            next += n;
+        }
+        uint64_t offset;
+        int64_t result;
+        if (!engine->wait(offset, result, true)) {
+            break;
+        }
+        size_t expected = sizes[offset];
+        sizes.erase(offset);
+        if (result < 0) {
+            std::cerr << "Error reading " << path << " at offset " << offset << ": " << strerror(-result) << std::endl;
+            ok = false;
+        } else if ((size_t) result < expected && !readFully(fd, &data[offset + result], expected - result, offset + result)) {
+            std::cerr << "Error reading " << path << ": file is shorter than expected" << std::endl;
+            ok = false;
+        }
+    }
+    // Let reads still in flight finish before the string can be freed
+    engine.reset();
+    ::close(fd);
+    if (!ok || !sizes.empty()) {
+        data.clear();
+        return false;
+    }
+    return true;
+}
+
+namespace {
+
+/**
+ * Removes files in the background. Every path is first renamed to a unique name, so a new
+ * file created at the same path is never removed by mistake.
+ */
+class AsyncUnlinker {
+public:
+    ~AsyncUnlinker() {
+        std::lock_guard<std::mutex> lock(unlinkMutex);
+        while (!paths.empty() && reap(true)) {
+        }
+    }
+
+    bool unlink(const std::string& path) {
+        std::lock_guard<std::mutex> lock(unlinkMutex);
+        // The engine on pread/pwrite removes the file right away
+        if (!start()) {
+            return ::unlink(path.c_str()) == 0;
+        }
+        std::string tombstone = path + ".deleted-" + generateRandomUUID();
+        if (rename(path.c_str(), tombstone.c_str()) != 0) {
+            return false;
+        }
+        submit(tombstone, "");
+        engine->flush();
+        return true;
+    }
+
+    bool removeDirectory(const std::string& path) {
+        std::error_code ec;
+        std::lock_guard<std::mutex> lock(unlinkMutex);
+        if (!start()) {
+            std::filesystem::remove_all(path, ec);
+            return !ec;
+        }
+        std::string tombstone = path + ".deleted-" + generateRandomUUID();
+        if (rename(path.c_str(), tombstone.c_str()) != 0) {
+            return false;
+        }
+        // Files are removed through the engine and the directory once the last one is gone.
+        // Subdirectories are rare and removed right away.
+        std::vector<std::string> files;
+        for (const auto& entry : std::filesystem::directory_iterator(tombstone, ec)) {
+            if (entry.is_directory(ec)) {
+                std::filesystem::remove_all(entry.path(), ec);
+            } else {
+                files.push_back(entry.path().string());
+            }
+        }
+        if (files.empty()) {
+            return ::rmdir(tombstone.c_str()) == 0;
+        }
+        directories[tombstone] = files.size();
+        for (const std::string& file : files) {
+            submit(file, tombstone);
+        }
+        engine->flush();
+        return true;
+    }
+
+private:
+    struct Removal {
+        std::string path;
+        std::string directory; // Directory to remove after its last file, empty for none
+    };
+
+    std::mutex unlinkMutex;
+    std::unique_ptr<FileIOEngine> engine;
+    std::map<uint64_t, Removal> paths;
+    std::map<std::string, size_t> directories; // Files left, by directory
+    uint64_t lastTag = 0;
+
+    // Creates the engine and reaps finished removals. Returns false if removals cannot run in the background.
+    bool start() {
+        if (!engine) {
+            FileIOOptions options = getFileIOOptions();
+            options.queueDepth = 32;
+            engine = FileIOEngine::create(options);
+        }
+        while (reap(false)) {
+        }
+        return std::string(engine->name()) != "posix";
+    }
+
+    void submit(const std::string& path, const std::string& directory) {
+        // Limit the number of removals in flight to the size of the completion queue
+        while (paths.size() >= 32 && reap(true)) {
+        }
+        uint64_t tag = ++lastTag;
+        paths[tag] = {path, directory};
+        if (!engine->submitUnlink(paths[tag].path, tag)) {
+            finish(tag, ::unlink(path.c_str()) == 0 ? 0 : -errno);
+        }
+    }
+
+    bool reap(bool block) {
+        uint64_t tag;
+        int64_t result;
+        if (!engine || !engine->wait(tag, result, block)) {
+            return false;
+        }
+        finish(tag, result);
+        return true;
+    }
+
+    void finish(uint64_t tag, int64_t result) {
+        auto it = paths.find(tag);
+        if (it == paths.end()) {
+            return;
+        }
+        Removal removal = it->second;
+        paths.erase(it);
+        // Kernels before 5.11 cannot unlink through io_uring
+        if (result == -EINVAL) {
+            result = ::unlink(removal.path.c_str()) == 0 ? 0 : -errno;
+        }
+        // A file in a directory may have been removed with deleteFileFromDisk() meanwhile
+        if (result < 0 && !(result == -ENOENT && !removal.directory.empty())) {
+            std::cerr << "Error deleting file " << removal.path << ": " << strerror(-result) << std::endl;
+        }
+        if (!removal.directory.empty() && --directories[removal.directory] == 0) {
+            directories.erase(removal.directory);
+            std::error_code ec;
+            std::filesystem::remove_all(removal.directory, ec);
+        }
+    }
+};
+
+AsyncUnlinker asyncUnlinker;
+
+} // namespace
+
+/**
+ * @brief Removes a file without waiting for the file system to free its blocks.
+ *
+ * With io_uring the file is renamed and removed in the background, which matters for large
+ * model files. Otherwise the file is removed right away.
+ *
+ * @param path The path of the file.
+ * @return true if the file was, or will be, removed, false if it could not be removed.
+ */
+bool unlinkFileAsync(const std::string& path) {
+    return asyncUnlinker.unlink(path);
+}
+
+/**
+ * @brief Removes a directory and the files in it, see unlinkFileAsync().
+ *
+ * @param path The path of the directory.
+ * @return true if the directory was, or will be, removed, false if it could not be removed.
+ */
+bool removeDirectoryAsync(const std::string& path) {
+    return asyncUnlinker.removeDirectory(path);
+}
+
+/**
+ * @brief Maps a file read-only into memory.
+ *
+ * @param path The path to the file.
+ * @return std::shared_ptr<MappedFile> The mapped file, nullptr if the file could not be mapped.
+ */
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error opening file " << path << " for reading" << std::endl;
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    const char* data = nullptr;
+    if (st.st_size > 0) {
+        void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "Error mapping file " << path << std::endl;
+            close(fd);
+            return nullptr;
+        }
+        // The file is sent front to back once
+        madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapped);
+    }
+    close(fd);
+    return std::shared_ptr<MappedFile>(new MappedFile(data, st.st_size));
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+/**
+ * @brief Drops the pages of a range that has been sent from memory.
+ *
+ * Pages are otherwise kept until the file is unmapped, so a large upload would keep the
+ * whole model resident. Only pages that lie entirely in the range are dropped.
+ *
+ * @param offset The offset of the range in the file.
+ * @param size The size of the range.
+ */
+void MappedFile::release(int64_t offset, int64_t size) const {
+    static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+    int64_t begin = (offset + pageSize - 1) / pageSize * pageSize;
+    int64_t end = offset + size == size_ ? size_ : (offset + size) / pageSize * pageSize;
+    if (end > begin) {
+        madvise(const_cast<char*>(data_) + begin, end - begin, MADV_DONTNEED);
+    }
+}
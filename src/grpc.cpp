@@ -1,13 +1,29 @@
 
 #include <iostream>
 #include <sstream>
+#include <cstring>
 #include <iomanip>
 #include <chrono>
 #include <thread>
 #include <fstream>
+#include <random>
+#include <algorithm>
+#include <filesystem>
 
 #include "../include/fednlib/grpc.h"
 #include "../include/fednlib/utils.h"
+#include "../include/fednlib/fileio.h"
+#include "../include/fednlib/convert.h"
+#include "../include/fednlib/delta.h"
+#include "../include/fednlib/quantize.h"
+#include "../include/fednlib/sparsify.h"
+#include "../include/fednlib/lowrank.h"
+#include "../include/fednlib/codec.h"
+#include "../include/fednlib/dedup.h"
+#include "../include/fednlib/modelcache.h"
+#include "../include/fednlib/partial.h"
+#include "../include/fednlib/privacy.h"
+#include "../include/fednlib/ops.h"
 #include "google/protobuf/timestamp.pb.h"
 
 using grpc::ClientContext;
@@ -22,6 +38,7 @@ using fedn::ModelPrediction;
 using fedn::ModelResponse;
 using fedn::ModelRequest;
 using fedn::ModelStatus;
+using fedn::ChunkRef;
 using fedn::StatusType;
 using fedn::Client;
 using fedn::ClientAvailableMessage;
@@ -29,6 +46,35 @@ using fedn::CLIENT;
 using fedn::Response;
 using fedn::ModelMetric;
 using fedn::AttributeMessage;
+using fedn::ReassignRequest;
+using fedn::ReconnectRequest;
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
+
+/**
+ * Arena for the messages of one RPC. The first block lives on the stack, so the messages
+ * of a typical RPC are built without touching the heap, and they are all freed at once
+ * when the RpcArena goes out of scope.
+ *
+ * Only use it for messages of bounded size: memory of fields that are overwritten is not
+ * reclaimed until the arena is destroyed, so reused model chunks do not belong here.
+ */
+class RpcArena {
+public:
+    RpcArena() : arena_(makeOptions(block_, sizeof(block_))) {}
+    template <typename T> T* create() { return Arena::CreateMessage<T>(&arena_); }
+
+private:
+    alignas(8) char block_[4096];
+    Arena arena_;
+
+    static ArenaOptions makeOptions(char* block, size_t size) {
+        ArenaOptions options;
+        options.initial_block = block;
+        options.initial_block_size = size;
+        return options;
+    }
+};
 
 /**
  * @brief Constructs a new GrpcClient object.
@@ -42,10 +88,115 @@ using fedn::AttributeMessage;
 GrpcClient::GrpcClient(std::shared_ptr<ChannelInterface> channel)
       : connectorStub_(Connector::NewStub(channel)),
         combinerStub_(Combiner::NewStub(channel)),
-        modelserviceStub_(ModelService::NewStub(channel)) {
+        modelserviceStub_(ModelService::NewStub(channel)),
+        rawModelTransfer_(std::make_shared<RawModelTransfer>(channel)) {
+            taskStreamStub_ = Combiner::NewStub(channel);
+            sender_.set_role(CLIENT);
             this->setChunkSize(1024 * 1024);
         }
+
+/**
+ * @brief Destroys the GrpcClient object.
+ * 
+ * Stops the worker threads, see GrpcClient::stop.
+ */
+GrpcClient::~GrpcClient() {
+    stop();
+}
+
+/**
+ * @brief Stops the task and outbox worker threads.
+ * 
+ * Waits for the task that is running to finish. Tasks that are still queued are discarded,
+ * entries in the outbox are kept on disk. The workers call the train, validate and predict
+ * hooks, so a class that overrides them must call stop() in its destructor: by the time
+ * the destructor of GrpcClient runs, the overrides are already destroyed.
+ */
+void GrpcClient::stop() {
+    {
+        std::lock_guard<std::mutex> lock(taskMutex_);
+        stopWorker_ = true;
+        taskCondition_.notify_all();
+        outboxCondition_.notify_all();
+    }
+    if (taskWorker_.joinable()) {
+        taskWorker_.join();
+    }
+    if (outboxWorker_.joinable()) {
+        outboxWorker_.join();
+    }
+}
         
+/**
+ * @brief Points the GrpcClient to a new gRPC channel.
+ * 
+ * This function recreates the Connector, Combiner and ModelService stubs on the
+ * given channel, e.g. after the client has been assigned to another combiner.
+ * 
+ * @param channel A shared pointer to the new gRPC ChannelInterface.
+ */
+void GrpcClient::setChannel(std::shared_ptr<ChannelInterface> channel) {
+    std::shared_ptr<Connector::Stub> connectorStub = Connector::NewStub(channel);
+    std::shared_ptr<Combiner::Stub> combinerStub = Combiner::NewStub(channel);
+    std::shared_ptr<ModelService::Stub> modelserviceStub = ModelService::NewStub(channel);
+    std::shared_ptr<RawModelTransfer> rawModelTransfer = std::make_shared<RawModelTransfer>(channel);
+
+    // RPCs that are already in flight keep their own reference to the old stubs
+    std::lock_guard<std::mutex> lock(stubMutex_);
+    connectorStub_ = connectorStub;
+    combinerStub_ = combinerStub;
+    taskStreamStub_ = combinerStub;
+    modelserviceStub_ = modelserviceStub;
+    rawModelTransfer_ = rawModelTransfer;
+    // The server on the new channel may deduplicate uploads
+    dedupUnsupported_ = false;
+}
+
+/**
+ * @brief Returns the current Connector stub.
+ * 
+ * The stub is returned as a shared pointer so that it, and the channel it uses, stay
+ * alive for the duration of an RPC even if setChannel() is called concurrently.
+ */
+std::shared_ptr<Connector::Stub> GrpcClient::getConnectorStub() {
+    std::lock_guard<std::mutex> lock(stubMutex_);
+    return connectorStub_;
+}
+
+/**
+ * @brief Returns the current Combiner stub, see getConnectorStub().
+ */
+std::shared_ptr<Combiner::Stub> GrpcClient::getCombinerStub() {
+    std::lock_guard<std::mutex> lock(stubMutex_);
+    return combinerStub_;
+}
+
+/**
+ * @brief Returns the Combiner stub used for the task stream, see getConnectorStub().
+ * 
+ * This differs from getCombinerStub() while the client migrates to a new combiner.
+ */
+std::shared_ptr<Combiner::Stub> GrpcClient::getTaskStreamStub() {
+    std::lock_guard<std::mutex> lock(stubMutex_);
+    return taskStreamStub_;
+}
+
+/**
+ * @brief Returns the current ModelService stub, see getConnectorStub().
+ */
+std::shared_ptr<ModelService::Stub> GrpcClient::getModelServiceStub() {
+    std::lock_guard<std::mutex> lock(stubMutex_);
+    return modelserviceStub_;
+}
+
+/**
+ * @brief Returns the ModelService transfer over the generic stub, see getConnectorStub().
+ */
+std::shared_ptr<RawModelTransfer> GrpcClient::getRawModelTransfer() {
+    std::lock_guard<std::mutex> lock(stubMutex_);
+    return rawModelTransfer_;
+}
+
 
 /**
  * @brief Sends a heartbeat message to the server.
@@ -58,95 +209,625 @@ GrpcClient::GrpcClient(std::shared_ptr<ChannelInterface> channel)
  * server's response is printed to the standard output.
  */
 void GrpcClient::heartBeat() {
-    // Data we are sending to the server.
-    Client* client = new Client();
-    client->set_name(name_);
-    client->set_role(CLIENT);
-    client->set_client_id(id_);
+    RpcArena arena;
 
-    Heartbeat request;
-    // Pass ownership of client to protobuf message
-    request.set_allocated_sender(client);
+    // Data we are sending to the server, the sender is shared and not owned by the message
+    Heartbeat& request = *arena.create<Heartbeat>();
+    request.unsafe_arena_set_allocated_sender(&sender_);
 
     // Container for the data we expect from the server.
-    Response reply;
+    Response& reply = *arena.create<Response>();
 
     // Context for the client. It could be used to convey extra information to
     // the server and/or tweak certain RPC behaviors.
     ClientContext context;
 
     // The actual RPC.
-    Status status = connectorStub_->SendHeartbeat(&context, request, &reply);
+    Status status = getConnectorStub()->SendHeartbeat(&context, request, &reply);
 
     // Print response attribute from fedn::Response
     std::cout << "Response: " << reply.response() << std::endl;
   
-    // Garbage collect the client object.
-    //Client* client = request.release_sender();
-  
     // Act upon its status.
     if (!status.ok()) {
       // Print response attribute from fedn::Response
       std::cout << "HeartbeatResponse: " << reply.response() << std::endl;
       std::cout << status.error_code() << ": " << status.error_message() << std::endl;
     }
+
+    // The combiner is reachable again, retry the outbox right away
+    bool reconnected = status.ok() && !heartbeatOk_;
+    heartbeatOk_ = status.ok();
+    if (reconnected) {
+      wakeOutbox(true);
+    }
 }
 
 /**
- * @brief Establishes a connection to the TaskStream and processes incoming tasks.
+ * @brief Establishes a connection to the TaskStream and queues incoming tasks.
  * 
  * This function sets up a gRPC client, sends a ClientAvailableMessage to the server,
- * and listens for TaskRequest messages from the combiner. Depending on the type of 
- * TaskRequest received, it performs different actions such as updating the local model,
- * validating the global model, or handling model prediction.
+ * and listens for TaskRequest messages from the combiner. The tasks are queued and
+ * processed in order by a worker thread, see GrpcClient::runTask, so the stream keeps
+ * being read while a task is running.
  * 
- * @note The function currently only handles MODEL_UPDATE and MODEL_VALIDATION task types.
- *       Model prediction is not yet implemented.
+ * NETWORK tasks carry a ReassignRequest or ReconnectRequest in JSON form in the data
+ * field. When one is received, the stream is closed and the request can be picked up
+ * with takeReassignRequest() or takeReconnectRequest(). Tasks that are already queued
+ * are not dropped.
+ * 
+ * @return true if the stream was closed normally or on request, false if the stream failed.
  */
-void GrpcClient::connectTaskStream() {
-    // Data we are sending to the server.
-    Client* client = new Client();
-    client->set_name(name_);
-    client->set_role(CLIENT);
-    client->set_client_id(id_);
+bool GrpcClient::connectTaskStream() {
+    RpcArena arena;
 
-    ClientAvailableMessage request;
-    // Pass ownership of client to protobuf message
-    request.set_allocated_sender(client);
+    // Data we are sending to the server
+    ClientAvailableMessage& request = *arena.create<ClientAvailableMessage>();
+    request.unsafe_arena_set_allocated_sender(&sender_);
 
     ClientContext context;
     // Add metadata to context
     context.AddMetadata("client", name_);
 
+    // Start the worker that processes queued tasks
+    {
+        std::lock_guard<std::mutex> lock(taskMutex_);
+        if (!taskWorker_.joinable()) {
+            taskWorker_ = std::thread(&GrpcClient::processTasks, this);
+        }
+    }
+
     // Get ClientReader from stream
+    std::shared_ptr<Combiner::Stub> taskStreamStub = getTaskStreamStub();
     std::unique_ptr<ClientReader<TaskRequest> > reader(
-        combinerStub_->TaskStream(&context, request));
+        taskStreamStub->TaskStream(&context, request));
 
     // Read from stream
-    // TODO: Generalize this to handle different types of TaskRequests, i.e don't call TaskRequest "modelUpdate"
+    bool closedOnRequest = false;
     TaskRequest task;
     while (reader->Read(&task)) {
       std::cout << "TaskRequest ModelID: " << task.model_id() << std::endl;
       std::cout << "TaskRequest: TaskType:" << task.type() << std::endl;
-      if (task.type() == StatusType::MODEL_UPDATE) {
-        this->loggingContext = LoggingContext(task);
-        this->updateLocalModel(task.model_id(), task.data());
-        this->loggingContext.reset();
-      }
-      else if (task.type() == StatusType::MODEL_VALIDATION) {
-        this->loggingContext = LoggingContext(task);
-        this->validateGlobalModel(task.model_id(), task);
-        this->loggingContext.reset();
+      if (task.type() == StatusType::NETWORK) {
+        if (handleNetworkTask(task)) {
+          closedOnRequest = true;
+          context.TryCancel();
+          break;
+        }
+        continue;
       }
-      else if (task.type() == StatusType::MODEL_PREDICTION) {
-        this->loggingContext = LoggingContext(task);
-        this->predictGlobalModel(task.model_id(), task);
-        this->loggingContext.reset();
+      std::shared_ptr<Outbox> outbox = getOutbox();
+      if (outbox) {
+        json data = json::parse(task.data(), nullptr, false);
+        std::string roundId;
+        if (task.type() == StatusType::MODEL_UPDATE && data.is_object() && data.contains("round_id")) {
+          roundId = data["round_id"].is_string() ? data["round_id"].get<std::string>() : data["round_id"].dump();
+        }
+        outbox->expire(task.session_id(), roundId);
       }
-      
+      std::lock_guard<std::mutex> lock(taskMutex_);
+      taskQueue_.push_back(QueuedTask{task, nullptr});
+      taskCondition_.notify_all();
     }
-    reader->Finish();
+    Status status = reader->Finish();
     std::cout << "Disconnecting from TaskStream" << std::endl;
+    if (closedOnRequest) {
+        return true;
+    }
+    if (!status.ok()) {
+        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+    }
+    return status.ok();
+}
+
+/**
+ * @brief Parses a NETWORK task from the combiner.
+ * 
+ * @param task The task, with a ReassignRequest ({"server": ..., "port": ...}) or a
+ *             ReconnectRequest ({"reconnect": seconds}) in JSON form in the data field.
+ * @return true if the task stream should be closed, false if the task was ignored.
+ */
+bool GrpcClient::handleNetworkTask(const TaskRequest& task) {
+    json data;
+    try {
+        data = json::parse(task.data());
+    } catch (const std::exception& e) {
+        std::cerr << "Ignoring NETWORK task with invalid data: " << e.what() << std::endl;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    if (data.contains("server") && data["server"].is_string()) {
+        ReassignRequest reassign;
+        reassign.set_server(data["server"].get<std::string>());
+        reassign.set_port(data.value("port", 0u));
+        std::cout << "Combiner requested reassignment to " << reassign.server() << ":" << reassign.port() << std::endl;
+        reassignRequest_ = reassign;
+        return true;
+    }
+    if (data.contains("reconnect") && data["reconnect"].is_number()) {
+        ReconnectRequest reconnect;
+        reconnect.set_reconnect(data["reconnect"].get<uint32_t>());
+        std::cout << "Combiner requested reconnect in " << reconnect.reconnect() << " s" << std::endl;
+        reconnectRequest_ = reconnect;
+        return true;
+    }
+    std::cerr << "Ignoring unknown NETWORK task: " << task.data() << std::endl;
+    return false;
+}
+
+/**
+ * @brief Returns and clears the reassignment requested by the combiner, if any.
+ */
+std::optional<ReassignRequest> GrpcClient::takeReassignRequest() {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    std::optional<ReassignRequest> request;
+    std::swap(request, reassignRequest_);
+    return request;
+}
+
+/**
+ * @brief Returns and clears the reconnect requested by the combiner, if any.
+ */
+std::optional<ReconnectRequest> GrpcClient::takeReconnectRequest() {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    std::optional<ReconnectRequest> request;
+    std::swap(request, reconnectRequest_);
+    return request;
+}
+
+/**
+ * @brief Migrates the client to a new combiner.
+ * 
+ * The task stream and the heartbeats switch to the new channel right away. Tasks that
+ * were received from the old combiner, including the one in progress, are completed on
+ * the old channel; the remaining stubs switch to the new channel once the worker has
+ * processed them.
+ * 
+ * @param channel A shared pointer to a connected channel to the new combiner.
+ */
+void GrpcClient::switchChannel(std::shared_ptr<ChannelInterface> channel) {
+    {
+        std::shared_ptr<Connector::Stub> connectorStub = Connector::NewStub(channel);
+        std::shared_ptr<Combiner::Stub> taskStreamStub = Combiner::NewStub(channel);
+        std::lock_guard<std::mutex> lock(stubMutex_);
+        connectorStub_ = connectorStub;
+        taskStreamStub_ = taskStreamStub;
+    }
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    taskQueue_.push_back(QueuedTask{TaskRequest(), channel});
+    taskCondition_.notify_all();
+}
+
+/**
+ * @brief Worker loop that processes queued tasks in order.
+ */
+void GrpcClient::processTasks() {
+    while (true) {
+        QueuedTask item;
+        {
+            std::unique_lock<std::mutex> lock(taskMutex_);
+            taskCondition_.wait(lock, [this] { return !taskQueue_.empty() || stopWorker_; });
+            if (stopWorker_) {
+                return;
+            }
+            item = std::move(taskQueue_.front());
+            taskQueue_.pop_front();
+        }
+        if (item.channel) {
+            std::cout << "Tasks from previous combiner completed, switching channel" << std::endl;
+            setChannel(item.channel);
+        } else {
+            runTask(item.task);
+        }
+    }
+}
+
+/**
+ * @brief Runs a task received from the combiner.
+ * 
+ * Depending on the type of TaskRequest received, it performs different actions such
+ * as updating the local model, validating the global model, or handling model prediction.
+ * 
+ * @param task The task to run.
+ */
+void GrpcClient::runTask(TaskRequest& task) {
+    if (task.type() == StatusType::MODEL_UPDATE) {
+      this->loggingContext = LoggingContext(task);
+      this->updateLocalModel(task.model_id(), task.data());
+      this->loggingContext.reset();
+    }
+    else if (task.type() == StatusType::MODEL_VALIDATION) {
+      this->loggingContext = LoggingContext(task);
+      this->validateGlobalModel(task.model_id(), task);
+      this->loggingContext.reset();
+    }
+    else if (task.type() == StatusType::MODEL_PREDICTION) {
+      this->loggingContext = LoggingContext(task);
+      this->predictGlobalModel(task.model_id(), task);
+      this->loggingContext.reset();
+    }
+}
+
+/**
+ * @brief Attaches an outbox for results that cannot be delivered to the combiner.
+ * 
+ * Model updates, validations, predictions and metrics that fail to be delivered are
+ * stored in the outbox instead of being discarded. A worker thread retries them with
+ * exponential backoff, and right away when a heartbeat succeeds after having failed.
+ * Entries left in the outbox by a previous run are retried as well.
+ * 
+ * @param outbox A shared pointer to the outbox.
+ */
+void GrpcClient::setOutbox(std::shared_ptr<Outbox> outbox) {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    outbox_ = outbox;
+    outboxWakeup_ = true;
+    if (!outboxWorker_.joinable()) {
+        outboxWorker_ = std::thread(&GrpcClient::processOutbox, this);
+    }
+    outboxCondition_.notify_all();
+}
+
+/**
+ * @brief Returns the outbox, or nullptr if no outbox is used.
+ */
+std::shared_ptr<Outbox> GrpcClient::getOutbox() {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    return outbox_;
+}
+
+/**
+ * @brief Sets the workspace that tasks keep their files in.
+ */
+void GrpcClient::setWorkspace(std::shared_ptr<Workspace> workspace) {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    workspace_ = workspace;
+}
+
+/**
+ * @brief Returns the workspace, creating one with the default options if none was set.
+ * 
+ * @return std::shared_ptr<Workspace> The workspace, nullptr if it could not be created.
+ */
+std::shared_ptr<Workspace> GrpcClient::getWorkspace() {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    if (!workspace_) {
+        try {
+            workspace_ = std::make_shared<Workspace>(WorkspaceOptions());
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to open workspace: " << e.what() << std::endl;
+        }
+    }
+    return workspace_;
+}
+
+/**
+ * @brief Sets the cache of global models that later global models are downloaded as deltas
+ * against, see downloadModelToFile(). nullptr disables delta downloads. Downloaded models
+ * share their file with the cached model where they can, so hooks must not change them in place.
+ */
+void GrpcClient::setModelCache(std::shared_ptr<ModelCache> modelCache) {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    modelCache_ = modelCache;
+}
+
+/**
+ * @brief Returns the model cache, or nullptr if none is used.
+ */
+std::shared_ptr<ModelCache> GrpcClient::getModelCache() {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    return modelCache_;
+}
+
+/**
+ * @brief Wakes the outbox worker.
+ * 
+ * @param resetBackoff Whether to retry all entries now, e.g. after reconnecting, instead of when their backoff expires.
+ */
+void GrpcClient::wakeOutbox(bool resetBackoff) {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    if (resetBackoff) {
+        outboxRetries_.clear();
+    }
+    outboxWakeup_ = true;
+    outboxCondition_.notify_all();
+}
+
+/**
+ * @brief Worker loop that retries the outbox when woken, or at least once a minute.
+ */
+void GrpcClient::processOutbox() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(taskMutex_);
+            outboxCondition_.wait_for(lock, std::chrono::seconds(60), [this] { return outboxWakeup_ || stopWorker_; });
+            if (stopWorker_) {
+                return;
+            }
+            outboxWakeup_ = false;
+        }
+        flushOutbox();
+
+        // Sleep until the earliest retry is due
+        std::unique_lock<std::mutex> lock(taskMutex_);
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (const auto& retry : outboxRetries_) {
+            next = std::min(next, retry.second.second);
+        }
+        if (next != std::chrono::steady_clock::time_point::max()) {
+            outboxCondition_.wait_until(lock, next, [this] { return outboxWakeup_ || stopWorker_; });
+            outboxWakeup_ = true;
+        }
+    }
+}
+
+/**
+ * @brief Tries to deliver the entries in the outbox whose backoff has expired.
+ * 
+ * Entries are delivered oldest first. An entry that fails is retried after a delay
+ * that doubles with every attempt, from 5 seconds up to 5 minutes, with full jitter.
+ */
+void GrpcClient::flushOutbox() {
+    std::shared_ptr<Outbox> outbox = getOutbox();
+    if (!outbox) {
+        return;
+    }
+    static thread_local std::mt19937 generator(std::random_device{}());
+    for (const OutboxEntry& entry : outbox->pending()) {
+        int attempts = 0;
+        {
+            std::lock_guard<std::mutex> lock(taskMutex_);
+            auto retry = outboxRetries_.find(entry.id);
+            if (retry != outboxRetries_.end()) {
+                if (retry->second.second > std::chrono::steady_clock::now()) {
+                    continue;
+                }
+                attempts = retry->second.first;
+            }
+        }
+        std::cout << "Outbox: delivering " << entry.kind << " " << entry.id << std::endl;
+        bool delivered = false;
+        try {
+            delivered = deliver(entry);
+        } catch (const std::exception& e) {
+            std::cerr << "Outbox: dropping invalid entry " << entry.id << ": " << e.what() << std::endl;
+            outbox->drop(entry.id, "invalid entry");
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(taskMutex_);
+        if (delivered) {
+            outbox->complete(entry.id);
+            outboxRetries_.erase(entry.id);
+        } else {
+            long capMs = std::min(300000L, 5000L << std::min(attempts, 6));
+            std::uniform_int_distribution<long> jitter(0, capMs);
+            outboxRetries_[entry.id] = std::make_pair(attempts + 1,
+                std::chrono::steady_clock::now() + std::chrono::milliseconds(jitter(generator)));
+        }
+    }
+}
+
+/**
+ * @brief Delivers an entry from the outbox to the combiner.
+ * 
+ * @param entry The entry to deliver.
+ * @return true if the entry was delivered, false otherwise.
+ */
+bool GrpcClient::deliver(const OutboxEntry& entry) {
+    const json& payload = entry.payload;
+    if (entry.kind == "update") {
+        std::string modelUpdateID = payload.at("model_update_id");
+        if (!payload.value("uploaded", false)) {
+            // Upload under a new ID, the combiner may hold part of an earlier attempt
+            modelUpdateID = generateRandomUUID();
+            if (!uploadModelFromFile(modelUpdateID, entry.blobPath)) {
+                return false;
+            }
+            // Do not upload the model again if only the update message fails
+            json uploaded = payload;
+            uploaded["model_update_id"] = modelUpdateID;
+            uploaded["uploaded"] = true;
+            getOutbox()->update(entry.id, uploaded);
+        }
+        return sendModelUpdate(payload.at("model_id"), modelUpdateID, payload.at("config"), payload.value("encoding", json()),
+            payload.value("partial", json()), payload.value("privacy", json()), payload.value("secure_aggregation", json()));
+    }
+    if (entry.kind == "validation" || entry.kind == "prediction") {
+        TaskRequest requestData;
+        requestData.set_session_id(payload.at("session_id").get<std::string>());
+        json data = payload.at("data");
+        if (entry.kind == "validation") {
+            return sendModelValidation(payload.at("model_id"), data, requestData);
+        }
+        return sendModelPrediction(payload.at("model_id"), data, requestData);
+    }
+    if (entry.kind == "metrics") {
+        std::map<std::string, float> metrics = payload.at("metrics");
+        return sendModelMetrics(metrics, name_, id_, payload.at("model_id"), payload.at("round_id"),
+            payload.at("session_id"), payload.at("step"));
+    }
+    throw std::runtime_error("unknown kind " + entry.kind);
+}
+
+/**
+ * @brief Returns whether a failed transfer is worth retrying.
+ */
+static bool isTransientError(const Status& status) {
+    switch (status.error_code()) {
+        case grpc::StatusCode::UNAVAILABLE:
+        case grpc::StatusCode::DEADLINE_EXCEEDED:
+        case grpc::StatusCode::ABORTED:
+        case grpc::StatusCode::RESOURCE_EXHAUSTED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Waits before retry number attempt of a transfer, from 1 second doubling up to 30 seconds.
+ */
+static void transferBackoff(int attempt) {
+    long delayMs = std::min(30000L, 1000L << std::min(attempt, 5));
+    std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+}
+
+/**
+ * @brief Streams a model from the server, resuming the download if the stream breaks.
+ *
+ * A broken download is retried up to the number of times set with setTransferRetries().
+ * The retry asks the server to continue from the last byte received; if the server does
+ * not support resuming, the model is streamed again from the start.
+ *
+ * With zero-copy transfers enabled the chunks are passed to write as views of the gRPC
+ * buffers, see RawModelTransfer, otherwise as the data of the generated ModelResponse.
+ *
+ * With cached models given, the server may send a delta against one of them instead, see
+ * downloadModelToFile(). A resumed download asks for a delta against the same model, and
+ * fails if the server sends something else from the middle of the stream.
+ *
+ * With tensors named, a server that supports it sends a partial model with only those tensors,
+ * see partial.h. Every attempt names them, so a resumed download continues the same model.
+ *
+ * @param modelID The ID of the model to download.
+ * @param write Called with each piece of data, the offset of its first byte in the model and the size of the model
+ *              (-1 if the server does not report it). Returns false on a write error.
+ * @param cachedModelIDs The models the client holds, most recent first.
+ * @param tensorNames The tensors needed, empty for the whole model.
+ * @param encoding Set to the model the data is a delta against, if any, and the hash of the model,
+ *                 before the first piece of data is passed to write.
+ * @return int64_t The size of the data in bytes, or -1 if the download failed.
+ */
+int64_t GrpcClient::downloadStream(const std::string& modelID, const std::function<bool(std::string_view, int64_t, int64_t)>& write,
+        const std::vector<std::string>& cachedModelIDs, const std::vector<std::string>& tensorNames, DownloadEncoding* encoding) {
+    DownloadEncoding received;
+    int64_t offset = 0;
+    // Reused for every chunk, so the chunk buffer is only allocated once
+    ModelResponse modelResponse;
+    ModelChunk responseChunk;
+    for (int attempt = 0; ; ++attempt) {
+        RpcArena arena;
+
+        // request 
+        ModelRequest& request = *arena.create<ModelRequest>();
+        request.set_id(modelID);
+        request.set_offset(offset);
+        request.unsafe_arena_set_allocated_sender(&sender_);
+        if (offset == 0) {
+            for (const std::string& cachedModelID : cachedModelIDs) {
+                request.add_cached_model_ids(cachedModelID);
+            }
+        } else if (!received.deltaBase.empty()) {
+            request.add_cached_model_ids(received.deltaBase);
+        }
+        for (const std::string& tensorName : tensorNames) {
+            request.add_tensor_names(tensorName);
+        }
+
+        // context
+        ClientContext context;
+
+        bool complete = false;
+        bool failed = false;
+        bool firstChunk = true;
+        int64_t totalSize = -1;
+        // Handles one response, returns false to stop reading
+        auto onChunk = [&](const ModelChunk& chunk) {
+            if (chunk.totalSize > 0) {
+                totalSize = chunk.totalSize;
+            }
+            if (chunk.status == ModelStatus::IN_PROGRESS) {
+                if (firstChunk) {
+                    // A server that does not support resuming starts over from the first byte
+                    if (offset > 0 && chunk.totalSize == 0) {
+                        std::cout << "Server cannot resume download, starting over" << std::endl;
+                    }
+                    offset = chunk.totalSize > 0 ? chunk.offset : 0;
+                    firstChunk = false;
+                    if (offset > 0 && chunk.deltaBase != received.deltaBase) {
+                        std::cerr << "Server changed the encoding of model " << modelID << " while resuming" << std::endl;
+                        failed = true;
+                        return false;
+                    }
+                    received.deltaBase = std::string(chunk.deltaBase);
+                    received.modelHash = std::string(chunk.modelHash);
+                    if (encoding) {
+                        *encoding = received;
+                    }
+                }
+                for (std::string_view data : chunk.data) {
+                    if (!write(data, offset, totalSize)) {
+                        std::cerr << "Error writing downloaded model " << modelID << std::endl;
+                        failed = true;
+                        return false;
+                    }
+                    offset += data.size();
+                }
+                std::cout << "Download in progress: " << chunk.id << std::endl;
+                std::cout << "Downloaded size: " << offset << " bytes" << std::endl;
+            }
+            else if (chunk.status == ModelStatus::OK) {
+                complete = true;
+            }
+            else if (chunk.status == ModelStatus::FAILED) {
+                // Print download failed
+                std::cout << "Download failed: internal server error" << std::endl;
+                failed = true;
+            }
+            return true;
+        };
+
+        Status status;
+        if (zeroCopyTransfer_) {
+            status = getRawModelTransfer()->download(context, request, onChunk);
+        }
+        else {
+            // Get ClientReader from stream
+            std::shared_ptr<ModelService::Stub> modelserviceStub = getModelServiceStub();
+            std::unique_ptr<ClientReader<ModelResponse> > reader(
+                modelserviceStub->Download(&context, request));
+
+            // Read from stream
+            while (reader->Read(&modelResponse)) {
+                responseChunk.id = modelResponse.id();
+                responseChunk.status = modelResponse.status();
+                responseChunk.message = modelResponse.message();
+                responseChunk.offset = modelResponse.offset();
+                responseChunk.totalSize = modelResponse.total_size();
+                responseChunk.data.assign(1, modelResponse.data());
+                responseChunk.deltaBase = modelResponse.delta_base();
+                responseChunk.modelHash = modelResponse.model_sha256();
+                if (!onChunk(responseChunk)) {
+                    context.TryCancel();
+                    break;
+                }
+            }
+            status = reader->Finish();
+        }
+        std::cout << "Disconnecting from DownloadStream" << std::endl;
+
+        if (complete && (totalSize < 0 || offset == totalSize)) {
+            std::cout << "Download complete for model: " << modelID << " (" << offset << " bytes"
+                      << (received.deltaBase.empty() ? "" : ", delta against " + received.deltaBase) << ")" << std::endl;
+            if (encoding) {
+                *encoding = received;
+            }
+            return offset;
+        }
+        // A stream that ends without an error before the last chunk was cut short, e.g. by a
+        // proxy, and is resumed like a broken one
+        bool cutShort = status.ok();
+        if (failed || !(cutShort || isTransientError(status)) || attempt >= transferRetries_) {
+            std::cout << "Download failed for model: " << modelID << std::endl;
+            if (!status.ok()) {
+                std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+            }
+            return -1;
+        }
+        std::cout << "Download of " << modelID << " interrupted at " << offset << " bytes, resuming (retry "
+                  << attempt + 1 << " of " << transferRetries_ << ")" << std::endl;
+        transferBackoff(attempt);
+    }
 }
 
 /**
@@ -154,63 +835,129 @@ void GrpcClient::connectTaskStream() {
  *
  * This function sends a request to the server to download a model identified by the given model ID.
  * It reads the model data from the server in a streaming manner and accumulates the data until the
- * download is complete or fails.
+ * download is complete or fails. A broken download is resumed, see downloadStream().
  *
  * @param modelID The ID of the model to be downloaded.
- * @return A string containing the accumulated model data.
+ * @return A string containing the accumulated model data, empty if the download failed.
  */
 std::string GrpcClient::downloadModel(const std::string& modelID) {
+    // Collection for data
+    std::string accumulatedData;
 
-    // request 
-    ModelRequest request;
-    request.set_id(modelID);
+    int64_t size = downloadStream(modelID, [&accumulatedData](std::string_view data, int64_t offset, int64_t totalSize) {
+        // Allocate the whole model once instead of growing the buffer chunk by chunk
+        if (totalSize > 0 && accumulatedData.capacity() < (size_t) totalSize) {
+            accumulatedData.reserve(totalSize);
+        }
+        accumulatedData.resize(offset);
+        accumulatedData.append(data.data(), data.size());
+        return true;
+    });
+    if (size < 0) {
+        return "";
+    }
+    accumulatedData.resize(size);
+    return accumulatedData;
+}
 
-    // context
-    ClientContext context;
+namespace {
 
-     // Set client
-    Client* client = new Client();
-    client->set_name(name_);
-    client->set_role(CLIENT);
-    client->set_client_id(id_);
+// Checks a model file against the SHA-256 sent by the server, if it sent one
+bool matchesModelHash(const std::string& modelPath, const std::string& modelHash) {
+    if (modelHash.empty()) {
+        return true;
+    }
+    std::shared_ptr<MappedFile> file = MappedFile::open(modelPath);
+    ChunkHash hash;
+    if (!file || modelHash.size() != hash.size()) {
+        return false;
+    }
+    sha256(file->data(), file->size(), hash.data());
+    return memcmp(hash.data(), modelHash.data(), hash.size()) == 0;
+}
 
-    // Pass ownership of client to protobuf message
-    request.set_allocated_sender(client);
+} // namespace
 
-    // Get ClientReader from stream
-    std::unique_ptr<ClientReader<ModelResponse> > reader(
-        modelserviceStub_->Download(&context, request));
+/**
+ * @brief Streams data from the server to a local file, see downloadStream().
+ *
+ * @return true if the data was downloaded, false otherwise.
+ */
+bool GrpcClient::downloadStreamToFile(const std::string& modelID, const std::string& path, TaskDirectory* task,
+        const std::vector<std::string>& cachedModelIDs, const std::vector<std::string>& tensorNames, DownloadEncoding& encoding) {
+    // Chunks are written in blocks while the download continues, and the file is
+    // preallocated once the server reports the size of the model
+    ModelFileWriter writer;
+    if (!writer.open(path)) {
+        return false;
+    }
 
-    // Collection for data
-    std::string accumulatedData;
+    // Only the whole model tells the size of the model, not a delta or a partial model
+    bool wholeModel = tensorNames.empty();
+    bool reserved = false;
+    int64_t size = downloadStream(modelID, [&writer, &reserved, &encoding, wholeModel, task, &modelID](std::string_view data, int64_t offset, int64_t totalSize) {
+        if (task && !reserved && totalSize > 0) {
+            if (!(wholeModel && encoding.deltaBase.empty() ? task->reserveModel(totalSize) : task->reserve(totalSize))) {
+                std::cerr << "Not enough workspace space for model " << modelID << std::endl;
+                return false;
+            }
+            reserved = true;
+        }
+        writer.reserve(totalSize);
+        return writer.write(data.data(), data.size(), offset);
+    }, cachedModelIDs, tensorNames, &encoding);
+    if (size < 0) {
+        writer.finish(0);
+        return false;
+    }
 
-    // Read from stream
-    ModelResponse modelResponse;
-    while (reader->Read(&modelResponse)) {
-        std::cout << "ModelResponseID: " << modelResponse.id() << std::endl;
-        std::cout << "ModelResponseStatus: " << modelResponse.status() << std::endl;
-        if (modelResponse.status() == ModelStatus::IN_PROGRESS) {
-            const std::string& dataResponse = modelResponse.data();
-            accumulatedData += dataResponse;
-            std::cout << "Download in progress: " << modelResponse.id() << std::endl;
-            std::cout << "Downloaded size: " << accumulatedData.size() << " bytes" << std::endl;
-        } 
-        else if (modelResponse.status() == ModelStatus::OK) {
-            // Print download complete
-            std::cout << "Download complete for model: " << modelResponse.id() << std::endl;
-        }
-        else if (modelResponse.status() == ModelStatus::FAILED) {
-            // Print download failed
-            std::cout << "Download failed: internal server error" << std::endl;      
-        }
-    }
-
-    reader->Finish();
-    std::cout << "Downloaded size: " << accumulatedData.size() << " bytes" << std::endl;
-    std::cout << "Disconnecting from DownloadStream" << std::endl;
-    
-    // return accumulatedData
-    return accumulatedData;
+    // Drop bytes left from an attempt that was started over
+    if (!writer.finish(size)) {
+        std::cerr << "Error writing file " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Turns the result of a download that offered cached models into the model, see
+ * downloadModelToFile().
+ *
+ * @param modelID The ID of the model.
+ * @param downloadPath The downloaded data, a delta or the model itself.
+ * @param modelPath The path to write the model to.
+ * @param encoding How the server encoded the data.
+ * @param task The task directory, space for the model is reserved in it.
+ * @return true if the model was written and matches its hash, false otherwise.
+ */
+bool GrpcClient::applyDownloadedDelta(const std::string& modelID, const std::string& downloadPath, const std::string& modelPath,
+        const DownloadEncoding& encoding, TaskDirectory* task) {
+    std::shared_ptr<ModelCache> cache = getModelCache();
+    if (encoding.deltaBase.empty()) {
+        return std::rename(downloadPath.c_str(), modelPath.c_str()) == 0 && matchesModelHash(modelPath, encoding.modelHash);
+    }
+    std::string basePath = cache ? cache->path(encoding.deltaBase) : "";
+    std::shared_ptr<MappedFile> delta = MappedFile::open(downloadPath);
+    DeltaInfo info;
+    if (basePath.empty() || !delta || !readDeltaInfo(delta->data(), delta->size(), info)) {
+        std::cerr << "Invalid delta of model " << modelID << " against " << encoding.deltaBase << std::endl;
+        return false;
+    }
+    delta.reset();
+    if (task && !task->reserveModel(info.modelSize)) {
+        std::cerr << "Not enough workspace space for model " << modelID << std::endl;
+        return false;
+    }
+    if (!decodeModelDelta(downloadPath, basePath, modelPath) || !matchesModelHash(modelPath, encoding.modelHash)) {
+        std::cerr << "Model " << modelID << " could not be decoded from a delta against " << encoding.deltaBase << std::endl;
+        // The cached model may be what is wrong, e.g. changed on disk
+        cache->remove(encoding.deltaBase);
+        std::remove(modelPath.c_str());
+        return false;
+    }
+    std::cout << "Decoded model " << modelID << " from a delta of " << info.encodedSize << " bytes against "
+              << encoding.deltaBase << std::endl;
+    return true;
 }
 
 /**
@@ -218,81 +965,416 @@ std::string GrpcClient::downloadModel(const std::string& modelID) {
  *
  * This function streams a model identified by the given modelID from the server
  * and writes it to a file specified by modelPath. It uses gRPC for communication
- * with the server and handles the streaming of data in chunks.
+ * with the server and handles the streaming of data in chunks, which are written
+ * through the file I/O engine, see ModelFileWriter. A broken download is resumed,
+ * see downloadStream().
+ *
+ * With a model cache set, see setModelCache(), a cached model is linked or copied instead,
+ * and otherwise the IDs of the cached models are sent with the request. A server that supports
+ * it streams a delta against one of them, which is decoded against the cached model and
+ * checked against the hash of the model. If that fails the model is downloaded in full.
+ * Downloaded models are added to the cache.
+ *
+ * With tensors named, a server that supports it sends a partial model with only those tensors
+ * instead, see partial.h, which is not cached. A cached model is still taken whole.
  *
  * @param modelID The ID of the model to be streamed.
  * @param modelPath The path to the file where the streamed model will be saved.
- *
- * @note If the file cannot be opened for writing, an error message is printed.
- * @note The function assumes that the server sends the model data in chunks and
- *       that the status of the model response indicates the progress of the download.
+ * @param task The task directory the file is in. Space for the model is reserved in it
+ *             once the server reports the size of the model, and the download fails if there is none.
+ * @param tensorNames The tensors needed, empty for the whole model.
+ * @return true if the model was downloaded, false otherwise.
  */
-void GrpcClient::downloadModelToFile(const std::string& modelID, const std::string& modelPath) {
+bool GrpcClient::downloadModelToFile(const std::string& modelID, const std::string& modelPath, TaskDirectory* task,
+        const std::vector<std::string>& tensorNames) {
     std::cout << "Buffering model " << modelID << "..." << std::endl;
 
-    // request 
+    std::shared_ptr<ModelCache> cache = getModelCache();
+    std::vector<std::string> cachedModelIDs = cache ? cache->modelIDs() : std::vector<std::string>();
+    std::string cachedPath = cache ? cache->path(modelID) : "";
+    // A file left at the path may be linked to a cached model, so it is replaced, not written over
+    std::remove(modelPath.c_str());
+    if (!cachedPath.empty()) {
+        std::error_code error;
+        uint64_t size = std::filesystem::file_size(cachedPath, error);
+        if (!error && (!task || task->reserveModel(size))) {
+            std::filesystem::create_hard_link(cachedPath, modelPath, error);
+            if (error) {
+                error.clear();
+                std::filesystem::copy_file(cachedPath, modelPath, error);
+            }
+            if (!error) {
+                std::cout << "Model " << modelID << " taken from the model cache" << std::endl;
+                return true;
+            }
+        }
+    }
+
+    DownloadEncoding encoding;
+    bool downloaded = false;
+    // A partial model is usually smaller than a delta of the whole model
+    if (!cachedModelIDs.empty() && tensorNames.empty()) {
+        std::string downloadPath = modelPath + ".download";
+        downloaded = downloadStreamToFile(modelID, downloadPath, task, cachedModelIDs, {}, encoding)
+            && applyDownloadedDelta(modelID, downloadPath, modelPath, encoding, task);
+        std::remove(downloadPath.c_str());
+        if (!downloaded) {
+            std::cout << "Downloading model " << modelID << " in full" << std::endl;
+        }
+    }
+    if (!downloaded) {
+        downloaded = downloadStreamToFile(modelID, modelPath, task, {}, tensorNames, encoding);
+        if (downloaded && !matchesModelHash(modelPath, encoding.modelHash)) {
+            std::cerr << "Downloaded model " << modelID << " does not match its hash" << std::endl;
+            std::remove(modelPath.c_str());
+            downloaded = false;
+        }
+    }
+    if (!downloaded) {
+        return false;
+    }
+    if (!tensorNames.empty() && readPartialManifest(modelPath)) {
+        std::cout << "Downloaded " << tensorNames.size() << " tensors of model " << modelID << std::endl;
+    } else if (cache) {
+        cache->insert(modelID, modelPath);
+    }
+    std::cout << "modelData saved to file " << modelPath << " successfully" << std::endl;
+    return true;
+}
+
+/**
+ * @brief Asks the server how many bytes of an interrupted upload it holds.
+ *
+ * @param modelID The ID of the model being uploaded.
+ * @param totalSize The size of the model in bytes.
+ * @return int64_t The offset to resume the upload at, -1 if the server does not support resuming.
+ */
+int64_t GrpcClient::queryUploadOffset(const std::string& modelID, int64_t totalSize) {
+    RpcArena arena;
+    ModelResponse& response = *arena.create<ModelResponse>();
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(30));
+
+    ModelRequest& request = *arena.create<ModelRequest>();
+    request.set_id(modelID);
+    request.set_status(ModelStatus::UNKNOWN);
+    request.set_total_size(totalSize);
+    request.unsafe_arena_set_allocated_sender(&sender_);
+
+    std::shared_ptr<ModelService::Stub> modelserviceStub = getModelServiceStub();
+    std::unique_ptr<ClientWriter<ModelRequest> > writer(
+        modelserviceStub->Upload(&context, &response));
+    writer->Write(request);
+    writer->WritesDone();
+    Status status = writer->Finish();
+    if (status.ok() && response.status() == ModelStatus::IN_PROGRESS
+            && response.offset() >= 0 && response.offset() <= totalSize) {
+        return response.offset();
+    }
+    return -1;
+}
+
+/**
+ * @brief Streams a model to the server in chunks, resuming the upload if the stream breaks.
+ *
+ * A broken upload is retried up to the number of times set with setTransferRetries(). Before
+ * a retry the server is asked how many bytes it holds, see queryUploadOffset(), and the upload
+ * continues from there. A server that does not support resuming would append the retried
+ * chunks to the interrupted upload, so the upload is not retried in that case.
+ *
+ * @param modelID The unique identifier for the model being uploaded.
+ * @param totalSize The size of the model in bytes.
+ * With zero-copy transfers enabled and a mapped file given, the chunks are sent straight from
+ * the mapping, see RawModelTransfer, and read is not used.
+ *
+ * @param read Fills the buffer with the given number of bytes from the given offset. Returns false on a read error.
+ * @param file The mapped model file, nullptr if the model is not in a file.
+ * @return true if the upload succeeded, false otherwise.
+ */
+bool GrpcClient::uploadStream(const std::string& modelID, int64_t totalSize,
+        const std::function<bool(int64_t, size_t, std::string&)>& read, std::shared_ptr<MappedFile> file) {
+    size_t chunkSize = this->getChunkSize();
+    int64_t offset = 0;
+
+    // Reused for every chunk, so the chunk buffer is only allocated once. It is not on an
+    // arena, which would keep the memory of every chunk until the upload is done.
     ModelRequest request;
     request.set_id(modelID);
 
-    // context
-    ClientContext context;
+    std::cout << "Upload in progress: " << modelID << std::endl;
+    std::cout << "Chunk size: " << chunkSize << " bytes" << std::endl;
 
-    // Set client
-    Client* client = new Client();
-    client->set_name(name_);
-    client->set_role(CLIENT);
-    client->set_client_id(id_);
+    for (int attempt = 0; ; ++attempt) {
+        RpcArena arena;
+        // response 
+        ModelResponse& response = *arena.create<ModelResponse>();
+        // context
+        ClientContext context;
 
-    // Pass ownership of client to protobuf message
-    request.set_allocated_sender(client);
+        Status status;
+        if (file && zeroCopyTransfer_) {
+            status = getRawModelTransfer()->upload(context, modelID, sender_, file, offset, chunkSize, response);
+        }
+        else {
+            // Get ClientWriter from stream
+            std::shared_ptr<ModelService::Stub> modelserviceStub = getModelServiceStub();
+            std::unique_ptr<ClientWriter<ModelRequest> > writer(
+                modelserviceStub->Upload(&context, &response));
+
+            bool broken = false;
+            bool firstChunk = true;
+            request.set_status(ModelStatus::IN_PROGRESS);
+            while (offset < totalSize) {
+                size_t currentChunkSize = std::min<int64_t>(chunkSize, totalSize - offset);
+                // Read the chunk straight into the request
+                if (!read(offset, currentChunkSize, *request.mutable_data())) {
+                    std::cerr << "Error reading model " << modelID << " at offset " << offset << std::endl;
+                    request.unsafe_arena_release_sender();
+                    context.TryCancel();
+                    writer->Finish();
+                    return false;
+                }
+                request.set_offset(offset);
+                // Identify the client in the first chunk only
+                if (firstChunk) {
+                    request.unsafe_arena_set_allocated_sender(&sender_);
+                    request.set_total_size(totalSize);
+                }
+                bool written = writer->Write(request);
+                if (firstChunk) {
+                    request.unsafe_arena_release_sender();
+                    request.clear_total_size();
+                    firstChunk = false;
+                }
+
+                if (!written) {
+                    // Broken stream.
+                    std::cout << "Disconnecting from UploadStream" << std::endl;
+                    broken = true;
+                    break;
+                }
+                std::cout << "Uploading chunk: " << offset << " - " << offset + currentChunkSize << std::endl;
+                offset += currentChunkSize;
+            }
+
+            // Finish writing to stream with final message
+            if (!broken) {
+                request.clear_data();
+                request.set_status(ModelStatus::OK);
+                request.set_offset(offset);
+                request.set_total_size(totalSize);
+                writer->Write(request);
+                writer->WritesDone();
+                request.clear_total_size();
+            }
+            status = writer->Finish();
+        }
 
-    // Get ClientReader from stream
-    std::unique_ptr<ClientReader<ModelResponse> > reader(
-        modelserviceStub_->Download(&context, request));
+        if (status.ok()) {
+            std::cout << "Upload complete for local model: " << modelID << std::endl;
+            // Print message from response
+            std::cout << "Response: " << response.message() << std::endl;
+            return true;
+        }
+        std::cout << "Upload failed for model: " << modelID << std::endl;
+        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+        // Print message from response
+        std::cout << "Response: " << response.message() << std::endl;
+        if (!isTransientError(status) || attempt >= transferRetries_) {
+            return false;
+        }
+        transferBackoff(attempt);
+        offset = queryUploadOffset(modelID, totalSize);
+        if (offset < 0) {
+            std::cout << "Server cannot resume upload of " << modelID << std::endl;
+            return false;
+        }
+        std::cout << "Resuming upload of " << modelID << " at " << offset << " bytes (retry "
+                  << attempt + 1 << " of " << transferRetries_ << ")" << std::endl;
+    }
+}
 
-    // Create an ofstream object and open the file in binary mode
-    std::ofstream outFile(modelPath, std::ios::binary); // Before stream loop
+namespace {
 
-    // Check if the file was opened successfully
-    if (!outFile) {
-        std::cerr << "Error opening file for writing" << std::endl;
+// About 0.7 MB of chunk references per request
+const size_t kChunkRefsPerRequest = 16384;
+
+void setChunkRefs(ModelRequest& request, const std::vector<ContentChunk>& chunks, size_t begin, size_t end) {
+    request.clear_chunks();
+    for (size_t i = begin; i < end; i++) {
+        ChunkRef* ref = request.add_chunks();
+        ref->set_hash(chunks[i].hash.data(), chunks[i].hash.size());
+        ref->set_size(chunks[i].size);
     }
+}
 
-    // Number of bytes streamed so far
-    size_t streamedDataSize = 0;
+} // namespace
 
-    // Read from stream
-    ModelResponse modelResponse;
-    while (reader->Read(&modelResponse)) {
-        std::cout << "ModelResponseID: " << modelResponse.id() << std::endl;
-        std::cout << "ModelResponseStatus: " << modelResponse.status() << std::endl;
-        if (modelResponse.status() == ModelStatus::IN_PROGRESS) {
-            const std::string& dataResponse = modelResponse.data();
-            // Increment number of bytes streamed
-            streamedDataSize += dataResponse.size();
-            // Write the binary string to the file
-            outFile.write(dataResponse.c_str(), dataResponse.size()); // In each iteration. After chunk is downloaded
-            std::cout << "Download in progress: " << modelResponse.id() << std::endl;
-            // TODO Calculate and print current written size
-            std::cout << "Downloaded size: " << streamedDataSize << " bytes" << std::endl;
-        }
-        else if (modelResponse.status() == ModelStatus::OK) {
-            // Print download complete
-            std::cout << "Download complete for model: " << modelResponse.id() << std::endl;
-        }
-        else if (modelResponse.status() == ModelStatus::FAILED) {
-            // Print download failed
-            std::cout << "Download failed: internal server error" << std::endl;      
-        }
-    }
-
-    // Close the file
-    outFile.close();
-    std::cout << "modelData saved to file " << modelPath << " successfully" << std::endl;
+/**
+ * @brief Asks the server which chunks of a model it does not hold, see uploadDeduplicated().
+ *
+ * @param modelID The ID of the model being uploaded.
+ * @param totalSize The size of the model in bytes.
+ * @param chunks The chunks of the model.
+ * @param missing Set to the runs of chunks the server does not hold, as pairs of the index of
+ *        the first chunk and the number of chunks, or to nullopt if the server does not
+ *        deduplicate uploads.
+ * @return The status of the call.
+ */
+Status GrpcClient::queryMissingChunks(const std::string& modelID, int64_t totalSize, const std::vector<ContentChunk>& chunks,
+        std::optional<std::vector<int64_t>>& missing) {
+    missing.reset();
+    ModelResponse response;
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(60));
+
+    ModelRequest request;
+    request.set_id(modelID);
+    request.set_status(ModelStatus::UNKNOWN);
+    request.set_total_size(totalSize);
+    *request.mutable_sender() = sender_;
+
+    std::shared_ptr<ModelService::Stub> modelserviceStub = getModelServiceStub();
+    std::unique_ptr<ClientWriter<ModelRequest> > writer(
+        modelserviceStub->Upload(&context, &response));
+    for (size_t begin = 0; begin == 0 || begin < chunks.size(); begin += kChunkRefsPerRequest) {
+        setChunkRefs(request, chunks, begin, std::min(chunks.size(), begin + kChunkRefsPerRequest));
+        if (!writer->Write(request)) {
+            break;
+        }
+        request.clear_sender();
+        request.clear_total_size();
+    }
+    writer->WritesDone();
+    Status status = writer->Finish();
+    if (!status.ok() || !response.dedup() || response.status() != ModelStatus::IN_PROGRESS) {
+        return status;
+    }
+    // Runs out of order or out of range are not trusted
+    std::vector<int64_t> runs(response.missing().begin(), response.missing().end());
+    int64_t next = 0;
+    for (size_t i = 0; i + 1 < runs.size(); i += 2) {
+        if (runs[i] < next || runs[i + 1] <= 0 || runs[i + 1] > int64_t(chunks.size()) - runs[i]) {
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "invalid missing chunks");
+        }
+        next = runs[i] + runs[i + 1];
+    }
+    if (runs.size() % 2 != 0) {
+        return Status(grpc::StatusCode::INVALID_ARGUMENT, "invalid missing chunks");
+    }
+    missing = std::move(runs);
+    return status;
+}
+
+/**
+ * @brief Sends the chunk list of a model and the data of the chunks the server does not
+ * hold, see uploadDeduplicated().
+ *
+ * @return The status of the call.
+ */
+Status GrpcClient::uploadChunks(const std::string& modelID, std::shared_ptr<MappedFile> file, const std::vector<ContentChunk>& chunks,
+        const std::vector<int64_t>& missing, ModelResponse& response) {
+    ClientContext context;
+    std::shared_ptr<ModelService::Stub> modelserviceStub = getModelServiceStub();
+    std::unique_ptr<ClientWriter<ModelRequest> > writer(
+        modelserviceStub->Upload(&context, &response));
+
+    ModelRequest request;
+    request.set_id(modelID);
+    request.set_status(ModelStatus::IN_PROGRESS);
+    request.set_total_size(file->size());
+    *request.mutable_sender() = sender_;
+    bool written = true;
+    for (size_t begin = 0; written && (begin == 0 || begin < chunks.size()); begin += kChunkRefsPerRequest) {
+        setChunkRefs(request, chunks, begin, std::min(chunks.size(), begin + kChunkRefsPerRequest));
+        written = writer->Write(request);
+        request.clear_sender();
+        request.clear_total_size();
+    }
+    request.clear_chunks();
 
-    reader->Finish();
-    std::cout << "Downloaded size: " << streamedDataSize << " bytes" << std::endl;
-    std::cout << "Disconnecting from DownloadStream" << std::endl;
+    // Consecutive missing chunks go out together, in pieces of the chunk size
+    size_t chunkSize = this->getChunkSize();
+    for (size_t i = 0; written && i < missing.size(); i += 2) {
+        const ContentChunk& last = chunks[missing[i] + missing[i + 1] - 1];
+        int64_t end = last.offset + last.size;
+        for (int64_t offset = chunks[missing[i]].offset; written && offset < end; ) {
+            size_t size = std::min<int64_t>(chunkSize, end - offset);
+            request.set_data(file->data() + offset, size);
+            request.set_offset(offset);
+            written = writer->Write(request);
+            file->release(offset, size);
+            offset += size;
+        }
+    }
+    if (written) {
+        request.clear_data();
+        request.set_status(ModelStatus::OK);
+        request.set_offset(file->size());
+        request.set_total_size(file->size());
+        writer->Write(request);
+        writer->WritesDone();
+    }
+    return writer->Finish();
+}
+
+/**
+ * @brief Uploads a model in content-defined chunks, sending only the chunks the server does
+ * not already hold, e.g. of frozen layers or of a model that is sent back unchanged.
+ *
+ * The model is split into chunks, see dedup.h, the server is asked which of them it lacks,
+ * see queryMissingChunks(), and only those are sent. A broken upload is retried like in
+ * uploadStream(); the server is asked again, so chunks it received before the break are not
+ * sent twice if it kept them.
+ *
+ * @param modelID The ID of the model being uploaded.
+ * @param file The mapped model file.
+ * @return Whether the upload succeeded, or nullopt if the server does not deduplicate
+ *         uploads or fails the probe with an error that is not transient, in which case the
+ *         model has to be uploaded in full.
+ */
+std::optional<bool> GrpcClient::uploadDeduplicated(const std::string& modelID, std::shared_ptr<MappedFile> file) {
+    std::vector<ContentChunk> chunks = chunkContent(file->data(), file->size());
+    for (int attempt = 0; ; ++attempt) {
+        std::optional<std::vector<int64_t>> missing;
+        ModelResponse response;
+        Status status = queryMissingChunks(modelID, file->size(), chunks, missing);
+        // A server that fails the probe for good, e.g. with UNIMPLEMENTED or with UNKNOWN for an
+        // exception of a handler that does not expect it, does not deduplicate uploads either
+        if ((status.ok() && !missing) || (!status.ok() && !isTransientError(status))) {
+            std::cout << "Server does not deduplicate uploads";
+            if (!status.ok()) {
+                std::cout << " (" << status.error_code() << ": " << status.error_message() << ")";
+            }
+            std::cout << ", uploading " << modelID << " in full" << std::endl;
+            dedupUnsupported_ = true;
+            return std::nullopt;
+        }
+        if (status.ok()) {
+            size_t missingChunks = 0;
+            int64_t missingBytes = 0;
+            for (size_t i = 0; i < missing->size(); i += 2) {
+                const ContentChunk& last = chunks[(*missing)[i] + (*missing)[i + 1] - 1];
+                missingChunks += (*missing)[i + 1];
+                missingBytes += last.offset + last.size - chunks[(*missing)[i]].offset;
+            }
+            std::cout << "Deduplicated upload of " << modelID << ": sending " << missingChunks << " of " << chunks.size()
+                      << " chunks, " << missingBytes << " of " << file->size() << " bytes" << std::endl;
+            status = uploadChunks(modelID, file, chunks, *missing, response);
+        }
+        if (status.ok()) {
+            std::cout << "Upload complete for local model: " << modelID << std::endl;
+            std::cout << "Response: " << response.message() << std::endl;
+            return true;
+        }
+        std::cout << "Deduplicated upload failed for model: " << modelID << std::endl;
+        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
+        if (!isTransientError(status) || attempt >= transferRetries_) {
+            return false;
+        }
+        transferBackoff(attempt);
+        std::cout << "Retrying upload of " << modelID << " (retry " << attempt + 1 << " of " << transferRetries_ << ")" << std::endl;
+    }
 }
 
 /**
@@ -300,158 +1382,49 @@ void GrpcClient::downloadModelToFile(const std::string& modelID, const std::stri
  * 
  * This function uploads a model to the server by dividing the model data into chunks
  * and sending each chunk sequentially. It uses gRPC for communication and handles
- * the streaming of data to the server.
+ * the streaming of data to the server. A broken upload is resumed, see uploadStream().
  * 
  * @param modelID The unique identifier for the model being uploaded.
  * @param modelData The binary data of the model to be uploaded.
+ * @return true if the upload succeeded, false otherwise.
  */
-void GrpcClient::uploadModel(std::string& modelID, std::string& modelData) {
-    // response 
-    ModelResponse response;
-    // context
-    ClientContext context;
-
-    // Client
-    Client* client = new Client();
-    client->set_name(name_);
-    client->set_role(CLIENT);
-    client->set_client_id(id_);
-
-    // Get ClientWriter from stream
-    std::unique_ptr<ClientWriter<ModelRequest> > writer(
-        modelserviceStub_->Upload(&context, &response));
-
-    // Calculate the number of chunks
-    size_t chunkSize = this->getChunkSize();
-    size_t totalSize = modelData.size();
-    size_t offset = 0;
-
-    std::cout << "Upload in progress: " << modelID << std::endl;
-    std::cout << "Chunk size: " << chunkSize << " bytes" << std::endl;
-
-    while (offset < totalSize) {
-        ModelRequest request;
-        size_t currentChunkSize = std::min(chunkSize, totalSize - offset);
-        request.set_data(modelData.data() + offset, currentChunkSize);
-        request.set_id(modelID);
-        request.set_status(ModelStatus::IN_PROGRESS);
-        // Pass ownership of client to protobuf message only for the first chunk
-        if (offset == 0) {
-            request.set_allocated_sender(client);
-        }
-
-        if (!writer->Write(request)) {
-            // Broken stream.
-            std::cout << "Upload failed for model: " << modelID << std::endl;
-            std::cout << "Disconnecting from UploadStream" << std::endl;
-            grpc::Status status = writer->Finish();
-            return;
-        }
-        std::cout << "Uploading chunk: " << offset << " - " << offset + currentChunkSize << std::endl;
-        offset += currentChunkSize;
-    }
-
-    // Finish writing to stream with final message
-    ModelRequest requestFinal;
-    requestFinal.set_id(modelID);
-    requestFinal.set_status(ModelStatus::OK);
-    writer->Write(requestFinal);
-    writer->WritesDone();
-    grpc::Status status = writer->Finish();
-
-    if (status.ok()) {
-        std::cout << "Upload complete for local model: " << modelID << std::endl;
-        // Print message from response
-        std::cout << "Response: " << response.message() << std::endl;
-    } else {
-        std::cout << "Upload failed for model: " << modelID << std::endl;
-        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
-        // Print message from response
-        std::cout << "Response: " << response.message() << std::endl;
-    }
+bool GrpcClient::uploadModel(std::string& modelID, std::string& modelData) {
+    return uploadStream(modelID, modelData.size(), [&modelData](int64_t offset, size_t size, std::string& buffer) {
+        buffer.assign(modelData, offset, size);
+        return true;
+    });
 }
 
-void GrpcClient::uploadModelFromFile(const std::string& modelID, const std::string& modelPath) {
-    // Create an ifstream object and open the file in binary mode
-    std::ifstream inFile(modelPath, std::ios::binary);
-    // Check if the file was opened successfully
-    if (!inFile) {
-        std::cerr << "Error opening file " << modelPath << " for reading" << std::endl;
-        return;
+/**
+ * @brief Uploads a model from a file to the server in chunks.
+ * 
+ * The file is mapped into memory and sent one chunk at a time. A broken upload is resumed,
+ * see uploadStream(). With deduplicated uploads enabled, only the chunks the server does not
+ * hold are sent, see uploadDeduplicated().
+ * 
+ * @param modelID The unique identifier for the model being uploaded.
+ * @param modelPath The path to the model file.
+ * @return true if the upload succeeded, false otherwise.
+ */
+bool GrpcClient::uploadModelFromFile(const std::string& modelID, const std::string& modelPath) {
+    // Map the file, files can be larger than 2 GB
+    std::shared_ptr<MappedFile> file = MappedFile::open(modelPath);
+    if (!file) {
+        return false;
     }
-
-    // Get the length of the file
-    inFile.seekg(0, inFile.end);
-    size_t totalSize = inFile.tellg();
-    inFile.seekg(0, inFile.beg);
-
-    // response 
-    ModelResponse response;
-    // context
-    ClientContext context;
-
-    // Client
-    Client* client = new Client();
-    client->set_name(name_);
-    client->set_role(CLIENT);
-    client->set_client_id(id_);
-
-    // Get ClientWriter from stream
-    std::unique_ptr<ClientWriter<ModelRequest> > writer(
-        modelserviceStub_->Upload(&context, &response));
-
-    // Calculate the number of chunks
-    size_t chunkSize = this->getChunkSize();
-    size_t offset = 0;
-
-    std::cout << "Upload in progress: " << modelID << std::endl;
-    std::cout << "Chunk size: " << chunkSize << " bytes" << std::endl;
-
-    while (offset < totalSize) {
-        ModelRequest request;
-        size_t currentChunkSize = std::min(chunkSize, totalSize - offset);
-        std::string buffer(currentChunkSize, '\0');
-        inFile.read(&buffer[0], currentChunkSize);
-        std::cout << "File pointer position: " << inFile.tellg() << std::endl;
-        request.set_data(buffer);
-        request.set_id(modelID);
-        request.set_status(ModelStatus::IN_PROGRESS);
-        // Pass ownership of client to protobuf message only for the first chunk
-        if (offset == 0) {
-            request.set_allocated_sender(client);
-        }
-
-        if (!writer->Write(request)) {
-            // Broken stream.
-            std::cout << "Upload failed for model: " << modelID << std::endl;
-            std::cout << "Disconnecting from UploadStream" << std::endl;
-            grpc::Status status = writer->Finish();
-            inFile.close();
-            return;
+    if (dedupUploads_ && !dedupUnsupported_) {
+        std::optional<bool> uploaded = uploadDeduplicated(modelID, file);
+        if (uploaded) {
+            return *uploaded;
         }
-        std::cout << "Uploading chunk: " << offset << " - " << offset + currentChunkSize << std::endl;
-        offset += currentChunkSize;
     }
 
-    // Finish writing to stream with final message
-    ModelRequest requestFinal;
-    requestFinal.set_id(modelID);
-    requestFinal.set_status(ModelStatus::OK);
-    writer->Write(requestFinal);
-    writer->WritesDone();
-    grpc::Status status = writer->Finish();
-    inFile.close();
-
-    if (status.ok()) {
-        std::cout << "Upload complete for local model: " << modelID << std::endl;
-        // Print message from response
-        std::cout << "Response: " << response.message() << std::endl;
-    } else {
-        std::cout << "Upload failed for model: " << modelID << std::endl;
-        std::cout << status.error_code() << ": " << status.error_message() << std::endl;
-        // Print message from response
-        std::cout << "Response: " << response.message() << std::endl;
-    }
+    return uploadStream(modelID, file->size(), [&file](int64_t offset, size_t size, std::string& buffer) {
+        buffer.assign(file->data() + offset, size);
+        // Pages already sent are dropped, so a large model does not stay resident
+        file->release(offset, size);
+        return true;
+    }, file);
 }
 
 /**
@@ -466,27 +1439,21 @@ void GrpcClient::uploadModelFromFile(const std::string& modelID, const std::stri
  * @param outModelPath The file path to save the updated model data to.
  */
 void GrpcClient::train(const std::string& inModelPath, const std::string& outModelPath) {
-    // Using own code to load the matrix from a binary file, dymmy code. Remove if using Armadillo
-    std::string modelData = loadModelFromFile(inModelPath);
-    
-    // Send the same model back as update
-    std::string modelUpdateData = modelData;
-    
-    // Using own code to save the matrix as a binary file, dymmy code. Remove if using Armadillo
-    saveModelToFile(modelUpdateData, outModelPath);
+    // Send the same model back as update, copied block by block so it never has to fit in memory
+    copyModelFile(inModelPath, outModelPath);
 }
 /**
  * @brief Updates the local model by downloading it from the server, training it, and uploading the updated model back to the server.
  * 
  * This function performs the following steps:
  * 1. Downloads the model from the server using the provided model ID.
- * 2. Saves the downloaded model to a file.
+ * 2. Saves the downloaded model to a file in a task directory of the workspace.
  * 3. Generates a random UUID for the model update.
  * 4. Trains the model using the saved file and generates an updated model file.
  * 5. Loads the updated model from the file.
  * 6. Uploads the updated model to the server.
  * 7. Sends a model update response to the server.
- * 8. Deletes the temporary model files from the disk.
+ * 8. Removes the task directory with the temporary model files.
  * 
  * @param modelID The ID of the model to be updated.
  * @param requestData Additional request data to be sent with the model update via gRPC.
@@ -494,31 +1461,350 @@ void GrpcClient::train(const std::string& inModelPath, const std::string& outMod
 void GrpcClient::updateLocalModel(const std::string& modelID, const std::string& requestData) {
     std::cout << "Updating local model: " << modelID << std::endl;
 
-    // Generate random UUIDs for temporary files
-    std::string tempModelFile = generateRandomUUID();
+    // The files of the task are kept in a directory of their own, which is removed with them
+    std::shared_ptr<Workspace> workspace = getWorkspace();
+    std::unique_ptr<TaskDirectory> task = workspace ? workspace->createTask("train") : nullptr;
+    if (!task) {
+        std::cerr << "Skipping model update, could not create a task directory" << std::endl;
+        return;
+    }
     std::string modelUpdateID = generateRandomUUID();
     
     // Create file paths
-    std::string inModelPath = "./" + tempModelFile + ".bin";
-    std::string outModelPath = "./" + modelUpdateID + ".bin";
+    std::string inModelPath = task->file("model.bin");
+    std::string outModelPath = task->file(modelUpdateID + ".bin");
+
+    // Stream model and write it to file, only the tensors training needs if they are set
+    if (!downloadModelToFile(modelID, inModelPath, task.get(), getRequiredTensors())) {
+        std::cerr << "Skipping model update, could not download model " << modelID << std::endl;
+        return;
+    }
 
-    // Stream model and write it to file
-    downloadModelToFile(modelID, inModelPath);
+    // Make room for the trained model, which is usually as large as the global model. The
+    // space of a delta the model was decoded from is free again and is used first.
+    uint64_t modelSize = task->modelSize() > 0 ? task->modelSize() : task->reserved();
+    uint64_t freed = task->reserved() - modelSize;
+    if (modelSize > freed && !task->reserve(modelSize - freed)) {
+        std::cerr << "Skipping model update, not enough workspace space for the trained model" << std::endl;
+        return;
+    }
 
     std::cout << "Generated random UUID " << modelUpdateID << " for model update" << std::endl;
 
     // train the model
+    {
+        std::lock_guard<std::mutex> lock(taskMutex_);
+        modifiedTensors_.reset();
+    }
     this->train(inModelPath, outModelPath);
 
+    // Upload only the tensors training modified, with a manifest naming the global model the
+    // combiner takes the others from
+    json partial = writePartialUpdate(modelID, inModelPath, outModelPath, *task);
+
+    // Clip the update and add noise before it is converted, encoded or kept in the outbox
+    json privacy;
+    if (privacy_) {
+        privacy = privatizeTrainedModel(inModelPath, outModelPath, *task);
+        if (privacy.is_null()) {
+            std::cerr << "Skipping model update, differential privacy could not be applied" << std::endl;
+            return;
+        }
+    }
+
+    // Mask the update last, so the combiner sees only the sum of the updates of the round
+    json secureAggregation;
+    if (secureAggregation_) {
+        secureAggregation = maskTrainedModel(modelID, outModelPath, *task);
+        if (secureAggregation.is_null()) {
+            std::cerr << "Skipping model update, it could not be masked for secure aggregation" << std::endl;
+            return;
+        }
+    }
+
+    // A model that cannot be converted is uploaded as trained. Masked models are uploaded as
+    // they are, the masks cancel only in the sum of the fixed-point models.
+    if (modelDType_ && secureAggregation.is_null() && !convertContainerFile(outModelPath, *modelDType_)) {
+        std::cerr << "Uploading model update " << modelUpdateID << " in the dtype it was trained in" << std::endl;
+    }
+
+    // Upload an encoding of the update against the global model instead, the combiner holds
+    // the global model to reconstruct the update from
+    json encoding;
+    if (secureAggregation.is_null()) {
+        for (const std::shared_ptr<CodecPipeline>& pipeline : updatePipelines()) {
+            encoding = encodeUpdate(*pipeline, modelID, inModelPath, outModelPath, *task);
+            if (!encoding.is_null()) {
+                break;
+            }
+        }
+    }
+
     std::cout << "Streaming model from file: " << modelUpdateID << std::endl;
-    GrpcClient::uploadModelFromFile(modelUpdateID, outModelPath);
+    bool uploaded = GrpcClient::uploadModelFromFile(modelUpdateID, outModelPath);
 
     // Send model update response to server
-    GrpcClient::sendModelUpdate(modelID, modelUpdateID, requestData);
+    bool delivered = uploaded && GrpcClient::sendModelUpdate(modelID, modelUpdateID, requestData, encoding, partial, privacy,
+        secureAggregation);
+
+    // Keep an undelivered update in the outbox, it is moved there from outModelPath
+    std::shared_ptr<Outbox> outbox = getOutbox();
+    if (!delivered && outbox) {
+        json payload = {
+            {"model_id", modelID},
+            {"model_update_id", modelUpdateID},
+            {"config", requestData},
+            {"uploaded", uploaded}
+        };
+        if (!encoding.is_null()) {
+            payload["encoding"] = encoding;
+        }
+        if (!partial.is_null()) {
+            payload["partial"] = partial;
+        }
+        if (!privacy.is_null()) {
+            payload["privacy"] = privacy;
+        }
+        if (!secureAggregation.is_null()) {
+            payload["secure_aggregation"] = secureAggregation;
+        }
+        if (!outbox->put("update", loggingContext.getSessionId(), loggingContext.getRoundId(), payload, outModelPath).empty()) {
+            wakeOutbox(false);
+        }
+    }
+
+    // The task directory is removed with the models when it goes out of scope
+}
+
+/**
+ * @brief Replaces a trained model by the partial model of the tensors training modified, see
+ * partial.h.
+ * 
+ * Partial updates are written with partial updates enabled, see setPartialUpdates(), if the
+ * train hook declared the tensors it modified, see setModifiedTensors(). A model trained from a
+ * partial global model, see setRequiredTensors(), is always uploaded as a partial update, of the
+ * declared tensors or else of all it holds. Models that are not tensor containers or lack a
+ * declared tensor are uploaded as trained.
+ * 
+ * @param modelID The ID of the global model.
+ * @param basePath The path to the global model.
+ * @param modelPath The path to the trained model, replaced by the partial model.
+ * @param task The task directory the partial model is written to.
+ * @return The manifest to send with the model update, null if the model is uploaded as it is.
+ */
+json GrpcClient::writePartialUpdate(const std::string& modelID, const std::string& basePath, const std::string& modelPath, TaskDirectory& task) {
+    std::optional<std::vector<std::string>> tensorNames;
+    {
+        std::lock_guard<std::mutex> lock(taskMutex_);
+        tensorNames = modifiedTensors_;
+    }
+    std::optional<json> baseManifest = readPartialManifest(basePath);
+    bool partialBase = baseManifest.has_value();
+    if (!partialBase && (!partialUpdates_ || !tensorNames)) {
+        return json();
+    }
+    if (!tensorNames) {
+        std::shared_ptr<TensorReader> model = TensorReader::open(modelPath);
+        if (!model) {
+            return json();
+        }
+        tensorNames.emplace();
+        for (const TensorInfo& tensor : model->tensors()) {
+            tensorNames->push_back(tensor.name);
+        }
+    }
+
+    json manifest;
+    std::string partialPath = task.file("partial.bin");
+    size_t modelTensors = partialBase ? baseManifest->value("model_tensors", size_t(0)) : 0;
+    if (!writePartialModel(modelPath, *tensorNames, modelID, partialPath, &manifest, modelTensors)
+            || std::rename(partialPath.c_str(), modelPath.c_str()) != 0) {
+        std::cerr << "Uploading the whole trained model, cannot write a partial update" << std::endl;
+        std::remove(partialPath.c_str());
+        return json();
+    }
+    std::cout << "Uploading " << manifest["tensors"].size() << " of " << manifest["model_tensors"]
+              << " tensors as a partial update" << std::endl;
+    return manifest;
+}
+
+/**
+ * @brief Replaces a trained model by the global model plus its clipped and noised update,
+ * see privatizeUpdate() and setPrivacy().
+ * 
+ * Every update gets a new random seed. The parameters returned do not include the seed or
+ * the norm of the update, which would undo the privacy.
+ * 
+ * @param basePath The path to the global model.
+ * @param modelPath The path to the trained model, replaced by the private model.
+ * @param task The task directory the private model is written to.
+ * @return The parameters to send with the model update, null if the update could not be made private.
+ */
+json GrpcClient::privatizeTrainedModel(const std::string& basePath, const std::string& modelPath, TaskDirectory& task) {
+    std::error_code error;
+    uint64_t modelSize = std::filesystem::file_size(modelPath, error);
+    if (error || !task.reserve(modelSize)) {
+        std::cerr << "Not enough workspace space to make the model update private" << std::endl;
+        return json();
+    }
+    PrivacyOptions options = *privacy_;
+    std::random_device random;
+    options.seed = (uint64_t(random()) << 32) ^ random();
+
+    std::string privatePath = modelPath + ".private";
+    auto start = std::chrono::steady_clock::now();
+    if (!privatizeUpdate(modelPath, basePath, privatePath, options)
+            || std::rename(privatePath.c_str(), modelPath.c_str()) != 0) {
+        std::remove(privatePath.c_str());
+        return json();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "Clipped model update to norm " << options.clipNorm << " and added noise of standard deviation "
+              << options.noiseMultiplier * options.clipNorm << " in " << elapsed.count() << " ms, kernels: " << fednlib::ops::kernels() << std::endl;
+    return {
+        {"mechanism", "gaussian"},
+        {"clip_norm", options.clipNorm},
+        {"noise_multiplier", options.noiseMultiplier},
+        {"noise_stddev", options.noiseMultiplier * options.clipNorm},
+        {"clipping", "global_l2"},
+        {"prng", "philox4x32-10"}
+    };
+}
+
+/**
+ * @brief Replaces a trained model by the model masked for secure aggregation, see maskModel()
+ * and setSecureAggregation().
+ * 
+ * The global model names the round, so the clients training it exchange keys with each other.
+ * 
+ * @param modelID The ID of the global model.
+ * @param modelPath The path to the trained model, replaced by the masked model.
+ * @param task The task directory the masked model is written to.
+ * @return The parameters to send with the model update, null if the model could not be masked.
+ */
+json GrpcClient::maskTrainedModel(const std::string& modelID, const std::string& modelPath, TaskDirectory& task) {
+    std::error_code error;
+    uint64_t modelSize = std::filesystem::file_size(modelPath, error);
+    if (error || !task.reserve(modelSize)) {
+        std::cerr << "Not enough workspace space to mask the model update" << std::endl;
+        return json();
+    }
+    const SecureAggregationOptions& options = *secureAggregation_;
+    std::string clientID = id_.empty() ? name_ : id_;
+    auto start = std::chrono::steady_clock::now();
+    std::optional<std::vector<MaskKey>> keys = agreeMaskKeys(*options.keyExchange, modelID, clientID);
+    if (!keys) {
+        return json();
+    }
 
-    // Delete model from disk
-    deleteFileFromDisk(inModelPath);
-    deleteFileFromDisk(outModelPath);
+    std::string maskedPath = modelPath + ".masked";
+    if (!maskModel(modelPath, maskedPath, *keys, options.fractionalBits)
+            || std::rename(maskedPath.c_str(), modelPath.c_str()) != 0) {
+        std::remove(maskedPath.c_str());
+        return json();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "Masked model update for secure aggregation with " << keys->size() << " other clients in "
+              << elapsed.count() << " ms, kernels: " << fednlib::ops::kernels() << std::endl;
+    std::vector<std::string> clients = {clientID};
+    for (const MaskKey& key : *keys) {
+        clients.push_back(key.peerID);
+    }
+    std::sort(clients.begin(), clients.end());
+    return {
+        {"scheme", "pairwise_masks"},
+        {"key_agreement", "x25519"},
+        {"kdf", "hkdf-sha256"},
+        {"prg", "chacha20"},
+        {"encoding", "fixed_point"},
+        {"fractional_bits", options.fractionalBits},
+        {"round", modelID},
+        {"clients", clients}
+    };
+}
+
+/**
+ * @brief Replaces a trained model by its encoding with a codec pipeline, see
+ * CodecPipeline::encode().
+ * 
+ * Codecs that keep state across rounds, such as the residuals of error feedback, keep it in
+ * the workspace.
+ * 
+ * @param pipeline The pipeline.
+ * @param modelID The ID of the global model.
+ * @param basePath The path to the global model.
+ * @param modelPath The path to the trained model, replaced by its encoding.
+ * @param task The task directory the encoding is written to.
+ * @return The descriptor to send with the model update, null if the model is uploaded as it is.
+ */
+json GrpcClient::encodeUpdate(const CodecPipeline& pipeline, const std::string& modelID, const std::string& basePath, const std::string& modelPath, TaskDirectory& task) {
+    // The encodings are usually much smaller, but a delta may be as large as the model
+    std::error_code error;
+    uint64_t modelSize = std::filesystem::file_size(modelPath, error);
+    if (error || !task.reserve(modelSize)) {
+        std::cerr << "Uploading model update in full, not enough workspace space to encode it with " << pipeline.spec() << std::endl;
+        return json();
+    }
+    CodecContext context;
+    context.baseModelID = modelID;
+    context.basePath = basePath;
+    // Difference whole weights, the words of converted models are narrower
+    if (modelDType_ == DType::F16 || modelDType_ == DType::BF16) {
+        context.wordSize = 2;
+    } else if (modelDType_ == DType::F64) {
+        context.wordSize = 8;
+    }
+    std::shared_ptr<Workspace> workspace = getWorkspace();
+    if (workspace) {
+        context.stateFile = [this, workspace](const std::string& name) {
+            std::filesystem::path path(name);
+            return workspace->stateFile(path.stem().string() + (id_.empty() ? "" : "-" + id_) + path.extension().string());
+        };
+    }
+
+    json descriptor;
+    std::string updatePath = modelPath + ".encoded";
+    if (!pipeline.encode(context, modelPath, updatePath, descriptor)
+            || std::rename(updatePath.c_str(), modelPath.c_str()) != 0) {
+        std::remove(updatePath.c_str());
+        std::cerr << "Uploading model update in full, it could not be encoded with " << pipeline.spec() << std::endl;
+        return json();
+    }
+    std::cout << "Encoded model update against " << modelID << " with " << pipeline.spec() << ": " << modelSize
+              << " -> " << std::filesystem::file_size(modelPath, error) << " bytes" << std::endl;
+    return descriptor;
+}
+
+/**
+ * @brief Returns the codec pipelines to try on a trained model, in order, see
+ * setUpdatePipeline().
+ */
+std::vector<std::shared_ptr<CodecPipeline>> GrpcClient::updatePipelines() const {
+    if (updatePipeline_) {
+        return {updatePipeline_};
+    }
+    std::vector<std::shared_ptr<CodecPipeline>> pipelines;
+    auto add = [&](const std::string& name, const std::map<std::string, std::string>& options) {
+        auto pipeline = std::make_shared<CodecPipeline>();
+        if (pipeline->addStage(name, options)) {
+            pipelines.push_back(pipeline);
+        }
+    };
+    if (modelLowRank_) {
+        add("lowrank", {{"rank", std::to_string(modelLowRank_->rank)}, {"min_elements", std::to_string(modelLowRank_->minElements)}});
+    }
+    if (modelSparsification_) {
+        std::ostringstream ratio;
+        ratio << std::setprecision(17) << modelSparsification_->ratio;
+        add("sparsify", {{"ratio", ratio.str()}});
+    }
+    if (modelQuantization_) {
+        add("quantize", {{"bits", std::to_string(modelQuantization_->bits)}, {"block_size", std::to_string(modelQuantization_->blockSize)}});
+    }
+    if (modelDelta_) {
+        add("delta", {{"mode", deltaModeName(*modelDelta_)}});
+    }
+    return pipelines;
 }
 
 /**
@@ -545,11 +1831,11 @@ void GrpcClient::validate(const std::string& inModelPath, const std::string& out
  * 
  * This function performs the following steps:
  * 1. Downloads the model from the server using the provided model ID.
- * 2. Saves the downloaded model to a temporary file.
+ * 2. Saves the downloaded model to a temporary file in a task directory of the workspace.
  * 3. Validates the model and saves the validation metrics to a file.
  * 4. Reads the validation metrics from the file.
  * 5. Sends the model validation response to the server.
- * 6. Deletes the temporary files (model and metrics) from the disk.
+ * 6. Removes the task directory with the temporary files (model and metrics).
  * 
  * @param modelID The ID of the model to be validated.
  * @param requestData The task request data to be sent along with the validation response via gRPC.
@@ -557,16 +1843,23 @@ void GrpcClient::validate(const std::string& inModelPath, const std::string& out
 void GrpcClient::validateGlobalModel(const std::string& modelID, TaskRequest& requestData) {
     std::cout << "Validating global model: " << modelID << std::endl;
 
-    // Generate random UUIDs for temporary files
-    std::string tempModelFile = generateRandomUUID();
-    std::string tempMetricFile = generateRandomUUID();
+    // The files of the task are kept in a directory of their own, which is removed with them
+    std::shared_ptr<Workspace> workspace = getWorkspace();
+    std::unique_ptr<TaskDirectory> task = workspace ? workspace->createTask("validate") : nullptr;
+    if (!task) {
+        std::cerr << "Skipping validation, could not create a task directory" << std::endl;
+        return;
+    }
     
     // Create file paths
-    std::string modelPath = "./" + tempModelFile + ".bin";
-    std::string metricPath = "./" + tempMetricFile + ".json";
+    std::string modelPath = task->file("model.bin");
+    std::string metricPath = task->file("metrics.json");
 
     // Stream model to file
-    downloadModelToFile(modelID, modelPath);
+    if (!downloadModelToFile(modelID, modelPath, task.get())) {
+        std::cerr << "Skipping validation, could not download model " << modelID << std::endl;
+        return;
+    }
 
     // validate the model
     this->validate(modelPath, metricPath);
@@ -575,12 +1868,15 @@ void GrpcClient::validateGlobalModel(const std::string& modelID, TaskRequest& re
     std::cout << "Loading metric from file: " << metricPath << std::endl;
     json metricData = loadMetricsFromFile(metricPath);
 
-    // Send model validation response to server
-    GrpcClient::sendModelValidation(modelID, metricData, requestData);
+    // Send model validation response to server, or keep it in the outbox
+    std::shared_ptr<Outbox> outbox = getOutbox();
+    if (!GrpcClient::sendModelValidation(modelID, metricData, requestData) && outbox) {
+        json payload = {{"model_id", modelID}, {"data", metricData}, {"session_id", requestData.session_id()}};
+        outbox->put("validation", requestData.session_id(), "", payload);
+        wakeOutbox(false);
+    }
 
-    // Delete temporary files from disk
-    deleteFileFromDisk(metricPath);
-    deleteFileFromDisk(modelPath);
+    // The task directory is removed with the temporary files when it goes out of scope
 }
 
 /**
@@ -597,8 +1893,6 @@ void GrpcClient::predict(const std::string& modelPath, const std::string& output
     // Placeholder for model prediction logic
     std::cout << "Performing model prediction on model: " << modelPath << std::endl;
 
-    std::string modelData = loadModelFromFile(modelPath);
-
     // Mock model prediction data classificaion
     json predictionData = {
         {"prediction", 1},
@@ -614,8 +1908,8 @@ void GrpcClient::predict(const std::string& modelPath, const std::string& output
  *
  * This function downloads a model from the server, saves it to a file, performs
  * prediction using the model, reads the prediction data from a file, and sends the
- * prediction results back to the server. Finally, it cleans up by deleting the
- * model and output files from disk.
+ * prediction results back to the server. The files are kept in a task directory
+ * of the workspace, which is removed with them at the end.
  *
  * @param modelID The identifier of the model to be used for prediction.
  * @param requestData The task request data to be sent along with the prediction results.
@@ -623,16 +1917,23 @@ void GrpcClient::predict(const std::string& modelPath, const std::string& output
 void GrpcClient::predictGlobalModel(const std::string& modelID, TaskRequest& requestData) {
     
 
-    // Generate random UUIDs for temporary files
-    std::string tempModelFile = generateRandomUUID();
-    std::string tempPredictionFile = generateRandomUUID();
+    // The files of the task are kept in a directory of their own, which is removed with them
+    std::shared_ptr<Workspace> workspace = getWorkspace();
+    std::unique_ptr<TaskDirectory> task = workspace ? workspace->createTask("predict") : nullptr;
+    if (!task) {
+        std::cerr << "Skipping prediction, could not create a task directory" << std::endl;
+        return;
+    }
     
     // Create file paths
-    std::string modelPath = "./" + tempModelFile + ".bin";
-    std::string predictionPath = "./" + tempPredictionFile + ".json";
+    std::string modelPath = task->file("model.bin");
+    std::string predictionPath = task->file("prediction.json");
 
     // Stream model to file
-    downloadModelToFile(modelID, modelPath);
+    if (!downloadModelToFile(modelID, modelPath, task.get())) {
+        std::cerr << "Skipping prediction, could not download model " << modelID << std::endl;
+        return;
+    }
 
     // Perform model prediction
     this->predict(modelPath, predictionPath);
@@ -641,12 +1942,15 @@ void GrpcClient::predictGlobalModel(const std::string& modelID, TaskRequest& req
     std::cout << "Loading prediction data from file: " << predictionPath << std::endl;
     json predictionData = loadMetricsFromFile(predictionPath);
 
-    // Send model prediction response to server
-    GrpcClient::sendModelPrediction(modelID, predictionData, requestData);
+    // Send model prediction response to server, or keep it in the outbox
+    std::shared_ptr<Outbox> outbox = getOutbox();
+    if (!GrpcClient::sendModelPrediction(modelID, predictionData, requestData) && outbox) {
+        json payload = {{"model_id", modelID}, {"data", predictionData}, {"session_id", requestData.session_id()}};
+        outbox->put("prediction", requestData.session_id(), "", payload);
+        wakeOutbox(false);
+    }
 
-    // Delete temporary files from disk
-    deleteFileFromDisk(modelPath);
-    deleteFileFromDisk(predictionPath);
+    // The task directory is removed with the temporary files when it goes out of scope
 }
 
 /**
@@ -659,40 +1963,55 @@ void GrpcClient::predictGlobalModel(const std::string& modelID, TaskRequest& req
  * @param modelID The ID of the model being updated.
  * @param modelUpdateID The ID of the model update.
  * @param config The configuration string for the model update.
+ * @param encoding How the uploaded model is encoded, null if it is uploaded as trained.
+ * @param partial The manifest of a partial update, see partial.h, null for the whole model.
+ * @param privacy The differential privacy parameters the update was made private with, null if it was not.
+ * @param secureAggregation How the update was masked for secure aggregation, null if it was not.
+ * @return true if the combiner received the model update, false otherwise.
  */
-void GrpcClient::sendModelUpdate(const std::string& modelID, std::string& modelUpdateID, const std::string& config) {
+bool GrpcClient::sendModelUpdate(const std::string& modelID, std::string& modelUpdateID, const std::string& config, const json& encoding,
+        const json& partial, const json& privacy, const json& secureAggregation) {
     // Send model update response to server
-    Client client;
-    client.set_name(name_);
-    client.set_role(CLIENT);
-    client.set_client_id(id_);
-
-    
-    ModelUpdate modelUpdate;
+    RpcArena arena;
+    ModelUpdate& modelUpdate = *arena.create<ModelUpdate>();
     
-    modelUpdate.set_allocated_sender(&client);
+    modelUpdate.unsafe_arena_set_allocated_sender(&sender_);
     modelUpdate.set_model_update_id(modelUpdateID);
     modelUpdate.set_model_id(modelID);
 
     // get current date and time to string
     time_t now = time(0);
-    tm *ltm = localtime(&now);
-    std::stringstream ss;
-    ss << std::put_time(ltm, "%Y-%m-%d %H:%M:%S");
-    std::string timeString = ss.str();
+    tm ltm;
+    localtime_r(&now, &ltm);
+    char timeString[32];
+    strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", &ltm);
     modelUpdate.set_timestamp(timeString);
 
     // TODO: get metadata from train function
-    // string as json
-    std::ostringstream oss;
-    std::string metadata = "{\"training_metadata\": {\"epochs\": 1, \"batch_size\": 1, \"num_examples\": 3000}}";
-    modelUpdate.set_meta(metadata);
+    json meta = {{"training_metadata", {{"epochs", 1}, {"batch_size", 1}, {"num_examples", 3000}}}};
+    // Tell the combiner how to decode an encoded model, e.g. a delta against modelID
+    if (!encoding.is_null()) {
+        meta["update_encoding"] = encoding;
+    }
+    // and that the decoded model holds only some tensors, merged into the global model
+    if (!partial.is_null()) {
+        meta["partial_update"] = partial;
+    }
+    // Record how the update was made private, for the privacy accounting of the server
+    if (!privacy.is_null()) {
+        meta["differential_privacy"] = privacy;
+    }
+    // and that it must be summed with the other masked updates of the round to be read
+    if (!secureAggregation.is_null()) {
+        meta["secure_aggregation"] = secureAggregation;
+    }
+    modelUpdate.set_meta(meta.dump());
     modelUpdate.set_config(config);
 
     // The actual RPC.
     ClientContext context;
-    Response response;
-    Status status = combinerStub_->SendModelUpdate(&context, modelUpdate, &response);
+    Response& response = *arena.create<Response>();
+    Status status = getCombinerStub()->SendModelUpdate(&context, modelUpdate, &response);
     std::cout << "sendModelUpdate: " << modelUpdate.model_id() << std::endl;
 
     if (!status.ok()) {
@@ -704,8 +2023,7 @@ void GrpcClient::sendModelUpdate(const std::string& modelID, std::string& modelU
     else {
       std::cout << "sendModelUpdate: Response: " << response.response() << std::endl;
     }
-    // Garbage collect the client object.
-    Client *clientCollect = modelUpdate.release_sender();
+    return status.ok();
 }
 
 /**
@@ -718,25 +2036,20 @@ void GrpcClient::sendModelUpdate(const std::string& modelID, std::string& modelU
  * @param modelID The ID of the model being validated.
  * @param metricData A JSON object containing the metric data for the model validation.
  * @param requestData A TaskRequest object containing the session ID and other request data.
+ * @return true if the combiner received the validation, false otherwise.
  */
-void GrpcClient::sendModelValidation(const std::string& modelID, json& metricData, TaskRequest& requestData) {
+bool GrpcClient::sendModelValidation(const std::string& modelID, json& metricData, TaskRequest& requestData) {
     // Send model validation response to server
-    Client client;
-    client.set_name(name_);
-    client.set_role(CLIENT);
-    client.set_client_id(id_);
-
-    ModelValidation validation;
-    validation.set_allocated_sender(&client);
+    RpcArena arena;
+    ModelValidation& validation = *arena.create<ModelValidation>();
+    validation.unsafe_arena_set_allocated_sender(&sender_);
     validation.set_model_id(modelID);
     validation.set_data(metricData.dump());
     validation.set_session_id(requestData.session_id());
 
     // TODO: get metadata from train function
     // string as json
-    std::ostringstream oss;
-    std::string metadata = "{\"validation_metadata\": {\"num_examples\": 3000}}";
-    validation.set_meta(metadata);
+    validation.set_meta("{\"validation_metadata\": {\"num_examples\": 3000}}");
     
     // get current date and time
     google::protobuf::Timestamp* timestamp = validation.mutable_timestamp();
@@ -750,8 +2063,8 @@ void GrpcClient::sendModelValidation(const std::string& modelID, json& metricDat
 
     // The actual RPC.
     ClientContext context;
-    Response response;
-    Status status = combinerStub_->SendModelValidation(&context, validation, &response);
+    Response& response = *arena.create<Response>();
+    Status status = getCombinerStub()->SendModelValidation(&context, validation, &response);
     std::cout << "sendModelValidation: " << validation.model_id() << std::endl;
 
     if (!status.ok()) {
@@ -763,8 +2076,7 @@ void GrpcClient::sendModelValidation(const std::string& modelID, json& metricDat
     else {
       std::cout << "sendModelValidation: Response: " << response.response() << std::endl;
     }
-    // Garbage collect the client object.
-    Client *clientCollect = validation.release_sender();
+    return status.ok();
 }
 
 /**
@@ -776,26 +2088,21 @@ void GrpcClient::sendModelValidation(const std::string& modelID, json& metricDat
  * @param modelID The ID of the model for which the prediction is being sent.
  * @param predictionData The prediction data in JSON format.
  * @param requestData The task request data containing session information.
+ * @return true if the combiner received the prediction, false otherwise.
  */
-void GrpcClient::sendModelPrediction(const std::string& modelID, json& predictionData, TaskRequest& requestData) {
+bool GrpcClient::sendModelPrediction(const std::string& modelID, json& predictionData, TaskRequest& requestData) {
     // Send model prediction response to server
-    Client client;
-    client.set_name(name_);
-    client.set_role(CLIENT);
-    client.set_client_id(id_);
+    RpcArena arena;
+    ModelPrediction& prediction = *arena.create<ModelPrediction>();
 
-    ModelPrediction prediction;
-
-    // Pass ownership of client to protobuf message
-    prediction.set_allocated_sender(&client);
+    // The sender is shared and not owned by the message
+    prediction.unsafe_arena_set_allocated_sender(&sender_);
     prediction.set_model_id(modelID);
     prediction.set_data(predictionData.dump());
     prediction.set_prediction_id(requestData.session_id());
 
     // string as json
-    std::ostringstream oss;
-    std::string metadata = "{\"prediction_metadata\": {\"num_examples\": 3000}}";
-    prediction.set_meta(metadata);
+    prediction.set_meta("{\"prediction_metadata\": {\"num_examples\": 3000}}");
     
     // get current date and time
     google::protobuf::Timestamp* timestamp = prediction.mutable_timestamp();
@@ -809,8 +2116,8 @@ void GrpcClient::sendModelPrediction(const std::string& modelID, json& predictio
 
     // The actual RPC.
     ClientContext context;
-    Response response;
-    Status status = combinerStub_->SendModelPrediction(&context, prediction, &response);
+    Response& response = *arena.create<Response>();
+    Status status = getCombinerStub()->SendModelPrediction(&context, prediction, &response);
     std::cout << "sendModelPrediction: " << prediction.model_id() << std::endl;
 
     if (!status.ok()) {
@@ -822,30 +2129,35 @@ void GrpcClient::sendModelPrediction(const std::string& modelID, json& predictio
     else {
       std::cout << "sendModelPrediction: Response: " << response.response() << std::endl;
     }
-    // Get the ownership of the client object back so it is deleted correctly at end of scope
-    Client *clientCollect = prediction.release_sender();    
+    return status.ok();
 }
 
 /**
  * @brief Sets the name for the GrpcClient.
  * 
  * This function assigns the provided name to the GrpcClient instance.
+ * It also updates the sender identity that is shared by all outgoing messages, so it
+ * must not be called while RPCs are in flight.
  * 
  * @param name The name to be set for the GrpcClient.
  */
 void GrpcClient::setName(const std::string& name) {
     name_ = name;
+    sender_.set_name(name);
 }
 
 /**
  * @brief Sets the ID for the GrpcClient.
  * 
  * This function assigns the provided ID to the GrpcClient instance.
+ * It also updates the sender identity that is shared by all outgoing messages, so it
+ * must not be called while RPCs are in flight.
  * 
  * @param id The ID to be set for the GrpcClient.
  */
 void GrpcClient::setId(const std::string& id) {
     id_ = id;
+    sender_.set_client_id(id);
 }
 
 /**
@@ -860,6 +2172,181 @@ void GrpcClient::setChunkSize(std::size_t chunkSize) {
     this->chunkSize = chunkSize;
 }
 
+/**
+ * @brief Sets how many times a broken model download or upload is resumed before giving up.
+ * 
+ * @param transferRetries The number of retries, 0 disables resuming.
+ */
+void GrpcClient::setTransferRetries(int transferRetries) {
+    transferRetries_ = transferRetries;
+}
+
+/**
+ * @brief Sets whether models are transferred without copying them through protobuf messages.
+ * 
+ * When enabled, model chunks are sent from a memory mapping of the model file and received
+ * as views of the gRPC buffers, see RawModelTransfer. The messages on the wire are the same.
+ * 
+ * @param zeroCopyTransfer true to use RawModelTransfer, false to use the generated ModelService stub.
+ */
+void GrpcClient::setZeroCopyTransfer(bool zeroCopyTransfer) {
+    zeroCopyTransfer_ = zeroCopyTransfer;
+}
+
+/**
+ * @brief Sets whether uploads from files send only the chunks the server does not already
+ * hold, see uploadDeduplicated(). Servers that do not support it get the whole model.
+ */
+void GrpcClient::setDedupUploads(bool dedupUploads) {
+    dedupUploads_ = dedupUploads;
+}
+
+/**
+ * @brief Sets whether the updates of trained models are clipped and noised for differential
+ * privacy before they leave the client, see privatizeUpdate(). Updates that cannot be made
+ * private, e.g. models that are not tensor containers, are not uploaded.
+ * 
+ * @param privacy The clipping norm and the noise multiplier, std::nullopt to upload updates as trained.
+ */
+void GrpcClient::setPrivacy(std::optional<PrivacyOptions> privacy) {
+    privacy_ = privacy;
+}
+
+/**
+ * @brief Sets whether the updates of trained models are masked for secure aggregation, see
+ * secagg.h, so the combiner can read only the sum of the updates of a round. Masked updates
+ * are not converted or encoded, and updates that cannot be masked, e.g. if the key exchange
+ * times out, are not uploaded. Enable it only with a combiner that sums masked updates.
+ * 
+ * @param secureAggregation The key exchange and the fixed-point encoding, std::nullopt to upload updates unmasked.
+ */
+void GrpcClient::setSecureAggregation(std::optional<SecureAggregationOptions> secureAggregation) {
+    secureAggregation_ = secureAggregation;
+}
+
+/**
+ * @brief Sets whether trained models are uploaded as partial updates of the tensors the train
+ * hook declares it modified, see setModifiedTensors() and partial.h. Enable it only with a
+ * combiner that merges partial updates.
+ */
+void GrpcClient::setPartialUpdates(bool partialUpdates) {
+    partialUpdates_ = partialUpdates;
+}
+
+/**
+ * @brief Declares, from the train hook, the tensors training modified, e.g. the last layers
+ * when fine-tuning. With partial updates enabled only these are uploaded, see
+ * setPartialUpdates(). The declaration is cleared before every round of training.
+ */
+void GrpcClient::setModifiedTensors(const std::vector<std::string>& tensorNames) {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    modifiedTensors_ = tensorNames;
+}
+
+/**
+ * @brief Sets the tensors training needs, which are the only ones downloaded of the global
+ * model from a server that supports it, see downloadModelToFile(). The train hook then gets a
+ * partial model, see partial.h, and the trained model is uploaded as a partial update. Empty
+ * for the whole model.
+ */
+void GrpcClient::setRequiredTensors(const std::vector<std::string>& tensorNames) {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    requiredTensors_ = tensorNames;
+}
+
+/**
+ * @brief Returns the tensors training needs, see setRequiredTensors().
+ */
+std::vector<std::string> GrpcClient::getRequiredTensors() {
+    std::lock_guard<std::mutex> lock(taskMutex_);
+    return requiredTensors_;
+}
+
+/**
+ * @brief Sets the dtype in which the floating point tensors of trained models are uploaded.
+ * 
+ * Only models written as fednlib tensor containers are converted, see convertContainerFile().
+ * The container records the dtype of every tensor, so receivers convert back as needed.
+ * 
+ * @param modelDType float32, bfloat16 or float16 to shrink uploads, std::nullopt to upload models as trained.
+ */
+void GrpcClient::setModelDType(std::optional<DType> modelDType) {
+    modelDType_ = modelDType;
+}
+
+/**
+ * @brief Sets whether trained models are uploaded as deltas against the global model they
+ * were trained from.
+ * 
+ * The delta is uploaded only if it is smaller than the model, and the model update names
+ * the global model and the encoding in its metadata, see encodeModelDelta().
+ * 
+ * @param modelDelta The delta mode, std::nullopt to upload models in full.
+ */
+void GrpcClient::setModelDelta(std::optional<DeltaMode> modelDelta) {
+    modelDelta_ = modelDelta;
+}
+
+/**
+ * @brief Sets whether trained models are uploaded as quantized updates against the global
+ * model they were trained from.
+ * 
+ * Only models written as fednlib tensor containers are quantized, see quantizeUpdate(). The
+ * model update names the global model and the quantization in its metadata, and receivers
+ * reconstruct the model with dequantizeUpdate(). Quantization is tried before setModelDelta().
+ * 
+ * @param modelQuantization The bits and block size, std::nullopt to upload models in full.
+ */
+void GrpcClient::setModelQuantization(std::optional<QuantizeOptions> modelQuantization) {
+    modelQuantization_ = modelQuantization;
+}
+
+/**
+ * @brief Sets whether trained models are uploaded as the largest entries of their update
+ * against the global model they were trained from.
+ * 
+ * Only models written as fednlib tensor containers are sparsified, see sparsifyUpdate(). The
+ * model update names the global model and the ratio in its metadata, and receivers
+ * reconstruct the model with densifyUpdate(). Sparsification is tried after setModelLowRank(),
+ * before setModelQuantization() and setModelDelta().
+ * 
+ * @param modelSparsification The fraction of the weights to send, std::nullopt to upload models in full.
+ */
+void GrpcClient::setModelSparsification(std::optional<SparsifyOptions> modelSparsification) {
+    modelSparsification_ = modelSparsification;
+}
+
+/**
+ * @brief Sets the codec pipeline that trained models are encoded with before they are
+ * uploaded, e.g. parsed from the update_pipeline setting.
+ * 
+ * The model update carries the descriptor of the pipeline in its metadata, and receivers
+ * reconstruct the model with CodecPipeline::decode(). If the pipeline fails, the model is
+ * uploaded in full. A pipeline replaces the codecs set with setModelLowRank(),
+ * setModelSparsification(), setModelQuantization() and setModelDelta(), which are tried one
+ * after the other.
+ * 
+ * @param pipeline The pipeline, nullptr to use the single codecs.
+ */
+void GrpcClient::setUpdatePipeline(std::shared_ptr<CodecPipeline> pipeline) {
+    updatePipeline_ = pipeline;
+}
+
+/**
+ * @brief Sets whether trained models are uploaded as low-rank factors of their update
+ * against the global model they were trained from.
+ * 
+ * Only models written as fednlib tensor containers are compressed, see lowRankUpdate(). The
+ * model update names the global model and reports the compression and the error of the
+ * approximation in its metadata, and receivers reconstruct the model with
+ * expandLowRankUpdate(). Low-rank compression is tried before the other codecs.
+ * 
+ * @param modelLowRank The rank and the size of the smallest tensor to factor, std::nullopt to upload models in full.
+ */
+void GrpcClient::setModelLowRank(std::optional<LowRankOptions> modelLowRank) {
+    modelLowRank_ = modelLowRank;
+}
+
 /**
  * @brief Retrieves the size of the chunk.
  * 
@@ -902,7 +2389,16 @@ bool GrpcClient::logMetrics(const std::map<std::string, float>& metrics, const s
         loggingContext.incrementStep();
     }
 
-    return this->sendModelMetrics(metrics, this->name_, this->id_, modelId, roundId, sessionId, loggingStep);
+    bool sent = this->sendModelMetrics(metrics, this->name_, this->id_, modelId, roundId, sessionId, loggingStep);
+
+    // Keep the metrics in the outbox, they are sent again once the combiner is reachable
+    std::shared_ptr<Outbox> outbox = getOutbox();
+    if (!sent && outbox) {
+        json payload = {{"metrics", metrics}, {"model_id", modelId}, {"round_id", roundId}, {"session_id", sessionId}, {"step", loggingStep}};
+        outbox->put("metrics", sessionId, roundId, payload);
+        wakeOutbox(false);
+    }
+    return sent;
 }
 
 bool GrpcClient::sendModelMetrics(const std::map<std::string, float>& metrics, 
@@ -912,11 +2408,16 @@ bool GrpcClient::sendModelMetrics(const std::map<std::string, float>& metrics,
         const std::string& roundID, 
         const std::string& sessionID, 
         const int step){
-    ModelMetric modelMetric;
-    Client* client = modelMetric.mutable_sender();
-    client->set_name(name);
-    client->set_role(CLIENT);
-    client->set_client_id(client_id);
+    RpcArena arena;
+    ModelMetric& modelMetric = *arena.create<ModelMetric>();
+    if (name == name_ && client_id == id_) {
+        modelMetric.unsafe_arena_set_allocated_sender(&sender_);
+    } else {
+        Client* client = modelMetric.mutable_sender();
+        client->set_name(name);
+        client->set_role(CLIENT);
+        client->set_client_id(client_id);
+    }
     modelMetric.set_model_id(modelID);
     modelMetric.set_round_id(roundID);
     modelMetric.set_session_id(sessionID);
@@ -935,8 +2436,8 @@ bool GrpcClient::sendModelMetrics(const std::map<std::string, float>& metrics,
     }
 
     ClientContext context;
-    Response response;
-    Status status = combinerStub_->SendModelMetric(&context, modelMetric, &response);
+    Response& response = *arena.create<Response>();
+    Status status = getCombinerStub()->SendModelMetric(&context, modelMetric, &response);
     std::cout << "sendModelMetrics: " << modelMetric.model_id() << std::endl;
 
     if (!status.ok()) {
@@ -953,11 +2454,9 @@ bool GrpcClient::sendModelMetrics(const std::map<std::string, float>& metrics,
 }
 
 bool GrpcClient::logAttributes(const std::map<std::string, std::string>& attributes){
-    AttributeMessage attributeMessage;
-    Client* client = attributeMessage.mutable_sender();
-    client->set_name(name_);
-    client->set_role(CLIENT);
-    client->set_client_id(id_);
+    RpcArena arena;
+    AttributeMessage& attributeMessage = *arena.create<AttributeMessage>();
+    attributeMessage.unsafe_arena_set_allocated_sender(&sender_);
 
     google::protobuf::Timestamp* timestamp = attributeMessage.mutable_timestamp();
     auto now = std::chrono::system_clock::now();
@@ -972,8 +2471,8 @@ bool GrpcClient::logAttributes(const std::map<std::string, std::string>& attribu
     }
 
     ClientContext context;
-    Response response;
-    Status status = combinerStub_->SendAttributeMessage(&context, attributeMessage, &response);
+    Response& response = *arena.create<Response>();
+    Status status = getCombinerStub()->SendAttributeMessage(&context, attributeMessage, &response);
 
     if (!status.ok()) {
         std::cout << "sendModelMetrics: failed" << std::endl;
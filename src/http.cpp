@@ -1,5 +1,9 @@
 #include <iostream>
 #include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
 
 #include "../include/fednlib/http.h"
 #include "../include/fednlib/utils.h"
@@ -8,31 +12,142 @@
  * @brief Constructs a new HttpClient object.
  * 
  * Initializes the HttpClient with the specified API URL and optional token.
- * Also initializes the libcurl library for HTTP requests.
+ * A single libcurl easy handle is created and configured once, so that the
+ * connection, TLS session and DNS cache are reused between requests. The
+ * request headers, including the authorization header, are also built once
+ * here and freed in the destructor.
  * 
  * @param apiUrl The base URL of the API to interact with.
  * @param token (Optional) The authentication token for the API.
  * 
  * @throws std::runtime_error If libcurl initialization fails.
  */
-HttpClient::HttpClient(const std::string& apiUrl, const std::string& token = "") : apiUrl(apiUrl), token(token) {
+HttpClient::HttpClient(const std::string& apiUrl, const std::string& token = "") 
+    : curl(nullptr), headers(nullptr), apiUrl(apiUrl), token(token),
+      connectTimeoutMs(5000), requestTimeoutMs(30000), maxRetries(5) {
     curl = curl_easy_init();
     if (!curl) {
         std::cerr << "Error initializing libcurl." << std::endl;
         std::exit(1);
     }
+
+    // Set the Content-Type header
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    // Get Environment variable for token scheme
+    char* token_scheme;
+    token_scheme = std::getenv("FEDN_AUTH_SCHEME");
+    if (token_scheme == NULL) {
+        token_scheme = (char*) "Bearer";
+    }
+    std::string fillString = token_scheme + (std::string) " ";
+
+    // Set the token as a header if it's provided
+    if (!token.empty()) {
+        headers = curl_slist_append(headers, ("Authorization: " + fillString + token).c_str());
+    }
+
+    // Options that stay the same for every request made with this handle
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeHttpResponseToString);
+    // allow all redirects
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // Prefer HTTP/2 over TLS, falls back to HTTP/1.1 if the server does not support it
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    // Keep the connection alive between requests
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 60L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 30L);
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+    // Cache resolved host names for 10 minutes
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+    // Required for timeouts to be safe in multi-threaded programs
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 }
 
 /**
  * @brief Destructor for the HttpClient class.
  *
- * This destructor cleans up the CURL handle if it has been initialized.
- * It ensures that any resources allocated by CURL are properly released.
+ * This destructor cleans up the CURL handle and the request headers if they
+ * have been initialized. It ensures that any resources allocated by CURL are
+ * properly released.
  */
 HttpClient::~HttpClient() {
     if (curl) {
         curl_easy_cleanup(curl);
     }
+    if (headers) {
+        curl_slist_free_all(headers);
+    }
+}
+
+/**
+ * @brief Sends a POST request with retries.
+ *
+ * The request is retried on transport errors, on HTTP 429 and on HTTP 5xx
+ * responses, up to the configured number of retries. Between attempts the
+ * client sleeps for a random delay drawn from an exponentially growing window
+ * (full jitter), or for the delay given by the server in a Retry-After header.
+ * This keeps a fleet of clients that restart at the same time from hammering
+ * the controller in lockstep.
+ *
+ * @param url The URL to send the request to.
+ * @param body The JSON request body.
+ * @param responseData Output string for the response body of the last attempt.
+ * @param statusCode Output HTTP status code of the last attempt.
+ * @return true if a response was received without transport errors, false otherwise.
+ */
+bool HttpClient::post(const std::string& url, const std::string& body, std::string& responseData, long& statusCode) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    const long baseDelayMs = 500;
+    const long maxDelayMs = 30000;
+
+    std::unique_lock<std::mutex> lock(curlMutex);
+    for (int attempt = 0; ; ++attempt) {
+        responseData.clear();
+        statusCode = 0;
+
+        // Set on every attempt, another request may have used the handle during the backoff
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) body.size());
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connectTimeoutMs);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, requestTimeoutMs);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseData);
+
+        // Perform the HTTP POST request
+        CURLcode res = curl_easy_perform(curl);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &statusCode);
+
+        bool retryable;
+        if (res != CURLE_OK) {
+            std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
+            retryable = true;
+        } else {
+            retryable = statusCode == 429 || statusCode >= 500;
+        }
+        if (!retryable) {
+            return true;
+        }
+        if (attempt >= maxRetries) {
+            return res == CURLE_OK;
+        }
+
+        // Full jitter: sleep a random time in [0, min(max, base * 2^attempt)]
+        long window = std::min(maxDelayMs, baseDelayMs << std::min(attempt, 16));
+        long delayMs = std::uniform_int_distribution<long>(0, window)(gen);
+        curl_off_t retryAfter = 0;
+        if (res == CURLE_OK && curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retryAfter) == CURLE_OK && retryAfter > 0) {
+            delayMs = std::min<long>(retryAfter * 1000, maxDelayMs) + delayMs / 10;
+        }
+        std::cerr << "Request to " << url << " failed (HTTP " << statusCode << "), retrying in " 
+                  << delayMs << " ms (attempt " << attempt + 1 << "/" << maxRetries << ")" << std::endl;
+        // Other requests and the setters are not held up by the backoff
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+        lock.lock();
+    }
 }
 
 /**
@@ -41,7 +156,8 @@ HttpClient::~HttpClient() {
  * This function sends a POST request to the /add_client endpoint of the API,
  * with the client configuration provided in the controllerConfig map. The
  * request body is formatted as JSON and includes the client_id, name, package,
- * and preferred_combiner fields.
+ * and preferred_combiner fields. Failed requests are retried with jittered
+ * backoff, see HttpClient::post.
  *
  * @param controllerConfig A map containing the client configuration.
  *
@@ -69,45 +185,14 @@ json HttpClient::assign(std::map<std::string, std::string> controllerConfig) {
     // add endpoint api/v1/clients/add to the apiUrl
     const std::string addClientApiUrl = httpProtocol + apiUrl + "/api/v1/clients/add";
 
-    // Set libcurl options for the POST request
-    curl_easy_setopt(curl, CURLOPT_URL, addClientApiUrl.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonData.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeHttpResponseToString);
-    // allow all redirects
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-
-    // Set the Content-Type header
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-
-    // Get Environment variable for token scheme
-    char* token_scheme;
-    token_scheme = std::getenv("FEDN_AUTH_SCHEME");
-    if (token_scheme == NULL) {
-        token_scheme = (char*) "Bearer";
-    }
-    std::string fillString = token_scheme + (std::string) " ";
-
-    // Set the token as a header if it's provided
-    if (!token.empty()) {
-        headers = curl_slist_append(headers, ("Authorization: " + fillString + token).c_str());
-    }
-
-    // Set the headers for the POST request
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-
     // Response data will be stored here
     std::string responseData;
-
-    // Set the response data string as the write callback parameter
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseData);
+    long statusCode = 0;
 
     // Perform the HTTP POST request
-    CURLcode res = curl_easy_perform(curl);
-
-    // Get status code
-    long statusCode;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &statusCode);
+    if (!post(addClientApiUrl, jsonData, responseData, statusCode)) {
+        return json(); // Return an empty JSON object in case of an error
+    }
 
     // Check for HTTP errors
     if (statusCode < 200 || statusCode >= 300){
@@ -115,12 +200,6 @@ json HttpClient::assign(std::map<std::string, std::string> controllerConfig) {
         return json(); // Return an empty JSON object in case of an error
     }
 
-    // Check for errors
-    if (res != CURLE_OK) {
-        std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-        return json(); // Return an empty JSON object in case of an error
-    }
-
     // Parse and return the response JSON
     try {
         if (!responseData.empty() && responseData[0] == '{') {
@@ -147,4 +226,34 @@ json HttpClient::assign(std::map<std::string, std::string> controllerConfig) {
  */
 std::string HttpClient::getToken() {
     return token;
+}
+
+/**
+ * @brief Sets the connect timeout for requests to the controller.
+ * 
+ * @param connectTimeoutMs The maximum time in milliseconds to wait for a connection.
+ */
+void HttpClient::setConnectTimeout(long connectTimeoutMs) {
+    std::lock_guard<std::mutex> lock(curlMutex);
+    this->connectTimeoutMs = connectTimeoutMs;
+}
+
+/**
+ * @brief Sets the total timeout for a single request attempt to the controller.
+ * 
+ * @param requestTimeoutMs The maximum time in milliseconds a request attempt may take.
+ */
+void HttpClient::setRequestTimeout(long requestTimeoutMs) {
+    std::lock_guard<std::mutex> lock(curlMutex);
+    this->requestTimeoutMs = requestTimeoutMs;
+}
+
+/**
+ * @brief Sets the number of times a failed request is retried.
+ * 
+ * @param maxRetries The maximum number of retries, 0 disables retries.
+ */
+void HttpClient::setMaxRetries(int maxRetries) {
+    std::lock_guard<std::mutex> lock(curlMutex);
+    this->maxRetries = maxRetries;
 }
\ No newline at end of file
@@ -0,0 +1,318 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <set>
+#include <random>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+
+#include "../include/fednlib/lowrank.h"
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/convert.h"
+#include "../include/fednlib/ops.h"
+
+using json = nlohmann::json;
+
+namespace {
+
+const char kManifestName[] = "__lowrank__";
+const char kPSuffix[] = ".p";
+const char kQSuffix[] = ".q";
+// Copies a float32 tensor of the state if it has the given number of elements
+bool readState(const TensorReader* state, const std::string& name, size_t count, std::vector<float>& values) {
+    const TensorInfo* tensor = state ? state->find(name) : nullptr;
+    if (!tensor || tensor->dtype != DType::F32 || tensor->elements() != count) {
+        return false;
+    }
+    values.resize(count);
+    memcpy(values.data(), state->bytes(*tensor).data(), count * sizeof(float));
+    return true;
+}
+
+// Orthonormalizes the vectors with Gram-Schmidt. Vectors that are left with next to nothing
+// become zero: what is left of a vector in the span of the others is rounding error, which
+// would not be orthogonal to them once scaled up, e.g. for an update of lower rank than the
+// factors.
+void orthonormalize(float* vectors, size_t count, size_t length) {
+    for (size_t c = 0; c < count; c++) {
+        float* v = vectors + c * length;
+        double before = fednlib::ops::l2Norm(v, length);
+        for (size_t d = 0; d < c; d++) {
+            const float* u = vectors + d * length;
+            fednlib::ops::axpy(-static_cast<float>(fednlib::ops::dot(v, u, length)), u, v, length);
+        }
+        double norm = fednlib::ops::l2Norm(v, length);
+        fednlib::ops::scale(norm > 1e-4 * before && norm > 1e-30 ? static_cast<float>(1.0 / norm) : 0.0f, v, length);
+    }
+}
+
+} // namespace
+
+/**
+ * @brief Compresses the update from a base model to a trained model to low-rank factors.
+ *
+ * @param modelPath The path to the trained model, a tensor container.
+ * @param basePath The path to the model it was trained from.
+ * @param statePath The path to the factors and the residual of the previous round, which is
+ *        replaced by those of this round, or empty to start over every round. A missing file
+ *        or tensor starts over.
+ * @param updatePath The path to write the compressed update to.
+ * @param options The rank and the size of the smallest tensor to factor.
+ * @param report Set to the number of tensors factored and the error of the approximation.
+ * @return true if the update was written, false otherwise, e.g. if it is not finite.
+ */
+bool lowRankUpdate(const std::string& modelPath, const std::string& basePath, const std::string& statePath,
+        const std::string& updatePath, const LowRankOptions& options, LowRankReport* report) {
+    if (options.rank == 0) {
+        std::cerr << "Cannot compress to rank 0" << std::endl;
+        return false;
+    }
+    std::shared_ptr<TensorReader> model = TensorReader::open(modelPath);
+    std::shared_ptr<TensorReader> base = TensorReader::open(basePath);
+    if (!model || !base) {
+        return false;
+    }
+    // A state that cannot be read is started over
+    std::shared_ptr<TensorReader> state;
+    std::error_code error;
+    if (!statePath.empty() && std::filesystem::exists(statePath, error)) {
+        state = TensorReader::open(statePath);
+    }
+
+    std::string newStatePath = statePath + ".new";
+    TensorWriter writer;
+    TensorWriter stateWriter;
+    bool ok = writer.open(updatePath) && (statePath.empty() || stateWriter.open(newStatePath));
+    json manifest = {
+        {"version", kManifestVersion},
+        {"tensors", json::object()}
+    };
+
+    LowRankReport result;
+    double missed = 0;
+    double total = 0;
+    std::vector<float> update;
+    std::vector<float> baseValues;
+    std::vector<float> carried;
+    std::vector<float> p;
+    std::vector<float> q;
+    for (const TensorInfo& tensor : model->tensors()) {
+        if (!ok) {
+            break;
+        }
+        const TensorInfo* baseTensor = base->find(tensor.name);
+        if (!isFloatDType(tensor.dtype) || !baseTensor || !isFloatDType(baseTensor->dtype)
+                || baseTensor->elements() != tensor.elements()) {
+            TensorSpan<const uint8_t> bytes = model->bytes(tensor);
+            ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+        size_t count = tensor.elements();
+        ok = model->readFloats(tensor, update) && base->readFloats(*baseTensor, baseValues);
+        if (!ok) {
+            break;
+        }
+        fednlib::ops::sub(update.data(), baseValues.data(), update.data(), count);
+        if (readState(state.get(), tensor.name, count, carried)) {
+            fednlib::ops::axpy(1.0f, carried.data(), update.data(), count);
+        }
+        if (!fednlib::ops::allFinite(update.data(), count)) {
+            std::cerr << "Cannot compress the update of tensor " << tensor.name << ", it is not finite" << std::endl;
+            ok = false;
+            break;
+        }
+
+        size_t rows = tensor.shape.size() >= 2 ? tensor.shape[0] : 0;
+        size_t cols = rows > 0 ? count / rows : 0;
+        size_t rank = std::min<size_t>({options.rank, rows, cols});
+        if (tensor.shape.size() < 2 || count < options.minElements || rank * (rows + cols) >= count) {
+            ok = writer.add(tensor.name, DType::F32, tensor.shape, update.data(), count * sizeof(float));
+            manifest["tensors"][tensor.name] = {{"dtype", dtypeName(tensor.dtype)}, {"shape", tensor.shape}, {"rank", 0}};
+            result.raw++;
+            continue;
+        }
+
+        // Warm start from the previous Q, or from random vectors
+        std::mt19937 random(crc32c(0, tensor.name.data(), tensor.name.size()));
+        std::normal_distribution<float> normal;
+        if (!readState(state.get(), tensor.name + kQSuffix, rank * cols, q)) {
+            q.assign(rank * cols, 0.0f);
+        }
+        for (size_t c = 0; c < rank; c++) {
+            float* v = q.data() + c * cols;
+            if (fednlib::ops::maxAbs(v, cols) == 0) {
+                std::generate(v, v + cols, [&] { return normal(random); });
+            }
+        }
+        p.resize(rank * rows);
+        fednlib::ops::multiply(update.data(), rows, cols, q.data(), rank, p.data());
+        orthonormalize(p.data(), rank, rows);
+        fednlib::ops::multiplyTransposed(update.data(), rows, cols, p.data(), rank, q.data());
+
+        double norm = fednlib::ops::l2Norm(update.data(), count);
+        fednlib::ops::addOuter(-1.0f, p.data(), q.data(), rank, update.data(), rows, cols);
+        double residual = fednlib::ops::l2Norm(update.data(), count);
+        total += norm * norm;
+        missed += residual * residual;
+        result.factored++;
+
+        ok = writer.add(tensor.name + kPSuffix, DType::F32, {rank, rows}, p.data(), p.size() * sizeof(float))
+            && writer.add(tensor.name + kQSuffix, DType::F32, {rank, cols}, q.data(), q.size() * sizeof(float));
+        if (ok && !statePath.empty()) {
+            ok = stateWriter.add(tensor.name, DType::F32, tensor.shape, update.data(), count * sizeof(float))
+                && stateWriter.add(tensor.name + kQSuffix, DType::F32, {rank, cols}, q.data(), q.size() * sizeof(float));
+        }
+        manifest["tensors"][tensor.name] = {{"dtype", dtypeName(tensor.dtype)}, {"shape", tensor.shape}, {"rank", rank}};
+    }
+
+    std::string manifestText = manifest.dump();
+    ok = ok && writer.add(kManifestName, DType::U8, {manifestText.size()}, manifestText.data(), manifestText.size());
+    ok = writer.finish() && ok;
+    if (!statePath.empty()) {
+        ok = stateWriter.finish() && ok;
+        // Keep the old state unless the whole update was compressed
+        ok = ok && std::rename(newStatePath.c_str(), statePath.c_str()) == 0;
+        std::remove(newStatePath.c_str());
+    }
+    if (!ok) {
+        std::cerr << "Failed to compress model " << modelPath << std::endl;
+        std::remove(updatePath.c_str());
+        return false;
+    }
+    result.relativeError = total > 0 ? std::sqrt(missed / total) : 0;
+    if (report) {
+        *report = result;
+    }
+    return true;
+}
+
+/**
+ * @brief Reconstructs a model from a low-rank update and the base model it was computed
+ * against, e.g. on the server side or in tests.
+ *
+ * Compressed tensors are written as the base plus the expanded update, in the dtype of the
+ * trained model. The other tensors are copied.
+ *
+ * @param updatePath The path to the update, written by lowRankUpdate().
+ * @param basePath The path to the base model.
+ * @param modelPath The path to write the model to.
+ * @return true if the model was written, false otherwise.
+ */
+bool expandLowRankUpdate(const std::string& updatePath, const std::string& basePath, const std::string& modelPath) {
+    std::shared_ptr<TensorReader> update = TensorReader::open(updatePath);
+    std::shared_ptr<TensorReader> base = TensorReader::open(basePath);
+    if (!update || !base) {
+        return false;
+    }
+    const TensorInfo* manifestTensor = update->find(kManifestName);
+    json manifest;
+    try {
+        if (!manifestTensor || !update->verify(*manifestTensor)) {
+            throw std::runtime_error("no manifest");
+        }
+        TensorSpan<const uint8_t> bytes = update->bytes(*manifestTensor);
+        manifest = json::parse(bytes.begin(), bytes.end());
+        if (manifest.at("version").get<int>() != kManifestVersion) {
+            throw std::runtime_error("unknown version");
+        }
+        manifest.at("tensors").get<json::object_t>();
+    } catch (const std::exception& e) {
+        std::cerr << "Not a low-rank update: " << updatePath << " (" << e.what() << ")" << std::endl;
+        return false;
+    }
+    const json& compressed = manifest["tensors"];
+    std::set<std::string> factors;
+    for (const auto& entry : compressed.items()) {
+        factors.insert(entry.key() + kPSuffix);
+        factors.insert(entry.key() + kQSuffix);
+    }
+
+    TensorWriter writer;
+    bool ok = writer.open(modelPath);
+    std::set<std::string> written;
+    std::vector<float> values;
+    std::vector<float> p;
+    std::vector<float> q;
+    std::vector<char> converted;
+    for (const TensorInfo& tensor : update->tensors()) {
+        if (!ok) {
+            break;
+        }
+        // Factored tensors are written where their P factor is
+        std::string name = tensor.name;
+        if (name == kManifestName) {
+            continue;
+        }
+        if (!compressed.contains(name) && factors.count(name)) {
+            if (name.compare(name.size() - strlen(kPSuffix), std::string::npos, kPSuffix) != 0) {
+                continue;
+            }
+            name.resize(name.size() - strlen(kPSuffix));
+        }
+        if (!compressed.contains(name)) {
+            ok = update->verify(tensor);
+            TensorSpan<const uint8_t> bytes = update->bytes(tensor);
+            ok = ok && writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+        if (!written.insert(name).second) {
+            continue;
+        }
+
+        // Check every size against the manifest before touching the data
+        DType dtype;
+        std::vector<uint64_t> shape;
+        size_t rank = 0;
+        try {
+            ok = dtypeFromName(compressed[name].at("dtype").get<std::string>(), dtype) && isFloatDType(dtype);
+            shape = compressed[name].at("shape").get<std::vector<uint64_t>>();
+            rank = compressed[name].at("rank").get<size_t>();
+        } catch (const std::exception& e) {
+            ok = false;
+        }
+        TensorInfo info;
+        info.shape = shape;
+        size_t count = info.elements();
+        size_t rows = shape.size() >= 2 ? shape[0] : 0;
+        size_t cols = rows > 0 ? count / rows : 0;
+        const TensorInfo* baseTensor = base->find(name);
+        const TensorInfo* raw = rank == 0 ? update->find(name) : nullptr;
+        const TensorInfo* pTensor = rank > 0 ? update->find(name + kPSuffix) : nullptr;
+        const TensorInfo* qTensor = rank > 0 ? update->find(name + kQSuffix) : nullptr;
+        ok = ok && baseTensor && baseTensor->elements() == count && base->readFloats(*baseTensor, values);
+        if (ok && rank == 0) {
+            ok = raw && raw->dtype == DType::F32 && raw->elements() == count && update->verify(*raw);
+        } else if (ok) {
+            ok = pTensor && qTensor && pTensor->dtype == DType::F32 && qTensor->dtype == DType::F32
+                && rank <= std::min(rows, cols) && pTensor->elements() == rank * rows && qTensor->elements() == rank * cols
+                && update->verify(*pTensor) && update->verify(*qTensor);
+        }
+        if (!ok) {
+            std::cerr << "Invalid low-rank tensor " << name << " in " << updatePath << std::endl;
+            break;
+        }
+        if (rank == 0) {
+            p.resize(count);
+            memcpy(p.data(), update->bytes(*raw).data(), count * sizeof(float));
+            fednlib::ops::axpy(1.0f, p.data(), values.data(), count);
+        } else {
+            p.resize(rank * rows);
+            q.resize(rank * cols);
+            memcpy(p.data(), update->bytes(*pTensor).data(), p.size() * sizeof(float));
+            memcpy(q.data(), update->bytes(*qTensor).data(), q.size() * sizeof(float));
+            fednlib::ops::addOuter(1.0f, p.data(), q.data(), rank, values.data(), rows, cols);
+        }
+        converted.resize(count * dtypeSize(dtype));
+        ok = convertDType(values.data(), DType::F32, converted.data(), dtype, count)
+            && writer.add(name, dtype, shape, converted.data(), converted.size());
+    }
+    ok = writer.finish() && ok;
+    if (!ok) {
+        std::cerr << "Failed to expand update " << updatePath << std::endl;
+        std::remove(modelPath.c_str());
+    }
+    return ok;
+}
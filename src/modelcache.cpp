@@ -0,0 +1,264 @@
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <stdexcept>
+#include <cctype>
+#include <cstdio>
+
+#include "../include/fednlib/modelcache.h"
+#include "../include/fednlib/workspace.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const char kModelSuffix[] = ".model";
+const char kTemporaryPrefix[] = ".tmp-";
+
+// Model IDs are kept in file names with every byte but letters, digits, '-' and '_' escaped
+bool keptInName(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+}
+
+bool unescape(const std::string& name, std::string& modelID) {
+    modelID.clear();
+    for (size_t i = 0; i < name.size(); i++) {
+        if (name[i] != '%') {
+            modelID += name[i];
+            continue;
+        }
+        if (i + 2 >= name.size() || !isxdigit(static_cast<unsigned char>(name[i + 1])) || !isxdigit(static_cast<unsigned char>(name[i + 2]))) {
+            return false;
+        }
+        modelID += static_cast<char>(std::stoi(name.substr(i + 1, 2), nullptr, 16));
+        i += 2;
+    }
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Opens a model cache, creating the directory if needed.
+ *
+ * Files left under a temporary name by a crash are removed, and models beyond the capacity
+ * are evicted. With a workspace, space is reserved for the models already cached, and the
+ * least recently used ones that do not fit are removed.
+ *
+ * @param directory The directory of the cache.
+ * @param capacity The number of models kept.
+ * @param workspace The workspace whose quota the cached models count against, or nullptr.
+ * @throws std::runtime_error if the directory cannot be created.
+ */
+ModelCache::ModelCache(const std::string& directory, size_t capacity, std::shared_ptr<Workspace> workspace)
+    : directory(directory), capacity(capacity), workspace(workspace) {
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    if (ec) {
+        throw std::runtime_error("Failed to create model cache " + directory + ": " + ec.message());
+    }
+    for (const fs::directory_entry& entry : fs::directory_iterator(directory, ec)) {
+        if (entry.path().filename().string().rfind(kTemporaryPrefix, 0) == 0) {
+            fs::remove(entry.path(), ec);
+        }
+    }
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    evict();
+    if (!workspace) {
+        return;
+    }
+    for (const fs::path& file : cachedFiles()) {
+        uintmax_t size = fs::file_size(file, ec);
+        if (!ec && workspace->reserveState(size)) {
+            reservedBytes += size;
+        } else {
+            fs::remove(file, ec);
+        }
+    }
+}
+
+/**
+ * @brief Gives the space of the cached models back to the workspace. The models are kept.
+ */
+ModelCache::~ModelCache() {
+    if (workspace) {
+        workspace->releaseState(reservedBytes);
+    }
+}
+
+std::string ModelCache::fileName(const std::string& modelID) const {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string name;
+    for (char c : modelID) {
+        if (keptInName(c)) {
+            name += c;
+        } else {
+            name += '%';
+            name += digits[static_cast<unsigned char>(c) >> 4];
+            name += digits[static_cast<unsigned char>(c) & 0xf];
+        }
+    }
+    return name + kModelSuffix;
+}
+
+/**
+ * @brief Returns the IDs of the cached models, most recently used first.
+ */
+std::vector<std::string> ModelCache::modelIDs() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    std::vector<std::pair<fs::file_time_type, std::string>> models;
+    std::error_code ec;
+    for (const fs::directory_entry& entry : fs::directory_iterator(directory, ec)) {
+        std::string name = entry.path().filename().string();
+        std::string modelID;
+        size_t suffix = name.size() - std::min(name.size(), sizeof(kModelSuffix) - 1);
+        if (name.rfind(kTemporaryPrefix, 0) == 0 || name.compare(suffix, std::string::npos, kModelSuffix) != 0
+                || !unescape(name.substr(0, suffix), modelID)) {
+            continue;
+        }
+        fs::file_time_type time = entry.last_write_time(ec);
+        if (!ec) {
+            models.emplace_back(time, modelID);
+        }
+    }
+    std::sort(models.begin(), models.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    std::vector<std::string> modelIDs;
+    for (const auto& model : models) {
+        modelIDs.push_back(model.second);
+    }
+    return modelIDs;
+}
+
+/**
+ * @brief Returns the file of a cached model and marks it as used.
+ *
+ * @return The path, empty if the model is not cached.
+ */
+std::string ModelCache::path(const std::string& modelID) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    fs::path file = fs::path(directory) / fileName(modelID);
+    std::error_code ec;
+    if (!fs::is_regular_file(file, ec)) {
+        return "";
+    }
+    fs::last_write_time(file, fs::file_time_type::clock::now(), ec);
+    return file.string();
+}
+
+/**
+ * @brief Adds a model to the cache, evicting the least recently used models beyond the
+ * capacity or to make room for it in the workspace.
+ *
+ * The model is hard linked into the cache if it is on the same file system and copied
+ * otherwise. A linked file shares its data with the cached model, so it must only be
+ * replaced or removed afterwards, not changed in place.
+ *
+ * @param modelID The ID of the model.
+ * @param modelPath The file of the model.
+ * @return true if the model was added, false otherwise.
+ */
+bool ModelCache::insert(const std::string& modelID, const std::string& modelPath) {
+    if (capacity == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    fs::path file = fs::path(directory) / fileName(modelID);
+    fs::path temporary = fs::path(directory) / (kTemporaryPrefix + fileName(modelID));
+    std::error_code ec;
+    uintmax_t size = fs::file_size(modelPath, ec);
+    if (ec) {
+        std::cerr << "Failed to cache model " << modelID << ": " << ec.message() << std::endl;
+        return false;
+    }
+    removeFile(file);
+    if (!reserve(size)) {
+        std::cerr << "Not caching model " << modelID << ", it does not fit in the workspace" << std::endl;
+        return false;
+    }
+    fs::remove(temporary, ec);
+    fs::create_hard_link(modelPath, temporary, ec);
+    if (ec) {
+        ec.clear();
+        fs::copy_file(modelPath, temporary, fs::copy_options::overwrite_existing, ec);
+    }
+    if (!ec) {
+        fs::rename(temporary, file, ec);
+    }
+    if (ec) {
+        std::cerr << "Failed to cache model " << modelID << ": " << ec.message() << std::endl;
+        fs::remove(temporary, ec);
+        if (workspace) {
+            workspace->releaseState(size);
+            reservedBytes -= size;
+        }
+        return false;
+    }
+    fs::last_write_time(file, fs::file_time_type::clock::now(), ec);
+    evict();
+    return true;
+}
+
+/**
+ * @brief Removes a model from the cache, e.g. one that failed to verify.
+ */
+void ModelCache::remove(const std::string& modelID) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    removeFile(fs::path(directory) / fileName(modelID));
+}
+
+// The files of the cached models, most recently used first. Called with cacheMutex held.
+std::vector<fs::path> ModelCache::cachedFiles() {
+    std::vector<std::pair<fs::file_time_type, fs::path>> models;
+    std::error_code ec;
+    for (const fs::directory_entry& entry : fs::directory_iterator(directory, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind(kTemporaryPrefix, 0) != 0 && name.size() > sizeof(kModelSuffix) - 1
+                && name.compare(name.size() - (sizeof(kModelSuffix) - 1), std::string::npos, kModelSuffix) == 0) {
+            models.emplace_back(entry.last_write_time(ec), entry.path());
+        }
+    }
+    std::sort(models.begin(), models.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    std::vector<fs::path> files;
+    for (const auto& model : models) {
+        files.push_back(model.second);
+    }
+    return files;
+}
+
+// Reserves space for a model in the workspace, evicting the least recently used models until
+// it fits. Called with cacheMutex held.
+bool ModelCache::reserve(uint64_t bytes) {
+    if (!workspace) {
+        return true;
+    }
+    std::vector<fs::path> files = cachedFiles();
+    while (!workspace->reserveState(bytes)) {
+        if (files.empty()) {
+            return false;
+        }
+        removeFile(files.back());
+        files.pop_back();
+    }
+    reservedBytes += bytes;
+    return true;
+}
+
+// Removes the file of a cached model and gives its space back. Called with cacheMutex held.
+void ModelCache::removeFile(const fs::path& file) {
+    std::error_code ec;
+    uintmax_t size = fs::file_size(file, ec);
+    if (ec || !fs::remove(file, ec) || !workspace) {
+        return;
+    }
+    size = std::min<uintmax_t>(size, reservedBytes);
+    workspace->releaseState(size);
+    reservedBytes -= size;
+}
+
+// Called with cacheMutex held
+void ModelCache::evict() {
+    std::vector<fs::path> files = cachedFiles();
+    for (size_t i = capacity; i < files.size(); i++) {
+        removeFile(files[i]);
+    }
+}
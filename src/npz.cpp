@@ -0,0 +1,970 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
+#include <ctime>
+#include <zlib.h>
+
+#include "../include/fednlib/npz.h"
+#include "../include/fednlib/fileio.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The fednlib NPZ reader is only implemented for little endian hosts"
+#endif
+
+namespace {
+
+const char kNpyMagic[6] = {'\x93', 'N', 'U', 'M', 'P', 'Y'};
+const size_t kNpyAlignment = 64;
+const size_t kMaxHeaderSize = 1 << 20;
+
+const uint32_t kLocalHeaderSignature = 0x04034b50;
+const uint32_t kCentralHeaderSignature = 0x02014b50;
+const uint32_t kEndSignature = 0x06054b50;
+const uint32_t kZip64EndSignature = 0x06064b50;
+const uint32_t kZip64LocatorSignature = 0x07064b50;
+const uint32_t kDataDescriptorSignature = 0x08074b50;
+const size_t kLocalHeaderSize = 30;
+const size_t kCentralHeaderSize = 46;
+const size_t kEndSize = 22;
+const size_t kZip64EndSize = 56;
+const size_t kZip64LocatorSize = 20;
+const uint16_t kZip64ExtraId = 0x0001;
+const uint16_t kAlignmentExtraId = 0xd935; // The id zipalign uses for padding
+const uint16_t kMethodStored = 0;
+const uint16_t kMethodDeflated = 8;
+const uint16_t kFlagEncrypted = 1 << 0;
+const uint16_t kFlagDataDescriptor = 1 << 3;
+const uint16_t kFlagUtf8 = 1 << 11;
+// Entries from this size on get zip64 sizes, leaving room for deflate to expand the data
+const uint64_t kZip64Threshold = 0xf0000000;
+const size_t kDeflateChunk = 1 << 30;
+const size_t kDeflateBufferSize = 256 * 1024;
+
+template <typename T>
+T readLE(const char* p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void appendLE(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+uint32_t crc32Of(uint32_t crc, const void* data, size_t size) {
+    return crc32_z(crc, static_cast<const Bytef*>(data), size);
+}
+
+// Memory for copied and inflated arrays, aligned like the data in a container
+std::shared_ptr<char> allocateAligned(size_t size) {
+    size_t rounded = (size + kNpyAlignment - 1) / kNpyAlignment * kNpyAlignment;
+    void* memory = aligned_alloc(kNpyAlignment, rounded > 0 ? rounded : kNpyAlignment);
+    if (!memory) {
+        return nullptr;
+    }
+    return std::shared_ptr<char>(static_cast<char*>(memory), free);
+}
+
+const char* npyDescr(DType dtype) {
+    switch (dtype) {
+        case DType::F64: return "<f8";
+        case DType::F32: return "<f4";
+        case DType::F16: return "<f2";
+        case DType::I64: return "<i8";
+        case DType::I32: return "<i4";
+        case DType::I16: return "<i2";
+        case DType::I8: return "|i1";
+        case DType::U8: return "|u1";
+        case DType::BF16: return nullptr; // NumPy has no bfloat16
+    }
+    return nullptr;
+}
+
+bool parseNpyDescr(const std::string& descr, DType& dtype) {
+    if (descr.size() != 3) {
+        return false;
+    }
+    std::string type = descr.substr(1);
+    char order = descr[0];
+    bool singleByte = type == "i1" || type == "u1" || type == "b1";
+    if (order != '<' && order != '|' && order != '=' && !(order == '>' && singleByte)) {
+        return false; // Big endian data is not converted
+    }
+    if (type == "f8") dtype = DType::F64;
+    else if (type == "f4") dtype = DType::F32;
+    else if (type == "f2") dtype = DType::F16;
+    else if (type == "i8") dtype = DType::I64;
+    else if (type == "i4") dtype = DType::I32;
+    else if (type == "i2") dtype = DType::I16;
+    else if (type == "i1") dtype = DType::I8;
+    else if (type == "u1" || type == "b1") dtype = DType::U8;
+    else return false;
+    return true;
+}
+
+// Builds the .npy header for an array: magic, version, length and a dict padded to 64 bytes
+std::string npyHeader(DType dtype, const std::vector<uint64_t>& shape, bool fortranOrder) {
+    std::string dict = std::string("{'descr': '") + npyDescr(dtype) + "', 'fortran_order': "
+                     + (fortranOrder ? "True" : "False") + ", 'shape': (";
+    for (size_t i = 0; i < shape.size(); ++i) {
+        dict += std::to_string(shape[i]);
+        if (shape.size() == 1) {
+            dict += ",";
+        } else if (i + 1 < shape.size()) {
+            dict += ", ";
+        }
+    }
+    dict += "), }";
+    size_t prefixSize = 10;
+    size_t total = (prefixSize + dict.size() + 1 + kNpyAlignment - 1) / kNpyAlignment * kNpyAlignment;
+    if (total - prefixSize > UINT16_MAX) {
+        prefixSize = 12;
+        total = (prefixSize + dict.size() + 1 + kNpyAlignment - 1) / kNpyAlignment * kNpyAlignment;
+    }
+    dict.append(total - prefixSize - dict.size() - 1, ' ');
+    dict += '\n';
+
+    std::string header(kNpyMagic, sizeof(kNpyMagic));
+    header += static_cast<char>(prefixSize == 10 ? 1 : 2);
+    header += '\0';
+    if (prefixSize == 10) {
+        appendLE<uint16_t>(header, dict.size());
+    } else {
+        appendLE<uint32_t>(header, dict.size());
+    }
+    return header + dict;
+}
+
+/**
+ * Returns the size of the .npy header that starts the data, magic and length included,
+ * or 0 if the data does not start with a valid header prefix.
+ */
+size_t npyHeaderSize(const char* data, size_t size) {
+    if (size < 10 || memcmp(data, kNpyMagic, sizeof(kNpyMagic)) != 0) {
+        return 0;
+    }
+    uint8_t major = data[6];
+    if (major == 1) {
+        return 10 + readLE<uint16_t>(data + 8);
+    }
+    if ((major == 2 || major == 3) && size >= 12) {
+        uint32_t length = readLE<uint32_t>(data + 8);
+        return length <= kMaxHeaderSize ? 12 + length : 0;
+    }
+    return 0;
+}
+
+// Parses the Python dict literal of a .npy header, the only grammar numpy.save() writes
+class NpyDictParser {
+public:
+    NpyDictParser(const char* p, const char* end) : p(p), end(end) {}
+
+    bool parse(NpyArray& array) {
+        bool hasDescr = false, hasOrder = false, hasShape = false;
+        if (!consume('{')) {
+            return false;
+        }
+        while (!consume('}')) {
+            std::string key;
+            if (!parseString(key) || !consume(':')) {
+                return false;
+            }
+            if (key == "descr") {
+                std::string descr;
+                hasDescr = parseString(descr) && parseNpyDescr(descr, array.dtype);
+                if (!hasDescr) {
+                    return false;
+                }
+            } else if (key == "fortran_order") {
+                if (!parseBool(array.fortranOrder)) {
+                    return false;
+                }
+                hasOrder = true;
+            } else if (key == "shape") {
+                if (!parseShape(array.shape)) {
+                    return false;
+                }
+                hasShape = true;
+            } else {
+                return false;
+            }
+            if (!consume(',') && !peek('}')) {
+                return false;
+            }
+        }
+        return hasDescr && hasOrder && hasShape;
+    }
+
+private:
+    const char* p;
+    const char* end;
+
+    void skipSpace() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            ++p;
+        }
+    }
+
+    bool peek(char c) {
+        skipSpace();
+        return p < end && *p == c;
+    }
+
+    bool consume(char c) {
+        if (!peek(c)) {
+            return false;
+        }
+        ++p;
+        return true;
+    }
+
+    bool parseString(std::string& value) {
+        skipSpace();
+        if (p >= end || (*p != '\'' && *p != '"')) {
+            return false;
+        }
+        char quote = *p++;
+        const char* start = p;
+        while (p < end && *p != quote) {
+            ++p;
+        }
+        if (p >= end) {
+            return false;
+        }
+        value.assign(start, p - start);
+        ++p;
+        return true;
+    }
+
+    bool parseBool(bool& value) {
+        skipSpace();
+        if (end - p >= 4 && memcmp(p, "True", 4) == 0) {
+            value = true;
+            p += 4;
+            return true;
+        }
+        if (end - p >= 5 && memcmp(p, "False", 5) == 0) {
+            value = false;
+            p += 5;
+            return true;
+        }
+        return false;
+    }
+
+    bool parseShape(std::vector<uint64_t>& shape) {
+        shape.clear();
+        if (!consume('(')) {
+            return false;
+        }
+        while (!consume(')')) {
+            skipSpace();
+            uint64_t dimension = 0;
+            const char* start = p;
+            while (p < end && *p >= '0' && *p <= '9') {
+                if (__builtin_mul_overflow(dimension, 10, &dimension)
+                        || __builtin_add_overflow(dimension, (uint64_t) (*p - '0'), &dimension)) {
+                    return false;
+                }
+                ++p;
+            }
+            // Python writes long dimensions with an L suffix in version 1 headers of Python 2
+            if (p < end && *p == 'L') {
+                ++p;
+            }
+            if (p == start) {
+                return false;
+            }
+            shape.push_back(dimension);
+            if (!consume(',') && !peek(')')) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Parses a complete .npy header and returns the size of the data it describes
+bool parseNpyHeader(const char* data, size_t headerSize, NpyArray& array, uint64_t& dataSize) {
+    size_t prefixSize = data[6] == 1 ? 10 : 12;
+    NpyDictParser parser(data + prefixSize, data + headerSize);
+    if (!parser.parse(array)) {
+        return false;
+    }
+    uint64_t elements = 1;
+    for (uint64_t dimension : array.shape) {
+        if (__builtin_mul_overflow(elements, dimension, &elements)) {
+            return false;
+        }
+    }
+    return !__builtin_mul_overflow(elements, (uint64_t) dtypeSize(array.dtype), &dataSize);
+}
+
+// DOS date and time of the current local time, as stored in zip headers
+void dosDateTime(uint16_t& date, uint16_t& time) {
+    std::time_t now = std::time(nullptr);
+    std::tm local;
+    localtime_r(&now, &local);
+    if (local.tm_year < 80) {
+        date = (1 << 5) | 1;
+        time = 0;
+        return;
+    }
+    date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+    time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+}
+
+bool isAscii(const std::string& name) {
+    for (unsigned char c : name) {
+        if (c >= 0x80) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Returns the number of elements of the array, the product of its dimensions.
+ */
+uint64_t NpyArray::elements() const {
+    uint64_t count = 1;
+    for (uint64_t dimension : shape) {
+        count *= dimension;
+    }
+    return count;
+}
+
+/**
+ * @brief Reads an array in the .npy format held in memory.
+ *
+ * The data is used in place if it is aligned for its dtype and copied otherwise. In place,
+ * the buffer must outlive the array, or be kept alive by the owner.
+ *
+ * @param data The .npy data.
+ * @param size The size of the data.
+ * @param owner An object that keeps the buffer alive, e.g. the mapped file, or nullptr.
+ * @return std::shared_ptr<NpyArray> The array, nullptr if the data is not a valid .npy array.
+ */
+std::shared_ptr<NpyArray> NpyArray::fromBuffer(const char* data, size_t size, std::shared_ptr<const void> owner) {
+    std::shared_ptr<NpyArray> array = std::make_shared<NpyArray>();
+    size_t headerSize = npyHeaderSize(data, size);
+    uint64_t dataSize = 0;
+    if (headerSize == 0 || headerSize > size || !parseNpyHeader(data, headerSize, *array, dataSize)
+            || dataSize != size - headerSize) {
+        std::cerr << "Invalid .npy array" << std::endl;
+        return nullptr;
+    }
+    const char* start = data + headerSize;
+    array->size = dataSize;
+    if (reinterpret_cast<uintptr_t>(start) % dtypeSize(array->dtype) == 0) {
+        array->data = start;
+        array->owner = std::move(owner);
+        return array;
+    }
+    std::shared_ptr<char> copy = allocateAligned(dataSize);
+    if (!copy) {
+        std::cerr << "Failed to allocate " << dataSize << " bytes for an array" << std::endl;
+        return nullptr;
+    }
+    memcpy(copy.get(), start, dataSize);
+    array->data = copy.get();
+    array->owner = std::move(copy);
+    return array;
+}
+
+/**
+ * @brief Maps an archive into memory and reads its central directory.
+ *
+ * @param path The path to the .npz file.
+ * @return std::shared_ptr<NpzReader> The reader, nullptr if the file is not a valid zip archive.
+ */
+std::shared_ptr<NpzReader> NpzReader::open(const std::string& path) {
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file) {
+        return nullptr;
+    }
+    std::shared_ptr<NpzReader> reader(new NpzReader());
+    reader->file = file;
+    reader->data = file->data();
+    reader->size = file->size();
+    if (!reader->parse()) {
+        std::cerr << "Invalid .npz archive " << path << std::endl;
+        return nullptr;
+    }
+    return reader;
+}
+
+/**
+ * @brief Reads the central directory of an archive held in memory, e.g. a downloaded model.
+ *
+ * The buffer is not copied and must outlive the reader and the arrays loaded from it.
+ *
+ * @param data The archive.
+ * @param size The size of the archive.
+ * @return std::shared_ptr<NpzReader> The reader, nullptr if the buffer is not a valid zip archive.
+ */
+std::shared_ptr<NpzReader> NpzReader::fromBuffer(const char* data, size_t size) {
+    std::shared_ptr<NpzReader> reader(new NpzReader());
+    reader->data = data;
+    reader->size = size;
+    if (!reader->parse()) {
+        std::cerr << "Invalid .npz archive" << std::endl;
+        return nullptr;
+    }
+    return reader;
+}
+
+/**
+ * @brief Finds the end of central directory record and reads every entry, checking every bound.
+ */
+bool NpzReader::parse() {
+    if (size < kEndSize) {
+        return false;
+    }
+    // The end record is followed by a comment of at most 64 KiB
+    size_t end = size - kEndSize;
+    size_t lowest = end > UINT16_MAX ? end - UINT16_MAX : 0;
+    while (readLE<uint32_t>(data + end) != kEndSignature || end + kEndSize + readLE<uint16_t>(data + end + 20) != size) {
+        if (end == lowest) {
+            return false;
+        }
+        --end;
+    }
+    uint64_t count = readLE<uint16_t>(data + end + 10);
+    uint64_t directorySize = readLE<uint32_t>(data + end + 12);
+    uint64_t directoryOffset = readLE<uint32_t>(data + end + 16);
+    if (end >= kZip64LocatorSize && readLE<uint32_t>(data + end - kZip64LocatorSize) == kZip64LocatorSignature) {
+        uint64_t zip64End = readLE<uint64_t>(data + end - kZip64LocatorSize + 8);
+        if (zip64End > end - kZip64LocatorSize || end - kZip64LocatorSize - zip64End < kZip64EndSize
+                || readLE<uint32_t>(data + zip64End) != kZip64EndSignature) {
+            return false;
+        }
+        count = readLE<uint64_t>(data + zip64End + 32);
+        directorySize = readLE<uint64_t>(data + zip64End + 40);
+        directoryOffset = readLE<uint64_t>(data + zip64End + 48);
+    }
+    if (directoryOffset > size || directorySize > size - directoryOffset) {
+        return false;
+    }
+
+    const char* p = data + directoryOffset;
+    const char* directoryEnd = p + directorySize;
+    entryNames.clear();
+    entries.clear();
+    for (uint64_t i = 0; i < count; ++i) {
+        if ((size_t) (directoryEnd - p) < kCentralHeaderSize || readLE<uint32_t>(p) != kCentralHeaderSignature) {
+            return false;
+        }
+        Entry entry;
+        entry.flags = readLE<uint16_t>(p + 8);
+        entry.method = readLE<uint16_t>(p + 10);
+        entry.crc = readLE<uint32_t>(p + 16);
+        entry.compressedSize = readLE<uint32_t>(p + 20);
+        entry.uncompressedSize = readLE<uint32_t>(p + 24);
+        size_t nameLength = readLE<uint16_t>(p + 28);
+        size_t extraLength = readLE<uint16_t>(p + 30);
+        size_t commentLength = readLE<uint16_t>(p + 32);
+        entry.localOffset = readLE<uint32_t>(p + 42);
+        p += kCentralHeaderSize;
+        if ((size_t) (directoryEnd - p) < nameLength + extraLength + commentLength) {
+            return false;
+        }
+        std::string name(p, nameLength);
+        p += nameLength;
+
+        // Values that do not fit in 32 bits are in the zip64 extra field, in this order
+        const char* extra = p;
+        const char* extraEnd = p + extraLength;
+        while (extraEnd - extra >= 4) {
+            uint16_t id = readLE<uint16_t>(extra);
+            uint16_t length = readLE<uint16_t>(extra + 2);
+            const char* field = extra + 4;
+            if (extraEnd - field < length) {
+                return false;
+            }
+            if (id == kZip64ExtraId) {
+                const char* fieldEnd = field + length;
+                for (uint64_t* value : {&entry.uncompressedSize, &entry.compressedSize, &entry.localOffset}) {
+                    if (*value != UINT32_MAX) {
+                        continue;
+                    }
+                    if (fieldEnd - field < 8) {
+                        return false;
+                    }
+                    *value = readLE<uint64_t>(field);
+                    field += 8;
+                }
+            }
+            extra += 4 + length;
+        }
+        p += extraLength + commentLength;
+
+        // numpy.load() names arrays after their entries without the .npy suffix
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".npy") == 0) {
+            name.resize(name.size() - 4);
+        }
+        if (!entries.count(name)) {
+            entryNames.push_back(name);
+        }
+        entries[name] = entry;
+    }
+    return true;
+}
+
+/**
+ * @brief Loads an array.
+ *
+ * @param name The name of the array, the name of its entry without ".npy".
+ * @param verify Whether to check the data against the CRC-32 of the entry.
+ * @return std::shared_ptr<NpyArray> The array, nullptr if there is no such array or it is invalid.
+ */
+std::shared_ptr<NpyArray> NpzReader::load(const std::string& name, bool verify) const {
+    auto it = entries.find(name);
+    if (it == entries.end()) {
+        std::cerr << "No array named " << name << " in .npz archive" << std::endl;
+        return nullptr;
+    }
+    const Entry& entry = it->second;
+    if (entry.flags & kFlagEncrypted) {
+        std::cerr << "Array " << name << " is encrypted" << std::endl;
+        return nullptr;
+    }
+    // The sizes in the local header may be left out, only its name and extra field are needed
+    if (entry.localOffset > size || size - entry.localOffset < kLocalHeaderSize
+            || readLE<uint32_t>(data + entry.localOffset) != kLocalHeaderSignature) {
+        std::cerr << "Invalid entry for array " << name << std::endl;
+        return nullptr;
+    }
+    const char* local = data + entry.localOffset;
+    uint64_t start = entry.localOffset + kLocalHeaderSize + readLE<uint16_t>(local + 26) + readLE<uint16_t>(local + 28);
+    if (start > size || entry.compressedSize > size - start) {
+        std::cerr << "Invalid entry for array " << name << std::endl;
+        return nullptr;
+    }
+
+    std::shared_ptr<NpyArray> array;
+    if (entry.method == kMethodStored) {
+        if (entry.compressedSize != entry.uncompressedSize) {
+            std::cerr << "Invalid entry for array " << name << std::endl;
+            return nullptr;
+        }
+        if (verify && crc32Of(0, data + start, entry.compressedSize) != entry.crc) {
+            std::cerr << "Checksum mismatch for array " << name << std::endl;
+            return nullptr;
+        }
+        array = NpyArray::fromBuffer(data + start, entry.compressedSize, file);
+    } else if (entry.method == kMethodDeflated) {
+        array = inflateEntry(name, entry, data + start, verify);
+    } else {
+        std::cerr << "Array " << name << " uses unsupported compression method " << entry.method << std::endl;
+        return nullptr;
+    }
+    if (array) {
+        array->name = name;
+    }
+    return array;
+}
+
+/**
+ * @brief Inflates a deflated entry, the header into a string and the data straight into
+ *        aligned memory of the array.
+ */
+std::shared_ptr<NpyArray> NpzReader::inflateEntry(const std::string& name, const Entry& entry, const char* start, bool verify) const {
+    z_stream stream = {};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        std::cerr << "Failed to initialize zlib" << std::endl;
+        return nullptr;
+    }
+    const char* input = start;
+    uint64_t inputLeft = entry.compressedSize;
+    bool ended = false;
+
+    // Inflates exactly size bytes into out
+    auto inflateTo = [&](char* out, uint64_t size) {
+        while (size > 0) {
+            if (ended) {
+                return false;
+            }
+            if (stream.avail_in == 0 && inputLeft > 0) {
+                stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+                stream.avail_in = std::min<uint64_t>(inputLeft, kDeflateChunk);
+                input += stream.avail_in;
+                inputLeft -= stream.avail_in;
+            }
+            uInt chunk = std::min<uint64_t>(size, kDeflateChunk);
+            stream.next_out = reinterpret_cast<Bytef*>(out);
+            stream.avail_out = chunk;
+            int status = inflate(&stream, Z_NO_FLUSH);
+            uInt produced = chunk - stream.avail_out;
+            out += produced;
+            size -= produced;
+            if (status == Z_STREAM_END) {
+                ended = true;
+            } else if (status != Z_OK && !(status == Z_BUF_ERROR && produced > 0)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::shared_ptr<NpyArray> array = std::make_shared<NpyArray>();
+    std::string header(12, '\0');
+    uint64_t dataSize = 0;
+    std::shared_ptr<char> memory;
+    bool ok = entry.uncompressedSize >= 12 && inflateTo(&header[0], 10);
+    size_t headerSize = ok ? npyHeaderSize(header.data(), 10) : 0;
+    if (ok && header[6] != 1) {
+        ok = inflateTo(&header[10], 2);
+        headerSize = ok ? npyHeaderSize(header.data(), 12) : 0;
+    }
+    size_t prefixSize = ok && header[6] == 1 ? 10 : 12;
+    ok = ok && headerSize > prefixSize && headerSize <= entry.uncompressedSize;
+    if (ok) {
+        header.resize(headerSize);
+        ok = inflateTo(&header[prefixSize], headerSize - prefixSize)
+            && parseNpyHeader(header.data(), headerSize, *array, dataSize)
+            && dataSize == entry.uncompressedSize - headerSize;
+    }
+    if (ok) {
+        memory = allocateAligned(dataSize);
+        if (!memory) {
+            std::cerr << "Failed to allocate " << dataSize << " bytes for array " << name << std::endl;
+            inflateEnd(&stream);
+            return nullptr;
+        }
+        ok = inflateTo(memory.get(), dataSize);
+    }
+    inflateEnd(&stream);
+    if (!ok) {
+        std::cerr << "Invalid deflated entry for array " << name << std::endl;
+        return nullptr;
+    }
+    if (verify && crc32Of(crc32Of(0, header.data(), header.size()), memory.get(), dataSize) != entry.crc) {
+        std::cerr << "Checksum mismatch for array " << name << std::endl;
+        return nullptr;
+    }
+    array->data = memory.get();
+    array->size = dataSize;
+    array->owner = std::move(memory);
+    return array;
+}
+
+/**
+ * @brief Creates a writer. The archive is started with open().
+ *
+ * @param compress Whether to deflate the arrays, like numpy.savez_compressed(), or to store them, like numpy.savez().
+ */
+NpzWriter::NpzWriter(bool compress) : compress(compress) {}
+
+NpzWriter::~NpzWriter() = default;
+
+/**
+ * @brief Starts an archive in a file, written through the file I/O engine.
+ *
+ * @param path The path of the file.
+ * @return true if the file was opened, false otherwise.
+ */
+bool NpzWriter::open(const std::string& path) {
+    fileWriter.reset(new ModelFileWriter());
+    buffer = nullptr;
+    position = 0;
+    failed = false;
+    entries.clear();
+    if (!fileWriter->open(path)) {
+        fileWriter.reset();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Starts an archive in memory. The archive is appended to the buffer.
+ */
+void NpzWriter::openBuffer(std::string& buffer) {
+    fileWriter.reset();
+    this->buffer = &buffer;
+    position = 0;
+    failed = false;
+    entries.clear();
+}
+
+bool NpzWriter::emit(const void* data, size_t size) {
+    if (failed) {
+        return false;
+    }
+    if (buffer) {
+        buffer->append(static_cast<const char*>(data), size);
+    } else if (!fileWriter || !fileWriter->write(static_cast<const char*>(data), size, position)) {
+        failed = true;
+        return false;
+    }
+    position += size;
+    return true;
+}
+
+/**
+ * @brief Adds an array.
+ *
+ * @param name The name of the array, stored as the entry name + ".npy".
+ * @param dtype The dtype of the elements. NumPy has no bfloat16, so BF16 is refused.
+ * @param shape The dimensions of the array.
+ * @param data The elements, in C order unless fortranOrder is set.
+ * @param size The size of the elements in bytes, which must match the dtype and shape.
+ * @param fortranOrder Whether the elements are in Fortran (column major) order.
+ * @return true if the array was added, false otherwise.
+ */
+bool NpzWriter::add(const std::string& name, DType dtype, const std::vector<uint64_t>& shape, const void* data, size_t size, bool fortranOrder) {
+    if (failed) {
+        return false;
+    }
+    std::string entryName = name + ".npy";
+    TensorInfo info;
+    info.shape = shape;
+    bool duplicate = false;
+    for (const Entry& entry : entries) {
+        duplicate = duplicate || entry.name == entryName;
+    }
+    if (!npyDescr(dtype) || entryName.size() > UINT16_MAX || duplicate || size != info.elements() * dtypeSize(dtype)) {
+        std::cerr << "Invalid array " << name << std::endl;
+        return false;
+    }
+
+    std::string npy = npyHeader(dtype, shape, fortranOrder);
+    Entry entry;
+    entry.name = entryName;
+    entry.method = compress ? kMethodDeflated : kMethodStored;
+    entry.flags = (compress ? kFlagDataDescriptor : 0) | (isAscii(entryName) ? 0 : kFlagUtf8);
+    entry.crc = crc32Of(crc32Of(0, npy.data(), npy.size()), data, size);
+    entry.uncompressedSize = npy.size() + size;
+    entry.compressedSize = compress ? 0 : entry.uncompressedSize;
+    entry.localOffset = position;
+    bool zip64 = entry.uncompressedSize >= kZip64Threshold;
+
+    // Deflated sizes are not known yet and follow the data in a data descriptor
+    std::string extra;
+    if (zip64) {
+        appendLE<uint16_t>(extra, kZip64ExtraId);
+        appendLE<uint16_t>(extra, 16);
+        appendLE<uint64_t>(extra, compress ? 0 : entry.uncompressedSize);
+        appendLE<uint64_t>(extra, compress ? 0 : entry.compressedSize);
+    }
+    if (!compress) {
+        uint64_t dataStart = position + kLocalHeaderSize + entryName.size() + extra.size() + 4 + npy.size();
+        uint16_t padding = (kNpyAlignment - dataStart % kNpyAlignment) % kNpyAlignment;
+        appendLE<uint16_t>(extra, kAlignmentExtraId);
+        appendLE<uint16_t>(extra, padding);
+        extra.append(padding, '\0');
+    }
+    uint16_t date, time;
+    dosDateTime(date, time);
+    std::string local;
+    appendLE<uint32_t>(local, kLocalHeaderSignature);
+    appendLE<uint16_t>(local, zip64 ? 45 : 20);
+    appendLE<uint16_t>(local, entry.flags);
+    appendLE<uint16_t>(local, entry.method);
+    appendLE<uint16_t>(local, time);
+    appendLE<uint16_t>(local, date);
+    appendLE<uint32_t>(local, compress ? 0 : entry.crc);
+    appendLE<uint32_t>(local, zip64 ? UINT32_MAX : entry.compressedSize);
+    appendLE<uint32_t>(local, zip64 ? UINT32_MAX : compress ? 0 : entry.uncompressedSize);
+    appendLE<uint16_t>(local, entryName.size());
+    appendLE<uint16_t>(local, extra.size());
+    local += entryName;
+    local += extra;
+
+    if (!emit(local.data(), local.size())) {
+        return false;
+    }
+    if (compress) {
+        if (!deflateEntry(npy, data, size, entry.compressedSize)) {
+            failed = true;
+            return false;
+        }
+        std::string descriptor;
+        appendLE<uint32_t>(descriptor, kDataDescriptorSignature);
+        appendLE<uint32_t>(descriptor, entry.crc);
+        if (zip64) {
+            appendLE<uint64_t>(descriptor, entry.compressedSize);
+            appendLE<uint64_t>(descriptor, entry.uncompressedSize);
+        } else {
+            appendLE<uint32_t>(descriptor, entry.compressedSize);
+            appendLE<uint32_t>(descriptor, entry.uncompressedSize);
+        }
+        if (!emit(descriptor.data(), descriptor.size())) {
+            return false;
+        }
+    } else if (!emit(npy.data(), npy.size()) || !emit(data, size)) {
+        return false;
+    }
+    entries.push_back(entry);
+    return true;
+}
+
+// Deflates the header and data of an entry and writes them
+bool NpzWriter::deflateEntry(const std::string& header, const void* data, size_t size, uint64_t& compressedSize) {
+    z_stream stream = {};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        std::cerr << "Failed to initialize zlib" << std::endl;
+        return false;
+    }
+    std::vector<char> out(kDeflateBufferSize);
+    const std::pair<const char*, size_t> pieces[] = {{header.data(), header.size()}, {static_cast<const char*>(data), size}};
+    compressedSize = 0;
+    bool ok = true;
+    for (size_t i = 0; i < 2 && ok; ++i) {
+        const char* input = pieces[i].first;
+        size_t inputLeft = pieces[i].second;
+        bool last = i == 1;
+        int status = Z_OK;
+        do {
+            if (stream.avail_in == 0) {
+                stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+                stream.avail_in = std::min(inputLeft, kDeflateChunk);
+                input += stream.avail_in;
+                inputLeft -= stream.avail_in;
+            }
+            int flush = last && inputLeft == 0 ? Z_FINISH : Z_NO_FLUSH;
+            stream.next_out = reinterpret_cast<Bytef*>(out.data());
+            stream.avail_out = out.size();
+            status = deflate(&stream, flush);
+            size_t produced = out.size() - stream.avail_out;
+            compressedSize += produced;
+            ok = status != Z_STREAM_ERROR && emit(out.data(), produced);
+        } while (ok && (stream.avail_in > 0 || inputLeft > 0 || (last && status != Z_STREAM_END)));
+    }
+    deflateEnd(&stream);
+    return ok;
+}
+
+/**
+ * @brief Writes the central directory and, for a file, waits until everything is written.
+ *
+ * @return true if the archive was written, false otherwise.
+ */
+bool NpzWriter::finish() {
+    uint64_t directoryOffset = position;
+    std::string directory;
+    for (const Entry& entry : entries) {
+        std::string zip64;
+        for (uint64_t value : {entry.uncompressedSize, entry.compressedSize, entry.localOffset}) {
+            if (value >= UINT32_MAX) {
+                appendLE<uint64_t>(zip64, value);
+            }
+        }
+        std::string extra;
+        if (!zip64.empty()) {
+            appendLE<uint16_t>(extra, kZip64ExtraId);
+            appendLE<uint16_t>(extra, zip64.size());
+            extra += zip64;
+        }
+        uint16_t version = zip64.empty() ? 20 : 45;
+        uint16_t date, time;
+        dosDateTime(date, time);
+        appendLE<uint32_t>(directory, kCentralHeaderSignature);
+        appendLE<uint16_t>(directory, (3 << 8) | version); // Made on Unix
+        appendLE<uint16_t>(directory, version);
+        appendLE<uint16_t>(directory, entry.flags);
+        appendLE<uint16_t>(directory, entry.method);
+        appendLE<uint16_t>(directory, time);
+        appendLE<uint16_t>(directory, date);
+        appendLE<uint32_t>(directory, entry.crc);
+        appendLE<uint32_t>(directory, std::min<uint64_t>(entry.compressedSize, UINT32_MAX));
+        appendLE<uint32_t>(directory, std::min<uint64_t>(entry.uncompressedSize, UINT32_MAX));
+        appendLE<uint16_t>(directory, entry.name.size());
+        appendLE<uint16_t>(directory, extra.size());
+        appendLE<uint16_t>(directory, 0);
+        appendLE<uint16_t>(directory, 0);
+        appendLE<uint16_t>(directory, 0);
+        appendLE<uint32_t>(directory, 0644u << 16);
+        appendLE<uint32_t>(directory, std::min<uint64_t>(entry.localOffset, UINT32_MAX));
+        directory += entry.name;
+        directory += extra;
+    }
+
+    std::string end;
+    uint64_t directoryEnd = directoryOffset + directory.size();
+    bool zip64 = entries.size() >= UINT16_MAX || directoryOffset >= UINT32_MAX || directory.size() >= UINT32_MAX;
+    if (zip64) {
+        appendLE<uint32_t>(end, kZip64EndSignature);
+        appendLE<uint64_t>(end, kZip64EndSize - 12);
+        appendLE<uint16_t>(end, (3 << 8) | 45);
+        appendLE<uint16_t>(end, 45);
+        appendLE<uint32_t>(end, 0);
+        appendLE<uint32_t>(end, 0);
+        appendLE<uint64_t>(end, entries.size());
+        appendLE<uint64_t>(end, entries.size());
+        appendLE<uint64_t>(end, directory.size());
+        appendLE<uint64_t>(end, directoryOffset);
+        appendLE<uint32_t>(end, kZip64LocatorSignature);
+        appendLE<uint32_t>(end, 0);
+        appendLE<uint64_t>(end, directoryEnd);
+        appendLE<uint32_t>(end, 1);
+    }
+    appendLE<uint32_t>(end, kEndSignature);
+    appendLE<uint16_t>(end, 0);
+    appendLE<uint16_t>(end, 0);
+    appendLE<uint16_t>(end, std::min<uint64_t>(entries.size(), UINT16_MAX));
+    appendLE<uint16_t>(end, std::min<uint64_t>(entries.size(), UINT16_MAX));
+    appendLE<uint32_t>(end, std::min<uint64_t>(directory.size(), UINT32_MAX));
+    appendLE<uint32_t>(end, std::min<uint64_t>(directoryOffset, UINT32_MAX));
+    appendLE<uint16_t>(end, 0);
+
+    bool ok = emit(directory.data(), directory.size()) && emit(end.data(), end.size());
+    if (fileWriter) {
+        ok = fileWriter->finish(position) && ok;
+        fileWriter.reset();
+    }
+    buffer = nullptr;
+    return ok && !failed;
+}
+
+/**
+ * @brief Maps a .npy file into memory and reads the array in it.
+ *
+ * @param path The path to the .npy file.
+ * @return std::shared_ptr<NpyArray> The array, nullptr if the file is not a valid .npy array.
+ */
+std::shared_ptr<NpyArray> loadNpy(const std::string& path) {
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file) {
+        return nullptr;
+    }
+    std::shared_ptr<NpyArray> array = NpyArray::fromBuffer(file->data(), file->size(), file);
+    if (array) {
+        size_t slash = path.find_last_of('/');
+        array->name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+        if (array->name.size() > 4 && array->name.compare(array->name.size() - 4, 4, ".npy") == 0) {
+            array->name.resize(array->name.size() - 4);
+        }
+    }
+    return array;
+}
+
+/**
+ * @brief Writes an array to a .npy file, like numpy.save().
+ *
+ * @param path The path of the file.
+ * @param dtype The dtype of the elements. NumPy has no bfloat16, so BF16 is refused.
+ * @param shape The dimensions of the array.
+ * @param data The elements in C order.
+ * @param size The size of the elements in bytes, which must match the dtype and shape.
+ * @return true if the array was written, false otherwise.
+ */
+bool saveNpy(const std::string& path, DType dtype, const std::vector<uint64_t>& shape, const void* data, size_t size) {
+    TensorInfo info;
+    info.shape = shape;
+    if (!npyDescr(dtype) || size != info.elements() * dtypeSize(dtype)) {
+        std::cerr << "Invalid array for " << path << std::endl;
+        return false;
+    }
+    std::string header = npyHeader(dtype, shape, false);
+    ModelFileWriter writer;
+    return writer.open(path, header.size() + size)
+        && writer.write(header.data(), header.size(), 0)
+        && writer.write(static_cast<const char*>(data), size, header.size())
+        && writer.finish(header.size() + size);
+}
@@ -0,0 +1,1818 @@
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+#include "../include/fednlib/ops.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define FEDNLIB_X86_KERNELS
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define FEDNLIB_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+// The kernels rely on every multiplication and addition being rounded on its own, this file
+// is built with -ffp-contract=off so that the compiler does not fuse them either.
+
+namespace fednlib {
+namespace ops {
+
+namespace {
+
+const size_t kLanes = 16;
+const size_t kChunkElements = 256 * 1024;
+const size_t kParallelElements = 1024 * 1024;
+const size_t kTopKSamples = 64 * 1024;
+const uint32_t kExponentMask = 0x7f800000u;
+
+uint32_t floatBits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// Partial results of one chunk, lane i holds the squares of the elements at i modulo 16
+struct Partial {
+    double lanes[kLanes];
+    float maxAbs;
+    uint64_t nonFinite;
+};
+
+// The parameters of one quantization block, values are low + code * scale
+struct QuantizeBlock {
+    float low;
+    float scale;
+    float inverse;
+    float levels;
+};
+
+double sumLanes(double* lanes) {
+    for (size_t width = kLanes / 2; width > 0; width /= 2) {
+        for (size_t i = 0; i < width; i++) {
+            lanes[i] = lanes[i] + lanes[i + width];
+        }
+    }
+    return lanes[0];
+}
+
+// Portable kernels. The vector kernels below compute exactly the same expressions, and
+// finish the elements that do not fill a vector with these.
+
+void axpyScalar(float a, const float* x, float* y, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        y[i] = y[i] + a * x[i];
+    }
+}
+
+void axpbyScalar(float a, const float* x, float b, float* y, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        y[i] = a * x[i] + b * y[i];
+    }
+}
+
+void scaleScalar(float a, float* x, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        x[i] = a * x[i];
+    }
+}
+
+void subScalar(const float* x, const float* y, float* out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = x[i] - y[i];
+    }
+}
+
+// Written as the x86 max and min instructions behave, so that NaNs are kept
+void clampScalar(float* x, size_t count, float low, float high) {
+    for (size_t i = 0; i < count; i++) {
+        float t = low > x[i] ? low : x[i];
+        x[i] = high < t ? high : t;
+    }
+}
+
+void weightedSumScalar(const float* const* inputs, const float* weights, size_t inputCount, size_t offset, float* out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        float sum = weights[0] * inputs[0][offset + i];
+        for (size_t k = 1; k < inputCount; k++) {
+            sum = sum + weights[k] * inputs[k][offset + i];
+        }
+        out[i] = sum;
+    }
+}
+
+void statsTail(const float* x, size_t begin, size_t count, Partial& partial) {
+    for (size_t i = begin; i < count; i++) {
+        double value = x[i];
+        partial.lanes[i % kLanes] = partial.lanes[i % kLanes] + value * value;
+        float a = std::fabs(x[i]);
+        partial.maxAbs = a > partial.maxAbs ? a : partial.maxAbs;
+        partial.nonFinite += (floatBits(x[i]) & kExponentMask) == kExponentMask;
+    }
+}
+
+void statsScalar(const float* x, size_t count, Partial& partial) {
+    statsTail(x, 0, count, partial);
+}
+
+// Adds the products of x and y to the lanes, lane i holds the products at i modulo 16
+void dotTail(const float* x, const float* y, size_t begin, size_t count, double* lanes) {
+    for (size_t i = begin; i < count; i++) {
+        lanes[i % kLanes] = lanes[i % kLanes] + double(x[i]) * double(y[i]);
+    }
+}
+
+void dotScalar(const float* x, const float* y, size_t count, double* lanes) {
+    dotTail(x, y, 0, count, lanes);
+}
+
+// Adds the squares of x minus y to the lanes, like dotTail()
+void distanceTail(const float* x, const float* y, size_t begin, size_t count, double* lanes) {
+    for (size_t i = begin; i < count; i++) {
+        double d = x[i] - y[i];
+        lanes[i % kLanes] = lanes[i % kLanes] + d * d;
+    }
+}
+
+void distanceScalar(const float* x, const float* y, size_t count, double* lanes) {
+    distanceTail(x, y, 0, count, lanes);
+}
+
+// Gaussian noise comes from Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy
+// as 1, 2, 3"), a counter-based generator: the random words are a function of the key and
+// the counter only, so noise can be drawn for any element without drawing the ones before it.
+//
+// Elements are taken in groups of 32. Element 8 * j + l of group g gets word j of the block
+// of counter (8 * g + l, stream), and words 0 and 1, and 2 and 3, are turned into two normal
+// numbers with the Box-Muller transform. The logarithm, sine and cosine are polynomials
+// evaluated with the same operations by every kernel, so every kernel gives the same bits.
+const size_t kNoiseGroup = 32;
+const uint32_t kPhiloxM0 = 0xD2511F53u;
+const uint32_t kPhiloxM1 = 0xCD9E8D57u;
+const uint32_t kPhiloxW0 = 0x9E3779B9u;
+const uint32_t kPhiloxW1 = 0xBB67AE85u;
+const int kPhiloxRounds = 10;
+const float kSqrtHalf2 = 1.41421356f; // Mantissas above this are halved, so log() works on [0.707, 1.414]
+const float kLn2 = 0.693147182f;
+const float kHalfPi = 1.57079637f;
+
+void philox(uint32_t counter[4], uint32_t key0, uint32_t key1) {
+    for (int round = 0; round < kPhiloxRounds; round++) {
+        uint64_t p0 = uint64_t(kPhiloxM0) * counter[0];
+        uint64_t p1 = uint64_t(kPhiloxM1) * counter[2];
+        uint32_t next[4] = {uint32_t(p1 >> 32) ^ counter[1] ^ key0, uint32_t(p1), uint32_t(p0 >> 32) ^ counter[3] ^ key1, uint32_t(p0)};
+        memcpy(counter, next, sizeof(next));
+        key0 += kPhiloxW0;
+        key1 += kPhiloxW1;
+    }
+}
+
+// ln(u) for u in (0, 1] as e ln 2 + 2 atanh((m - 1) / (m + 1)), with u = m 2^e
+float noiseLog(float u) {
+    uint32_t bits = floatBits(u);
+    float e = float(int32_t(bits >> 23) - 127);
+    uint32_t mantissaBits = (bits & 0x7fffffu) | 0x3f800000u;
+    float m;
+    memcpy(&m, &mantissaBits, sizeof(m));
+    if (m > kSqrtHalf2) {
+        m = m * 0.5f;
+        e = e + 1.0f;
+    }
+    float f = (m - 1.0f) / (m + 1.0f);
+    float f2 = f * f;
+    float p = f2 * (1.0f / 9.0f) + (1.0f / 7.0f);
+    p = p * f2 + (1.0f / 5.0f);
+    p = p * f2 + (1.0f / 3.0f);
+    p = p * f2 + 1.0f;
+    return e * kLn2 + (f + f) * p;
+}
+
+// Sine and cosine of x in [0, pi / 2) by their Taylor series
+float noiseSin(float x) {
+    float x2 = x * x;
+    float p = x2 * (1.0f / 6227020800.0f) + (-1.0f / 39916800.0f);
+    p = p * x2 + (1.0f / 362880.0f);
+    p = p * x2 + (-1.0f / 5040.0f);
+    p = p * x2 + (1.0f / 120.0f);
+    p = p * x2 + (-1.0f / 6.0f);
+    p = p * x2 + 1.0f;
+    return x * p;
+}
+
+float noiseCos(float x) {
+    float x2 = x * x;
+    float p = x2 * (-1.0f / 87178291200.0f) + (1.0f / 479001600.0f);
+    p = p * x2 + (-1.0f / 3628800.0f);
+    p = p * x2 + (1.0f / 40320.0f);
+    p = p * x2 + (-1.0f / 720.0f);
+    p = p * x2 + (1.0f / 24.0f);
+    p = p * x2 + (-1.0f / 2.0f);
+    return p * x2 + 1.0f;
+}
+
+// Two normal numbers from two random words: the radius from a uniform number in (0, 1], the
+// angle from the quadrant in the top two bits of the other and the position in it
+void boxMuller(uint32_t w0, uint32_t w1, float& z0, float& z1) {
+    float u = float((w0 >> 8) + 1) * 0x1.0p-24f;
+    float r = std::sqrt(noiseLog(u) * -2.0f);
+    float x = float((w1 >> 8) & 0x3fffffu) * 0x1.0p-22f * kHalfPi;
+    float s = noiseSin(x);
+    float c = noiseCos(x);
+    uint32_t quadrant = w1 >> 30;
+    float cosine = quadrant & 1 ? s : c;
+    float sine = quadrant & 1 ? c : s;
+    cosine = (quadrant ^ (quadrant >> 1)) & 1 ? -cosine : cosine;
+    sine = quadrant >> 1 ? -sine : sine;
+    z0 = r * cosine;
+    z1 = r * sine;
+}
+
+// Computes the noise of group g, see above
+void noiseGroup(uint64_t seed, uint64_t stream, uint64_t group, float* out) {
+    for (uint32_t l = 0; l < 8; l++) {
+        uint64_t n = group * 8 + l;
+        uint32_t counter[4] = {uint32_t(n), uint32_t(n >> 32), uint32_t(stream), uint32_t(stream >> 32)};
+        philox(counter, uint32_t(seed), uint32_t(seed >> 32));
+        boxMuller(counter[0], counter[1], out[l], out[8 + l]);
+        boxMuller(counter[2], counter[3], out[16 + l], out[24 + l]);
+    }
+}
+
+// Adds stddev times the noise to x[begin] to x[count - 1], where x[0] is element first,
+// computing whole groups and using the elements in range
+void noiseTail(float* x, size_t begin, size_t count, float stddev, uint64_t seed, uint64_t stream, uint64_t first) {
+    float noise[kNoiseGroup];
+    for (size_t i = begin; i < count; ) {
+        uint64_t group = (first + i) / kNoiseGroup;
+        noiseGroup(seed, stream, group, noise);
+        for (size_t j = (first + i) % kNoiseGroup; j < kNoiseGroup && i < count; j++, i++) {
+            x[i] = x[i] + stddev * noise[j];
+        }
+    }
+}
+
+void gaussianScalar(float* x, size_t count, float stddev, uint64_t seed, uint64_t stream, uint64_t first) {
+    noiseTail(x, 0, count, stddev, seed, stream, first);
+}
+
+// Fixed-point values are x * scale clamped to [-limit, limit], NaN to -limit like
+// _mm256_max_ps(), and rounded to nearest even like _mm256_cvtps_epi32()
+void fixedPointScalar(const float* x, int32_t* out, size_t count, float scale, float limit) {
+    for (size_t i = 0; i < count; i++) {
+        float v = x[i] * scale;
+        v = v > -limit ? v : -limit;
+        v = v < limit ? v : limit;
+        out[i] = int32_t(std::nearbyint(v));
+    }
+}
+
+// Masks are the key stream of ChaCha20 (Bernstein, "ChaCha, a variant of Salsa20") with a
+// 64-bit block counter and a 64-bit nonce, added to the elements modulo 2^32.
+//
+// Elements are taken in groups of 128. Element 8 * j + l of group g gets word j of block
+// 8 * g + l, so a vector kernel computes 8 blocks side by side and stores their words without
+// transposing them.
+const size_t kMaskGroup = 128;
+const uint32_t kChaChaConstants[4] = {0x61707865u, 0x3320646eu, 0x79622d32u, 0x6b206574u}; // "expand 32-byte k"
+
+inline uint32_t rotateLeft(uint32_t v, int bits) {
+    return (v << bits) | (v >> (32 - bits));
+}
+
+inline void quarterRound(uint32_t* x, int a, int b, int c, int d) {
+    x[a] += x[b]; x[d] = rotateLeft(x[d] ^ x[a], 16);
+    x[c] += x[d]; x[b] = rotateLeft(x[b] ^ x[c], 12);
+    x[a] += x[b]; x[d] = rotateLeft(x[d] ^ x[a], 8);
+    x[c] += x[d]; x[b] = rotateLeft(x[b] ^ x[c], 7);
+}
+
+void chachaBlock(const uint32_t key[8], uint64_t counter, uint64_t nonce, uint32_t out[16]) {
+    uint32_t state[16] = {kChaChaConstants[0], kChaChaConstants[1], kChaChaConstants[2], kChaChaConstants[3],
+        key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+        uint32_t(counter), uint32_t(counter >> 32), uint32_t(nonce), uint32_t(nonce >> 32)};
+    memcpy(out, state, sizeof(state));
+    for (int round = 0; round < 10; round++) {
+        quarterRound(out, 0, 4, 8, 12);
+        quarterRound(out, 1, 5, 9, 13);
+        quarterRound(out, 2, 6, 10, 14);
+        quarterRound(out, 3, 7, 11, 15);
+        quarterRound(out, 0, 5, 10, 15);
+        quarterRound(out, 1, 6, 11, 12);
+        quarterRound(out, 2, 7, 8, 13);
+        quarterRound(out, 3, 4, 9, 14);
+    }
+    for (int i = 0; i < 16; i++) {
+        out[i] += state[i];
+    }
+}
+
+// Computes the mask of group g, see above
+void maskGroup(const uint32_t key[8], uint64_t nonce, uint64_t group, uint32_t* out) {
+    uint32_t words[16];
+    for (uint32_t l = 0; l < 8; l++) {
+        chachaBlock(key, group * 8 + l, nonce, words);
+        for (size_t j = 0; j < 16; j++) {
+            out[8 * j + l] = words[j];
+        }
+    }
+}
+
+// Adds or subtracts the mask of x[begin] to x[count - 1], where x[0] is element first,
+// computing whole groups and using the elements in range
+void maskTail(int32_t* x, size_t begin, size_t count, const uint32_t key[8], uint64_t nonce, bool subtract, uint64_t first) {
+    uint32_t mask[kMaskGroup];
+    for (size_t i = begin; i < count; ) {
+        maskGroup(key, nonce, (first + i) / kMaskGroup, mask);
+        for (size_t j = (first + i) % kMaskGroup; j < kMaskGroup && i < count; j++, i++) {
+            uint32_t v = uint32_t(x[i]);
+            x[i] = int32_t(subtract ? v - mask[j] : v + mask[j]);
+        }
+    }
+}
+
+void maskScalar(int32_t* x, size_t count, const uint32_t key[8], uint64_t nonce, bool subtract, uint64_t first) {
+    maskTail(x, 0, count, key, nonce, subtract, first);
+}
+
+// Stochastic rounding draws a uniform number in [0, 1) from a hash of the element index,
+// so the result does not depend on which thread quantizes which elements
+uint32_t mixBits(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+float uniform(uint32_t seed, uint64_t index) {
+    return float(mixBits(uint32_t(index) ^ seed) >> 8) * 0x1.0p-24f;
+}
+
+// Sets v to x plus the error if there is one, where v is the error buffer, and widens
+// [low, high] to the values of v
+void rangeScalar(const float* x, float* error, size_t count, float& low, float& high) {
+    for (size_t i = 0; i < count; i++) {
+        float v = x[i];
+        if (error) {
+            v = v + error[i];
+            error[i] = v;
+        }
+        low = v < low ? v : low;
+        high = v > high ? v : high;
+    }
+}
+
+// Written as the x86 max and min instructions behave, like clampScalar()
+void quantizeScalar(const float* v, float* error, size_t count, const QuantizeBlock& block, uint32_t seed, uint64_t index, uint8_t* codes) {
+    for (size_t i = 0; i < count; i++) {
+        float t = (v[i] - block.low) * block.inverse;
+        t = floorf(t + uniform(seed, index + i));
+        t = t > 0.0f ? t : 0.0f;
+        t = t < block.levels ? t : block.levels;
+        codes[i] = uint8_t(t);
+        if (error) {
+            error[i] = v[i] - (block.low + t * block.scale);
+        }
+    }
+}
+
+void dequantizeScalar(const uint8_t* codes, size_t count, float low, float scale, float* out) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = low + float(codes[i]) * scale;
+    }
+}
+
+size_t countAboveScalar(const float* x, size_t count, float threshold) {
+    size_t above = 0;
+    for (size_t i = 0; i < count; i++) {
+        above += fabsf(x[i]) >= threshold;
+    }
+    return above;
+}
+
+// Writes index plus the positions of the elements whose magnitude is at least threshold
+size_t gatherAboveScalar(const float* x, size_t count, float threshold, uint64_t index, uint64_t* out) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (fabsf(x[i]) >= threshold) {
+            out[n++] = index + i;
+        }
+    }
+    return n;
+}
+
+#ifdef FEDNLIB_X86_KERNELS
+
+__attribute__((target("avx2")))
+void axpyAvx2(float a, const float* x, float* y, size_t count) {
+    const __m256 av = _mm256_set1_ps(a);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 product = _mm256_mul_ps(av, _mm256_loadu_ps(x + i));
+        _mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i), product));
+    }
+    axpyScalar(a, x + i, y + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void axpbyAvx2(float a, const float* x, float b, float* y, size_t count) {
+    const __m256 av = _mm256_set1_ps(a);
+    const __m256 bv = _mm256_set1_ps(b);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 ax = _mm256_mul_ps(av, _mm256_loadu_ps(x + i));
+        __m256 by = _mm256_mul_ps(bv, _mm256_loadu_ps(y + i));
+        _mm256_storeu_ps(y + i, _mm256_add_ps(ax, by));
+    }
+    axpbyScalar(a, x + i, b, y + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void scaleAvx2(float a, float* x, size_t count) {
+    const __m256 av = _mm256_set1_ps(a);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(av, _mm256_loadu_ps(x + i)));
+    }
+    scaleScalar(a, x + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void subAvx2(const float* x, const float* y, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    subScalar(x + i, y + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void clampAvx2(float* x, size_t count, float low, float high) {
+    const __m256 lowv = _mm256_set1_ps(low);
+    const __m256 highv = _mm256_set1_ps(high);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 t = _mm256_max_ps(lowv, _mm256_loadu_ps(x + i));
+        _mm256_storeu_ps(x + i, _mm256_min_ps(highv, t));
+    }
+    clampScalar(x + i, count - i, low, high);
+}
+
+__attribute__((target("avx2")))
+void weightedSumAvx2(const float* const* inputs, const float* weights, size_t inputCount, size_t offset, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_mul_ps(_mm256_set1_ps(weights[0]), _mm256_loadu_ps(inputs[0] + offset + i));
+        for (size_t k = 1; k < inputCount; k++) {
+            __m256 product = _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(inputs[k] + offset + i));
+            sum = _mm256_add_ps(sum, product);
+        }
+        _mm256_storeu_ps(out + i, sum);
+    }
+    weightedSumScalar(inputs, weights, inputCount, offset + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void statsAvx2(const float* x, size_t count, Partial& partial) {
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256i exponentMask = _mm256_set1_epi32((int) kExponentMask);
+    __m256d sums[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+    __m256 maxAbs = _mm256_setzero_ps();
+    uint64_t nonFinite = 0;
+    size_t i = 0;
+    for (; i + kLanes <= count; i += kLanes) {
+        for (size_t half = 0; half < 2; half++) {
+            __m256 v = _mm256_loadu_ps(x + i + 8 * half);
+            __m256d low = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+            __m256d high = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+            sums[2 * half] = _mm256_add_pd(sums[2 * half], _mm256_mul_pd(low, low));
+            sums[2 * half + 1] = _mm256_add_pd(sums[2 * half + 1], _mm256_mul_pd(high, high));
+            maxAbs = _mm256_max_ps(_mm256_and_ps(v, absMask), maxAbs);
+            __m256i exponent = _mm256_and_si256(_mm256_castps_si256(v), exponentMask);
+            int special = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(exponent, exponentMask)));
+            nonFinite += __builtin_popcount(special);
+        }
+    }
+    for (size_t j = 0; j < 4; j++) {
+        _mm256_storeu_pd(partial.lanes + 4 * j, sums[j]);
+    }
+    float maxes[8];
+    _mm256_storeu_ps(maxes, maxAbs);
+    partial.maxAbs = *std::max_element(maxes, maxes + 8);
+    partial.nonFinite = nonFinite;
+    statsTail(x, i, count, partial);
+}
+
+__attribute__((target("avx2")))
+void dotAvx2(const float* x, const float* y, size_t count, double* lanes) {
+    __m256d sums[4];
+    for (size_t j = 0; j < 4; j++) {
+        sums[j] = _mm256_loadu_pd(lanes + 4 * j);
+    }
+    size_t i = 0;
+    for (; i + kLanes <= count; i += kLanes) {
+        for (size_t half = 0; half < 2; half++) {
+            __m256 a = _mm256_loadu_ps(x + i + 8 * half);
+            __m256 b = _mm256_loadu_ps(y + i + 8 * half);
+            __m256d low = _mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(a)), _mm256_cvtps_pd(_mm256_castps256_ps128(b)));
+            __m256d high = _mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(a, 1)), _mm256_cvtps_pd(_mm256_extractf128_ps(b, 1)));
+            sums[2 * half] = _mm256_add_pd(sums[2 * half], low);
+            sums[2 * half + 1] = _mm256_add_pd(sums[2 * half + 1], high);
+        }
+    }
+    for (size_t j = 0; j < 4; j++) {
+        _mm256_storeu_pd(lanes + 4 * j, sums[j]);
+    }
+    dotTail(x, y, i, count, lanes);
+}
+
+__attribute__((target("avx2")))
+void distanceAvx2(const float* x, const float* y, size_t count, double* lanes) {
+    __m256d sums[4];
+    for (size_t j = 0; j < 4; j++) {
+        sums[j] = _mm256_loadu_pd(lanes + 4 * j);
+    }
+    size_t i = 0;
+    for (; i + kLanes <= count; i += kLanes) {
+        for (size_t half = 0; half < 2; half++) {
+            __m256 d = _mm256_sub_ps(_mm256_loadu_ps(x + i + 8 * half), _mm256_loadu_ps(y + i + 8 * half));
+            __m256d low = _mm256_cvtps_pd(_mm256_castps256_ps128(d));
+            __m256d high = _mm256_cvtps_pd(_mm256_extractf128_ps(d, 1));
+            sums[2 * half] = _mm256_add_pd(sums[2 * half], _mm256_mul_pd(low, low));
+            sums[2 * half + 1] = _mm256_add_pd(sums[2 * half + 1], _mm256_mul_pd(high, high));
+        }
+    }
+    for (size_t j = 0; j < 4; j++) {
+        _mm256_storeu_pd(lanes + 4 * j, sums[j]);
+    }
+    distanceTail(x, y, i, count, lanes);
+}
+
+// The high and low halves of the 64-bit products of the lanes of a and m
+__attribute__((target("avx2")))
+inline void mulHiLo(__m256i a, __m256i m, __m256i& high, __m256i& low) {
+    __m256i even = _mm256_mul_epu32(a, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    low = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xaa);
+    high = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xaa);
+}
+
+// noiseLog(), noiseSin() and noiseCos() on 8 lanes
+__attribute__((target("avx2")))
+inline __m256 noiseLogAvx2(__m256 u) {
+    __m256i bits = _mm256_castps_si256(u);
+    __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+    __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)), _mm256_set1_epi32(0x3f800000)));
+    __m256 large = _mm256_cmp_ps(m, _mm256_set1_ps(kSqrtHalf2), _CMP_GT_OQ);
+    m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), large);
+    e = _mm256_blendv_ps(e, _mm256_add_ps(e, _mm256_set1_ps(1.0f)), large);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 f = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+    __m256 f2 = _mm256_mul_ps(f, f);
+    __m256 p = _mm256_add_ps(_mm256_mul_ps(f2, _mm256_set1_ps(1.0f / 9.0f)), _mm256_set1_ps(1.0f / 7.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f2), _mm256_set1_ps(1.0f / 5.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f2), _mm256_set1_ps(1.0f / 3.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, f2), one);
+    return _mm256_add_ps(_mm256_mul_ps(e, _mm256_set1_ps(kLn2)), _mm256_mul_ps(_mm256_add_ps(f, f), p));
+}
+
+__attribute__((target("avx2")))
+inline __m256 noiseSinAvx2(__m256 x) {
+    __m256 x2 = _mm256_mul_ps(x, x);
+    __m256 p = _mm256_add_ps(_mm256_mul_ps(x2, _mm256_set1_ps(1.0f / 6227020800.0f)), _mm256_set1_ps(-1.0f / 39916800.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(1.0f / 362880.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(-1.0f / 5040.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(1.0f / 120.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(-1.0f / 6.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(1.0f));
+    return _mm256_mul_ps(x, p);
+}
+
+__attribute__((target("avx2")))
+inline __m256 noiseCosAvx2(__m256 x) {
+    __m256 x2 = _mm256_mul_ps(x, x);
+    __m256 p = _mm256_add_ps(_mm256_mul_ps(x2, _mm256_set1_ps(-1.0f / 87178291200.0f)), _mm256_set1_ps(1.0f / 479001600.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(-1.0f / 3628800.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(1.0f / 40320.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(-1.0f / 720.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(1.0f / 24.0f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(-1.0f / 2.0f));
+    return _mm256_add_ps(_mm256_mul_ps(p, x2), _mm256_set1_ps(1.0f));
+}
+
+// boxMuller() on 8 lanes
+__attribute__((target("avx2")))
+inline void boxMullerAvx2(__m256i w0, __m256i w1, __m256& z0, __m256& z1) {
+    // The words shifted right by 8 fit in the positive range of the signed conversion
+    __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_srli_epi32(w0, 8), _mm256_set1_epi32(1))),
+        _mm256_set1_ps(0x1.0p-24f));
+    __m256 r = _mm256_sqrt_ps(_mm256_mul_ps(noiseLogAvx2(u), _mm256_set1_ps(-2.0f)));
+    __m256 x = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(w1, 8), _mm256_set1_epi32(0x3fffff)));
+    x = _mm256_mul_ps(_mm256_mul_ps(x, _mm256_set1_ps(0x1.0p-22f)), _mm256_set1_ps(kHalfPi));
+    __m256 s = noiseSinAvx2(x);
+    __m256 c = noiseCosAvx2(x);
+    __m256i quadrant = _mm256_srli_epi32(w1, 30);
+    __m256 odd = _mm256_castsi256_ps(_mm256_slli_epi32(quadrant, 31));
+    __m256 cosine = _mm256_blendv_ps(c, s, odd);
+    __m256 sine = _mm256_blendv_ps(s, c, odd);
+    __m256i signBit = _mm256_set1_epi32(int32_t(0x80000000u));
+    __m256i cosineSign = _mm256_slli_epi32(_mm256_xor_si256(quadrant, _mm256_srli_epi32(quadrant, 1)), 31);
+    __m256i sineSign = _mm256_and_si256(_mm256_slli_epi32(quadrant, 30), signBit);
+    cosine = _mm256_xor_ps(cosine, _mm256_castsi256_ps(cosineSign));
+    sine = _mm256_xor_ps(sine, _mm256_castsi256_ps(sineSign));
+    z0 = _mm256_mul_ps(r, cosine);
+    z1 = _mm256_mul_ps(r, sine);
+}
+
+__attribute__((target("avx2")))
+void gaussianAvx2(float* x, size_t count, float stddev, uint64_t seed, uint64_t stream, uint64_t first) {
+    // Elements before the first whole group and after the last one are left to noiseTail()
+    size_t head = std::min(count, size_t((kNoiseGroup - first % kNoiseGroup) % kNoiseGroup));
+    noiseTail(x, 0, head, stddev, seed, stream, first);
+    __m256 scale = _mm256_set1_ps(stddev);
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    size_t i = head;
+    for (; i + kNoiseGroup <= count; i += kNoiseGroup) {
+        uint64_t n = (first + i) / kNoiseGroup * 8;
+        __m256i c[4] = {_mm256_add_epi32(_mm256_set1_epi32(int32_t(uint32_t(n))), lanes), _mm256_set1_epi32(int32_t(uint32_t(n >> 32))),
+            _mm256_set1_epi32(int32_t(uint32_t(stream))), _mm256_set1_epi32(int32_t(uint32_t(stream >> 32)))};
+        uint32_t key0 = uint32_t(seed);
+        uint32_t key1 = uint32_t(seed >> 32);
+        for (int round = 0; round < kPhiloxRounds; round++) {
+            __m256i high0, low0, high1, low1;
+            mulHiLo(c[0], _mm256_set1_epi32(int32_t(kPhiloxM0)), high0, low0);
+            mulHiLo(c[2], _mm256_set1_epi32(int32_t(kPhiloxM1)), high1, low1);
+            c[0] = _mm256_xor_si256(_mm256_xor_si256(high1, c[1]), _mm256_set1_epi32(int32_t(key0)));
+            c[1] = low1;
+            c[2] = _mm256_xor_si256(_mm256_xor_si256(high0, c[3]), _mm256_set1_epi32(int32_t(key1)));
+            c[3] = low0;
+            key0 += kPhiloxW0;
+            key1 += kPhiloxW1;
+        }
+        __m256 z[4];
+        boxMullerAvx2(c[0], c[1], z[0], z[1]);
+        boxMullerAvx2(c[2], c[3], z[2], z[3]);
+        for (size_t j = 0; j < 4; j++) {
+            float* out = x + i + 8 * j;
+            _mm256_storeu_ps(out, _mm256_add_ps(_mm256_loadu_ps(out), _mm256_mul_ps(scale, z[j])));
+        }
+    }
+    noiseTail(x, i, count, stddev, seed, stream, first);
+}
+
+__attribute__((target("avx2")))
+void fixedPointAvx2(const float* x, int32_t* out, size_t count, float scale, float limit) {
+    const __m256 scalev = _mm256_set1_ps(scale);
+    const __m256 lowv = _mm256_set1_ps(-limit);
+    const __m256 highv = _mm256_set1_ps(limit);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i), scalev), lowv);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_cvtps_epi32(_mm256_min_ps(v, highv)));
+    }
+    fixedPointScalar(x + i, out + i, count - i, scale, limit);
+}
+
+// Rotations of the lanes of v left by 16 and 8 bits move whole bytes
+__attribute__((target("avx2")))
+inline __m256i rotateLeftAvx2(__m256i v, int bits) {
+    if (bits == 16) {
+        return _mm256_shuffle_epi8(v, _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+            2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+    }
+    if (bits == 8) {
+        return _mm256_shuffle_epi8(v, _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+            3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14));
+    }
+    return _mm256_or_si256(_mm256_slli_epi32(v, bits), _mm256_srli_epi32(v, 32 - bits));
+}
+
+__attribute__((target("avx2")))
+inline void quarterRoundAvx2(__m256i* x, int a, int b, int c, int d) {
+    x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = rotateLeftAvx2(_mm256_xor_si256(x[d], x[a]), 16);
+    x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = rotateLeftAvx2(_mm256_xor_si256(x[b], x[c]), 12);
+    x[a] = _mm256_add_epi32(x[a], x[b]); x[d] = rotateLeftAvx2(_mm256_xor_si256(x[d], x[a]), 8);
+    x[c] = _mm256_add_epi32(x[c], x[d]); x[b] = rotateLeftAvx2(_mm256_xor_si256(x[b], x[c]), 7);
+}
+
+// ChaCha20 on 8 blocks, one per lane
+__attribute__((target("avx2")))
+void maskAvx2(int32_t* x, size_t count, const uint32_t key[8], uint64_t nonce, bool subtract, uint64_t first) {
+    // Elements before the first whole group and after the last one are left to maskTail()
+    size_t head = std::min(count, size_t((kMaskGroup - first % kMaskGroup) % kMaskGroup));
+    maskTail(x, 0, head, key, nonce, subtract, first);
+    __m256i state[16];
+    for (int j = 0; j < 4; j++) {
+        state[j] = _mm256_set1_epi32(int32_t(kChaChaConstants[j]));
+    }
+    for (int j = 0; j < 8; j++) {
+        state[4 + j] = _mm256_set1_epi32(int32_t(key[j]));
+    }
+    state[14] = _mm256_set1_epi32(int32_t(uint32_t(nonce)));
+    state[15] = _mm256_set1_epi32(int32_t(uint32_t(nonce >> 32)));
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    size_t i = head;
+    for (; i + kMaskGroup <= count; i += kMaskGroup) {
+        // The counters of a group are a multiple of 8 plus the lane, so the low word does not carry
+        uint64_t n = (first + i) / kMaskGroup * 8;
+        state[12] = _mm256_add_epi32(_mm256_set1_epi32(int32_t(uint32_t(n))), lanes);
+        state[13] = _mm256_set1_epi32(int32_t(uint32_t(n >> 32)));
+        __m256i w[16];
+        memcpy(w, state, sizeof(w));
+        for (int round = 0; round < 10; round++) {
+            quarterRoundAvx2(w, 0, 4, 8, 12);
+            quarterRoundAvx2(w, 1, 5, 9, 13);
+            quarterRoundAvx2(w, 2, 6, 10, 14);
+            quarterRoundAvx2(w, 3, 7, 11, 15);
+            quarterRoundAvx2(w, 0, 5, 10, 15);
+            quarterRoundAvx2(w, 1, 6, 11, 12);
+            quarterRoundAvx2(w, 2, 7, 8, 13);
+            quarterRoundAvx2(w, 3, 4, 9, 14);
+        }
+        for (int j = 0; j < 16; j++) {
+            __m256i* out = reinterpret_cast<__m256i*>(x + i + 8 * j);
+            __m256i mask = _mm256_add_epi32(w[j], state[j]);
+            __m256i v = _mm256_loadu_si256(out);
+            _mm256_storeu_si256(out, subtract ? _mm256_sub_epi32(v, mask) : _mm256_add_epi32(v, mask));
+        }
+    }
+    maskTail(x, i, count, key, nonce, subtract, first);
+}
+
+__attribute__((target("avx2")))
+void rangeAvx2(const float* x, float* error, size_t count, float& low, float& high) {
+    __m256 lows = _mm256_set1_ps(low);
+    __m256 highs = _mm256_set1_ps(high);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        if (error) {
+            v = _mm256_add_ps(v, _mm256_loadu_ps(error + i));
+            _mm256_storeu_ps(error + i, v);
+        }
+        lows = _mm256_min_ps(lows, v);
+        highs = _mm256_max_ps(highs, v);
+    }
+    float values[8];
+    _mm256_storeu_ps(values, lows);
+    low = *std::min_element(values, values + 8);
+    _mm256_storeu_ps(values, highs);
+    high = *std::max_element(values, values + 8);
+    rangeScalar(x + i, error ? error + i : nullptr, count - i, low, high);
+}
+
+__attribute__((target("avx2")))
+__m256i mixBitsAvx2(__m256i h) {
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x7feb352d));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int) 0x846ca68bu));
+    return _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+}
+
+__attribute__((target("avx2")))
+void quantizeAvx2(const float* v, float* error, size_t count, const QuantizeBlock& block, uint32_t seed, uint64_t index, uint8_t* codes) {
+    const __m256 low = _mm256_set1_ps(block.low);
+    const __m256 scale = _mm256_set1_ps(block.scale);
+    const __m256 inverse = _mm256_set1_ps(block.inverse);
+    const __m256 levels = _mm256_set1_ps(block.levels);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 unit = _mm256_set1_ps(0x1.0p-24f);
+    const __m256i seeds = _mm256_set1_epi32((int) seed);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i indices = _mm256_add_epi32(_mm256_set1_epi32((int) uint32_t(index + i)), lanes);
+        __m256i bits = _mm256_srli_epi32(mixBitsAvx2(_mm256_xor_si256(indices, seeds)), 8);
+        __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(bits), unit);
+        __m256 x = _mm256_loadu_ps(v + i);
+        __m256 t = _mm256_mul_ps(_mm256_sub_ps(x, low), inverse);
+        t = _mm256_floor_ps(_mm256_add_ps(t, u));
+        t = _mm256_min_ps(_mm256_max_ps(t, zero), levels);
+        __m256i q = _mm256_cvttps_epi32(t);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(codes + i), _mm_packus_epi16(words, words));
+        if (error) {
+            _mm256_storeu_ps(error + i, _mm256_sub_ps(x, _mm256_add_ps(low, _mm256_mul_ps(t, scale))));
+        }
+    }
+    quantizeScalar(v + i, error ? error + i : nullptr, count - i, block, seed, index + i, codes + i);
+}
+
+__attribute__((target("avx2")))
+void dequantizeAvx2(const uint8_t* codes, size_t count, float low, float scale, float* out) {
+    const __m256 lows = _mm256_set1_ps(low);
+    const __m256 scales = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(codes + i));
+        __m256 q = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(lows, _mm256_mul_ps(q, scales)));
+    }
+    dequantizeScalar(codes + i, count - i, low, scale, out + i);
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t countAboveAvx2(const float* x, size_t count, float threshold) {
+    const __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 thresholds = _mm256_set1_ps(threshold);
+    size_t above = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_and_ps(_mm256_loadu_ps(x + i), magnitude);
+        above += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_cmp_ps(v, thresholds, _CMP_GE_OQ)));
+    }
+    return above + countAboveScalar(x + i, count - i, threshold);
+}
+
+__attribute__((target("avx2,bmi")))
+size_t gatherAboveAvx2(const float* x, size_t count, float threshold, uint64_t index, uint64_t* out) {
+    const __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 thresholds = _mm256_set1_ps(threshold);
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_and_ps(_mm256_loadu_ps(x + i), magnitude);
+        unsigned mask = _mm256_movemask_ps(_mm256_cmp_ps(v, thresholds, _CMP_GE_OQ));
+        while (mask) {
+            out[n++] = index + i + _tzcnt_u32(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + gatherAboveScalar(x + i, count - i, threshold, index + i, out + n);
+}
+
+// GCC 12 warns about the undefined pass-through operand inside the AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+void axpyAvx512(float a, const float* x, float* y, size_t count) {
+    const __m512 av = _mm512_set1_ps(a);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 product = _mm512_mul_ps(av, _mm512_loadu_ps(x + i));
+        _mm512_storeu_ps(y + i, _mm512_add_ps(_mm512_loadu_ps(y + i), product));
+    }
+    axpyScalar(a, x + i, y + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+void axpbyAvx512(float a, const float* x, float b, float* y, size_t count) {
+    const __m512 av = _mm512_set1_ps(a);
+    const __m512 bv = _mm512_set1_ps(b);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 ax = _mm512_mul_ps(av, _mm512_loadu_ps(x + i));
+        __m512 by = _mm512_mul_ps(bv, _mm512_loadu_ps(y + i));
+        _mm512_storeu_ps(y + i, _mm512_add_ps(ax, by));
+    }
+    axpbyScalar(a, x + i, b, y + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+void scaleAvx512(float a, float* x, size_t count) {
+    const __m512 av = _mm512_set1_ps(a);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(x + i, _mm512_mul_ps(av, _mm512_loadu_ps(x + i)));
+    }
+    scaleScalar(a, x + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+void subAvx512(const float* x, const float* y, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(out + i, _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    }
+    subScalar(x + i, y + i, out + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+void clampAvx512(float* x, size_t count, float low, float high) {
+    const __m512 lowv = _mm512_set1_ps(low);
+    const __m512 highv = _mm512_set1_ps(high);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 t = _mm512_max_ps(lowv, _mm512_loadu_ps(x + i));
+        _mm512_storeu_ps(x + i, _mm512_min_ps(highv, t));
+    }
+    clampScalar(x + i, count - i, low, high);
+}
+
+__attribute__((target("avx512f")))
+void weightedSumAvx512(const float* const* inputs, const float* weights, size_t inputCount, size_t offset, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 sum = _mm512_mul_ps(_mm512_set1_ps(weights[0]), _mm512_loadu_ps(inputs[0] + offset + i));
+        for (size_t k = 1; k < inputCount; k++) {
+            __m512 product = _mm512_mul_ps(_mm512_set1_ps(weights[k]), _mm512_loadu_ps(inputs[k] + offset + i));
+            sum = _mm512_add_ps(sum, product);
+        }
+        _mm512_storeu_ps(out + i, sum);
+    }
+    weightedSumScalar(inputs, weights, inputCount, offset + i, out + i, count - i);
+}
+
+__attribute__((target("avx512f")))
+void statsAvx512(const float* x, size_t count, Partial& partial) {
+    const __m512i exponentMask = _mm512_set1_epi32((int) kExponentMask);
+    __m512d low = _mm512_setzero_pd();
+    __m512d high = _mm512_setzero_pd();
+    __m512 maxAbs = _mm512_setzero_ps();
+    uint64_t nonFinite = 0;
+    size_t i = 0;
+    for (; i + kLanes <= count; i += kLanes) {
+        __m512d first = _mm512_cvtps_pd(_mm256_loadu_ps(x + i));
+        __m512d second = _mm512_cvtps_pd(_mm256_loadu_ps(x + i + 8));
+        low = _mm512_add_pd(low, _mm512_mul_pd(first, first));
+        high = _mm512_add_pd(high, _mm512_mul_pd(second, second));
+        __m512 v = _mm512_loadu_ps(x + i);
+        maxAbs = _mm512_max_ps(_mm512_abs_ps(v), maxAbs);
+        __m512i exponent = _mm512_and_si512(_mm512_castps_si512(v), exponentMask);
+        nonFinite += __builtin_popcount(_mm512_cmpeq_epi32_mask(exponent, exponentMask));
+    }
+    _mm512_storeu_pd(partial.lanes, low);
+    _mm512_storeu_pd(partial.lanes + 8, high);
+    float maxes[16];
+    _mm512_storeu_ps(maxes, maxAbs);
+    partial.maxAbs = *std::max_element(maxes, maxes + 16);
+    partial.nonFinite = nonFinite;
+    statsTail(x, i, count, partial);
+}
+
+#pragma GCC diagnostic pop
+
+#endif // FEDNLIB_X86_KERNELS
+
+#ifdef FEDNLIB_NEON_KERNELS
+
+// vmaxq_f32() and vminq_f32() return NaN if either input is NaN, compare and select instead
+// to match the other kernels
+
+void axpyNeon(float a, const float* x, float* y, size_t count) {
+    const float32x4_t av = vdupq_n_f32(a);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t product = vmulq_f32(av, vld1q_f32(x + i));
+        vst1q_f32(y + i, vaddq_f32(vld1q_f32(y + i), product));
+    }
+    axpyScalar(a, x + i, y + i, count - i);
+}
+
+void axpbyNeon(float a, const float* x, float b, float* y, size_t count) {
+    const float32x4_t av = vdupq_n_f32(a);
+    const float32x4_t bv = vdupq_n_f32(b);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t ax = vmulq_f32(av, vld1q_f32(x + i));
+        float32x4_t by = vmulq_f32(bv, vld1q_f32(y + i));
+        vst1q_f32(y + i, vaddq_f32(ax, by));
+    }
+    axpbyScalar(a, x + i, b, y + i, count - i);
+}
+
+void scaleNeon(float a, float* x, size_t count) {
+    const float32x4_t av = vdupq_n_f32(a);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(x + i, vmulq_f32(av, vld1q_f32(x + i)));
+    }
+    scaleScalar(a, x + i, count - i);
+}
+
+void subNeon(const float* x, const float* y, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(out + i, vsubq_f32(vld1q_f32(x + i), vld1q_f32(y + i)));
+    }
+    subScalar(x + i, y + i, out + i, count - i);
+}
+
+void clampNeon(float* x, size_t count, float low, float high) {
+    const float32x4_t lowv = vdupq_n_f32(low);
+    const float32x4_t highv = vdupq_n_f32(high);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t v = vld1q_f32(x + i);
+        float32x4_t t = vbslq_f32(vcgtq_f32(lowv, v), lowv, v);
+        vst1q_f32(x + i, vbslq_f32(vcltq_f32(highv, t), highv, t));
+    }
+    clampScalar(x + i, count - i, low, high);
+}
+
+void weightedSumNeon(const float* const* inputs, const float* weights, size_t inputCount, size_t offset, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t sum = vmulq_f32(vdupq_n_f32(weights[0]), vld1q_f32(inputs[0] + offset + i));
+        for (size_t k = 1; k < inputCount; k++) {
+            sum = vaddq_f32(sum, vmulq_f32(vdupq_n_f32(weights[k]), vld1q_f32(inputs[k] + offset + i)));
+        }
+        vst1q_f32(out + i, sum);
+    }
+    weightedSumScalar(inputs, weights, inputCount, offset + i, out + i, count - i);
+}
+
+void statsNeon(const float* x, size_t count, Partial& partial) {
+    const uint32x4_t exponentMask = vdupq_n_u32(kExponentMask);
+    float64x2_t sums[8];
+    for (size_t j = 0; j < 8; j++) {
+        sums[j] = vdupq_n_f64(0);
+    }
+    float32x4_t maxAbs = vdupq_n_f32(0);
+    uint32x4_t nonFinite = vdupq_n_u32(0); // A chunk is small enough not to overflow
+    size_t i = 0;
+    for (; i + kLanes <= count; i += kLanes) {
+        for (size_t j = 0; j < 4; j++) {
+            float32x4_t v = vld1q_f32(x + i + 4 * j);
+            float64x2_t low = vcvt_f64_f32(vget_low_f32(v));
+            float64x2_t high = vcvt_high_f64_f32(v);
+            sums[2 * j] = vaddq_f64(sums[2 * j], vmulq_f64(low, low));
+            sums[2 * j + 1] = vaddq_f64(sums[2 * j + 1], vmulq_f64(high, high));
+            float32x4_t a = vabsq_f32(v);
+            maxAbs = vbslq_f32(vcgtq_f32(a, maxAbs), a, maxAbs);
+            uint32x4_t exponent = vandq_u32(vreinterpretq_u32_f32(v), exponentMask);
+            nonFinite = vsubq_u32(nonFinite, vceqq_u32(exponent, exponentMask));
+        }
+    }
+    for (size_t j = 0; j < 8; j++) {
+        vst1q_f64(partial.lanes + 2 * j, sums[j]);
+    }
+    partial.maxAbs = vmaxvq_f32(maxAbs);
+    partial.nonFinite = vaddvq_u32(nonFinite);
+    statsTail(x, i, count, partial);
+}
+
+#endif // FEDNLIB_NEON_KERNELS
+
+struct Kernels {
+    const char* name;
+    void (*axpy)(float, const float*, float*, size_t);
+    void (*axpby)(float, const float*, float, float*, size_t);
+    void (*scale)(float, float*, size_t);
+    void (*sub)(const float*, const float*, float*, size_t);
+    void (*clamp)(float*, size_t, float, float);
+    void (*weightedSum)(const float* const*, const float*, size_t, size_t, float*, size_t);
+    void (*stats)(const float*, size_t, Partial&);
+    void (*range)(const float*, float*, size_t, float&, float&);
+    void (*quantize)(const float*, float*, size_t, const QuantizeBlock&, uint32_t, uint64_t, uint8_t*);
+    void (*dequantize)(const uint8_t*, size_t, float, float, float*);
+    size_t (*countAbove)(const float*, size_t, float);
+    size_t (*gatherAbove)(const float*, size_t, float, uint64_t, uint64_t*);
+    void (*dot)(const float*, const float*, size_t, double*);
+    void (*distance)(const float*, const float*, size_t, double*);
+    void (*gaussian)(float*, size_t, float, uint64_t, uint64_t, uint64_t);
+    void (*fixedPoint)(const float*, int32_t*, size_t, float, float);
+    void (*mask)(int32_t*, size_t, const uint32_t*, uint64_t, bool, uint64_t);
+};
+
+// The quantization, noise and mask kernels are bound by the hashing and the conversions rather
+// than by memory, and the top-k, dot product, distance and fixed-point ones by memory on any
+// vector unit, AVX-512 and NEON use the AVX2 and portable ones
+
+const Kernels scalarKernels = {"scalar", axpyScalar, axpbyScalar, scaleScalar, subScalar, clampScalar, weightedSumScalar, statsScalar,
+    rangeScalar, quantizeScalar, dequantizeScalar, countAboveScalar, gatherAboveScalar, dotScalar, distanceScalar, gaussianScalar,
+    fixedPointScalar, maskScalar};
+#ifdef FEDNLIB_X86_KERNELS
+const Kernels avx2Kernels = {"avx2", axpyAvx2, axpbyAvx2, scaleAvx2, subAvx2, clampAvx2, weightedSumAvx2, statsAvx2,
+    rangeAvx2, quantizeAvx2, dequantizeAvx2, countAboveAvx2, gatherAboveAvx2, dotAvx2, distanceAvx2, gaussianAvx2,
+    fixedPointAvx2, maskAvx2};
+const Kernels avx512Kernels = {"avx512", axpyAvx512, axpbyAvx512, scaleAvx512, subAvx512, clampAvx512, weightedSumAvx512, statsAvx512,
+    rangeAvx2, quantizeAvx2, dequantizeAvx2, countAboveAvx2, gatherAboveAvx2, dotAvx2, distanceAvx2, gaussianAvx2,
+    fixedPointAvx2, maskAvx2};
+#endif
+#ifdef FEDNLIB_NEON_KERNELS
+const Kernels neonKernels = {"neon", axpyNeon, axpbyNeon, scaleNeon, subNeon, clampNeon, weightedSumNeon, statsNeon,
+    rangeScalar, quantizeScalar, dequantizeScalar, countAboveScalar, gatherAboveScalar, dotScalar, distanceScalar, gaussianScalar,
+    fixedPointScalar, maskScalar};
+#endif
+
+std::vector<const Kernels*> supportedKernels() {
+    std::vector<const Kernels*> supported = {&scalarKernels};
+#ifdef FEDNLIB_X86_KERNELS
+    __builtin_cpu_init();
+    // The AVX2 kernels also use POPCNT and BMI1, and the AVX-512 kernels use the AVX2 ones
+    bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi");
+    if (avx2) {
+        supported.push_back(&avx2Kernels);
+    }
+    if (avx2 && __builtin_cpu_supports("avx512f")) {
+        supported.push_back(&avx512Kernels);
+    }
+#endif
+#ifdef FEDNLIB_NEON_KERNELS
+    supported.push_back(&neonKernels);
+#endif
+    return supported;
+}
+
+std::atomic<const Kernels*>& selected() {
+    static std::atomic<const Kernels*> kernels(supportedKernels().back());
+    return kernels;
+}
+
+const Kernels& active() {
+    return *selected().load(std::memory_order_relaxed);
+}
+
+/**
+ * A persistent pool of worker threads that run the chunks of one operation at a time. The
+ * calling thread takes chunks too, operations from several threads are run one after the
+ * other. An operation started from a chunk of another, which would wait for the pool it is
+ * running on, runs all its chunks on the thread of that chunk.
+ */
+class ChunkPool {
+public:
+    ~ChunkPool() { resize(0); }
+
+    void setThreads(unsigned count) {
+        std::lock_guard<std::mutex> call(callMutex);
+        threads = count;
+        resize(0);
+    }
+
+    void run(size_t chunks, const std::function<void(size_t)>& fn) {
+        if (inChunk) {
+            for (size_t chunk = 0; chunk < chunks; chunk++) {
+                fn(chunk);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> call(callMutex);
+        ChunkScope scope;
+        unsigned total = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        size_t wanted = std::min<size_t>(total, chunks) - 1;
+        if (wanted == 0) {
+            for (size_t chunk = 0; chunk < chunks; chunk++) {
+                fn(chunk);
+            }
+            return;
+        }
+        if (workers.size() < wanted) {
+            resize(std::min<size_t>(total, 64) - 1);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            jobChunks = chunks;
+            next = 0;
+            active = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        work();
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
+        job = nullptr;
+    }
+
+private:
+    // Marks the calling thread as running chunks for as long as it is in run()
+    struct ChunkScope {
+        ChunkScope() { inChunk = true; }
+        ~ChunkScope() { inChunk = false; }
+    };
+
+    void resize(size_t count) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        stopping = false;
+        for (size_t i = 0; i < count; i++) {
+            workers.emplace_back(&ChunkPool::workerLoop, this, generation);
+        }
+    }
+
+    void work() {
+        for (size_t chunk = next++; chunk < jobChunks; chunk = next++) {
+            (*job)(chunk);
+        }
+    }
+
+    void workerLoop(uint64_t seen) {
+        inChunk = true;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            work();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--active == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    static inline thread_local bool inChunk = false;
+    std::mutex callMutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::vector<std::thread> workers;
+    unsigned threads = 0;
+    bool stopping = false;
+    uint64_t generation = 0;
+    const std::function<void(size_t)>* job = nullptr;
+    size_t jobChunks = 0;
+    std::atomic<size_t> next{0};
+    size_t active = 0;
+};
+
+ChunkPool& pool() {
+    static ChunkPool instance;
+    return instance;
+}
+
+// Runs fn(begin, end) over the chunks of a buffer, on the pool if the buffer is large
+template <typename Fn>
+void forChunks(size_t count, const Fn& fn, size_t chunkElements = kChunkElements) {
+    size_t chunks = (count + chunkElements - 1) / chunkElements;
+    auto runChunk = [&](size_t chunk) {
+        size_t begin = chunk * chunkElements;
+        fn(chunk, begin, std::min(count, begin + chunkElements));
+    };
+    if (count < kParallelElements) {
+        for (size_t chunk = 0; chunk < chunks; chunk++) {
+            runChunk(chunk);
+        }
+        return;
+    }
+    pool().run(chunks, runChunk);
+}
+
+// Runs fn(block, beginRow, endRow) over blocks of the rows of a matrix, on the pool if the
+// matrix is large. The blocks do not depend on the number of threads.
+template <typename Fn>
+void forRowBlocks(size_t rows, size_t cols, size_t blocks, const Fn& fn) {
+    auto runBlock = [&](size_t block) {
+        fn(block, rows * block / blocks, rows * (block + 1) / blocks);
+    };
+    if (rows * cols < kParallelElements) {
+        for (size_t block = 0; block < blocks; block++) {
+            runBlock(block);
+        }
+        return;
+    }
+    pool().run(blocks, runBlock);
+}
+
+size_t rowBlocks(size_t rows, size_t cols, size_t most) {
+    return std::max<size_t>(1, std::min({rows, most, (rows * cols + kChunkElements - 1) / kChunkElements}));
+}
+
+} // namespace
+
+/**
+ * @brief Adds a times x to y.
+ */
+void axpy(float a, const float* x, float* y, size_t count) {
+    const Kernels& k = active();
+    forChunks(count, [&](size_t, size_t begin, size_t end) { k.axpy(a, x + begin, y + begin, end - begin); });
+}
+
+/**
+ * @brief Sets y to a times x plus b times y, e.g. to update a momentum buffer.
+ */
+void axpby(float a, const float* x, float b, float* y, size_t count) {
+    const Kernels& k = active();
+    forChunks(count, [&](size_t, size_t begin, size_t end) { k.axpby(a, x + begin, b, y + begin, end - begin); });
+}
+
+/**
+ * @brief Multiplies x by a.
+ */
+void scale(float a, float* x, size_t count) {
+    const Kernels& k = active();
+    forChunks(count, [&](size_t, size_t begin, size_t end) { k.scale(a, x + begin, end - begin); });
+}
+
+/**
+ * @brief Writes x minus y to out, which may be x or y.
+ */
+void sub(const float* x, const float* y, float* out, size_t count) {
+    const Kernels& k = active();
+    forChunks(count, [&](size_t, size_t begin, size_t end) { k.sub(x + begin, y + begin, out + begin, end - begin); });
+}
+
+/**
+ * @brief Limits the elements of x to [low, high]. NaNs are left as they are.
+ */
+void clamp(float* x, size_t count, float low, float high) {
+    const Kernels& k = active();
+    forChunks(count, [&](size_t, size_t begin, size_t end) { k.clamp(x + begin, end - begin, low, high); });
+}
+
+/**
+ * @brief Writes the sum of inputs[k] times weights[k] to out, adding the inputs in order.
+ *
+ * The output may be one of the inputs. Nothing is written if there are no inputs.
+ */
+void weightedSum(const float* const* inputs, const float* weights, size_t inputCount, float* out, size_t count) {
+    if (inputCount == 0) {
+        return;
+    }
+    const Kernels& k = active();
+    forChunks(count, [&](size_t, size_t begin, size_t end) {
+        k.weightedSum(inputs, weights, inputCount, begin, out + begin, end - begin);
+    });
+}
+
+/**
+ * @brief Computes the sum of squares, the largest absolute value and the number of
+ * non-finite elements of x in one pass.
+ */
+Stats stats(const float* x, size_t count) {
+    const Kernels& k = active();
+    std::vector<Partial> partials((count + kChunkElements - 1) / kChunkElements);
+    forChunks(count, [&](size_t chunk, size_t begin, size_t end) {
+        Partial& partial = partials[chunk];
+        std::fill(partial.lanes, partial.lanes + kLanes, 0.0);
+        partial.maxAbs = 0;
+        partial.nonFinite = 0;
+        k.stats(x + begin, end - begin, partial);
+    });
+    Stats result;
+    for (Partial& partial : partials) {
+        result.sumSquares = result.sumSquares + sumLanes(partial.lanes);
+        result.maxAbs = std::max(result.maxAbs, partial.maxAbs);
+        result.nonFinite += partial.nonFinite;
+    }
+    return result;
+}
+
+double l2Norm(const float* x, size_t count) {
+    return std::sqrt(stats(x, count).sumSquares);
+}
+
+float maxAbs(const float* x, size_t count) {
+    return stats(x, count).maxAbs;
+}
+
+bool allFinite(const float* x, size_t count) {
+    return stats(x, count).nonFinite == 0;
+}
+
+/**
+ * @brief Computes the dot product of x and y, accumulated in double like stats().
+ */
+double dot(const float* x, const float* y, size_t count) {
+    const Kernels& k = active();
+    std::vector<Partial> partials((count + kChunkElements - 1) / kChunkElements);
+    forChunks(count, [&](size_t chunk, size_t begin, size_t end) {
+        Partial& partial = partials[chunk];
+        std::fill(partial.lanes, partial.lanes + kLanes, 0.0);
+        k.dot(x + begin, y + begin, end - begin, partial.lanes);
+    });
+    double result = 0;
+    for (Partial& partial : partials) {
+        result = result + sumLanes(partial.lanes);
+    }
+    return result;
+}
+
+/**
+ * @brief Computes the squared L2 distance of x and y, i.e. the squared norm of x minus y
+ * without writing it, accumulated in double like stats().
+ */
+double squaredDistance(const float* x, const float* y, size_t count) {
+    const Kernels& k = active();
+    std::vector<Partial> partials((count + kChunkElements - 1) / kChunkElements);
+    forChunks(count, [&](size_t chunk, size_t begin, size_t end) {
+        Partial& partial = partials[chunk];
+        std::fill(partial.lanes, partial.lanes + kLanes, 0.0);
+        k.distance(x + begin, y + begin, end - begin, partial.lanes);
+    });
+    double result = 0;
+    for (Partial& partial : partials) {
+        result = result + sumLanes(partial.lanes);
+    }
+    return result;
+}
+
+/**
+ * @brief Adds Gaussian noise of mean 0 and standard deviation stddev to x, e.g. for
+ * differentially private updates.
+ *
+ * The noise of every element is a function of the seed, the stream and the index of the
+ * element only, drawn with the counter-based generator Philox4x32-10, so x can be noised in
+ * pieces, by any kernels and number of threads, with the same result.
+ *
+ * @param seed The key of the generator, a new random one for every update.
+ * @param stream Selects independent noise for the same seed, e.g. one per tensor.
+ * @param first The index of x[0], to noise a buffer in pieces.
+ */
+void addGaussianNoise(float* x, size_t count, float stddev, uint64_t seed, uint64_t stream, uint64_t first) {
+    const Kernels& k = active();
+    forChunks(count, [&](size_t, size_t begin, size_t end) { k.gaussian(x + begin, end - begin, stddev, seed, stream, first + begin); });
+}
+
+/**
+ * @brief Encodes x in fixed point, out[i] = x[i] * scale rounded to nearest even, e.g. for
+ * masked updates that are summed as integers.
+ *
+ * Values beyond limit are clamped to it, NaN to -limit, so out does not depend on the
+ * kernels. limit is capped at the largest float below 2^31.
+ */
+void toFixedPoint(const float* x, int32_t* out, size_t count, float scale, float limit) {
+    const Kernels& k = active();
+    limit = std::min(std::fabs(limit), 2147483520.0f);
+    forChunks(count, [&](size_t, size_t begin, size_t end) { k.fixedPoint(x + begin, out + begin, end - begin, scale, limit); });
+}
+
+/**
+ * @brief Adds the ChaCha20 key stream of a key and a nonce to x modulo 2^32, or subtracts it,
+ * e.g. the pairwise masks of secure aggregation.
+ *
+ * Like addGaussianNoise(), the mask of every element is a function of the key, the nonce and
+ * the index of the element only, so x can be masked in pieces, by any kernels and number of
+ * threads, and subtracting the mask of the same key and nonce removes it.
+ *
+ * @param key The 256-bit key, e.g. the one two clients agreed on.
+ * @param nonce Selects independent masks for the same key, e.g. one per tensor.
+ * @param first The index of x[0], to mask a buffer in pieces.
+ */
+void addMask(int32_t* x, size_t count, const uint8_t key[32], uint64_t nonce, bool subtract, uint64_t first) {
+    const Kernels& k = active();
+    uint32_t words[8];
+    for (int j = 0; j < 8; j++) {
+        words[j] = uint32_t(key[4 * j]) | uint32_t(key[4 * j + 1]) << 8 | uint32_t(key[4 * j + 2]) << 16 | uint32_t(key[4 * j + 3]) << 24;
+    }
+    forChunks(count, [&](size_t, size_t begin, size_t end) { k.mask(x + begin, end - begin, words, nonce, subtract, first + begin); });
+}
+
+/**
+ * @brief Multiplies a matrix by a set of vectors: y[c][i] is the dot product of row i of a
+ * and vector c of x.
+ *
+ * @param a The matrix, rows x cols, row major.
+ * @param x The vectors, vectors x cols.
+ * @param y The products, vectors x rows.
+ */
+void multiply(const float* a, size_t rows, size_t cols, const float* x, size_t vectors, float* y) {
+    const Kernels& k = active();
+    forRowBlocks(rows, cols, rowBlocks(rows, cols, rows), [&](size_t, size_t begin, size_t end) {
+        double lanes[kLanes];
+        for (size_t i = begin; i < end; i++) {
+            for (size_t c = 0; c < vectors; c++) {
+                std::fill(lanes, lanes + kLanes, 0.0);
+                k.dot(a + i * cols, x + c * cols, cols, lanes);
+                y[c * rows + i] = static_cast<float>(sumLanes(lanes));
+            }
+        }
+    });
+}
+
+/**
+ * @brief Multiplies the transpose of a matrix by a set of vectors: y[c][j] is the sum over
+ * the rows i of a[i][j] times x[c][i].
+ *
+ * The rows are split in at most 16 fixed blocks whose sums are added in order.
+ *
+ * @param a The matrix, rows x cols, row major.
+ * @param x The vectors, vectors x rows.
+ * @param y The products, vectors x cols.
+ */
+void multiplyTransposed(const float* a, size_t rows, size_t cols, const float* x, size_t vectors, float* y) {
+    const Kernels& k = active();
+    size_t blocks = rowBlocks(rows, cols, 16);
+    std::vector<float> sums(blocks * vectors * cols, 0.0f);
+    forRowBlocks(rows, cols, blocks, [&](size_t block, size_t begin, size_t end) {
+        float* sum = sums.data() + block * vectors * cols;
+        for (size_t i = begin; i < end; i++) {
+            for (size_t c = 0; c < vectors; c++) {
+                k.axpy(x[c * rows + i], a + i * cols, sum + c * cols, cols);
+            }
+        }
+    });
+    std::copy(sums.begin(), sums.begin() + vectors * cols, y);
+    for (size_t block = 1; block < blocks; block++) {
+        axpy(1.0f, sums.data() + block * vectors * cols, y, vectors * cols);
+    }
+}
+
+/**
+ * @brief Adds alpha times the sum of the outer products of p[c] and q[c] to a matrix, e.g.
+ * to expand a low-rank approximation.
+ *
+ * @param alpha The factor.
+ * @param p The column factors, vectors x rows.
+ * @param q The row factors, vectors x cols.
+ * @param vectors The number of factors.
+ * @param a The matrix, rows x cols, row major.
+ */
+void addOuter(float alpha, const float* p, const float* q, size_t vectors, float* a, size_t rows, size_t cols) {
+    const Kernels& k = active();
+    forRowBlocks(rows, cols, rowBlocks(rows, cols, rows), [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            for (size_t c = 0; c < vectors; c++) {
+                k.axpy(alpha * p[c * rows + i], q + c * cols, a + i * cols, cols);
+            }
+        }
+    });
+}
+
+/**
+ * @brief Scales x down so that its L2 norm is at most maxNorm.
+ *
+ * x is left alone if its norm is not finite.
+ *
+ * @return The norm of x before clipping.
+ */
+double clipL2(float* x, size_t count, double maxNorm) {
+    double norm = l2Norm(x, count);
+    if (std::isfinite(norm) && norm > maxNorm && maxNorm >= 0) {
+        scale(static_cast<float>(maxNorm / norm), x, count);
+    }
+    return norm;
+}
+
+/**
+ * @brief Quantizes x to codes of 4 or 8 bits with stochastic rounding, in blocks that each
+ * get a scale and an offset.
+ *
+ * The values of a block are mapped linearly from their range onto the codes, and rounded up
+ * or down at random with the probabilities that make the rounding unbiased. The random
+ * numbers are a hash of the seed and the index of each element, so the result is the same
+ * for any kernels and number of threads.
+ *
+ * With error feedback, the error is added to x before quantizing, and set to what the
+ * codes fail to represent, to be added the next time.
+ *
+ * @param x The values to quantize, which must be finite.
+ * @param error The error carried over, updated in place, or nullptr.
+ * @param count The number of values.
+ * @param bits 8, one code per byte, or 4, two codes per byte with the first in the low half.
+ * @param blockSize The number of values per block, a multiple of 16, or 0 for one block.
+ * @param seed The seed of the rounding, different for every call.
+ * @param codes The codes, quantizedSize(count, bits) bytes.
+ * @param params The scale and the offset of every block: values are offset + code * scale.
+ * @return false if the arguments are invalid or the range of a block is not finite.
+ */
+bool quantize(const float* x, float* error, size_t count, unsigned bits, size_t blockSize, uint32_t seed,
+        uint8_t* codes, float* params) {
+    if ((bits != 4 && bits != 8) || blockSize % 16 != 0) {
+        std::cerr << "Cannot quantize to " << bits << " bits in blocks of " << blockSize << std::endl;
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+    const Kernels& k = active();
+    size_t block = blockSize > 0 ? blockSize : count;
+    size_t blocks = (count + block - 1) / block;
+    // Chunks of whole blocks, or blocks of whole chunks
+    size_t chunkElements = block <= kChunkElements ? kChunkElements / block * block : kChunkElements;
+
+    std::vector<float> lows(blocks, INFINITY);
+    std::vector<float> highs(blocks, -INFINITY);
+    std::mutex rangeMutex;
+    forChunks(count, [&](size_t, size_t begin, size_t end) {
+        for (size_t start = begin; start < end; ) {
+            size_t b = start / block;
+            size_t stop = std::min(end, (b + 1) * block);
+            float low = INFINITY;
+            float high = -INFINITY;
+            k.range(x + start, error ? error + start : nullptr, stop - start, low, high);
+            // Only blocks larger than a chunk are shared between chunks
+            std::unique_lock<std::mutex> lock(rangeMutex, std::defer_lock);
+            if (block > chunkElements) {
+                lock.lock();
+            }
+            lows[b] = std::min(lows[b], low);
+            highs[b] = std::max(highs[b], high);
+            start = stop;
+        }
+    }, chunkElements);
+
+    const float levels = float((1u << bits) - 1);
+    std::vector<QuantizeBlock> parameters(blocks);
+    for (size_t b = 0; b < blocks; b++) {
+        float scale = (highs[b] - lows[b]) / levels;
+        if (!std::isfinite(lows[b]) || !std::isfinite(scale)) {
+            return false;
+        }
+        parameters[b] = {lows[b], scale, scale > 0 ? 1.0f / scale : 0.0f, levels};
+        params[2 * b] = scale;
+        params[2 * b + 1] = lows[b];
+    }
+
+    // The sums of x and the error are in the error buffer now
+    const float* values = error ? error : x;
+    forChunks(count, [&](size_t, size_t begin, size_t end) {
+        std::vector<uint8_t> unpacked(bits == 4 ? end - begin : 0);
+        for (size_t start = begin; start < end; ) {
+            size_t b = start / block;
+            size_t stop = std::min(end, (b + 1) * block);
+            uint8_t* out = bits == 8 ? codes + start : unpacked.data() + (start - begin);
+            k.quantize(values + start, error ? error + start : nullptr, stop - start, parameters[b], seed, start, out);
+            start = stop;
+        }
+        // Chunks and blocks start at even indices, so no byte is shared between chunks
+        for (size_t i = 0; i < unpacked.size(); i += 2) {
+            uint8_t high = i + 1 < unpacked.size() ? unpacked[i + 1] : 0;
+            codes[(begin + i) / 2] = uint8_t(unpacked[i] | (high << 4));
+        }
+    }, chunkElements);
+    return true;
+}
+
+/**
+ * @brief Converts the codes written by quantize() back to values.
+ *
+ * @return false if the arguments are invalid.
+ */
+bool dequantize(const uint8_t* codes, const float* params, size_t count, unsigned bits, size_t blockSize, float* out) {
+    if ((bits != 4 && bits != 8) || blockSize % 16 != 0) {
+        std::cerr << "Cannot dequantize from " << bits << " bits in blocks of " << blockSize << std::endl;
+        return false;
+    }
+    if (count == 0) {
+        return true;
+    }
+    const Kernels& k = active();
+    size_t block = blockSize > 0 ? blockSize : count;
+    size_t chunkElements = block <= kChunkElements ? kChunkElements / block * block : kChunkElements;
+    forChunks(count, [&](size_t, size_t begin, size_t end) {
+        std::vector<uint8_t> unpacked;
+        if (bits == 4) {
+            // Chunks start at even indices, see quantize()
+            const uint8_t* packed = codes + begin / 2;
+            size_t n = end - begin;
+            unpacked.resize(n);
+            for (size_t i = 0; i + 1 < n; i += 2) {
+                unpacked[i] = packed[i / 2] & 0x0f;
+                unpacked[i + 1] = packed[i / 2] >> 4;
+            }
+            if (n % 2 != 0) {
+                unpacked[n - 1] = packed[n / 2] & 0x0f;
+            }
+        }
+        for (size_t start = begin; start < end; ) {
+            size_t b = start / block;
+            size_t stop = std::min(end, (b + 1) * block);
+            const uint8_t* in = bits == 8 ? codes + start : unpacked.data() + (start - begin);
+            k.dequantize(in, stop - start, params[2 * b + 1], params[2 * b], out + start);
+            start = stop;
+        }
+    }, chunkElements);
+    return true;
+}
+
+/**
+ * @brief Finds the k elements of x with the largest magnitudes, without sorting x.
+ *
+ * A threshold a little below the k-th largest magnitude is estimated from a sample of x,
+ * the elements at or above it are collected in one pass, and the k largest are selected
+ * among those. If the sample was unlucky and too few elements pass, the threshold is
+ * lowered and the pass repeated. Ties at the k-th magnitude go to the lower indices, so
+ * the result is the same for any kernels and number of threads.
+ *
+ * @param x The values, which must be finite.
+ * @param count The number of values.
+ * @param k The number of elements to select.
+ * @param seed The seed of the sample.
+ * @param indices The positions of the selected elements in ascending order, min(k, count)
+ *        of them.
+ * @return The number of elements selected, min(k, count).
+ */
+size_t topK(const float* x, size_t count, size_t k, uint32_t seed, uint64_t* indices) {
+    if (k >= count) {
+        for (size_t i = 0; i < count; i++) {
+            indices[i] = i;
+        }
+        return count;
+    }
+    if (k == 0) {
+        return 0;
+    }
+    const Kernels& kernels = active();
+
+    // Magnitudes of one element at random from every stretch of count / samples elements
+    size_t samples = std::min(count, kTopKSamples);
+    std::vector<float> sample(samples);
+    for (size_t j = 0; j < samples; j++) {
+        uint64_t begin = uint64_t(j) * count / samples;
+        uint64_t end = uint64_t(j + 1) * count / samples;
+        sample[j] = fabsf(x[begin + mixBits(uint32_t(j) ^ seed) % (end - begin)]);
+    }
+    // Aim three standard deviations past the k-th largest of the sample, so that one pass
+    // almost always collects enough elements
+    double p = double(k) / count;
+    double margin = 3 * std::sqrt(samples * p * (1 - p)) + 1;
+    size_t rank = std::min(samples - 1, size_t(samples * p + margin));
+
+    std::vector<size_t> counts((count + kChunkElements - 1) / kChunkElements);
+    size_t total = 0;
+    float threshold = 0;
+    bool everything = false;
+    while (true) {
+        if (!everything) {
+            std::nth_element(sample.begin(), sample.begin() + rank, sample.end(), std::greater<float>());
+            threshold = sample[rank];
+        } else {
+            threshold = 0;
+        }
+        forChunks(count, [&](size_t chunk, size_t begin, size_t end) {
+            counts[chunk] = kernels.countAbove(x + begin, end - begin, threshold);
+        });
+        total = 0;
+        for (size_t n : counts) {
+            total += n;
+        }
+        if (total >= k) {
+            break;
+        }
+        // Past the smallest of the sample, every element passes a threshold of 0
+        everything = rank == samples - 1;
+        rank = std::min(samples - 1, 2 * rank + 1);
+    }
+
+    std::vector<uint64_t> candidates(total);
+    std::vector<size_t> offsets(counts.size());
+    for (size_t chunk = 1; chunk < counts.size(); chunk++) {
+        offsets[chunk] = offsets[chunk - 1] + counts[chunk - 1];
+    }
+    forChunks(count, [&](size_t chunk, size_t begin, size_t end) {
+        kernels.gatherAbove(x + begin, end - begin, threshold, begin, candidates.data() + offsets[chunk]);
+    });
+    if (total == k) {
+        std::copy(candidates.begin(), candidates.end(), indices);
+        return k;
+    }
+
+    // The k-th largest magnitude among the candidates, then those above it and the first
+    // of those equal to it
+    std::vector<float> magnitudes(total);
+    for (size_t i = 0; i < total; i++) {
+        magnitudes[i] = fabsf(x[candidates[i]]);
+    }
+    std::nth_element(magnitudes.begin(), magnitudes.begin() + (k - 1), magnitudes.end(), std::greater<float>());
+    float kth = magnitudes[k - 1];
+    size_t above = 0;
+    for (float magnitude : magnitudes) {
+        above += magnitude > kth;
+    }
+    size_t ties = k - above;
+    size_t n = 0;
+    for (uint64_t index : candidates) {
+        float magnitude = fabsf(x[index]);
+        if (magnitude > kth || (magnitude == kth && ties > 0 && ties--)) {
+            indices[n++] = index;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Sets the number of threads, including the caller, that large buffers are split
+ * over. 0, the default, uses one thread per core.
+ */
+void setThreads(unsigned threads) {
+    pool().setThreads(threads);
+}
+
+/**
+ * @brief Selects the kernels by name, e.g. "scalar" to compare against the vector kernels.
+ *
+ * @return false if the kernels are unknown or the CPU does not support them.
+ */
+bool setKernels(const std::string& name) {
+    for (const Kernels* supported : supportedKernels()) {
+        if (name == supported->name) {
+            selected().store(supported);
+            return true;
+        }
+    }
+    std::cerr << "Kernels " << name << " are not available" << std::endl;
+    return false;
+}
+
+/**
+ * @brief Returns the name of the kernels in use, e.g. "avx512" or "scalar".
+ */
+const char* kernels() {
+    return active().name;
+}
+
+} // namespace ops
+} // namespace fednlib
@@ -0,0 +1,346 @@
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../include/fednlib/outbox.h"
+#include "../include/fednlib/utils.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// The journal is compacted once it holds this many records and at least twice as many as
+// there are pending entries, so a client that always has entries pending keeps it bounded
+const size_t kCompactRecords = 1024;
+
+// Flushes a file or directory to disk
+bool syncPath(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+} // namespace
+
+/**
+ * @brief Opens the outbox in the given directory, creating it if needed.
+ *
+ * Entries left by a previous run are loaded from the journal, and the journal is
+ * compacted so it only holds the pending entries.
+ *
+ * @param directory The directory of the outbox.
+ * @param ttlSeconds How long an entry is kept before it is dropped, 0 to keep entries until they expire by session or round.
+ * @throws std::runtime_error If the outbox directory or journal cannot be created.
+ */
+Outbox::Outbox(const std::string& directory, long ttlSeconds)
+    : directory(directory), ttl(ttlSeconds), journal(nullptr) {
+    std::error_code ec;
+    fs::create_directories(fs::path(directory) / "blobs", ec);
+    if (ec) {
+        throw std::runtime_error("Failed to create outbox directory " + directory + ": " + ec.message());
+    }
+    journalPath = (fs::path(directory) / "journal.log").string();
+    load();
+    compact();
+
+    // Remove blob files that no pending entry refers to, e.g. after a crash during put()
+    for (const auto& file : fs::directory_iterator(fs::path(directory) / "blobs", ec)) {
+        bool referenced = false;
+        for (const auto& [id, entry] : entries) {
+            referenced = referenced || fs::path(entry.blobPath) == file.path();
+        }
+        if (!referenced) {
+            fs::remove(file.path(), ec);
+        }
+    }
+    if (!entries.empty()) {
+        std::cout << "Outbox holds " << entries.size() << " undelivered entries" << std::endl;
+    }
+}
+
+Outbox::~Outbox() {
+    if (journal) {
+        fclose(journal);
+    }
+}
+
+/**
+ * @brief Replays the journal into the map of pending entries.
+ *
+ * A record that was only partly written when the client stopped is ignored.
+ */
+void Outbox::load() {
+    std::ifstream in(journalPath);
+    std::string line;
+    while (std::getline(in, line)) {
+        json record;
+        try {
+            record = json::parse(line);
+        } catch (const std::exception& e) {
+            std::cerr << "Outbox: skipping invalid journal record" << std::endl;
+            continue;
+        }
+        std::string op = record.value("op", "");
+        std::string id = record.value("id", "");
+        if (op == "put") {
+            OutboxEntry entry;
+            entry.id = id;
+            entry.kind = record.value("kind", "");
+            entry.sessionId = record.value("session_id", "");
+            entry.roundId = record.value("round_id", "");
+            entry.blobPath = record.value("blob", "");
+            entry.payload = record.value("payload", json::object());
+            entry.createdAt = record.value("created", (std::time_t) 0);
+            entries[id] = entry;
+        } else if (op == "update" && entries.count(id)) {
+            entries[id].payload = record.value("payload", json::object());
+        } else if (op == "done" || op == "drop") {
+            entries.erase(id);
+        }
+    }
+}
+
+/**
+ * @brief Rewrites the journal with one record per pending entry and reopens it for appending.
+ */
+void Outbox::compact() {
+    if (journal) {
+        fclose(journal);
+        journal = nullptr;
+    }
+    std::string tempPath = journalPath + ".tmp";
+    FILE* out = fopen(tempPath.c_str(), "w");
+    if (!out) {
+        throw std::runtime_error("Failed to write outbox journal " + tempPath);
+    }
+    for (const auto& [id, entry] : entries) {
+        json record = {
+            {"op", "put"}, {"id", id}, {"kind", entry.kind},
+            {"session_id", entry.sessionId}, {"round_id", entry.roundId},
+            {"blob", entry.blobPath}, {"payload", entry.payload}, {"created", entry.createdAt}
+        };
+        std::string line = record.dump() + "\n";
+        fwrite(line.data(), 1, line.size(), out);
+    }
+    fflush(out);
+    fsync(fileno(out));
+    fclose(out);
+    fs::rename(tempPath, journalPath);
+    syncPath(directory);
+    journalRecords = entries.size();
+
+    journal = fopen(journalPath.c_str(), "a");
+    if (!journal) {
+        throw std::runtime_error("Failed to open outbox journal " + journalPath);
+    }
+}
+
+/**
+ * @brief Appends a record to the journal and flushes it to disk.
+ */
+void Outbox::append(const json& record) {
+    std::string line = record.dump() + "\n";
+    if (fwrite(line.data(), 1, line.size(), journal) != line.size() || fflush(journal) != 0) {
+        std::cerr << "Outbox: failed to write journal record" << std::endl;
+        return;
+    }
+    fsync(fileno(journal));
+    journalRecords++;
+}
+
+/**
+ * @brief Compacts the journal when the outbox is empty, or when most of its records are
+ * for entries that are gone or were updated since.
+ */
+void Outbox::compactIfNeeded() {
+    if (entries.empty() ? journalRecords > 0 : journalRecords >= kCompactRecords && journalRecords >= 2 * entries.size()) {
+        compact();
+    }
+}
+
+/**
+ * @brief Stores a result that could not be delivered.
+ *
+ * The file is flushed to disk, and so is the blobs/ directory it was moved to, before the
+ * entry is recorded in the journal, so the journal never refers to a blob that a crash
+ * left truncated or missing.
+ *
+ * @param kind The kind of result: "update", "validation", "prediction" or "metrics".
+ * @param sessionId The session the result belongs to.
+ * @param roundId The round the result belongs to, empty if it is not tied to a round.
+ * @param payload The data needed to deliver the result.
+ * @param filePath A file to keep with the entry. The file is moved into the outbox.
+ * @return std::string The ID of the entry, empty if the file could not be moved into the outbox.
+ */
+std::string Outbox::put(const std::string& kind, const std::string& sessionId, const std::string& roundId,
+        const json& payload, const std::string& filePath) {
+    OutboxEntry entry;
+    entry.id = generateRandomUUID();
+    entry.kind = kind;
+    entry.sessionId = sessionId;
+    entry.roundId = roundId;
+    entry.payload = payload;
+    entry.createdAt = std::time(nullptr);
+
+    if (!filePath.empty()) {
+        entry.blobPath = (fs::path(directory) / "blobs" / (entry.id + ".bin")).string();
+        std::error_code ec;
+        fs::rename(filePath, entry.blobPath, ec);
+        if (ec) {
+            // The outbox is on another file system
+            fs::copy_file(filePath, entry.blobPath, ec);
+            if (ec) {
+                std::cerr << "Outbox: failed to store " << filePath << ": " << ec.message() << std::endl;
+                return "";
+            }
+            fs::remove(filePath, ec);
+        }
+        if (!syncPath(entry.blobPath) || !syncPath((fs::path(directory) / "blobs").string())) {
+            std::cerr << "Outbox: failed to flush " << entry.blobPath << " to disk" << std::endl;
+            fs::remove(entry.blobPath, ec);
+            return "";
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    append({
+        {"op", "put"}, {"id", entry.id}, {"kind", entry.kind},
+        {"session_id", entry.sessionId}, {"round_id", entry.roundId},
+        {"blob", entry.blobPath}, {"payload", entry.payload}, {"created", entry.createdAt}
+    });
+    entries[entry.id] = entry;
+    std::cout << "Outbox: stored " << kind << " " << entry.id << " for later delivery" << std::endl;
+    return entry.id;
+}
+
+/**
+ * @brief Replaces the payload of an entry, e.g. to record that part of the delivery succeeded.
+ */
+void Outbox::update(const std::string& id, const json& payload) {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    auto it = entries.find(id);
+    if (it == entries.end()) {
+        return;
+    }
+    append({{"op", "update"}, {"id", id}, {"payload", payload}});
+    it->second.payload = payload;
+    compactIfNeeded();
+}
+
+/**
+ * @brief Removes an entry after it has been delivered.
+ */
+void Outbox::complete(const std::string& id) {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    if (!entries.count(id)) {
+        return;
+    }
+    append({{"op", "done"}, {"id", id}});
+    remove(id);
+}
+
+/**
+ * @brief Removes an entry that will not be delivered.
+ */
+void Outbox::drop(const std::string& id, const std::string& reason) {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    if (!entries.count(id)) {
+        return;
+    }
+    append({{"op", "drop"}, {"id", id}, {"reason", reason}});
+    std::cout << "Outbox: dropped " << entries[id].kind << " " << id << " (" << reason << ")" << std::endl;
+    remove(id);
+}
+
+/**
+ * @brief Deletes the blob of an entry and forgets it, see Outbox::compactIfNeeded.
+ */
+void Outbox::remove(const std::string& id) {
+    std::error_code ec;
+    if (!entries[id].blobPath.empty()) {
+        fs::remove(entries[id].blobPath, ec);
+    }
+    entries.erase(id);
+    compactIfNeeded();
+}
+
+/**
+ * @brief Drops the entries that the combiner no longer wants.
+ *
+ * Called for every task received from the combiner. Entries from another session are
+ * dropped, and so are model updates from an earlier round of the same session, since
+ * the combiner only aggregates updates for the current round.
+ *
+ * @param sessionId The session of the task.
+ * @param roundId The round of the task, empty if the task is not tied to a round.
+ */
+void Outbox::expire(const std::string& sessionId, const std::string& roundId) {
+    if (sessionId.empty()) {
+        return;
+    }
+    std::vector<std::pair<std::string, std::string> > expired;
+    {
+        std::lock_guard<std::mutex> lock(outboxMutex);
+        for (const auto& [id, entry] : entries) {
+            if (entry.sessionId.empty()) {
+                continue;
+            }
+            if (entry.sessionId != sessionId) {
+                expired.emplace_back(id, "session " + entry.sessionId + " ended");
+            } else if (entry.kind == "update" && !roundId.empty() && !entry.roundId.empty()) {
+                try {
+                    if (std::stol(entry.roundId) < std::stol(roundId)) {
+                        expired.emplace_back(id, "round " + entry.roundId + " ended");
+                    }
+                } catch (const std::exception& e) {
+                    // Round IDs that are not numbers are never considered older
+                }
+            }
+        }
+    }
+    for (const auto& [id, reason] : expired) {
+        drop(id, reason);
+    }
+}
+
+/**
+ * @brief Returns the pending entries, oldest first. Entries older than the ttl are dropped.
+ */
+std::vector<OutboxEntry> Outbox::pending() {
+    std::vector<OutboxEntry> result;
+    std::vector<std::string> expired;
+    {
+        std::lock_guard<std::mutex> lock(outboxMutex);
+        std::time_t now = std::time(nullptr);
+        for (const auto& [id, entry] : entries) {
+            if (ttl > 0 && now - entry.createdAt > ttl) {
+                expired.push_back(id);
+            } else {
+                result.push_back(entry);
+            }
+        }
+    }
+    for (const std::string& id : expired) {
+        drop(id, "older than outbox_ttl");
+    }
+    std::sort(result.begin(), result.end(), [](const OutboxEntry& a, const OutboxEntry& b) {
+        return a.createdAt < b.createdAt;
+    });
+    return result;
+}
+
+/**
+ * @brief Returns the number of pending entries.
+ */
+size_t Outbox::size() {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    return entries.size();
+}
\ No newline at end of file
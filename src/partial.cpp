@@ -0,0 +1,165 @@
+#include <iostream>
+#include <set>
+#include <cstdio>
+
+#include "../include/fednlib/partial.h"
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/convert.h"
+
+const char kPartialManifestTensor[] = "__partial__";
+
+namespace {
+
+std::optional<json> parseManifest(const TensorReader& reader) {
+    const TensorInfo* tensor = reader.find(kPartialManifestTensor);
+    if (!tensor || tensor->dtype != DType::U8) {
+        return std::nullopt;
+    }
+    TensorSpan<const uint8_t> bytes = reader.bytes(*tensor);
+    json manifest = json::parse(bytes.begin(), bytes.end(), nullptr, false);
+    if (!manifest.is_object() || manifest.value("version", 0) != kManifestVersion
+            || !manifest.contains("tensors") || !manifest["tensors"].is_array()) {
+        return std::nullopt;
+    }
+    return manifest;
+}
+
+} // namespace
+
+/**
+ * @brief Writes the partial model of some tensors of a model, see partial.h.
+ *
+ * The model may itself be partial, e.g. one trained from a partial global model, in which case
+ * the number of tensors of the whole model is taken from its manifest unless given.
+ *
+ * @param modelPath The model, a tensor container.
+ * @param tensorNames The tensors to keep, each of which must be in the model.
+ * @param baseModelID The ID of the model the other tensors are taken from.
+ * @param partialPath The file the partial model is written to.
+ * @param manifest Set to the manifest written.
+ * @param modelTensors The number of tensors of the whole model, 0 to count them.
+ * @return true if the partial model was written, false if the model is not a tensor container,
+ *         lacks one of the tensors or the file cannot be written.
+ */
+bool writePartialModel(const std::string& modelPath, const std::vector<std::string>& tensorNames,
+        const std::string& baseModelID, const std::string& partialPath, json* manifest, size_t modelTensors) {
+    std::shared_ptr<TensorReader> reader = TensorReader::openIfContainer(modelPath);
+    if (!reader) {
+        return false;
+    }
+    std::set<std::string> wanted;
+    for (const std::string& name : tensorNames) {
+        if (name == kPartialManifestTensor) {
+            continue;
+        }
+        if (!reader->find(name)) {
+            std::cerr << "Model " << modelPath << " has no tensor " << name << std::endl;
+            return false;
+        }
+        wanted.insert(name);
+    }
+
+    std::optional<json> modelManifest = parseManifest(*reader);
+    if (modelTensors == 0) {
+        modelTensors = reader->tensors().size() - (reader->find(kPartialManifestTensor) ? 1 : 0);
+        modelTensors = modelManifest ? modelManifest->value("model_tensors", modelTensors) : modelTensors;
+    }
+    json written = {
+        {"version", kManifestVersion},
+        {"base_model_id", baseModelID},
+        {"tensors", json::array()},
+        {"model_tensors", modelTensors}
+    };
+
+    TensorWriter writer;
+    bool ok = writer.open(partialPath);
+    for (const TensorInfo& tensor : reader->tensors()) {
+        if (ok && wanted.count(tensor.name)) {
+            TensorSpan<const uint8_t> bytes = reader->bytes(tensor);
+            ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            written["tensors"].push_back(tensor.name);
+        }
+    }
+    std::string text = written.dump();
+    ok = ok && writer.add(kPartialManifestTensor, DType::U8, {text.size()}, text.data(), text.size());
+    ok = writer.finish() && ok;
+    if (!ok) {
+        std::cerr << "Failed to write partial model " << partialPath << std::endl;
+        std::remove(partialPath.c_str());
+        return false;
+    }
+    if (manifest) {
+        *manifest = written;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the manifest of a partial model, or nullopt if the model is not partial.
+ */
+std::optional<json> readPartialManifest(const std::string& path) {
+    std::shared_ptr<TensorReader> reader = TensorReader::openIfContainer(path);
+    if (!reader) {
+        return std::nullopt;
+    }
+    return parseManifest(*reader);
+}
+
+/**
+ * @brief Merges a partial model into its base model, e.g. on the server that receives
+ * partial updates.
+ *
+ * The tensors of the partial model replace those of the same name, and must have the same
+ * shape. Floating point tensors uploaded in another dtype, see GrpcClient::setModelDType(), are
+ * converted to the dtype of the base model. The merged model has the tensors in the order of
+ * the base model.
+ *
+ * @param basePath The base model, a tensor container.
+ * @param partialPath The partial model.
+ * @param modelPath The file the merged model is written to.
+ * @return true if the model was merged, false otherwise.
+ */
+bool mergePartialModel(const std::string& basePath, const std::string& partialPath, const std::string& modelPath) {
+    std::shared_ptr<TensorReader> base = TensorReader::openIfContainer(basePath);
+    std::shared_ptr<TensorReader> partial = TensorReader::openIfContainer(partialPath);
+    std::optional<json> manifest = partial ? parseManifest(*partial) : std::nullopt;
+    if (!base || !manifest) {
+        std::cerr << "Cannot merge " << partialPath << " into " << basePath << ", not a partial model and its base" << std::endl;
+        return false;
+    }
+    for (const std::string& name : (*manifest)["tensors"].get<std::vector<std::string>>()) {
+        const TensorInfo* tensor = partial->find(name);
+        const TensorInfo* replaced = base->find(name);
+        bool convertible = tensor && replaced && (tensor->dtype == replaced->dtype
+            || (isFloatDType(tensor->dtype) && isFloatDType(replaced->dtype)));
+        if (!convertible || tensor->shape != replaced->shape) {
+            std::cerr << "Tensor " << name << " of partial model " << partialPath << " does not match the base model" << std::endl;
+            return false;
+        }
+    }
+
+    TensorWriter writer;
+    bool ok = writer.open(modelPath);
+    std::vector<char> converted;
+    for (const TensorInfo& tensor : base->tensors()) {
+        if (!ok) {
+            break;
+        }
+        const TensorInfo* replacement = partial->find(tensor.name);
+        if (replacement && replacement->dtype != tensor.dtype) {
+            converted.resize(tensor.size);
+            ok = partial->convert(*replacement, tensor.dtype, converted.data())
+                && writer.add(tensor.name, tensor.dtype, tensor.shape, converted.data(), converted.size());
+            continue;
+        }
+        TensorSpan<const uint8_t> bytes = replacement ? partial->bytes(*replacement) : base->bytes(tensor);
+        ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+    }
+    ok = writer.finish() && ok;
+    if (!ok) {
+        std::cerr << "Failed to write merged model " << modelPath << std::endl;
+        std::remove(modelPath.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "../include/fednlib/privacy.h"
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/convert.h"
+#include "../include/fednlib/ops.h"
+
+namespace {
+
+// Large enough for the operations to run on the thread pool, see fednlib::ops::setThreads()
+const size_t kBlockElements = 1024 * 1024;
+
+// The tensor of the base model the update of a tensor is against, nullptr for zeros
+const TensorInfo* baseOf(const TensorReader& base, const TensorInfo& tensor) {
+    const TensorInfo* baseTensor = base.find(tensor.name);
+    if (!baseTensor || !isFloatDType(baseTensor->dtype) || baseTensor->elements() != tensor.elements()) {
+        return nullptr;
+    }
+    return baseTensor;
+}
+
+} // namespace
+
+/**
+ * @brief Clips the update from a base model to a trained model and adds Gaussian noise, see
+ * privacy.h.
+ *
+ * @param modelPath The path to the trained model, a tensor container.
+ * @param basePath The path to the model it was trained from.
+ * @param privatePath The path to write the model with the private update to.
+ * @param options The clipping norm, the noise multiplier and the seed.
+ * @param norm Set to the norm of the update before clipping.
+ * @return true if the model was written, false otherwise, e.g. if the update is not finite.
+ */
+bool privatizeUpdate(const std::string& modelPath, const std::string& basePath, const std::string& privatePath,
+        const PrivacyOptions& options, double* norm) {
+    if (!(options.clipNorm > 0) || !(options.noiseMultiplier >= 0)) {
+        std::cerr << "Invalid privacy parameters, clip norm " << options.clipNorm << " and noise multiplier "
+                  << options.noiseMultiplier << std::endl;
+        return false;
+    }
+    std::shared_ptr<TensorReader> model = TensorReader::open(modelPath);
+    std::shared_ptr<TensorReader> base = TensorReader::open(basePath);
+    if (!model || !base) {
+        return false;
+    }
+
+    // The norm of the whole update, without writing it
+    std::vector<float> modelScratch;
+    std::vector<float> baseScratch;
+    std::vector<float> zeros;
+    double sumSquares = 0;
+    for (const TensorInfo& tensor : model->tensors()) {
+        if (!isFloatDType(tensor.dtype)) {
+            continue;
+        }
+        const TensorInfo* baseTensor = baseOf(*base, tensor);
+        size_t count = tensor.elements();
+        for (size_t begin = 0; begin < count; begin += kBlockElements) {
+            size_t n = std::min(kBlockElements, count - begin);
+            zeros.resize(baseTensor ? 0 : n, 0.0f);
+            const float* x = model->readBlock(tensor, begin, n, modelScratch);
+            const float* y = baseTensor ? base->readBlock(*baseTensor, begin, n, baseScratch) : zeros.data();
+            sumSquares = sumSquares + fednlib::ops::squaredDistance(x, y, n);
+        }
+    }
+    double updateNorm = std::sqrt(sumSquares);
+    if (norm) {
+        *norm = updateNorm;
+    }
+    if (!std::isfinite(updateNorm)) {
+        std::cerr << "Cannot make the update of model " << modelPath << " private, it is not finite" << std::endl;
+        return false;
+    }
+    float scale = updateNorm > options.clipNorm ? static_cast<float>(options.clipNorm / updateNorm) : 1.0f;
+    float stddev = static_cast<float>(options.noiseMultiplier * options.clipNorm);
+
+    // The base plus the clipped update plus noise, block by block. Every tensor draws noise
+    // from a stream of its own.
+    TensorWriter writer;
+    bool ok = writer.open(privatePath);
+    std::vector<float> update;
+    std::vector<char> converted;
+    uint64_t stream = 0;
+    for (const TensorInfo& tensor : model->tensors()) {
+        if (!ok) {
+            break;
+        }
+        if (!isFloatDType(tensor.dtype)) {
+            TensorSpan<const uint8_t> bytes = model->bytes(tensor);
+            ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+        const TensorInfo* baseTensor = baseOf(*base, tensor);
+        size_t count = tensor.elements();
+        ok = writer.begin(tensor.name, tensor.dtype, tensor.shape);
+        for (size_t begin = 0; ok && begin < count; begin += kBlockElements) {
+            size_t n = std::min(kBlockElements, count - begin);
+            zeros.resize(baseTensor ? 0 : n, 0.0f);
+            update.resize(n);
+            const float* x = model->readBlock(tensor, begin, n, modelScratch);
+            const float* y = baseTensor ? base->readBlock(*baseTensor, begin, n, baseScratch) : zeros.data();
+            fednlib::ops::sub(x, y, update.data(), n);
+            if (scale < 1.0f) {
+                fednlib::ops::scale(scale, update.data(), n);
+            }
+            fednlib::ops::addGaussianNoise(update.data(), n, stddev, options.seed, stream, begin);
+            fednlib::ops::axpy(1.0f, y, update.data(), n);
+            if (tensor.dtype == DType::F32) {
+                ok = writer.write(update.data(), n * sizeof(float));
+            } else {
+                converted.resize(n * dtypeSize(tensor.dtype));
+                ok = convertDType(update.data(), DType::F32, converted.data(), tensor.dtype, n)
+                    && writer.write(converted.data(), converted.size());
+            }
+        }
+        ok = ok && writer.end();
+        stream++;
+    }
+    ok = writer.finish() && ok;
+    if (!ok) {
+        std::cerr << "Failed to write private model " << privatePath << std::endl;
+        std::remove(privatePath.c_str());
+    }
+    return ok;
+}
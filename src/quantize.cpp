@@ -0,0 +1,241 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <set>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+
+#include "../include/fednlib/quantize.h"
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/convert.h"
+#include "../include/fednlib/ops.h"
+
+using json = nlohmann::json;
+
+namespace {
+
+const char kManifestName[] = "__quantization__";
+const char kParamsSuffix[] = ".qparams";
+} // namespace
+
+/**
+ * @brief Parses the name of a quantization, "int8" or "int4".
+ *
+ * @return true if the name is known, false otherwise.
+ */
+bool quantizationFromName(const std::string& name, unsigned& bits) {
+    if (name == "int8" || name == "int4") {
+        bits = name == "int8" ? 8 : 4;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Quantizes the update from a base model to a trained model.
+ *
+ * @param modelPath The path to the trained model, a tensor container.
+ * @param basePath The path to the model it was trained from.
+ * @param residualPath The path to the residual of earlier updates, which is replaced by the
+ *        new residual, or empty for no error feedback. A missing file or tensor counts as zero.
+ * @param updatePath The path to write the quantized update to.
+ * @param options The bits, block size and seed.
+ * @return true if the update was written, false otherwise, e.g. if it is not finite.
+ */
+bool quantizeUpdate(const std::string& modelPath, const std::string& basePath, const std::string& residualPath,
+        const std::string& updatePath, const QuantizeOptions& options) {
+    std::shared_ptr<TensorReader> model = TensorReader::open(modelPath);
+    std::shared_ptr<TensorReader> base = TensorReader::open(basePath);
+    if (!model || !base) {
+        return false;
+    }
+    // A residual that cannot be read is started over
+    std::shared_ptr<TensorReader> residual;
+    std::error_code error;
+    if (!residualPath.empty() && std::filesystem::exists(residualPath, error)) {
+        residual = TensorReader::open(residualPath);
+    }
+
+    std::string newResidualPath = residualPath + ".new";
+    TensorWriter writer;
+    TensorWriter residualWriter;
+    bool ok = writer.open(updatePath) && (residualPath.empty() || residualWriter.open(newResidualPath));
+    json manifest = {
+        {"version", kManifestVersion},
+        {"bits", options.bits},
+        {"block_size", options.blockSize},
+        {"tensors", json::object()}
+    };
+
+    std::vector<float> update;
+    std::vector<float> baseValues;
+    std::vector<float> carried;
+    std::vector<uint8_t> codes;
+    std::vector<float> params;
+    for (const TensorInfo& tensor : model->tensors()) {
+        if (!ok) {
+            break;
+        }
+        const TensorInfo* baseTensor = base->find(tensor.name);
+        if (!isFloatDType(tensor.dtype) || !baseTensor || !isFloatDType(baseTensor->dtype)
+                || baseTensor->elements() != tensor.elements()) {
+            TensorSpan<const uint8_t> bytes = model->bytes(tensor);
+            ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+        size_t count = tensor.elements();
+        ok = model->readFloats(tensor, update) && base->readFloats(*baseTensor, baseValues);
+        if (!ok) {
+            break;
+        }
+        fednlib::ops::sub(update.data(), baseValues.data(), update.data(), count);
+        if (!fednlib::ops::allFinite(update.data(), count)) {
+            std::cerr << "Cannot quantize the update of tensor " << tensor.name << ", it is not finite" << std::endl;
+            ok = false;
+            break;
+        }
+
+        const TensorInfo* residualTensor = residual ? residual->find(tensor.name) : nullptr;
+        if (residualTensor && residualTensor->dtype == DType::F32 && residualTensor->elements() == count) {
+            TensorSpan<const uint8_t> bytes = residual->bytes(*residualTensor);
+            carried.resize(count);
+            memcpy(carried.data(), bytes.data(), bytes.size());
+        } else {
+            carried.assign(count, 0.0f);
+        }
+
+        codes.resize(fednlib::ops::quantizedSize(count, options.bits));
+        params.resize(2 * fednlib::ops::quantizedBlocks(count, options.blockSize));
+        uint32_t seed = options.seed ^ crc32c(0, tensor.name.data(), tensor.name.size());
+        ok = fednlib::ops::quantize(update.data(), residualPath.empty() ? nullptr : carried.data(), count,
+            options.bits, options.blockSize, seed, codes.data(), params.data());
+        ok = ok && writer.add(tensor.name, DType::U8, {codes.size()}, codes.data(), codes.size())
+            && writer.add(tensor.name + kParamsSuffix, DType::F32, {params.size() / 2, 2}, params.data(), params.size() * sizeof(float));
+        if (ok && !residualPath.empty()) {
+            ok = residualWriter.add(tensor.name, DType::F32, tensor.shape, carried.data(), count * sizeof(float));
+        }
+        manifest["tensors"][tensor.name] = {{"dtype", dtypeName(tensor.dtype)}, {"shape", tensor.shape}};
+    }
+
+    std::string manifestText = manifest.dump();
+    ok = ok && writer.add(kManifestName, DType::U8, {manifestText.size()}, manifestText.data(), manifestText.size());
+    ok = writer.finish() && ok;
+    if (!residualPath.empty()) {
+        ok = residualWriter.finish() && ok;
+        // Keep the old residual unless the whole update was quantized
+        ok = ok && std::rename(newResidualPath.c_str(), residualPath.c_str()) == 0;
+        std::remove(newResidualPath.c_str());
+    }
+    if (!ok) {
+        std::cerr << "Failed to quantize model " << modelPath << std::endl;
+        std::remove(updatePath.c_str());
+    }
+    return ok;
+}
+
+/**
+ * @brief Reconstructs a model from a quantized update and the base model it was computed
+ * against, e.g. on the server side or in tests.
+ *
+ * Quantized tensors are written as the base plus the dequantized update, in the dtype of the
+ * trained model. The other tensors are copied.
+ *
+ * @param updatePath The path to the update, written by quantizeUpdate().
+ * @param basePath The path to the base model.
+ * @param modelPath The path to write the model to.
+ * @return true if the model was written, false otherwise.
+ */
+bool dequantizeUpdate(const std::string& updatePath, const std::string& basePath, const std::string& modelPath) {
+    std::shared_ptr<TensorReader> update = TensorReader::open(updatePath);
+    std::shared_ptr<TensorReader> base = TensorReader::open(basePath);
+    if (!update || !base) {
+        return false;
+    }
+    const TensorInfo* manifestTensor = update->find(kManifestName);
+    json manifest;
+    unsigned bits = 0;
+    size_t blockSize = 0;
+    try {
+        if (!manifestTensor || !update->verify(*manifestTensor)) {
+            throw std::runtime_error("no manifest");
+        }
+        TensorSpan<const uint8_t> bytes = update->bytes(*manifestTensor);
+        manifest = json::parse(bytes.begin(), bytes.end());
+        if (manifest.at("version").get<int>() != kManifestVersion) {
+            throw std::runtime_error("unknown version");
+        }
+        bits = manifest.at("bits").get<unsigned>();
+        blockSize = manifest.at("block_size").get<size_t>();
+        manifest.at("tensors").get<json::object_t>();
+    } catch (const std::exception& e) {
+        std::cerr << "Not a quantized update: " << updatePath << " (" << e.what() << ")" << std::endl;
+        return false;
+    }
+    const json& quantized = manifest["tensors"];
+    std::set<std::string> skipped = {kManifestName};
+    for (const auto& entry : quantized.items()) {
+        skipped.insert(entry.key() + kParamsSuffix);
+    }
+
+    TensorWriter writer;
+    bool ok = writer.open(modelPath);
+    std::vector<float> values;
+    std::vector<float> baseValues;
+    std::vector<char> converted;
+    for (const TensorInfo& tensor : update->tensors()) {
+        if (!ok) {
+            break;
+        }
+        if (skipped.count(tensor.name)) {
+            continue;
+        }
+        if (!quantized.contains(tensor.name)) {
+            ok = update->verify(tensor);
+            TensorSpan<const uint8_t> bytes = update->bytes(tensor);
+            ok = ok && writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+
+        // Check every size against the manifest before touching the data
+        DType dtype;
+        std::vector<uint64_t> shape;
+        try {
+            ok = dtypeFromName(quantized[tensor.name].at("dtype").get<std::string>(), dtype) && isFloatDType(dtype);
+            shape = quantized[tensor.name].at("shape").get<std::vector<uint64_t>>();
+        } catch (const std::exception& e) {
+            ok = false;
+        }
+        TensorInfo info;
+        info.shape = shape;
+        size_t count = info.elements();
+        const TensorInfo* params = update->find(tensor.name + kParamsSuffix);
+        const TensorInfo* baseTensor = base->find(tensor.name);
+        ok = ok && params && baseTensor && tensor.dtype == DType::U8 && params->dtype == DType::F32
+            && tensor.size == fednlib::ops::quantizedSize(count, bits)
+            && params->elements() == 2 * fednlib::ops::quantizedBlocks(count, blockSize)
+            && baseTensor->elements() == count && update->verify(tensor) && update->verify(*params);
+        if (!ok) {
+            std::cerr << "Invalid quantized tensor " << tensor.name << " in " << updatePath << std::endl;
+            break;
+        }
+        std::vector<float> blockParams(params->elements());
+        memcpy(blockParams.data(), update->bytes(*params).data(), params->size);
+        values.resize(count);
+        ok = fednlib::ops::dequantize(update->bytes(tensor).data(), blockParams.data(), count, bits, blockSize, values.data())
+            && base->readFloats(*baseTensor, baseValues);
+        if (!ok) {
+            break;
+        }
+        fednlib::ops::axpy(1.0f, baseValues.data(), values.data(), count);
+        converted.resize(count * dtypeSize(dtype));
+        ok = convertDType(values.data(), DType::F32, converted.data(), dtype, count)
+            && writer.add(tensor.name, dtype, shape, converted.data(), converted.size());
+    }
+    ok = writer.finish() && ok;
+    if (!ok) {
+        std::cerr << "Failed to dequantize update " << updatePath << std::endl;
+        std::remove(modelPath.c_str());
+    }
+    return ok;
+}
@@ -0,0 +1,446 @@
+#include <iostream>
+#include <mutex>
+
+#include "../include/fednlib/rawtransfer.h"
+
+using grpc::ByteBuffer;
+using grpc::ClientContext;
+using grpc::CompletionQueue;
+using grpc::GenericClientAsyncReaderWriter;
+using grpc::Slice;
+using grpc::Status;
+
+using fedn::ModelRequest;
+using fedn::ModelResponse;
+using fedn::ModelStatus;
+
+namespace {
+
+// Field numbers of ModelRequest and ModelResponse in fedn.proto
+const uint32_t kRequestDataField = 3;
+const uint32_t kResponseDataField = 1;
+const uint32_t kResponseIdField = 2;
+const uint32_t kResponseStatusField = 3;
+const uint32_t kResponseMessageField = 4;
+const uint32_t kResponseOffsetField = 5;
+const uint32_t kResponseTotalSizeField = 6;
+const uint32_t kResponseDeltaBaseField = 9;
+const uint32_t kResponseModelSha256Field = 10;
+
+const uint32_t kWireVarint = 0;
+const uint32_t kWireFixed64 = 1;
+const uint32_t kWireLengthDelimited = 2;
+const uint32_t kWireFixed32 = 5;
+
+void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+/**
+ * Reads protobuf wire format from the slices of a received message.
+ */
+class SliceReader {
+public:
+    explicit SliceReader(const std::vector<Slice>& slices) : slices_(slices) { skipEmpty(); }
+
+    bool done() const { return index_ >= slices_.size(); }
+
+    bool readVarint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (done()) {
+                return false;
+            }
+            uint8_t byte = slices_[index_].begin()[pos_];
+            advance(1);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns the next length bytes as views of the slices, without copying them
+    bool readPieces(uint64_t length, std::vector<std::string_view>& pieces) {
+        while (length > 0) {
+            if (done()) {
+                return false;
+            }
+            size_t available = slices_[index_].size() - pos_;
+            size_t take = std::min<uint64_t>(available, length);
+            pieces.emplace_back(reinterpret_cast<const char*>(slices_[index_].begin()) + pos_, take);
+            advance(take);
+            length -= take;
+        }
+        return true;
+    }
+
+    // Returns the next length bytes as one view, copied to scratch if they span slices
+    bool readString(uint64_t length, std::string& scratch, std::string_view& value) {
+        if (!done() && slices_[index_].size() - pos_ >= length) {
+            value = std::string_view(reinterpret_cast<const char*>(slices_[index_].begin()) + pos_, length);
+            if (length > 0) {
+                advance(length);
+            }
+            return true;
+        }
+        scratch.clear();
+        while (scratch.size() < length) {
+            if (done()) {
+                return false;
+            }
+            size_t take = std::min<uint64_t>(slices_[index_].size() - pos_, length - scratch.size());
+            scratch.append(reinterpret_cast<const char*>(slices_[index_].begin()) + pos_, take);
+            advance(take);
+        }
+        value = scratch;
+        return true;
+    }
+
+    bool skip(uint32_t wireType) {
+        uint64_t length = 0;
+        switch (wireType) {
+            case kWireVarint:
+                return readVarint(length);
+            case kWireFixed64:
+                length = 8;
+                break;
+            case kWireFixed32:
+                length = 4;
+                break;
+            case kWireLengthDelimited:
+                if (!readVarint(length)) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+        while (length > 0) {
+            if (done()) {
+                return false;
+            }
+            size_t take = std::min<uint64_t>(slices_[index_].size() - pos_, length);
+            advance(take);
+            length -= take;
+        }
+        return true;
+    }
+
+private:
+    const std::vector<Slice>& slices_;
+    size_t index_ = 0;
+    size_t pos_ = 0;
+
+    void advance(size_t n) {
+        pos_ += n;
+        if (pos_ == slices_[index_].size()) {
+            ++index_;
+            pos_ = 0;
+            skipEmpty();
+        }
+    }
+
+    void skipEmpty() {
+        while (index_ < slices_.size() && slices_[index_].size() == 0) {
+            ++index_;
+        }
+    }
+};
+
+/**
+ * Decodes a ModelResponse into chunk. Strings that span slices are copied to the scratch strings.
+ */
+bool decodeModelResponse(const std::vector<Slice>& slices, ModelChunk& chunk, std::string& idScratch, std::string& messageScratch,
+        std::string& deltaBaseScratch, std::string& modelHashScratch) {
+    chunk = ModelChunk{{}, ModelStatus::OK, {}, 0, 0, std::move(chunk.data), {}, {}};
+    chunk.data.clear();
+    SliceReader reader(slices);
+    while (!reader.done()) {
+        uint64_t tag;
+        if (!reader.readVarint(tag)) {
+            return false;
+        }
+        uint32_t field = tag >> 3;
+        uint32_t wireType = tag & 7;
+        uint64_t value;
+        if (field == kResponseDataField && wireType == kWireLengthDelimited) {
+            if (!reader.readVarint(value) || !reader.readPieces(value, chunk.data)) {
+                return false;
+            }
+        } else if (field == kResponseIdField && wireType == kWireLengthDelimited) {
+            if (!reader.readVarint(value) || !reader.readString(value, idScratch, chunk.id)) {
+                return false;
+            }
+        } else if (field == kResponseMessageField && wireType == kWireLengthDelimited) {
+            if (!reader.readVarint(value) || !reader.readString(value, messageScratch, chunk.message)) {
+                return false;
+            }
+        } else if (field == kResponseDeltaBaseField && wireType == kWireLengthDelimited) {
+            if (!reader.readVarint(value) || !reader.readString(value, deltaBaseScratch, chunk.deltaBase)) {
+                return false;
+            }
+        } else if (field == kResponseModelSha256Field && wireType == kWireLengthDelimited) {
+            if (!reader.readVarint(value) || !reader.readString(value, modelHashScratch, chunk.modelHash)) {
+                return false;
+            }
+        } else if (field == kResponseStatusField && wireType == kWireVarint) {
+            if (!reader.readVarint(value)) {
+                return false;
+            }
+            chunk.status = static_cast<ModelStatus>(value);
+        } else if (field == kResponseOffsetField && wireType == kWireVarint) {
+            if (!reader.readVarint(value)) {
+                return false;
+            }
+            chunk.offset = static_cast<int64_t>(value);
+        } else if (field == kResponseTotalSizeField && wireType == kWireVarint) {
+            if (!reader.readVarint(value)) {
+                return false;
+            }
+            chunk.totalSize = static_cast<int64_t>(value);
+        } else if (!reader.skip(wireType)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Waits for the single outstanding operation on the completion queue.
+ */
+bool wait(CompletionQueue& cq) {
+    void* tag;
+    bool ok = false;
+    return cq.Next(&tag, &ok) && ok;
+}
+
+/**
+ * Finishes the call and drains the completion queue.
+ */
+Status finish(GenericClientAsyncReaderWriter& call, CompletionQueue& cq) {
+    Status status;
+    call.Finish(&status, &call);
+    wait(cq);
+    cq.Shutdown();
+    void* tag;
+    bool ok;
+    while (cq.Next(&tag, &ok)) {
+    }
+    return status;
+}
+
+class MappedChunkPool;
+
+/**
+ * A chunk of a mapped file referenced by a slice.
+ */
+struct MappedChunk {
+    std::shared_ptr<MappedChunkPool> pool; // Set while a slice references the chunk
+    int64_t offset = 0;
+    int64_t size = 0;
+};
+
+/**
+ * The chunks of an upload from a mapped file. gRPC may hold a slice after the write that
+ * sent it has completed, so a chunk keeps the pool, and with it the file, alive until gRPC
+ * releases the slice. Released chunks are reused, so an upload does not allocate per chunk.
+ */
+class MappedChunkPool : public std::enable_shared_from_this<MappedChunkPool> {
+public:
+    explicit MappedChunkPool(std::shared_ptr<MappedFile> file) : file_(std::move(file)) {}
+
+    MappedChunk* acquire(int64_t offset, int64_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            chunks_.push_back(std::make_unique<MappedChunk>());
+            free_.reserve(chunks_.size());
+            free_.push_back(chunks_.back().get());
+        }
+        MappedChunk* chunk = free_.back();
+        free_.pop_back();
+        chunk->pool = shared_from_this();
+        chunk->offset = offset;
+        chunk->size = size;
+        return chunk;
+    }
+
+    // Called by gRPC once the slice has been sent
+    static void release(void* userData) {
+        MappedChunk* chunk = static_cast<MappedChunk*>(userData);
+        std::shared_ptr<MappedChunkPool> pool = std::move(chunk->pool);
+        pool->file_->release(chunk->offset, chunk->size);
+        std::lock_guard<std::mutex> lock(pool->mutex_);
+        pool->free_.push_back(chunk);
+    }
+
+private:
+    std::shared_ptr<MappedFile> file_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<MappedChunk>> chunks_;
+    std::vector<MappedChunk*> free_;
+};
+
+} // namespace
+
+/**
+ * @brief Creates a raw transfer on the given channel.
+ */
+RawModelTransfer::RawModelTransfer(std::shared_ptr<grpc::ChannelInterface> channel)
+    : stub_(channel) {}
+
+/**
+ * @brief Runs a ModelService Download call.
+ *
+ * The request is small and serialized as usual, the responses are decoded by hand and
+ * the data field is passed to onChunk as views of the received slices.
+ *
+ * @param context The context of the call.
+ * @param request The download request.
+ * @param onChunk Called for every response. Returning false cancels the download.
+ * @return grpc::Status The status of the call.
+ */
+Status RawModelTransfer::download(ClientContext& context, const ModelRequest& request,
+        const std::function<bool(const ModelChunk&)>& onChunk) {
+    CompletionQueue cq;
+    std::unique_ptr<GenericClientAsyncReaderWriter> call =
+        stub_.PrepareCall(&context, "/fedn.ModelService/Download", &cq);
+    call->StartCall(call.get());
+    bool ok = wait(cq);
+
+    if (ok) {
+        std::string serialized = request.SerializeAsString();
+        Slice slice(serialized);
+        ByteBuffer requestBuffer(&slice, 1);
+        call->Write(requestBuffer, call.get());
+        ok = wait(cq);
+    }
+    if (ok) {
+        call->WritesDone(call.get());
+        ok = wait(cq);
+    }
+
+    ModelChunk chunk;
+    std::string idScratch;
+    std::string messageScratch;
+    std::string deltaBaseScratch;
+    std::string modelHashScratch;
+    std::vector<Slice> slices;
+    ByteBuffer responseBuffer;
+    while (ok) {
+        call->Read(&responseBuffer, call.get());
+        if (!wait(cq)) {
+            break;
+        }
+        slices.clear();
+        if (!responseBuffer.Dump(&slices).ok() || !decodeModelResponse(slices, chunk, idScratch, messageScratch, deltaBaseScratch, modelHashScratch)) {
+            std::cerr << "Received malformed ModelResponse" << std::endl;
+            context.TryCancel();
+            finish(*call, cq);
+            return Status(grpc::StatusCode::INTERNAL, "malformed ModelResponse");
+        }
+        if (!onChunk(chunk)) {
+            context.TryCancel();
+            break;
+        }
+    }
+    return finish(*call, cq);
+}
+
+/**
+ * @brief Runs a ModelService Upload call from a mapped file.
+ *
+ * Each ModelRequest is sent as two slices: a small header with every field but data, and
+ * the data itself as a slice that references the mapped file.
+ *
+ * @param context The context of the call.
+ * @param modelID The ID of the model.
+ * @param sender The sender identity, sent in the first chunk.
+ * @param file The mapped model file.
+ * @param offset The offset to start at. Advanced past every chunk that was sent.
+ * @param chunkSize The size of the chunks.
+ * @param response Receives the response of the combiner.
+ * @return grpc::Status The status of the call.
+ */
+Status RawModelTransfer::upload(ClientContext& context, const std::string& modelID, const fedn::Client& sender,
+        std::shared_ptr<MappedFile> file, int64_t& offset, size_t chunkSize, ModelResponse& response) {
+    CompletionQueue cq;
+    std::unique_ptr<GenericClientAsyncReaderWriter> call =
+        stub_.PrepareCall(&context, "/fedn.ModelService/Upload", &cq);
+    call->StartCall(call.get());
+    bool ok = wait(cq);
+
+    ModelRequest header;
+    header.set_id(modelID);
+    header.set_status(ModelStatus::IN_PROGRESS);
+    std::string headerBytes;
+    bool firstChunk = true;
+    int64_t totalSize = file->size();
+    std::shared_ptr<MappedChunkPool> chunks = std::make_shared<MappedChunkPool>(file);
+    while (ok && offset < totalSize) {
+        size_t currentChunkSize = std::min<int64_t>(chunkSize, totalSize - offset);
+        header.set_offset(offset);
+        if (firstChunk) {
+            *header.mutable_sender() = sender;
+            header.set_total_size(totalSize);
+        }
+        headerBytes.clear();
+        header.AppendToString(&headerBytes);
+        appendVarint(headerBytes, (kRequestDataField << 3) | kWireLengthDelimited);
+        appendVarint(headerBytes, currentChunkSize);
+        if (firstChunk) {
+            header.clear_sender();
+            header.clear_total_size();
+            firstChunk = false;
+        }
+
+        Slice slices[2] = {
+            Slice(headerBytes),
+            Slice(const_cast<char*>(file->data() + offset), currentChunkSize,
+                MappedChunkPool::release, chunks->acquire(offset, currentChunkSize))
+        };
+        ByteBuffer requestBuffer(slices, 2);
+        call->Write(requestBuffer, call.get());
+        ok = wait(cq);
+        if (!ok) {
+            std::cout << "Disconnecting from UploadStream" << std::endl;
+            break;
+        }
+        std::cout << "Uploading chunk: " << offset << " - " << offset + currentChunkSize << std::endl;
+        offset += currentChunkSize;
+    }
+
+    // Finish writing to stream with final message
+    if (ok) {
+        ModelRequest requestFinal;
+        requestFinal.set_id(modelID);
+        requestFinal.set_status(ModelStatus::OK);
+        requestFinal.set_offset(offset);
+        requestFinal.set_total_size(totalSize);
+        std::string serialized = requestFinal.SerializeAsString();
+        Slice slice(serialized);
+        ByteBuffer requestBuffer(&slice, 1);
+        call->Write(requestBuffer, call.get());
+        ok = wait(cq);
+    }
+    if (ok) {
+        call->WritesDone(call.get());
+        ok = wait(cq);
+    }
+    if (ok) {
+        ByteBuffer responseBuffer;
+        call->Read(&responseBuffer, call.get());
+        if (wait(cq)) {
+            Slice slice;
+            if (responseBuffer.DumpToSingleSlice(&slice).ok()) {
+                response.ParseFromArray(slice.begin(), slice.size());
+            }
+        }
+    }
+    return finish(*call, cq);
+}
\ No newline at end of file
@@ -0,0 +1,593 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <random>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+
+#include "../include/fednlib/secagg.h"
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/convert.h"
+#include "../include/fednlib/dedup.h"
+#include "../include/fednlib/ops.h"
+#include "nlohmann/json.hpp"
+
+using json = nlohmann::json;
+
+const char kMaskManifestTensor[] = "__secure_aggregation__";
+
+namespace {
+
+// Large enough for masking to run on all cores, see fednlib::ops::setThreads()
+const size_t kBlockElements = 4 * 1024 * 1024;
+
+const char kMaskInfo[] = "fednlib secure aggregation mask";
+
+// X25519 (RFC 7748) over field elements of 16 limbs of 16 bits, after TweetNaCl. The limbs
+// are wider than 16 bits between carries, and the ladder runs in constant time.
+using Field = int64_t[16];
+
+void carry(int64_t* o) {
+    for (int i = 0; i < 16; i++) {
+        o[i] += int64_t(1) << 16;
+        int64_t c = o[i] >> 16;
+        o[(i + 1) * (i < 15)] += c - 1 + 37 * (c - 1) * (i == 15);
+        o[i] -= c * 65536;
+    }
+}
+
+// Swaps p and q if b is 1, without branching on it
+void swapIf(int64_t* p, int64_t* q, int64_t b) {
+    int64_t mask = ~(b - 1);
+    for (int i = 0; i < 16; i++) {
+        int64_t t = mask & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+void pack(uint8_t* out, const int64_t* n) {
+    Field m;
+    Field t;
+    std::copy(n, n + 16, t);
+    carry(t);
+    carry(t);
+    carry(t);
+    for (int j = 0; j < 2; j++) {
+        m[0] = t[0] - 0xffed;
+        for (int i = 1; i < 15; i++) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        int64_t b = (m[15] >> 16) & 1;
+        m[14] &= 0xffff;
+        swapIf(t, m, 1 - b);
+    }
+    for (int i = 0; i < 16; i++) {
+        out[2 * i] = uint8_t(t[i] & 0xff);
+        out[2 * i + 1] = uint8_t(t[i] >> 8);
+    }
+}
+
+void unpack(int64_t* out, const uint8_t* n) {
+    for (int i = 0; i < 16; i++) {
+        out[i] = n[2 * i] + (int64_t(n[2 * i + 1]) << 8);
+    }
+    out[15] &= 0x7fff;
+}
+
+void add(int64_t* o, const int64_t* a, const int64_t* b) {
+    for (int i = 0; i < 16; i++) {
+        o[i] = a[i] + b[i];
+    }
+}
+
+void subtract(int64_t* o, const int64_t* a, const int64_t* b) {
+    for (int i = 0; i < 16; i++) {
+        o[i] = a[i] - b[i];
+    }
+}
+
+void multiply(int64_t* o, const int64_t* a, const int64_t* b) {
+    int64_t t[31] = {};
+    for (int i = 0; i < 16; i++) {
+        for (int j = 0; j < 16; j++) {
+            t[i + j] += a[i] * b[j];
+        }
+    }
+    for (int i = 0; i < 15; i++) {
+        t[i] += 38 * t[i + 16];
+    }
+    std::copy(t, t + 16, o);
+    carry(o);
+    carry(o);
+}
+
+// The inverse as i^(p - 2), p = 2^255 - 19
+void invert(int64_t* o, const int64_t* i) {
+    Field c;
+    std::copy(i, i + 16, c);
+    for (int a = 253; a >= 0; a--) {
+        multiply(c, c, c);
+        if (a != 2 && a != 4) {
+            multiply(c, c, i);
+        }
+    }
+    std::copy(c, c + 16, o);
+}
+
+// HMAC-SHA256 (RFC 2104)
+std::array<uint8_t, 32> hmacSha256(const std::string& key, const std::string& message) {
+    std::string block = key;
+    if (block.size() > 64) {
+        block.assign(32, '\0');
+        sha256(key.data(), key.size(), reinterpret_cast<uint8_t*>(&block[0]));
+    }
+    block.resize(64, '\0');
+    std::string inner(block);
+    std::string outer(block);
+    for (size_t i = 0; i < 64; i++) {
+        inner[i] = char(inner[i] ^ 0x36);
+        outer[i] = char(outer[i] ^ 0x5c);
+    }
+    inner += message;
+    std::array<uint8_t, 32> digest;
+    sha256(inner.data(), inner.size(), digest.data());
+    outer.append(reinterpret_cast<const char*>(digest.data()), digest.size());
+    sha256(outer.data(), outer.size(), digest.data());
+    return digest;
+}
+
+// The nonce of the masks of a tensor, from its name so the clients agree on it whatever the
+// order of their tensors
+uint64_t tensorNonce(const std::string& name) {
+    uint8_t digest[32];
+    sha256(name.data(), name.size(), digest);
+    uint64_t nonce = 0;
+    for (int i = 7; i >= 0; i--) {
+        nonce = (nonce << 8) | digest[i];
+    }
+    return nonce;
+}
+
+// IDs in file names as hexadecimal, whatever characters they have
+std::string toHex(const std::string& value) {
+    std::ostringstream hex;
+    for (unsigned char c : value) {
+        hex << std::hex << std::setw(2) << std::setfill('0') << int(c);
+    }
+    return hex.str();
+}
+
+std::optional<std::string> fromHex(const std::string& hex) {
+    if (hex.size() % 2 != 0 || hex.find_first_not_of("0123456789abcdef") != std::string::npos) {
+        return std::nullopt;
+    }
+    std::string value;
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        value += char(std::stoi(hex.substr(i, 2), nullptr, 16));
+    }
+    return value;
+}
+
+std::optional<json> parseManifest(const TensorReader& reader) {
+    const TensorInfo* tensor = reader.find(kMaskManifestTensor);
+    if (!tensor || tensor->dtype != DType::U8) {
+        return std::nullopt;
+    }
+    TensorSpan<const uint8_t> bytes = reader.bytes(*tensor);
+    json manifest = json::parse(bytes.begin(), bytes.end(), nullptr, false);
+    if (!manifest.is_object() || manifest.value("version", 0) != kManifestVersion
+            || !manifest.contains("tensors") || !manifest["tensors"].is_object()) {
+        return std::nullopt;
+    }
+    return manifest;
+}
+
+} // namespace
+
+/**
+ * @brief Creates a key exchange over a shared directory.
+ *
+ * @param directory The directory, created if it does not exist.
+ * @param clients The number of clients of every round, this one included.
+ * @param timeout How long to wait for the keys of the other clients.
+ */
+DirectoryKeyExchange::DirectoryKeyExchange(const std::string& directory, size_t clients, std::chrono::milliseconds timeout)
+    : directory_(directory), clients_(clients), timeout_(timeout) {}
+
+/**
+ * @brief Writes the key of a client to <directory>/<round>/<client>.key, with the IDs in
+ * hexadecimal, and polls the directory of the round until it holds the keys of all the
+ * clients.
+ *
+ * The key is written to a temporary file and linked to its name, which fails if the name is
+ * taken, so a key once published is never replaced: another key of the client for the round,
+ * e.g. from a restarted client, is refused, since the other clients may already be using the
+ * first. The directories of earlier rounds are removed once no client can still be waiting
+ * in them, that is when they have not changed for twice the timeout.
+ *
+ * @return The keys, std::nullopt on a timeout, if the client published another key for the
+ *         round or if more clients than expected wrote keys.
+ */
+std::optional<std::map<std::string, std::string>> DirectoryKeyExchange::exchange(const std::string& roundID,
+        const std::string& clientID, const std::string& publicKey) {
+    removeOldRounds(toHex(roundID));
+    std::filesystem::path round = std::filesystem::path(directory_) / toHex(roundID);
+    std::error_code error;
+    std::filesystem::create_directories(round, error);
+    std::filesystem::path keyPath = round / (toHex(clientID) + ".key");
+    std::random_device random;
+    std::filesystem::path tempPath = round / (toHex(clientID) + "." + std::to_string(random()) + ".tmp");
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(publicKey.data(), publicKey.size());
+        if (!file.flush()) {
+            std::cerr << "Failed to write key to " << tempPath << std::endl;
+            std::filesystem::remove(tempPath, error);
+            return std::nullopt;
+        }
+    }
+    // Others see the key whole or not at all
+    std::filesystem::create_hard_link(tempPath, keyPath, error);
+    std::error_code removeError;
+    std::filesystem::remove(tempPath, removeError);
+    if (error == std::errc::file_exists) {
+        std::ifstream file(keyPath, std::ios::binary);
+        std::string published((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (published != publicKey) {
+            std::cerr << "Client " << clientID << " already published another key for round " << roundID << std::endl;
+            return std::nullopt;
+        }
+    } else if (error) {
+        std::cerr << "Failed to publish key " << keyPath << ": " << error.message() << std::endl;
+        return std::nullopt;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + timeout_;
+    while (true) {
+        std::map<std::string, std::string> keys;
+        for (const auto& entry : std::filesystem::directory_iterator(round, error)) {
+            std::optional<std::string> id = fromHex(entry.path().stem().string());
+            if (entry.path().extension() != ".key" || !id) {
+                continue;
+            }
+            std::ifstream file(entry.path(), std::ios::binary);
+            keys[*id] = std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        }
+        if (keys.size() > clients_) {
+            std::cerr << "Round " << roundID << " has keys of " << keys.size() << " clients, expected " << clients_ << std::endl;
+            return std::nullopt;
+        }
+        if (keys.size() == clients_) {
+            return keys;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            std::cerr << "Timed out waiting for the keys of round " << roundID << ", " << keys.size() << " of "
+                      << clients_ << " clients" << std::endl;
+            return std::nullopt;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+// Removes the directories of rounds other than the current one that have not changed for
+// twice the timeout. Clients publish their key before they wait, so nobody waits in them.
+void DirectoryKeyExchange::removeOldRounds(const std::string& currentRound) {
+    std::error_code error;
+    auto now = std::filesystem::file_time_type::clock::now();
+    for (const auto& entry : std::filesystem::directory_iterator(directory_, error)) {
+        std::string name = entry.path().filename().string();
+        if (name == currentRound || !fromHex(name) || !entry.is_directory(error)) {
+            continue;
+        }
+        std::filesystem::file_time_type changed = entry.last_write_time(error);
+        if (!error && now - changed > 2 * timeout_) {
+            std::filesystem::remove_all(entry.path(), error);
+        }
+    }
+}
+
+/**
+ * @brief Computes the X25519 function of RFC 7748, the scalar multiple of a curve point, e.g.
+ * a public key from a secret key and the base point 9, or a shared secret from a secret key
+ * and the public key of a peer.
+ *
+ * @param out Set to the u-coordinate of the result.
+ * @param scalar The scalar, clamped as the RFC specifies.
+ * @param point The u-coordinate of the point.
+ */
+void x25519(uint8_t out[32], const uint8_t scalar[32], const uint8_t point[32]) {
+    static const Field a24 = {0xdb41, 1}; // 121665
+    uint8_t z[32];
+    std::copy(scalar, scalar + 32, z);
+    z[31] = uint8_t((z[31] & 127) | 64);
+    z[0] &= 248;
+    Field x, a = {1}, b, c = {}, d = {1}, e, f;
+    unpack(x, point);
+    std::copy(x, x + 16, b);
+    for (int i = 254; i >= 0; i--) {
+        int64_t bit = (z[i >> 3] >> (i & 7)) & 1;
+        swapIf(a, b, bit);
+        swapIf(c, d, bit);
+        add(e, a, c);
+        subtract(a, a, c);
+        add(c, b, d);
+        subtract(b, b, d);
+        multiply(d, e, e);
+        multiply(f, a, a);
+        multiply(a, c, a);
+        multiply(c, b, e);
+        add(e, a, c);
+        subtract(a, a, c);
+        multiply(b, a, a);
+        subtract(c, d, f);
+        multiply(a, c, a24);
+        add(a, a, d);
+        multiply(c, c, a);
+        multiply(a, d, f);
+        multiply(d, b, x);
+        multiply(b, e, e);
+        swapIf(a, b, bit);
+        swapIf(c, d, bit);
+    }
+    invert(c, c);
+    multiply(a, a, c);
+    pack(out, a);
+}
+
+/**
+ * @brief Derives a key with HKDF-SHA256 (RFC 5869), the first 32 bytes of its output.
+ *
+ * @param secret The input keying material, e.g. an X25519 shared secret.
+ * @param salt The salt, may be empty.
+ * @param info The context the key is bound to.
+ * @return The key, the first block of the output.
+ */
+std::array<uint8_t, 32> hkdfSha256(const std::string& secret, const std::string& salt, const std::string& info) {
+    std::array<uint8_t, 32> pseudoRandomKey = hmacSha256(salt, secret);
+    return hmacSha256(std::string(reinterpret_cast<const char*>(pseudoRandomKey.data()), pseudoRandomKey.size()), info + '\x01');
+}
+
+/**
+ * @brief Agrees on the keys of the masks a client shares with the other clients of a round,
+ * see secagg.h.
+ *
+ * The key pair is drawn for the round and forgotten afterwards. The key of two clients is
+ * HKDF-SHA256 of their X25519 secret, salted with the round ID and bound to both client IDs.
+ *
+ * @param exchange The key exchange the clients of the round share.
+ * @param roundID The round, e.g. the ID of the global model the clients trained.
+ * @param clientID The ID of this client, unique in the round.
+ * @return The keys of the masks, one per other client, std::nullopt if the exchange failed or
+ *         a peer sent an invalid key.
+ */
+std::optional<std::vector<MaskKey>> agreeMaskKeys(KeyExchange& exchange, const std::string& roundID, const std::string& clientID) {
+    uint8_t secretKey[32];
+    std::random_device random;
+    for (size_t i = 0; i < sizeof(secretKey); i += 4) {
+        uint32_t word = random();
+        memcpy(secretKey + i, &word, 4);
+    }
+    const uint8_t basePoint[32] = {9};
+    uint8_t publicKey[32];
+    x25519(publicKey, secretKey, basePoint);
+    std::string published(reinterpret_cast<const char*>(publicKey), sizeof(publicKey));
+
+    std::optional<std::map<std::string, std::string>> keys = exchange.exchange(roundID, clientID, published);
+    if (!keys) {
+        return std::nullopt;
+    }
+    auto own = keys->find(clientID);
+    if (own == keys->end() || own->second != published) {
+        std::cerr << "The key exchange of round " << roundID << " lost the key of client " << clientID << std::endl;
+        return std::nullopt;
+    }
+
+    std::vector<MaskKey> maskKeys;
+    for (const auto& [peerID, peerKey] : *keys) {
+        if (peerID == clientID) {
+            continue;
+        }
+        uint8_t shared[32];
+        if (peerKey.size() != 32) {
+            std::cerr << "Client " << peerID << " sent a key of " << peerKey.size() << " bytes" << std::endl;
+            return std::nullopt;
+        }
+        x25519(shared, secretKey, reinterpret_cast<const uint8_t*>(peerKey.data()));
+        // Points of small order give the secret 0, which the peer would know
+        if (std::all_of(shared, shared + 32, [](uint8_t byte) { return byte == 0; })) {
+            std::cerr << "Client " << peerID << " sent an invalid key" << std::endl;
+            return std::nullopt;
+        }
+        MaskKey maskKey;
+        maskKey.peerID = peerID;
+        maskKey.subtract = clientID > peerID;
+        const std::string& low = maskKey.subtract ? peerID : clientID;
+        const std::string& high = maskKey.subtract ? clientID : peerID;
+        std::string info = std::string(kMaskInfo) + '\0' + low + '\0' + high;
+        maskKey.key = hkdfSha256(std::string(reinterpret_cast<const char*>(shared), sizeof(shared)), roundID, info);
+        maskKeys.push_back(maskKey);
+    }
+    std::fill(secretKey, secretKey + sizeof(secretKey), 0);
+    return maskKeys;
+}
+
+/**
+ * @brief Encodes the floating point tensors of a model in fixed point and adds the pairwise
+ * masks of a client, see secagg.h.
+ *
+ * The model is streamed in blocks, the encoding and every mask are computed on all cores.
+ *
+ * @param modelPath The model, a tensor container.
+ * @param maskedPath The path to write the masked model to.
+ * @param keys The keys of the masks the client shares with the other clients of the round.
+ * @param fractionalBits The bits after the point of the fixed-point encoding, 0 to 30.
+ * @return true if the masked model was written, false otherwise, e.g. if it is not finite.
+ */
+bool maskModel(const std::string& modelPath, const std::string& maskedPath, const std::vector<MaskKey>& keys, int fractionalBits) {
+    if (fractionalBits < 0 || fractionalBits > 30) {
+        std::cerr << "Invalid number of fractional bits " << fractionalBits << std::endl;
+        return false;
+    }
+    std::shared_ptr<TensorReader> model = TensorReader::open(modelPath);
+    if (!model) {
+        return false;
+    }
+    if (model->find(kMaskManifestTensor)) {
+        std::cerr << "Model " << modelPath << " is already masked" << std::endl;
+        return false;
+    }
+
+    // The largest value of a client whose sum over all the clients fits in int32, rounded
+    // down to a float
+    int64_t largest = int64_t(INT32_MAX) / int64_t(keys.size() + 1);
+    float limit = float(largest);
+    if (double(limit) > double(largest)) {
+        limit = std::nextafter(limit, 0.0f);
+    }
+    float scale = std::ldexp(1.0f, fractionalBits);
+
+    json manifest = {{"version", kManifestVersion}, {"fractional_bits", fractionalBits}, {"tensors", json::object()}};
+    TensorWriter writer;
+    bool ok = writer.open(maskedPath);
+    std::vector<float> scratch;
+    std::vector<int32_t> masked;
+    for (const TensorInfo& tensor : model->tensors()) {
+        if (!ok) {
+            break;
+        }
+        if (!isFloatDType(tensor.dtype)) {
+            TensorSpan<const uint8_t> bytes = model->bytes(tensor);
+            ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+        manifest["tensors"][tensor.name] = dtypeName(tensor.dtype);
+        uint64_t nonce = tensorNonce(tensor.name);
+        size_t count = tensor.elements();
+        ok = writer.begin(tensor.name, DType::I32, tensor.shape);
+        for (size_t begin = 0; ok && begin < count; begin += kBlockElements) {
+            size_t n = std::min(kBlockElements, count - begin);
+            const float* values = model->readBlock(tensor, begin, n, scratch);
+            // The fixed-point encoding has no NaN or infinity, so the sum would silently be wrong
+            if (!fednlib::ops::allFinite(values, n)) {
+                std::cerr << "Cannot mask tensor " << tensor.name << ", it is not finite" << std::endl;
+                ok = false;
+                break;
+            }
+            masked.resize(n);
+            fednlib::ops::toFixedPoint(values, masked.data(), n, scale, limit);
+            for (const MaskKey& key : keys) {
+                fednlib::ops::addMask(masked.data(), n, key.key.data(), nonce, key.subtract, begin);
+            }
+            ok = writer.write(masked.data(), n * sizeof(int32_t));
+        }
+        ok = ok && writer.end();
+    }
+    std::string manifestText = manifest.dump();
+    ok = ok && writer.add(kMaskManifestTensor, DType::U8, {manifestText.size()}, manifestText.data(), manifestText.size());
+    ok = writer.finish() && ok;
+    if (!ok) {
+        std::cerr << "Failed to write masked model " << maskedPath << std::endl;
+        std::remove(maskedPath.c_str());
+    }
+    return ok;
+}
+
+/**
+ * @brief Sums the masked models of all the clients of a round, which removes the masks, and
+ * decodes the sum, see secagg.h. Divide by the number of models for their average.
+ *
+ * The masked tensors are summed block by block. The sum is written in the dtypes the clients
+ * trained in, the tensors that were not masked are taken from the first model.
+ *
+ * @param paths The masked models, with the same manifest.
+ * @param sumPath The path to write the sum to.
+ * @return true if the sum was written, false if a model is not masked or the models do not match.
+ */
+bool sumMaskedModels(const std::vector<std::string>& paths, const std::string& sumPath) {
+    std::vector<std::shared_ptr<TensorReader>> models;
+    std::optional<json> manifest;
+    for (const std::string& path : paths) {
+        std::shared_ptr<TensorReader> model = TensorReader::open(path);
+        std::optional<json> modelManifest = model ? parseManifest(*model) : std::nullopt;
+        if (!modelManifest || (manifest && *modelManifest != *manifest)) {
+            std::cerr << "Model " << path << " is not masked like the others" << std::endl;
+            return false;
+        }
+        manifest = modelManifest;
+        models.push_back(model);
+    }
+    if (models.empty()) {
+        return false;
+    }
+    float scale = std::ldexp(1.0f, -manifest->value("fractional_bits", 0));
+
+    TensorWriter writer;
+    bool ok = writer.open(sumPath);
+    std::vector<uint32_t> sum;
+    std::vector<float> decoded;
+    std::vector<char> converted;
+    for (const TensorInfo& tensor : models[0]->tensors()) {
+        if (!ok) {
+            break;
+        }
+        if (tensor.name == kMaskManifestTensor) {
+            continue;
+        }
+        DType dtype = DType::F32;
+        if (!manifest->at("tensors").contains(tensor.name)) {
+            TensorSpan<const uint8_t> bytes = models[0]->bytes(tensor);
+            ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+        std::vector<const TensorInfo*> inputs;
+        for (const std::shared_ptr<TensorReader>& model : models) {
+            const TensorInfo* input = model->find(tensor.name);
+            if (!input || input->dtype != DType::I32 || input->elements() != tensor.elements()) {
+                std::cerr << "Masked models differ in tensor " << tensor.name << std::endl;
+                ok = false;
+                break;
+            }
+            inputs.push_back(input);
+        }
+        ok = ok && tensor.dtype == DType::I32 && dtypeFromName(manifest->at("tensors").at(tensor.name).get<std::string>(), dtype);
+        ok = ok && writer.begin(tensor.name, dtype, tensor.shape);
+        size_t count = tensor.elements();
+        for (size_t begin = 0; ok && begin < count; begin += kBlockElements) {
+            size_t n = std::min(kBlockElements, count - begin);
+            sum.assign(n, 0);
+            for (size_t m = 0; m < models.size(); m++) {
+                const uint8_t* data = models[m]->bytes(*inputs[m]).data() + begin * sizeof(uint32_t);
+                for (size_t i = 0; i < n; i++) {
+                    uint32_t value;
+                    memcpy(&value, data + i * sizeof(value), sizeof(value));
+                    sum[i] += value;
+                }
+            }
+            decoded.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                decoded[i] = float(int32_t(sum[i])) * scale;
+            }
+            if (dtype == DType::F32) {
+                ok = writer.write(decoded.data(), n * sizeof(float));
+            } else {
+                converted.resize(n * dtypeSize(dtype));
+                ok = convertDType(decoded.data(), DType::F32, converted.data(), dtype, n) && writer.write(converted.data(), converted.size());
+            }
+        }
+        ok = ok && writer.end();
+    }
+    ok = writer.finish() && ok;
+    if (!ok) {
+        std::cerr << "Failed to write the sum of the masked models to " << sumPath << std::endl;
+        std::remove(sumPath.c_str());
+    }
+    return ok;
+}
@@ -0,0 +1,274 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <set>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+
+#include "../include/fednlib/sparsify.h"
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/convert.h"
+#include "../include/fednlib/ops.h"
+
+using json = nlohmann::json;
+
+namespace {
+
+const char kManifestName[] = "__sparsification__";
+const char kValuesSuffix[] = ".values";
+void encodePositions(const std::vector<uint64_t>& indices, size_t count, std::vector<uint8_t>& out) {
+    out.clear();
+    uint64_t next = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t gap = indices[i] - next;
+        while (gap >= 0x80) {
+            out.push_back(uint8_t(gap) | 0x80);
+            gap >>= 7;
+        }
+        out.push_back(uint8_t(gap));
+        next = indices[i] + 1;
+    }
+}
+
+// Reads exactly k positions below count from the whole of data
+bool decodePositions(const uint8_t* data, size_t size, size_t k, uint64_t count, std::vector<uint64_t>& indices) {
+    indices.resize(k);
+    uint64_t next = 0;
+    size_t p = 0;
+    for (size_t i = 0; i < k; i++) {
+        uint64_t gap = 0;
+        for (unsigned shift = 0; ; shift += 7) {
+            if (p == size || shift > 63) {
+                return false;
+            }
+            uint8_t byte = data[p++];
+            gap |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        if (gap >= count - next) {
+            return false;
+        }
+        indices[i] = next + gap;
+        next = indices[i] + 1;
+    }
+    return p == size;
+}
+
+} // namespace
+
+/**
+ * @brief Sparsifies the update from a base model to a trained model.
+ *
+ * @param modelPath The path to the trained model, a tensor container.
+ * @param basePath The path to the model it was trained from.
+ * @param residualPath The path to the entries not sent in earlier updates, which is replaced
+ *        by the new residual, or empty to drop them. A missing file or tensor counts as zero.
+ * @param updatePath The path to write the sparse update to.
+ * @param options The fraction of entries to send.
+ * @return true if the update was written, false otherwise, e.g. if it is not finite.
+ */
+bool sparsifyUpdate(const std::string& modelPath, const std::string& basePath, const std::string& residualPath,
+        const std::string& updatePath, const SparsifyOptions& options) {
+    if (!(options.ratio > 0 && options.ratio <= 1)) {
+        std::cerr << "Cannot sparsify to a ratio of " << options.ratio << std::endl;
+        return false;
+    }
+    std::shared_ptr<TensorReader> model = TensorReader::open(modelPath);
+    std::shared_ptr<TensorReader> base = TensorReader::open(basePath);
+    if (!model || !base) {
+        return false;
+    }
+    // A residual that cannot be read is started over
+    std::shared_ptr<TensorReader> residual;
+    std::error_code error;
+    if (!residualPath.empty() && std::filesystem::exists(residualPath, error)) {
+        residual = TensorReader::open(residualPath);
+    }
+
+    std::string newResidualPath = residualPath + ".new";
+    TensorWriter writer;
+    TensorWriter residualWriter;
+    bool ok = writer.open(updatePath) && (residualPath.empty() || residualWriter.open(newResidualPath));
+    json manifest = {
+        {"version", kManifestVersion},
+        {"ratio", options.ratio},
+        {"tensors", json::object()}
+    };
+
+    std::vector<float> update;
+    std::vector<float> baseValues;
+    std::vector<uint64_t> indices;
+    std::vector<float> values;
+    std::vector<uint8_t> positions;
+    for (const TensorInfo& tensor : model->tensors()) {
+        if (!ok) {
+            break;
+        }
+        const TensorInfo* baseTensor = base->find(tensor.name);
+        if (!isFloatDType(tensor.dtype) || !baseTensor || !isFloatDType(baseTensor->dtype)
+                || baseTensor->elements() != tensor.elements()) {
+            TensorSpan<const uint8_t> bytes = model->bytes(tensor);
+            ok = writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+        size_t count = tensor.elements();
+        ok = model->readFloats(tensor, update) && base->readFloats(*baseTensor, baseValues);
+        if (!ok) {
+            break;
+        }
+        fednlib::ops::sub(update.data(), baseValues.data(), update.data(), count);
+        const TensorInfo* residualTensor = residual ? residual->find(tensor.name) : nullptr;
+        if (residualTensor && residualTensor->dtype == DType::F32 && residualTensor->elements() == count) {
+            TensorSpan<const uint8_t> bytes = residual->bytes(*residualTensor);
+            std::vector<float> carried(count);
+            memcpy(carried.data(), bytes.data(), bytes.size());
+            fednlib::ops::axpy(1.0f, carried.data(), update.data(), count);
+        }
+        if (!fednlib::ops::allFinite(update.data(), count)) {
+            std::cerr << "Cannot sparsify the update of tensor " << tensor.name << ", it is not finite" << std::endl;
+            ok = false;
+            break;
+        }
+
+        size_t k = count > 0 ? std::max<size_t>(1, size_t(std::ceil(options.ratio * count))) : 0;
+        indices.resize(std::min(k, count));
+        uint32_t seed = crc32c(0, tensor.name.data(), tensor.name.size());
+        k = fednlib::ops::topK(update.data(), count, k, seed, indices.data());
+        values.resize(k);
+        for (size_t i = 0; i < k; i++) {
+            values[i] = update[indices[i]];
+            update[indices[i]] = 0.0f;
+        }
+        encodePositions(indices, k, positions);
+        ok = writer.add(tensor.name, DType::U8, {positions.size()}, positions.data(), positions.size())
+            && writer.add(tensor.name + kValuesSuffix, DType::F32, {k}, values.data(), k * sizeof(float));
+        if (ok && !residualPath.empty()) {
+            ok = residualWriter.add(tensor.name, DType::F32, tensor.shape, update.data(), count * sizeof(float));
+        }
+        manifest["tensors"][tensor.name] = {{"dtype", dtypeName(tensor.dtype)}, {"shape", tensor.shape}, {"k", k}};
+    }
+
+    std::string manifestText = manifest.dump();
+    ok = ok && writer.add(kManifestName, DType::U8, {manifestText.size()}, manifestText.data(), manifestText.size());
+    ok = writer.finish() && ok;
+    if (!residualPath.empty()) {
+        ok = residualWriter.finish() && ok;
+        // Keep the old residual unless the whole update was sparsified
+        ok = ok && std::rename(newResidualPath.c_str(), residualPath.c_str()) == 0;
+        std::remove(newResidualPath.c_str());
+    }
+    if (!ok) {
+        std::cerr << "Failed to sparsify model " << modelPath << std::endl;
+        std::remove(updatePath.c_str());
+    }
+    return ok;
+}
+
+/**
+ * @brief Reconstructs a model from a sparse update and the base model it was computed
+ * against, e.g. on the server side or in tests.
+ *
+ * Sparse tensors are written as the base plus the entries of the update, in the dtype of
+ * the trained model. The other tensors are copied.
+ *
+ * @param updatePath The path to the update, written by sparsifyUpdate().
+ * @param basePath The path to the base model.
+ * @param modelPath The path to write the model to.
+ * @return true if the model was written, false otherwise.
+ */
+bool densifyUpdate(const std::string& updatePath, const std::string& basePath, const std::string& modelPath) {
+    std::shared_ptr<TensorReader> update = TensorReader::open(updatePath);
+    std::shared_ptr<TensorReader> base = TensorReader::open(basePath);
+    if (!update || !base) {
+        return false;
+    }
+    const TensorInfo* manifestTensor = update->find(kManifestName);
+    json manifest;
+    try {
+        if (!manifestTensor || !update->verify(*manifestTensor)) {
+            throw std::runtime_error("no manifest");
+        }
+        TensorSpan<const uint8_t> bytes = update->bytes(*manifestTensor);
+        manifest = json::parse(bytes.begin(), bytes.end());
+        if (manifest.at("version").get<int>() != kManifestVersion) {
+            throw std::runtime_error("unknown version");
+        }
+        manifest.at("tensors").get<json::object_t>();
+    } catch (const std::exception& e) {
+        std::cerr << "Not a sparse update: " << updatePath << " (" << e.what() << ")" << std::endl;
+        return false;
+    }
+    const json& sparse = manifest["tensors"];
+    std::set<std::string> skipped = {kManifestName};
+    for (const auto& entry : sparse.items()) {
+        skipped.insert(entry.key() + kValuesSuffix);
+    }
+
+    TensorWriter writer;
+    bool ok = writer.open(modelPath);
+    std::vector<float> values;
+    std::vector<uint64_t> indices;
+    std::vector<char> converted;
+    for (const TensorInfo& tensor : update->tensors()) {
+        if (!ok) {
+            break;
+        }
+        if (skipped.count(tensor.name)) {
+            continue;
+        }
+        if (!sparse.contains(tensor.name)) {
+            ok = update->verify(tensor);
+            TensorSpan<const uint8_t> bytes = update->bytes(tensor);
+            ok = ok && writer.add(tensor.name, tensor.dtype, tensor.shape, bytes.data(), bytes.size());
+            continue;
+        }
+
+        // Check every size and position against the manifest before touching the data
+        DType dtype;
+        std::vector<uint64_t> shape;
+        size_t k = 0;
+        try {
+            ok = dtypeFromName(sparse[tensor.name].at("dtype").get<std::string>(), dtype) && isFloatDType(dtype);
+            shape = sparse[tensor.name].at("shape").get<std::vector<uint64_t>>();
+            k = sparse[tensor.name].at("k").get<size_t>();
+        } catch (const std::exception& e) {
+            ok = false;
+        }
+        TensorInfo info;
+        info.shape = shape;
+        size_t count = info.elements();
+        const TensorInfo* entries = update->find(tensor.name + kValuesSuffix);
+        const TensorInfo* baseTensor = base->find(tensor.name);
+        ok = ok && entries && baseTensor && tensor.dtype == DType::U8 && entries->dtype == DType::F32
+            && entries->elements() == k && baseTensor->elements() == count
+            && update->verify(tensor) && update->verify(*entries)
+            && decodePositions(update->bytes(tensor).data(), tensor.size, k, count, indices);
+        if (!ok) {
+            std::cerr << "Invalid sparse tensor " << tensor.name << " in " << updatePath << std::endl;
+            break;
+        }
+        ok = base->readFloats(*baseTensor, values);
+        if (!ok) {
+            break;
+        }
+        TensorSpan<const uint8_t> bytes = update->bytes(*entries);
+        for (size_t i = 0; i < k; i++) {
+            float value;
+            memcpy(&value, bytes.data() + i * sizeof(float), sizeof(float));
+            values[indices[i]] += value;
+        }
+        converted.resize(count * dtypeSize(dtype));
+        ok = convertDType(values.data(), DType::F32, converted.data(), dtype, count)
+            && writer.add(tensor.name, dtype, shape, converted.data(), converted.size());
+    }
+    ok = writer.finish() && ok;
+    if (!ok) {
+        std::cerr << "Failed to densify update " << updatePath << std::endl;
+        std::remove(modelPath.c_str());
+    }
+    return ok;
+}
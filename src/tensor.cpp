@@ -0,0 +1,519 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+
+#include "../include/fednlib/tensor.h"
+#include "../include/fednlib/fileio.h"
+#include "../include/fednlib/convert.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The fednlib tensor container is only implemented for little endian hosts"
+#endif
+
+namespace {
+
+const char kMagic[8] = {'F', 'E', 'D', 'N', 'T', 'N', 'S', 'R'};
+const char kFooterMagic[8] = {'F', 'E', 'D', 'N', 'T', 'E', 'N', 'D'};
+const uint32_t kVersion = 1;
+const uint32_t kFlagChecksums = 1;
+const size_t kHeaderSize = 64;
+const size_t kFooterSize = 32;
+const size_t kAlignment = 64;
+const size_t kMaxRank = 255;
+
+// Tables for CRC32C (Castagnoli) eight bytes at a time
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (0x82f63b78 & (0u - (crc & 1)));
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int t = 1; t < 8; ++t) {
+                table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+const Crc32cTables crcTables;
+
+template <typename T>
+T readLE(const char* p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void appendLE(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+} // namespace
+
+/**
+ * @brief Returns the size of one element of a dtype in bytes.
+ */
+size_t dtypeSize(DType dtype) {
+    switch (dtype) {
+        case DType::F64: case DType::I64: return 8;
+        case DType::F32: case DType::I32: return 4;
+        case DType::F16: case DType::BF16: case DType::I16: return 2;
+        case DType::I8: case DType::U8: return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the name of a dtype, e.g. "float32".
+ */
+const char* dtypeName(DType dtype) {
+    switch (dtype) {
+        case DType::F64: return "float64";
+        case DType::F32: return "float32";
+        case DType::F16: return "float16";
+        case DType::BF16: return "bfloat16";
+        case DType::I64: return "int64";
+        case DType::I32: return "int32";
+        case DType::I16: return "int16";
+        case DType::I8: return "int8";
+        case DType::U8: return "uint8";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Continues a CRC32C checksum over more data.
+ *
+ * @param crc The checksum of the data so far, 0 to start.
+ * @param data The data.
+ * @param size The size of the data.
+ * @return uint32_t The checksum including the data.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const auto& t = crcTables.table;
+    crc = ~crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff]
+            ^ t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Returns the number of elements of the tensor, the product of its dimensions.
+ */
+uint64_t TensorInfo::elements() const {
+    uint64_t count = 1;
+    for (uint64_t dimension : shape) {
+        count *= dimension;
+    }
+    return count;
+}
+
+/**
+ * @brief Maps a container file into memory and reads its index.
+ *
+ * @param path The path to the container.
+ * @return std::shared_ptr<TensorReader> The reader, nullptr if the file cannot be read or is not
+ *         a valid container, which is printed.
+ */
+std::shared_ptr<TensorReader> TensorReader::open(const std::string& path) {
+    std::shared_ptr<MappedFile> file = MappedFile::open(path);
+    if (!file) {
+        return nullptr;
+    }
+    std::shared_ptr<TensorReader> reader(new TensorReader());
+    reader->file = file;
+    reader->data = file->data();
+    reader->size = file->size();
+    if (!reader->parse()) {
+        std::cerr << "Invalid tensor container " << path << std::endl;
+        return nullptr;
+    }
+    return reader;
+}
+
+/**
+ * @brief Opens a model if it is a container, without complaining about models in other
+ * formats, e.g. to read a manifest that only some models carry.
+ *
+ * @param path The path to the model.
+ * @return std::shared_ptr<TensorReader> The reader, nullptr if the file is not a container.
+ */
+std::shared_ptr<TensorReader> TensorReader::openIfContainer(const std::string& path) {
+    char head[kHeaderSize + kFooterSize] = {};
+    std::ifstream file(path, std::ios::binary);
+    if (!file || !file.read(head, sizeof(head)) || !isContainer(head, sizeof(head))) {
+        return nullptr;
+    }
+    file.close();
+    return open(path);
+}
+
+/**
+ * @brief Reads the index of a container held in memory, e.g. a model from downloadModel().
+ *
+ * The buffer is not copied and must outlive the reader.
+ *
+ * @param data The container.
+ * @param size The size of the container.
+ * @return std::shared_ptr<TensorReader> The reader, nullptr if the buffer is not a valid container.
+ */
+std::shared_ptr<TensorReader> TensorReader::fromBuffer(const char* data, size_t size) {
+    std::shared_ptr<TensorReader> reader(new TensorReader());
+    reader->data = data;
+    reader->size = size;
+    if (!reader->parse()) {
+        std::cerr << "Invalid tensor container" << std::endl;
+        return nullptr;
+    }
+    return reader;
+}
+
+/**
+ * @brief Returns whether the data starts like a fednlib tensor container.
+ */
+bool TensorReader::isContainer(const char* data, size_t size) {
+    return size >= kHeaderSize + kFooterSize && memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+/**
+ * @brief Checks the header and footer and reads the index, checking every bound.
+ */
+bool TensorReader::parse() {
+    if (!isContainer(data, size) || readLE<uint32_t>(data + 8) != kVersion) {
+        return false;
+    }
+    const char* footer = data + size - kFooterSize;
+    if (memcmp(footer + 24, kFooterMagic, sizeof(kFooterMagic)) != 0) {
+        return false;
+    }
+    uint64_t indexOffset = readLE<uint64_t>(footer);
+    uint64_t indexSize = readLE<uint64_t>(footer + 8);
+    uint32_t count = readLE<uint32_t>(footer + 16);
+    uint64_t dataEnd = size - kFooterSize;
+    if (indexOffset < kHeaderSize || indexOffset > dataEnd || indexSize != dataEnd - indexOffset) {
+        return false;
+    }
+    if (crc32c(0, data + indexOffset, indexSize) != readLE<uint32_t>(footer + 20)) {
+        return false;
+    }
+
+    const char* p = data + indexOffset;
+    const char* end = p + indexSize;
+    index.clear();
+    byName.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        TensorInfo tensor;
+        if (end - p < 2) {
+            return false;
+        }
+        uint16_t nameLength = readLE<uint16_t>(p);
+        p += 2;
+        if ((size_t) (end - p) < nameLength + 24u) {
+            return false;
+        }
+        tensor.name.assign(p, nameLength);
+        p += nameLength;
+        tensor.dtype = static_cast<DType>(readLE<uint8_t>(p));
+        uint8_t rank = readLE<uint8_t>(p + 1);
+        tensor.hasChecksum = readLE<uint8_t>(p + 2) != 0;
+        tensor.checksum = readLE<uint32_t>(p + 4);
+        tensor.offset = readLE<uint64_t>(p + 8);
+        tensor.size = readLE<uint64_t>(p + 16);
+        p += 24;
+        if ((size_t) (end - p) < rank * sizeof(uint64_t)) {
+            return false;
+        }
+        for (uint8_t d = 0; d < rank; ++d) {
+            tensor.shape.push_back(readLE<uint64_t>(p));
+            p += 8;
+        }
+        size_t elementSize = dtypeSize(tensor.dtype);
+        if (elementSize == 0 || tensor.offset % kAlignment != 0 || tensor.offset < kHeaderSize
+                || tensor.offset > indexOffset || tensor.size > indexOffset - tensor.offset
+                || tensor.size != tensor.elements() * elementSize || byName.count(tensor.name)) {
+            return false;
+        }
+        byName[tensor.name] = index.size();
+        index.push_back(std::move(tensor));
+    }
+    return p == end;
+}
+
+/**
+ * @brief Returns the tensor with the given name, nullptr if there is none.
+ */
+const TensorInfo* TensorReader::find(const std::string& name) const {
+    auto it = byName.find(name);
+    return it == byName.end() ? nullptr : &index[it->second];
+}
+
+/**
+ * @brief Returns the data of a tensor as bytes.
+ */
+TensorSpan<const uint8_t> TensorReader::bytes(const TensorInfo& tensor) const {
+    return TensorSpan<const uint8_t>(reinterpret_cast<const uint8_t*>(data + tensor.offset), tensor.size);
+}
+
+/**
+ * @brief Checks the data of a tensor against its checksum. Tensors without a checksum pass.
+ */
+bool TensorReader::verify(const TensorInfo& tensor) const {
+    return !tensor.hasChecksum || crc32c(0, data + tensor.offset, tensor.size) == tensor.checksum;
+}
+
+/**
+ * @brief Checks all tensors against their checksums.
+ */
+bool TensorReader::verify() const {
+    for (const TensorInfo& tensor : index) {
+        if (!verify(tensor)) {
+            std::cerr << "Checksum mismatch for tensor " << tensor.name << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Copies the elements of a tensor to out, converted to another floating point dtype.
+ *
+ * @param tensor The tensor.
+ * @param dtype The dtype to convert to, the dtype of the tensor for a plain copy.
+ * @param out Room for the elements in the dtype.
+ * @return true if the elements were copied, false if the dtypes cannot be converted.
+ */
+bool TensorReader::convert(const TensorInfo& tensor, DType dtype, void* out) const {
+    return convertDType(data + tensor.offset, tensor.dtype, out, dtype, tensor.size / dtypeSize(tensor.dtype));
+}
+
+/**
+ * @brief Reads a floating point tensor as float32, e.g. to encode the update of a model.
+ *
+ * @param tensor The tensor.
+ * @param values Set to the elements of the tensor.
+ * @return true if the tensor was read, false if it is not a floating point tensor.
+ */
+bool TensorReader::readFloats(const TensorInfo& tensor, std::vector<float>& values) const {
+    values.resize(tensor.elements());
+    return isFloatDType(tensor.dtype) && convert(tensor, DType::F32, values.data());
+}
+
+/**
+ * @brief Returns a block of the elements of a floating point tensor as float32, to go through
+ * a large tensor without converting all of it at once.
+ *
+ * @param tensor The tensor, of a floating point dtype.
+ * @param begin The index of the first element of the block.
+ * @param count The number of elements of the block.
+ * @param scratch Holds the converted elements, unless the tensor is float32.
+ * @return The elements, in place for an aligned float32 tensor and in scratch otherwise.
+ */
+const float* TensorReader::readBlock(const TensorInfo& tensor, size_t begin, size_t count, std::vector<float>& scratch) const {
+    const char* start = data + tensor.offset + begin * dtypeSize(tensor.dtype);
+    if (tensor.dtype == DType::F32 && reinterpret_cast<uintptr_t>(start) % alignof(float) == 0) {
+        return reinterpret_cast<const float*>(start);
+    }
+    scratch.resize(count);
+    convertDType(start, tensor.dtype, scratch.data(), DType::F32, count);
+    return scratch.data();
+}
+
+/**
+ * @brief Creates a writer. The container is started with open().
+ *
+ * @param checksums Whether to store a CRC32C checksum of every tensor.
+ */
+TensorWriter::TensorWriter(bool checksums) : checksums(checksums) {}
+
+TensorWriter::~TensorWriter() = default;
+
+/**
+ * @brief Starts a container in a file, written through the file I/O engine.
+ *
+ * @param path The path of the file.
+ * @return true if the file was opened, false otherwise.
+ */
+bool TensorWriter::open(const std::string& path) {
+    fileWriter.reset(new ModelFileWriter());
+    buffer = nullptr;
+    if (!fileWriter->open(path)) {
+        fileWriter.reset();
+        return false;
+    }
+    return start();
+}
+
+/**
+ * @brief Starts a container in memory. The container is appended to the buffer.
+ */
+void TensorWriter::openBuffer(std::string& buffer) {
+    fileWriter.reset();
+    this->buffer = &buffer;
+    start();
+}
+
+// Resets the writer and writes the header. Offsets are relative to the start of the container.
+bool TensorWriter::start() {
+    position = 0;
+    failed = false;
+    inTensor = false;
+    index.clear();
+    byName.clear();
+    char header[kHeaderSize] = {};
+    memcpy(header, kMagic, sizeof(kMagic));
+    uint32_t flags = checksums ? kFlagChecksums : 0;
+    memcpy(header + 8, &kVersion, 4);
+    memcpy(header + 12, &flags, 4);
+    return emit(header, sizeof(header));
+}
+
+bool TensorWriter::emit(const void* data, size_t size) {
+    if (failed) {
+        return false;
+    }
+    if (buffer) {
+        buffer->append(static_cast<const char*>(data), size);
+    } else if (!fileWriter || !fileWriter->write(static_cast<const char*>(data), size, position)) {
+        failed = true;
+        return false;
+    }
+    position += size;
+    return true;
+}
+
+// Pads the container up to the alignment of the next tensor
+bool TensorWriter::pad() {
+    static const char zeros[kAlignment] = {};
+    size_t padding = (kAlignment - position % kAlignment) % kAlignment;
+    return emit(zeros, padding);
+}
+
+/**
+ * @brief Adds a tensor.
+ *
+ * @param name The name of the tensor, unique in the container.
+ * @param dtype The dtype of the elements.
+ * @param shape The dimensions of the tensor.
+ * @param data The elements.
+ * @param size The size of the elements in bytes, which must match the dtype and shape.
+ * @return true if the tensor was added, false otherwise.
+ */
+bool TensorWriter::add(const std::string& name, DType dtype, const std::vector<uint64_t>& shape, const void* data, size_t size) {
+    return begin(name, dtype, shape) && write(data, size) && end();
+}
+
+/**
+ * @brief Starts a tensor whose data is passed in pieces with write().
+ */
+bool TensorWriter::begin(const std::string& name, DType dtype, const std::vector<uint64_t>& shape) {
+    if (failed || inTensor) {
+        return false;
+    }
+    if (name.size() > UINT16_MAX || shape.size() > kMaxRank || byName.count(name) || dtypeSize(dtype) == 0) {
+        std::cerr << "Invalid tensor " << name << std::endl;
+        return false;
+    }
+    if (!pad()) {
+        return false;
+    }
+    current = TensorInfo();
+    current.name = name;
+    current.dtype = dtype;
+    current.shape = shape;
+    current.offset = position;
+    current.hasChecksum = checksums;
+    inTensor = true;
+    return true;
+}
+
+/**
+ * @brief Appends data to the tensor started with begin().
+ */
+bool TensorWriter::write(const void* data, size_t size) {
+    if (!inTensor || !emit(data, size)) {
+        return false;
+    }
+    if (checksums) {
+        current.checksum = crc32c(current.checksum, data, size);
+    }
+    current.size += size;
+    return true;
+}
+
+/**
+ * @brief Ends the tensor started with begin().
+ *
+ * @return true if the size of the data matches the dtype and shape, false otherwise.
+ */
+bool TensorWriter::end() {
+    if (!inTensor) {
+        return false;
+    }
+    inTensor = false;
+    if (current.size != current.elements() * dtypeSize(current.dtype)) {
+        std::cerr << "Tensor " << current.name << " has " << current.size << " bytes, expected "
+                  << current.elements() * dtypeSize(current.dtype) << std::endl;
+        failed = true;
+        return false;
+    }
+    byName[current.name] = index.size();
+    index.push_back(current);
+    return true;
+}
+
+/**
+ * @brief Writes the index and footer and, for a file, waits until everything is written.
+ *
+ * @return true if the container was written, false otherwise.
+ */
+bool TensorWriter::finish() {
+    if (inTensor) {
+        failed = true;
+    }
+    std::string indexData;
+    for (const TensorInfo& tensor : index) {
+        appendLE<uint16_t>(indexData, tensor.name.size());
+        indexData += tensor.name;
+        appendLE<uint8_t>(indexData, static_cast<uint8_t>(tensor.dtype));
+        appendLE<uint8_t>(indexData, tensor.shape.size());
+        appendLE<uint8_t>(indexData, tensor.hasChecksum);
+        appendLE<uint8_t>(indexData, 0);
+        appendLE<uint32_t>(indexData, tensor.checksum);
+        appendLE<uint64_t>(indexData, tensor.offset);
+        appendLE<uint64_t>(indexData, tensor.size);
+        for (uint64_t dimension : tensor.shape) {
+            appendLE<uint64_t>(indexData, dimension);
+        }
+    }
+    std::string footer;
+    appendLE<uint64_t>(footer, position);
+    appendLE<uint64_t>(footer, indexData.size());
+    appendLE<uint32_t>(footer, index.size());
+    appendLE<uint32_t>(footer, crc32c(0, indexData.data(), indexData.size()));
+    footer.append(kFooterMagic, sizeof(kFooterMagic));
+    bool ok = emit(indexData.data(), indexData.size()) && emit(footer.data(), footer.size());
+    if (fileWriter) {
+        ok = fileWriter->finish(position) && ok;
+        fileWriter.reset();
+    }
+    buffer = nullptr;
+    return ok && !failed;
+}
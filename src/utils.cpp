@@ -2,8 +2,10 @@
 #include <fstream>
 #include <stdlib.h>
 #include <random>
+#include <filesystem>
 
 #include "../include/fednlib/utils.h"
+#include "../include/fednlib/fileio.h"
 
 /**
  * @brief Callback function for writing received data to a string.
@@ -27,28 +29,23 @@ size_t writeHttpResponseToString(void* contents, size_t size, size_t nmemb, std:
  * @brief Saves the given model data to a file at the specified path.
  *
  * This function writes the binary string representation of the model data
- * to a file. It opens the file in binary mode and writes the data to it.
- * If the file cannot be opened, an error message is printed to the standard error.
+ * to a file through the file I/O engine, see ModelFileWriter. The file is
+ * preallocated to the size of the model.
+ * If the file cannot be written, an error message is printed to the standard error.
  * Upon successful completion, a success message is printed to the standard output.
  *
  * @param modelData The binary string representation of the model data to be saved.
  * @param modelPath The file path where the model data should be saved.
  */
 void saveModelToFile(const std::string& modelData, const std::string& modelPath) {
-    // Write the binary string to a file
-    // Create an ofstream object and open the file in binary mode
-    std::ofstream outFile(modelPath, std::ios::binary);
-
-    // Check if the file was opened successfully
-    if (!outFile) {
-        std::cerr << "Error opening file for writing" << std::endl;
+    ModelFileWriter writer;
+    if (!writer.open(modelPath, modelData.size())) {
+        return;
+    }
+    if (!writer.write(modelData.data(), modelData.size(), 0) || !writer.finish(modelData.size())) {
+        std::cerr << "Error writing model to file " << modelPath << std::endl;
+        return;
     }
-
-    // Write the binary string to the file
-    outFile.write(modelData.c_str(), modelData.size());
-
-    // Close the file
-    outFile.close();
 
     std::cout << "modelData saved to file " << modelPath << " successfully" << std::endl;
 }
@@ -87,32 +84,53 @@ void saveMetricsToFile(const json& metrics, const std::string& metricPath) {
  * @brief Loads the content of a model file into a string.
  *
  * This function reads the entire content of a file specified by the given 
- * file path and returns it as a string. The file is read in binary mode.
+ * file path and returns it as a string. Several blocks are read at a time
+ * through the file I/O engine, see readModelFile().
  *
  * @param modelPath The path to the model file to be loaded.
- * @return A string containing the content of the model file.
+ * @return A string containing the content of the model file, empty if the file could not be read.
  */
 std::string loadModelFromFile(const std::string& modelPath) {
-    // Create an ifstream object and open the file in binary mode
-    std::ifstream inFile(modelPath, std::ios::binary);
-    // Check if the file was opened successfully
-    if (!inFile) {
-        std::cerr << "Error opening file " << modelPath << " for reading" << std::endl;
-    }
-    // Get the length of the file
-    inFile.seekg(0, inFile.end);
-    int length = inFile.tellg();
-    inFile.seekg(0, inFile.beg);
-    // Create a string object to hold the data
-    std::string data(length, '\0');
-    // Read the file
-    inFile.read(&data[0], length);
-    // Close the file
-    inFile.close();
-    // Return the data
+    std::string data;
+    if (!readModelFile(modelPath, data)) {
+        return "";
+    }
     return data;
 }
 
+/**
+ * @brief Copies a model file in fixed-size blocks.
+ *
+ * Unlike loadModelFromFile() followed by saveModelToFile(), the model is never held in
+ * memory as a whole, so the memory used does not depend on the size of the model.
+ *
+ * @param inModelPath The path to the model file to copy.
+ * @param outModelPath The path to write the copy to.
+ * @return true if the model was copied, false otherwise.
+ */
+bool copyModelFile(const std::string& inModelPath, const std::string& outModelPath) {
+    std::ifstream inFile(inModelPath, std::ios::binary);
+    if (!inFile) {
+        std::cerr << "Error opening file " << inModelPath << " for reading" << std::endl;
+        return false;
+    }
+    std::ofstream outFile(outModelPath, std::ios::binary);
+    if (!outFile) {
+        std::cerr << "Error opening file " << outModelPath << " for writing" << std::endl;
+        return false;
+    }
+    std::string buffer(4 * 1024 * 1024, '\0');
+    while (inFile) {
+        inFile.read(&buffer[0], buffer.size());
+        outFile.write(buffer.data(), inFile.gcount());
+    }
+    if (!inFile.eof() || !outFile) {
+        std::cerr << "Error copying " << inModelPath << " to " << outModelPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
 /**
  * @brief Loads metrics from a JSON file.
  *
@@ -151,12 +169,13 @@ json loadMetricsFromFile(const std::string& metricPath) {
  * This function attempts to delete the file located at the given path.
  * If the file is successfully deleted, a success message is printed to the console.
  * If the file cannot be deleted, an error message is printed to the console.
+ * The blocks of the file are freed in the background, see unlinkFileAsync().
  * 
  * @param path The path to the file that needs to be deleted.
  */
 void deleteFileFromDisk(const std::string& path) {
     // Delete the file
-    if (remove((path).c_str()) != 0) {
+    if (!unlinkFileAsync(path)) {
         std::cerr << "Error deleting file" << std::endl;
     }
     else {
@@ -195,9 +214,10 @@ std::string generateRandomUUID() {
  *
  * This function extracts various configuration parameters related to the combiner
  * from the provided YAML node and stores them in a map. The expected parameters
- * include "combiner", "proxy_server", "insecure", "token", and "auth_scheme".
- * Default values are provided for "insecure" (false) and "auth_scheme" (Bearer)
- * if they are not specified in the configuration file.
+ * include "combiner", "proxy_server", "insecure", "token", "auth_scheme" and
+ * "combiner_connect_timeout". Default values are provided for "insecure" (false),
+ * "auth_scheme" (Bearer) and "combiner_connect_timeout" (30 seconds) if they are
+ * not specified in the configuration file.
  *
  * @param configFile A YAML::Node object representing the configuration file.
  * @return A map containing the combiner configuration parameters as key-value pairs.
@@ -240,17 +260,94 @@ std::map<std::string, std::string> readCombinerConfig(YAML::Node configFile) {
         std::cout << "Auth scheme not found in config, using default Bearer" << std::endl;
         combinerConfig["auth_scheme"] = "Bearer";
     }
+    // Seconds to wait for the channel to the combiner to connect before giving up
+    if (configFile["combiner_connect_timeout"]) {
+        combinerConfig["connect_timeout"] = configFile["combiner_connect_timeout"].as<std::string>();
+    }
+    else {
+        combinerConfig["connect_timeout"] = "30";
+    }
+    // Seconds to wait for a combiner candidate to answer when probing candidates
+    if (configFile["probe_timeout"]) {
+        combinerConfig["probe_timeout"] = configFile["probe_timeout"].as<std::string>();
+    }
+    else {
+        combinerConfig["probe_timeout"] = "2";
+    }
+    // Number of times a broken model download or upload is resumed
+    if (configFile["transfer_retries"]) {
+        combinerConfig["transfer_retries"] = configFile["transfer_retries"].as<std::string>();
+    }
+    else {
+        combinerConfig["transfer_retries"] = "5";
+    }
+    // Send and receive model chunks without copying them through protobuf messages
+    if (configFile["zero_copy_transfer"]) {
+        combinerConfig["zero_copy_transfer"] = configFile["zero_copy_transfer"].as<bool>() ? "true" : "false";
+    }
+    else {
+        combinerConfig["zero_copy_transfer"] = "true";
+    }
+    // Upload only the chunks of a model the server does not already hold
+    if (configFile["dedup_uploads"]) {
+        combinerConfig["dedup_uploads"] = configFile["dedup_uploads"].as<bool>() ? "true" : "false";
+    }
+    else {
+        combinerConfig["dedup_uploads"] = "false";
+    }
+    // Upload only the tensors the train hook declares it modified
+    if (configFile["partial_updates"]) {
+        combinerConfig["partial_updates"] = configFile["partial_updates"].as<bool>() ? "true" : "false";
+    }
+    else {
+        combinerConfig["partial_updates"] = "false";
+    }
+    // Download only these tensors of the global model for training, kept comma separated
+    combinerConfig["download_tensors"] = "";
+    if (configFile["download_tensors"] && configFile["download_tensors"].IsSequence()) {
+        for (const auto& tensor : configFile["download_tensors"]) {
+            if (!combinerConfig["download_tensors"].empty()) {
+                combinerConfig["download_tensors"] += ",";
+            }
+            combinerConfig["download_tensors"] += tensor.as<std::string>();
+        }
+    }
+    else if (configFile["download_tensors"]) {
+        combinerConfig["download_tensors"] = configFile["download_tensors"].as<std::string>();
+    }
     std::cout << "Combiner configuration read successfully" << std::endl;
 
     return combinerConfig;
 }
 
+/**
+ * @brief Reads the list of combiner candidates from a YAML configuration file.
+ *
+ * The candidates are given as a list of hosts (including the port) under the
+ * "combiners" key. The client probes all candidates and connects to the one with
+ * the lowest round-trip time.
+ *
+ * @param configFile A YAML::Node object representing the configuration file.
+ * @return A vector with the candidate hosts, empty if none are configured.
+ */
+std::vector<std::string> readCombinerCandidates(YAML::Node configFile) {
+    std::vector<std::string> candidates;
+    if (configFile["combiners"] && configFile["combiners"].IsSequence()) {
+        for (const YAML::Node& candidate : configFile["combiners"]) {
+            candidates.push_back(candidate.as<std::string>());
+        }
+    }
+    return candidates;
+}
+
 /**
  * @brief Reads the controller configuration from a YAML node.
  *
  * This function extracts various configuration parameters from the provided
  * YAML node and stores them in a map. The configuration parameters include
- * API URL, token, client ID, name, package, and preferred combiner.
+ * API URL, token, client ID, name, package, and preferred combiner, as well as
+ * the timeouts and retries used for controller requests and the location and
+ * lifetime of the cached combiner assignment.
  *
  * @param config The YAML node containing the configuration data.
  * @return A map containing the configuration parameters as key-value pairs.
@@ -314,6 +411,184 @@ std::map<std::string, std::string> readControllerConfig(YAML::Node config) {
         std::cout << "Preferred combiner not found in config, using default None" << std::endl;
         controllerConfig["preferred_combiner"] = "";
     }
+
+    // Timeouts (in seconds) and retries for requests to the controller
+    if (config["connect_timeout"]) {
+        controllerConfig["connect_timeout"] = config["connect_timeout"].as<std::string>();
+    } else {
+        controllerConfig["connect_timeout"] = "5";
+    }
+    if (config["request_timeout"]) {
+        controllerConfig["request_timeout"] = config["request_timeout"].as<std::string>();
+    } else {
+        controllerConfig["request_timeout"] = "30";
+    }
+    if (config["max_retries"]) {
+        controllerConfig["max_retries"] = config["max_retries"].as<std::string>();
+    } else {
+        controllerConfig["max_retries"] = "5";
+    }
+
+    // File where the last combiner assignment is cached, and for how long (in seconds) it stays valid.
+    // An empty path or a ttl of 0 disables the cache.
+    if (config["assignment_cache"]) {
+        controllerConfig["assignment_cache"] = config["assignment_cache"].as<std::string>();
+    } else {
+        controllerConfig["assignment_cache"] = "./.fedn-assignment-" + controllerConfig["client_id"] + ".json";
+    }
+    if (config["assignment_ttl"]) {
+        controllerConfig["assignment_ttl"] = config["assignment_ttl"].as<std::string>();
+    } else {
+        controllerConfig["assignment_ttl"] = "3600";
+    }
+
+    // Directory of the outbox for results that could not be delivered, and how long (in seconds)
+    // they are kept. An empty path disables the outbox, a ttl of 0 keeps entries until their session ends.
+    if (config["outbox"]) {
+        controllerConfig["outbox"] = config["outbox"].as<std::string>();
+    } else {
+        controllerConfig["outbox"] = "./.fedn-outbox-" + controllerConfig["client_id"];
+    }
+    if (config["outbox_ttl"]) {
+        controllerConfig["outbox_ttl"] = config["outbox_ttl"].as<std::string>();
+    } else {
+        controllerConfig["outbox_ttl"] = "86400";
+    }
+
+    // Workspace for the files of tasks, with quotas in megabytes (0 for no quota). Models up to
+    // workspace_ram_threshold_mb are placed in workspace_ram, e.g. /dev/shm, if it is set.
+    if (config["workspace"]) {
+        controllerConfig["workspace"] = config["workspace"].as<std::string>();
+    } else {
+        controllerConfig["workspace"] = "./.fedn-workspace-" + controllerConfig["client_id"];
+    }
+    if (config["workspace_quota_mb"]) {
+        controllerConfig["workspace_quota_mb"] = config["workspace_quota_mb"].as<std::string>();
+    } else {
+        controllerConfig["workspace_quota_mb"] = "0";
+    }
+    if (config["workspace_ram"]) {
+        controllerConfig["workspace_ram"] = config["workspace_ram"].as<std::string>();
+    } else {
+        controllerConfig["workspace_ram"] = "";
+    }
+    if (config["workspace_ram_quota_mb"]) {
+        controllerConfig["workspace_ram_quota_mb"] = config["workspace_ram_quota_mb"].as<std::string>();
+    } else {
+        controllerConfig["workspace_ram_quota_mb"] = "0";
+    }
+    if (config["workspace_ram_threshold_mb"]) {
+        controllerConfig["workspace_ram_threshold_mb"] = config["workspace_ram_threshold_mb"].as<std::string>();
+    } else {
+        controllerConfig["workspace_ram_threshold_mb"] = "256";
+    }
+    // Number of global models kept in the workspace to download later ones as deltas against,
+    // 0 to download every model in full
+    if (config["model_cache_size"]) {
+        controllerConfig["model_cache_size"] = config["model_cache_size"].as<std::string>();
+    } else {
+        controllerConfig["model_cache_size"] = "0";
+    }
+
+    // Engine for model file I/O ("auto", "io_uring" or "posix"), and whether model files are
+    // written with O_DIRECT
+    if (config["file_io"]) {
+        controllerConfig["file_io"] = config["file_io"].as<std::string>();
+    } else {
+        controllerConfig["file_io"] = "auto";
+    }
+    if (config["direct_io"]) {
+        controllerConfig["direct_io"] = config["direct_io"].as<bool>() ? "true" : "false";
+    } else {
+        controllerConfig["direct_io"] = "false";
+    }
+
+    // Floating point dtype of uploaded tensor containers ("float32", "bfloat16" or "float16"),
+    // empty to upload models as trained
+    if (config["model_dtype"]) {
+        controllerConfig["model_dtype"] = config["model_dtype"].as<std::string>();
+    } else {
+        controllerConfig["model_dtype"] = "";
+    }
+    // Upload trained models as deltas against the global model ("xor" or "arithmetic"),
+    // empty to upload them in full
+    if (config["model_delta"]) {
+        controllerConfig["model_delta"] = config["model_delta"].as<std::string>();
+    } else {
+        controllerConfig["model_delta"] = "";
+    }
+    // Encode trained models with a chain of codecs, e.g. "quantize(bits=8) | compress | checksum", empty for the single codecs below
+    if (config["update_pipeline"]) {
+        controllerConfig["update_pipeline"] = config["update_pipeline"].as<std::string>();
+    } else {
+        controllerConfig["update_pipeline"] = "";
+    }
+    // Upload trained models as low-rank factors of their update of the given rank, empty to upload them in full
+    if (config["model_low_rank"]) {
+        controllerConfig["model_low_rank"] = config["model_low_rank"].as<std::string>();
+    } else {
+        controllerConfig["model_low_rank"] = "";
+    }
+    // Tensors of fewer elements are sent as they are
+    if (config["low_rank_min_elements"]) {
+        controllerConfig["low_rank_min_elements"] = config["low_rank_min_elements"].as<std::string>();
+    } else {
+        controllerConfig["low_rank_min_elements"] = "4096";
+    }
+    // Upload trained models as the given fraction of their update, e.g. "0.01", empty to upload them in full
+    if (config["model_sparsification"]) {
+        controllerConfig["model_sparsification"] = config["model_sparsification"].as<std::string>();
+    } else {
+        controllerConfig["model_sparsification"] = "";
+    }
+    // Upload trained models as quantized updates ("int8" or "int4"), empty to upload them in full
+    if (config["model_quantization"]) {
+        controllerConfig["model_quantization"] = config["model_quantization"].as<std::string>();
+    } else {
+        controllerConfig["model_quantization"] = "";
+    }
+    // Number of weights that share a scale and an offset, 0 for one per tensor
+    if (config["quantization_block_size"]) {
+        controllerConfig["quantization_block_size"] = config["quantization_block_size"].as<std::string>();
+    } else {
+        controllerConfig["quantization_block_size"] = "256";
+    }
+    // Clip model updates to this L2 norm and add Gaussian noise before they leave the client, empty to upload them as trained
+    if (config["dp_clip_norm"]) {
+        controllerConfig["dp_clip_norm"] = config["dp_clip_norm"].as<std::string>();
+    } else {
+        controllerConfig["dp_clip_norm"] = "";
+    }
+    // Standard deviation of the noise as a multiple of the clipping norm
+    if (config["dp_noise_multiplier"]) {
+        controllerConfig["dp_noise_multiplier"] = config["dp_noise_multiplier"].as<std::string>();
+    } else {
+        controllerConfig["dp_noise_multiplier"] = "1.0";
+    }
+    // Directory the clients of a round share their public keys in, empty to upload model updates unmasked
+    if (config["secagg_key_dir"]) {
+        controllerConfig["secagg_key_dir"] = config["secagg_key_dir"].as<std::string>();
+    } else {
+        controllerConfig["secagg_key_dir"] = "";
+    }
+    // Number of clients of every round of secure aggregation, this one included
+    if (config["secagg_clients"]) {
+        controllerConfig["secagg_clients"] = config["secagg_clients"].as<std::string>();
+    } else {
+        controllerConfig["secagg_clients"] = "0";
+    }
+    // Seconds to wait for the keys of the other clients
+    if (config["secagg_timeout"]) {
+        controllerConfig["secagg_timeout"] = config["secagg_timeout"].as<std::string>();
+    } else {
+        controllerConfig["secagg_timeout"] = "300";
+    }
+    // Bits after the point of the fixed-point encoding of masked updates
+    if (config["secagg_fractional_bits"]) {
+        controllerConfig["secagg_fractional_bits"] = config["secagg_fractional_bits"].as<std::string>();
+    } else {
+        controllerConfig["secagg_fractional_bits"] = "16";
+    }
     std::cout << "HTTP request data read successfully" << std::endl;
 
     return controllerConfig;
@@ -0,0 +1,254 @@
+#include <iostream>
+#include <filesystem>
+#include <chrono>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
+
+#include "../include/fednlib/workspace.h"
+#include "../include/fednlib/fileio.h"
+#include "../include/fednlib/utils.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Task directories start with this prefix, so a root can be shared with other files, e.g. in /dev/shm
+const std::string kTaskPrefix = "fedn-task-";
+const std::string kLockFile = ".lock";
+
+// Opens and locks the lock file of a task directory. Returns -1 if it is locked by another task.
+int lockTaskDirectory(const std::string& directory, bool create) {
+    std::string lockPath = (fs::path(directory) / kLockFile).string();
+    int fd = open(lockPath.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+} // namespace
+
+/**
+ * @brief Opens the workspace, creating its directories if needed, and removes what crashed clients left.
+ *
+ * @param options The roots, quotas and placement policy of the workspace.
+ * @throws std::runtime_error If a root directory cannot be created.
+ */
+Workspace::Workspace(const WorkspaceOptions& options)
+    : options(options), disk{options.root, options.quota}, ram{options.ramRoot, options.ramQuota} {
+    for (const Root* root : {&disk, &ram}) {
+        if (root->path.empty()) {
+            continue;
+        }
+        std::error_code ec;
+        fs::create_directories(root->path, ec);
+        if (ec) {
+            throw std::runtime_error("Failed to create workspace directory " + root->path + ": " + ec.message());
+        }
+    }
+    if (disk.path.empty()) {
+        throw std::runtime_error("Workspace root must not be empty");
+    }
+    sweep();
+}
+
+/**
+ * @brief Removes task directories that no running task holds, e.g. after a crash.
+ */
+void Workspace::sweep() {
+    for (const Root* root : {&disk, &ram}) {
+        if (root->path.empty()) {
+            continue;
+        }
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(root->path, ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, kTaskPrefix.size(), kTaskPrefix) != 0 || !entry.is_directory(ec)) {
+                continue;
+            }
+            int lockFd = lockTaskDirectory(entry.path().string(), false);
+            bool orphaned = lockFd >= 0;
+            if (lockFd < 0) {
+                // A directory without a lock file was left while it was being created or removed.
+                // Give a task of another client that shares the root time to create its lock file.
+                auto age = fs::file_time_type::clock::now() - fs::last_write_time(entry.path(), ec);
+                orphaned = !ec && !fs::exists(entry.path() / kLockFile, ec) && age > std::chrono::minutes(1);
+            }
+            if (orphaned) {
+                uintmax_t removed = fs::remove_all(entry.path(), ec);
+                std::cout << "Workspace: removed " << entry.path().string() << " (" << removed
+                          << " files) left by an earlier run" << std::endl;
+            }
+            if (lockFd >= 0) {
+                close(lockFd);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Returns the path of a file that is kept across tasks, e.g. the residual of
+ * quantized model updates.
+ *
+ * The files are in the "state" directory under root, which sweep() leaves alone. They are
+ * only counted against the quota if their space is reserved with reserveState(), as the
+ * model cache does.
+ *
+ * @param name The name of the file.
+ * @return std::string The path, empty if the directory could not be created.
+ */
+std::string Workspace::stateFile(const std::string& name) {
+    fs::path directory = fs::path(disk.path) / "state";
+    std::error_code ec;
+    fs::create_directories(directory, ec);
+    if (ec) {
+        std::cerr << "Failed to create workspace directory " << directory.string() << ": " << ec.message() << std::endl;
+        return "";
+    }
+    return (directory / name).string();
+}
+
+/**
+ * @brief Reserves space for files kept across tasks, see stateFile(), in the quota and the
+ * free space of the disk root.
+ *
+ * @param bytes The number of bytes to reserve.
+ * @return true if the space was reserved, false if the quota or the file system is full.
+ */
+bool Workspace::reserveState(uint64_t bytes) {
+    return admit(disk, bytes, disk.path);
+}
+
+/**
+ * @brief Gives back space reserved with reserveState(), e.g. when a file is removed.
+ */
+void Workspace::releaseState(uint64_t bytes) {
+    release(disk, bytes);
+}
+
+/**
+ * @brief Creates the directory for a task.
+ *
+ * The directory is placed in memory if a RAM root is configured and the last model seen
+ * is at most ramThreshold bytes, and on disk otherwise.
+ *
+ * @param kind The kind of task, e.g. "train", used in the name of the directory.
+ * @return std::unique_ptr<TaskDirectory> The directory, nullptr if it could not be created.
+ */
+std::unique_ptr<TaskDirectory> Workspace::createTask(const std::string& kind) {
+    Root* root = &disk;
+    {
+        std::lock_guard<std::mutex> lock(workspaceMutex);
+        if (!ram.path.empty() && lastModelSize >= 0 && (uint64_t) lastModelSize <= options.ramThreshold) {
+            root = &ram;
+        }
+    }
+    std::string directory = (fs::path(root->path) / (kTaskPrefix + kind + "-" + generateRandomUUID())).string();
+    std::error_code ec;
+    if (!fs::create_directory(directory, ec)) {
+        std::cerr << "Workspace: failed to create " << directory << ": " << ec.message() << std::endl;
+        return nullptr;
+    }
+    int lockFd = lockTaskDirectory(directory, true);
+    if (lockFd < 0) {
+        std::cerr << "Workspace: failed to lock " << directory << std::endl;
+        fs::remove_all(directory, ec);
+        return nullptr;
+    }
+    return std::unique_ptr<TaskDirectory>(new TaskDirectory(shared_from_this(), root, directory, lockFd));
+}
+
+/**
+ * @brief Admits a reservation if it fits in the quota and in the free space of the file system.
+ */
+bool Workspace::admit(Root& root, uint64_t bytes, const std::string& taskPath) {
+    std::lock_guard<std::mutex> lock(workspaceMutex);
+    if (root.quota > 0 && root.reserved + bytes > root.quota) {
+        std::cerr << "Workspace: cannot reserve " << bytes << " bytes in " << root.path << ", "
+                  << root.reserved << " of " << root.quota << " bytes of the quota are in use" << std::endl;
+        return false;
+    }
+    // Reserved space that has been written is no longer free, so only the new bytes are
+    // checked against the file system; the quota bounds what is reserved but not written yet
+    struct statvfs st;
+    if (statvfs(taskPath.c_str(), &st) == 0) {
+        uint64_t available = (uint64_t) st.f_bavail * st.f_frsize;
+        if (bytes > available) {
+            std::cerr << "Workspace: cannot reserve " << bytes << " bytes in " << root.path << ", only "
+                      << available << " bytes are free" << std::endl;
+            return false;
+        }
+    }
+    root.reserved += bytes;
+    return true;
+}
+
+void Workspace::release(Root& root, uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(workspaceMutex);
+    root.reserved -= std::min(root.reserved, bytes);
+}
+
+TaskDirectory::TaskDirectory(std::shared_ptr<Workspace> workspace, Workspace::Root* root, const std::string& directory, int lockFd)
+    : workspace(workspace), root(root), directory(directory), lockFd(lockFd) {}
+
+/**
+ * @brief Removes the directory with everything in it and releases the reserved space.
+ */
+TaskDirectory::~TaskDirectory() {
+    if (!removeDirectoryAsync(directory)) {
+        std::cerr << "Workspace: failed to remove " << directory << ": " << strerror(errno) << std::endl;
+    }
+    // The lock is kept until the directory has been renamed, so a sweep cannot remove it meanwhile
+    close(lockFd);
+    workspace->release(*root, reservedBytes);
+}
+
+/**
+ * @brief Returns the path of a file in the directory.
+ */
+std::string TaskDirectory::file(const std::string& name) const {
+    return (fs::path(directory) / name).string();
+}
+
+/**
+ * @brief Reserves space for a file before it is written.
+ *
+ * @param bytes The number of bytes to reserve.
+ * @return true if the space was reserved, false if the quota or the file system is full.
+ */
+bool TaskDirectory::reserve(uint64_t bytes) {
+    if (!workspace->admit(*root, bytes, directory)) {
+        return false;
+    }
+    reservedBytes += bytes;
+    return true;
+}
+
+/**
+ * @brief Reserves space for the model of the task, once the size of the whole model is known.
+ *
+ * The size is remembered as the size of the task's model, see modelSize(), and to place the
+ * directories of later tasks, see Workspace. Deltas and partial models are reserved with
+ * reserve() instead, their size says nothing about the model.
+ *
+ * @param bytes The size of the model in bytes.
+ * @return true if the space was reserved, false if the quota or the file system is full.
+ */
+bool TaskDirectory::reserveModel(uint64_t bytes) {
+    if (!reserve(bytes)) {
+        return false;
+    }
+    modelBytes = bytes;
+    std::lock_guard<std::mutex> lock(workspace->workspaceMutex);
+    workspace->lastModelSize = bytes;
+    return true;
+}
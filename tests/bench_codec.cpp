@@ -0,0 +1,116 @@
+// Size, speed and error of codec pipelines for a model update, see CodecPipeline::benchmark().
+//
+//   bench_codec [pipeline] [trained model] [global model] [repetitions]
+//
+// Without a pipeline, or with "all", a set of typical pipelines is run. Without models, a
+// model of 16 million float32 weights is made up, with every seventh weight changed a little
+// by training, in the temporary directory. Run it with a real pair of models to pick the
+// pipeline for them: deltas and sparse updates depend a lot on how training changed the model.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <filesystem>
+
+#include "fednlib/codec.h"
+#include "fednlib/tensor.h"
+
+namespace {
+
+const std::vector<std::string> kPipelines = {
+    "compress | checksum",
+    "delta(mode=xor) | checksum",
+    "delta(mode=xor) | compress | checksum",
+    "delta(mode=arithmetic) | compress | checksum",
+    "quantize(bits=8) | compress | checksum",
+    "quantize(bits=4) | checksum",
+    "sparsify(ratio=0.01) | compress | checksum",
+    "lowrank(rank=4) | checksum",
+};
+
+// A model of matrices of 1024 x 1024 weights, and the model after a round of training
+bool writeModels(const std::string& basePath, const std::string& modelPath, size_t matrices) {
+    std::mt19937 random(1);
+    std::normal_distribution<float> normal;
+    TensorWriter base;
+    TensorWriter trained;
+    bool ok = base.open(basePath) && trained.open(modelPath);
+    std::vector<float> weights(1024 * 1024);
+    for (size_t m = 0; ok && m < matrices; m++) {
+        std::string name = "layer" + std::to_string(m) + ".weight";
+        for (float& weight : weights) {
+            weight = normal(random);
+        }
+        ok = base.add<float>(name, {1024, 1024}, weights.data());
+        for (size_t i = m % 7; i < weights.size(); i += 7) {
+            weights[i] += 1e-3f * normal(random);
+        }
+        ok = ok && trained.add<float>(name, {1024, 1024}, weights.data());
+    }
+    return base.finish() && trained.finish() && ok;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string spec = argc > 1 ? argv[1] : "all";
+    int repetitions = argc > 4 ? std::stoi(argv[4]) : 3;
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-bench-codec").string();
+    std::filesystem::create_directories(directory);
+
+    CodecContext context;
+    context.baseModelID = "bench";
+    std::string modelPath;
+    if (argc > 3) {
+        modelPath = argv[2];
+        context.basePath = argv[3];
+    } else {
+        modelPath = directory + "/model.bin";
+        context.basePath = directory + "/base.bin";
+        if (!writeModels(context.basePath, modelPath, 16)) {
+            std::cerr << "Cannot write the models to " << directory << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::string> pipelines = spec == "all" ? kPipelines : std::vector<std::string>{spec};
+    std::cout << "Model " << modelPath << " of " << std::filesystem::file_size(modelPath) / (1024 * 1024)
+              << " MB, best of " << repetitions << std::endl;
+    std::cout << std::left << std::setw(48) << "pipeline" << std::right << std::setw(12) << "update MB" << std::setw(10) << "ratio"
+              << std::setw(14) << "encode MB/s" << std::setw(14) << "decode MB/s" << std::setw(14) << "rel. error" << std::endl;
+    int failures = 0;
+    for (const std::string& pipelineSpec : pipelines) {
+        std::shared_ptr<CodecPipeline> pipeline = CodecPipeline::parse(pipelineSpec);
+        CodecBenchmark best;
+        best.encodeSeconds = 1e30;
+        best.decodeSeconds = 1e30;
+        bool ok = pipeline != nullptr;
+        for (int i = 0; ok && i < repetitions; i++) {
+            CodecBenchmark result;
+            ok = pipeline->benchmark(context, modelPath, directory + "/scratch", result);
+            best.modelSize = result.modelSize;
+            best.updateSize = result.updateSize;
+            best.relativeError = result.relativeError;
+            best.encodeSeconds = std::min(best.encodeSeconds, result.encodeSeconds);
+            best.decodeSeconds = std::min(best.decodeSeconds, result.decodeSeconds);
+        }
+        std::cout << std::left << std::setw(48) << pipelineSpec << std::right;
+        if (!ok) {
+            std::cout << "  failed" << std::endl;
+            failures++;
+            continue;
+        }
+        double megabytes = double(best.modelSize) / (1024 * 1024);
+        std::cout << std::fixed << std::setprecision(2) << std::setw(12) << double(best.updateSize) / (1024 * 1024)
+                  << std::setw(10) << double(best.modelSize) / double(std::max<uint64_t>(best.updateSize, 1))
+                  << std::setprecision(0) << std::setw(14) << megabytes / best.encodeSeconds << std::setw(14) << megabytes / best.decodeSeconds
+                  << std::scientific << std::setprecision(2) << std::setw(14) << best.relativeError << std::defaultfloat << std::endl;
+    }
+    if (argc <= 3) {
+        std::filesystem::remove_all(directory);
+    }
+    return failures != 0;
+}
@@ -0,0 +1,129 @@
+// Throughput of model file writes and reads: the iostream path the client used before, against
+// ModelFileWriter and readModelFile on each FileIOEngine, with and without O_DIRECT.
+//
+//   bench_fileio [directory] [size in MB] [repetitions]
+//
+// Run it with a directory on the device to measure, e.g. an NVMe drive. Writes are timed up
+// to fdatasync() and the file is dropped from the page cache before it is read back, so the
+// numbers are those of the device and not of memory.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fednlib/fileio.h"
+
+namespace {
+
+double seconds(const std::function<void()>& run) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void syncFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        close(fd);
+    }
+}
+
+// Clean pages are dropped right away, so a synced file is read from the device next time
+void dropFromCache(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+struct Result {
+    double writeSeconds = 1e30;
+    double readSeconds = 1e30;
+};
+
+void report(const std::string& name, size_t size, const Result& result) {
+    std::cout << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(10) << size / result.writeSeconds / 1e6 << " MB/s write"
+              << std::setw(10) << size / result.readSeconds / 1e6 << " MB/s read" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string directory = argc > 1 ? argv[1] : ".";
+    size_t size = (argc > 2 ? std::stoul(argv[2]) : 1024) * 1024 * 1024;
+    int repetitions = argc > 3 ? std::stoi(argv[3]) : 3;
+    std::string path = directory + "/bench_fileio.bin";
+
+    std::string model(size, '\0');
+    std::mt19937_64 random(1);
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t value = random();
+        std::copy(reinterpret_cast<const char*>(&value), reinterpret_cast<const char*>(&value) + 8, &model[i]);
+    }
+    std::cout << "Model of " << size / (1024 * 1024) << " MB in " << directory << ", best of " << repetitions << std::endl;
+
+    Result iostream;
+    for (int i = 0; i < repetitions; i++) {
+        unlink(path.c_str());
+        iostream.writeSeconds = std::min(iostream.writeSeconds, seconds([&] {
+            std::ofstream out(path, std::ios::binary);
+            out.write(model.data(), model.size());
+            out.close();
+            syncFile(path);
+        }));
+        dropFromCache(path);
+        iostream.readSeconds = std::min(iostream.readSeconds, seconds([&] {
+            std::ifstream in(path, std::ios::binary);
+            std::string data(size, '\0');
+            in.read(&data[0], size);
+        }));
+    }
+    report("iostream", size, iostream);
+
+    for (std::string engine : {"posix", "io_uring"}) {
+        for (bool directIO : {false, true}) {
+            FileIOOptions options;
+            options.engine = engine;
+            options.directIO = directIO;
+            // An io_uring engine falls back to pread/pwrite where the kernel does not allow it
+            if (engine != FileIOEngine::create(options)->name()) {
+                std::cout << engine << " is not available" << std::endl;
+                break;
+            }
+            std::string name = engine + (directIO ? " O_DIRECT" : "");
+            Result result;
+            bool ok = true;
+            for (int i = 0; i < repetitions && ok; i++) {
+                unlink(path.c_str());
+                result.writeSeconds = std::min(result.writeSeconds, seconds([&] {
+                    ModelFileWriter writer(options);
+                    ok = writer.open(path, size) && writer.write(model.data(), size, 0) && writer.finish(size);
+                    syncFile(path);
+                }));
+                dropFromCache(path);
+                std::string data;
+                result.readSeconds = std::min(result.readSeconds, seconds([&] {
+                    ok = ok && readModelFile(path, data, options);
+                }));
+                ok = ok && data == model;
+            }
+            if (!ok) {
+                std::cerr << name << " failed" << std::endl;
+                unlink(path.c_str());
+                return 1;
+            }
+            report(name, size, result);
+        }
+    }
+    unlink(path.c_str());
+    return 0;
+}
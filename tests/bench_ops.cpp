@@ -0,0 +1,100 @@
+// Throughput of the kernels of ops.h with each set of kernels the CPU supports, in elements
+// per second.
+//
+//   bench_ops [elements in millions] [threads, 0 for one per core] [repetitions]
+//
+// Run it with one thread to compare the kernels, and with more to see how the buffers scale
+// over the cores; a buffer much larger than the caches measures the memory bandwidth.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+#include "fednlib/ops.h"
+
+using namespace fednlib;
+
+namespace {
+
+// The best time of the repetitions, in seconds
+double bestSeconds(int repetitions, const std::function<void()>& run) {
+    double best = 1e30;
+    for (int i = 0; i < repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t count = (argc > 1 ? std::stoul(argv[1]) : 16) * 1000 * 1000;
+    unsigned threads = argc > 2 ? std::stoul(argv[2]) : 1;
+    int repetitions = argc > 3 ? std::stoi(argv[3]) : 5;
+    ops::setThreads(threads);
+
+    std::mt19937 random(1);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> x(count), y(count), z(count), out(count);
+    for (size_t i = 0; i < count; i++) {
+        x[i] = normal(random);
+        y[i] = normal(random);
+        z[i] = normal(random);
+    }
+    std::vector<int32_t> fixed(count);
+    std::vector<uint8_t> codes(ops::quantizedSize(count, 8));
+    std::vector<float> params(2 * ops::quantizedBlocks(count, 256));
+    std::vector<uint64_t> indices(count / 100);
+    const uint8_t key[32] = {1};
+    const float* inputs[3] = {x.data(), y.data(), z.data()};
+    const float weights[3] = {0.2f, 0.5f, 0.3f};
+    volatile double sink = 0;
+
+    const std::vector<std::pair<std::string, std::function<void()>>> benchmarks = {
+        {"axpy", [&] { ops::axpy(0.5f, x.data(), y.data(), count); }},
+        {"axpby", [&] { ops::axpby(0.5f, x.data(), 0.9f, y.data(), count); }},
+        {"scale", [&] { ops::scale(1.0001f, y.data(), count); }},
+        {"sub", [&] { ops::sub(x.data(), y.data(), out.data(), count); }},
+        {"clamp", [&] { ops::clamp(out.data(), count, -3.0f, 3.0f); }},
+        {"weightedSum x3", [&] { ops::weightedSum(inputs, weights, 3, out.data(), count); }},
+        {"stats", [&] { sink = sink + ops::stats(x.data(), count).sumSquares; }},
+        {"dot", [&] { sink = sink + ops::dot(x.data(), z.data(), count); }},
+        {"squaredDistance", [&] { sink = sink + ops::squaredDistance(x.data(), z.data(), count); }},
+        {"addGaussianNoise", [&] { ops::addGaussianNoise(out.data(), count, 0.01f, 1, 2); }},
+        {"toFixedPoint", [&] { ops::toFixedPoint(x.data(), fixed.data(), count, 65536.0f, 16.0f); }},
+        {"addMask", [&] { ops::addMask(fixed.data(), count, key, 1, false); }},
+        {"quantize 8 bits", [&] { ops::quantize(x.data(), nullptr, count, 8, 256, 1, codes.data(), params.data()); }},
+        {"dequantize 8 bits", [&] { ops::dequantize(codes.data(), params.data(), count, 8, 256, out.data()); }},
+        {"topK 1%", [&] { sink = sink + ops::topK(x.data(), count, indices.size(), 1, indices.data()); }},
+    };
+
+    std::vector<std::string> kernels = {"scalar"};
+    for (const char* name : {"avx2", "avx512", "neon"}) {
+        if (ops::setKernels(name)) {
+            kernels.push_back(name);
+        }
+    }
+    std::cout << count << " elements, " << (threads ? std::to_string(threads) : "all") << " threads, best of "
+              << repetitions << ", Melem/s" << std::endl;
+    std::cout << std::left << std::setw(20) << "";
+    for (const std::string& name : kernels) {
+        std::cout << std::right << std::setw(10) << name;
+    }
+    std::cout << std::endl;
+    for (const auto& [name, run] : benchmarks) {
+        std::cout << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(0);
+        for (const std::string& kernel : kernels) {
+            ops::setKernels(kernel);
+            std::cout << std::setw(10) << count / bestSeconds(repetitions, run) / 1e6 << std::flush;
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
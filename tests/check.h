@@ -0,0 +1,23 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <iostream>
+
+/**
+ * Checks for the tests, which are plain programs run by ctest. A failed check is reported
+ * with its location and the test goes on, main() returns checkFailures() != 0.
+ */
+inline int& checkFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " << #condition << std::endl; \
+            checkFailures()++; \
+        } \
+    } while (0)
+
+#endif // CHECK_H
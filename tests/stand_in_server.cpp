@@ -0,0 +1,501 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "stand_in_server.h"
+#include "fednlib/delta.h"
+#include "fednlib/fileio.h"
+
+using fedn::ModelRequest;
+using fedn::ModelResponse;
+using fedn::ModelStatus;
+
+namespace {
+
+bool writeFile(const std::string& path, const std::string& data) {
+    std::ofstream file(path, std::ios::binary);
+    file << data;
+    file.close();
+    return bool(file);
+}
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// A file written at the offsets of an upload, closed with the upload
+class UploadFile {
+public:
+    UploadFile() = default;
+    UploadFile(const UploadFile&) = delete;
+    UploadFile& operator=(const UploadFile&) = delete;
+    ~UploadFile() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    bool write(const std::string& path, const std::string& data, int64_t offset) {
+        if (fd_ < 0) {
+            fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        }
+        for (size_t done = 0; fd_ >= 0 && done < data.size(); ) {
+            ssize_t written = pwrite(fd_, data.data() + done, data.size() - done, offset + done);
+            if (written <= 0) {
+                return false;
+            }
+            done += written;
+        }
+        return fd_ >= 0;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+} // namespace
+
+/**
+ * @brief Stores a model the service can be asked to download.
+ */
+void StandInModelService::setModel(const std::string& modelID, const std::string& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    models_[modelID] = data;
+    storeChunks(modelID);
+}
+
+/**
+ * @brief Returns an uploaded or stored model, std::nullopt if there is none with the ID.
+ */
+std::optional<std::string> StandInModelService::model(const std::string& modelID) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = models_.find(modelID);
+    if (it == models_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+/**
+ * @brief Sets the size of the chunks downloads are sent in.
+ */
+void StandInModelService::setChunkSize(size_t chunkSize) {
+    chunkSize_ = chunkSize;
+}
+
+/**
+ * @brief Deduplicates uploads against the models held, which are kept as files in the
+ * directory. The directory is created if needed, models stored before are added to it.
+ */
+void StandInModelService::setDedupDirectory(const std::string& directory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dedupDirectory_ = directory;
+    std::filesystem::create_directories(directory);
+    for (const auto& entry : models_) {
+        storeChunks(entry.first);
+    }
+}
+
+/**
+ * @brief Sends downloads as deltas against models the client holds, encoded in files in the
+ * directory. The directory is created if needed.
+ */
+void StandInModelService::setDeltaDirectory(const std::string& directory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    deltaDirectory_ = directory;
+    std::filesystem::create_directories(directory);
+}
+
+/**
+ * @brief Writes uploads to files in the directory, at the offsets of their chunks, instead of
+ * keeping them in memory. The uploaded models are served from their files, see modelFile().
+ * The directory is created if needed. Not for deduplicated uploads.
+ */
+void StandInModelService::setUploadDirectory(const std::string& directory) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uploadDirectory_ = directory;
+    std::filesystem::create_directories(directory);
+}
+
+/**
+ * @brief Serves a model from a file, which is mapped and sent without reading it into memory.
+ */
+void StandInModelService::setModelFile(const std::string& modelID, const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    models_.erase(modelID);
+    modelFiles_[modelID] = path;
+}
+
+/**
+ * @brief Returns the file of a model kept in a file, empty if the model is not.
+ */
+std::string StandInModelService::modelFile(const std::string& modelID) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = modelFiles_.find(modelID);
+    return it == modelFiles_.end() ? "" : it->second;
+}
+
+/**
+ * @brief Breaks the next transfer, upload or download, once it has moved the given number of
+ * bytes, as a lost connection would. The bytes received so far are kept, so the client can
+ * resume.
+ *
+ * The transfer ends with the given status, UNAVAILABLE like a lost connection by default,
+ * e.g. UNKNOWN for an exception in a combiner written in Python, or OK for a download stream
+ * that a proxy ends early.
+ */
+void StandInModelService::failAfter(int64_t bytes, grpc::StatusCode code) {
+    failCode_ = code;
+    failAfter_ = bytes;
+}
+
+/**
+ * @brief Fails every upload with status UNKNOWN, the probe of a resumed or deduplicated
+ * upload, with the given status, like a combiner that does not expect it does, e.g. UNKNOWN
+ * for an exception in a combiner written in Python or UNIMPLEMENTED. OK answers them again.
+ */
+void StandInModelService::rejectProbes(grpc::StatusCode code) {
+    probeRejection_ = code;
+}
+
+void StandInModelService::resetCounters() {
+    bytesReceived_ = 0;
+    bytesSent_ = 0;
+}
+
+/**
+ * @brief Counts the bytes of a transfer and returns true if it is to be broken, see failAfter().
+ */
+bool StandInModelService::breakTransfer(int64_t bytes) {
+    int64_t limit = failAfter_;
+    if (limit <= 0 || bytes < limit) {
+        return false;
+    }
+    failAfter_ = 0;
+    std::cerr << "Stand-in: breaking transfer after " << bytes << " bytes" << std::endl;
+    return true;
+}
+
+// The status a transfer broken with failAfter() ends with
+grpc::Status StandInModelService::brokenStatus() const {
+    grpc::StatusCode code = failCode_;
+    return code == grpc::StatusCode::OK ? grpc::Status::OK : grpc::Status(code, "Connection lost");
+}
+
+grpc::Status StandInModelService::Upload(grpc::ServerContext*, grpc::ServerReader<ModelRequest>* reader,
+        ModelResponse* response) {
+    ModelRequest request;
+    std::string modelID;
+    UploadFile file; // With an upload directory
+    std::vector<ContentChunk> chunks; // Listed by a deduplicated upload
+    int64_t chunksEnd = 0;
+    bool probe = false;
+    int64_t received = 0;
+    while (reader->Read(&request)) {
+        modelID = request.id();
+        for (const fedn::ChunkRef& ref : request.chunks()) {
+            ContentChunk chunk;
+            chunk.offset = chunksEnd;
+            chunk.size = ref.size();
+            if (ref.hash().size() != chunk.hash.size()) {
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Chunk hash of " + std::to_string(ref.hash().size()) + " bytes");
+            }
+            memcpy(chunk.hash.data(), ref.hash().data(), chunk.hash.size());
+            chunks.push_back(chunk);
+            chunksEnd += chunk.size;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string& data = partial_[modelID];
+        std::string partialPath = uploadDirectory_ + "/" + modelID + ".partial";
+        if (request.status() == ModelStatus::UNKNOWN) {
+            // Answered once the client has listed all its chunks
+            probe = true;
+        } else if (request.status() == ModelStatus::IN_PROGRESS && !request.data().empty() && !uploadDirectory_.empty()) {
+            int64_t held = heldUploadBytes(modelID);
+            if (request.offset() > held) {
+                return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Chunk at " + std::to_string(request.offset())
+                    + " after a gap, " + std::to_string(held) + " bytes held");
+            }
+            if (!file.write(partialPath, request.data(), request.offset())) {
+                return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to write " + partialPath);
+            }
+            received += request.data().size();
+            bytesReceived_ += request.data().size();
+            if (breakTransfer(received)) {
+                return brokenStatus();
+            }
+        } else if (request.status() == ModelStatus::OK && !uploadDirectory_.empty()) {
+            std::string path = uploadDirectory_ + "/" + modelID;
+            if ((!std::filesystem::exists(partialPath) && !writeFile(partialPath, ""))
+                    || std::rename(partialPath.c_str(), path.c_str()) != 0) {
+                return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to store " + path);
+            }
+            models_.erase(modelID);
+            modelFiles_[modelID] = path;
+            partial_.erase(modelID);
+            response->set_status(ModelStatus::OK);
+            response->set_message("Model " + modelID + " stored");
+        } else if (request.status() == ModelStatus::IN_PROGRESS && !request.data().empty()) {
+            // The chunks of a deduplicated upload come in any order, with gaps for the chunks held
+            if (chunks.empty() && request.offset() > (int64_t) data.size()) {
+                return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Chunk at " + std::to_string(request.offset())
+                    + " after a gap, " + std::to_string(data.size()) + " bytes held");
+            }
+            size_t end = request.offset() + request.data().size();
+            data.resize(chunks.empty() ? end : std::max(data.size(), end));
+            data.replace(request.offset(), request.data().size(), request.data());
+            received += request.data().size();
+            bytesReceived_ += request.data().size();
+            if (breakTransfer(received)) {
+                return brokenStatus();
+            }
+        } else if (request.status() == ModelStatus::OK) {
+            if (!chunks.empty() && !completeChunks(modelID, chunks, data)) {
+                partial_.erase(modelID);
+                return grpc::Status(grpc::StatusCode::DATA_LOSS, "Model " + modelID + " does not match its chunks");
+            }
+            models_[modelID] = std::move(data);
+            partial_.erase(modelID);
+            storeChunks(modelID);
+            response->set_status(ModelStatus::OK);
+            response->set_message("Model " + modelID + " stored");
+        }
+    }
+    grpc::StatusCode rejection = probeRejection_;
+    if (probe && rejection != grpc::StatusCode::OK) {
+        return grpc::Status(rejection, "Model request with status UNKNOWN");
+    }
+    response->set_id(modelID);
+    if (probe) {
+        // How much of the upload is held, to resume it, and which chunks are not held
+        std::lock_guard<std::mutex> lock(mutex_);
+        response->set_status(ModelStatus::IN_PROGRESS);
+        response->set_offset(uploadDirectory_.empty() ? int64_t(partial_[modelID].size()) : heldUploadBytes(modelID));
+        if (!dedupDirectory_.empty()) {
+            response->set_dedup(true);
+            for (int64_t value : chunkStore_.missing(chunks)) {
+                response->add_missing(value);
+            }
+        }
+    }
+    return grpc::Status::OK;
+}
+
+/**
+ * @brief Returns the bytes of an upload to the upload directory held so far. Called with the
+ * mutex held.
+ */
+int64_t StandInModelService::heldUploadBytes(const std::string& modelID) {
+    std::error_code error;
+    uintmax_t size = std::filesystem::file_size(uploadDirectory_ + "/" + modelID + ".partial", error);
+    return error ? 0 : int64_t(size);
+}
+
+/**
+ * @brief Keeps a model as a file in the dedup directory and indexes its chunks, if there is
+ * one. The file is replaced by a rename, so the mapping of the file it replaces stays valid.
+ * Called with the mutex held.
+ */
+bool StandInModelService::storeChunks(const std::string& modelID) {
+    if (dedupDirectory_.empty()) {
+        return true;
+    }
+    std::string path = dedupDirectory_ + "/" + modelID;
+    std::string temporary = path + ".tmp";
+    if (!writeFile(temporary, models_[modelID]) || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "Stand-in: failed to store " << path << std::endl;
+        return false;
+    }
+    return chunkStore_.add(path);
+}
+
+/**
+ * @brief Completes a deduplicated upload with the chunks that were not sent, see
+ * ChunkStore::complete(). Called with the mutex held.
+ */
+bool StandInModelService::completeChunks(const std::string& modelID, const std::vector<ContentChunk>& chunks, std::string& data) {
+    std::string path = dedupDirectory_ + "/" + modelID + ".upload";
+    bool completed = !dedupDirectory_.empty() && writeFile(path, data) && chunkStore_.complete(chunks, path);
+    if (completed) {
+        data = readFile(path);
+    }
+    std::remove(path.c_str());
+    return completed;
+}
+
+/**
+ * @brief Encodes a model as a delta against another, see encodeModelDelta().
+ *
+ * @return The delta, std::nullopt if the base is not held or the delta is not smaller than the model.
+ */
+std::optional<std::string> StandInModelService::encodeDelta(const std::string& modelID, const std::string& baseID) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto model = models_.find(modelID);
+    auto base = models_.find(baseID);
+    if (model == models_.end() || base == models_.end() || model->second.size() != base->second.size()) {
+        return std::nullopt;
+    }
+    std::string prefix = deltaDirectory_ + "/" + modelID + "-" + baseID;
+    DeltaInfo info;
+    std::optional<std::string> delta;
+    if (writeFile(prefix + ".model", model->second) && writeFile(prefix + ".base", base->second)
+            && encodeModelDelta(prefix + ".model", prefix + ".base", prefix + ".delta", DeltaMode::Xor, 4, &info)
+            && info.encodedSize < info.modelSize) {
+        delta = readFile(prefix + ".delta");
+    }
+    for (const char* suffix : {".model", ".base", ".delta"}) {
+        std::remove((prefix + suffix).c_str());
+    }
+    return delta;
+}
+
+grpc::Status StandInModelService::Download(grpc::ServerContext*, const ModelRequest* request,
+        grpc::ServerWriter<ModelResponse>* writer) {
+    std::optional<std::string> data = model(request->id());
+    std::shared_ptr<MappedFile> file;
+    if (!data && !modelFile(request->id()).empty()) {
+        file = MappedFile::open(modelFile(request->id()));
+    }
+    ModelResponse response;
+    response.set_id(request->id());
+    if (!data && !file) {
+        response.set_status(ModelStatus::FAILED);
+        response.set_message("No model " + request->id());
+        writer->Write(response);
+        return grpc::Status::OK;
+    }
+
+    if (data && !deltaDirectory_.empty()) {
+        std::string hash(32, '\0');
+        sha256(data->data(), data->size(), reinterpret_cast<uint8_t*>(&hash[0]));
+        response.set_model_sha256(hash);
+        for (const std::string& cachedModelID : request->cached_model_ids()) {
+            std::optional<std::string> delta = encodeDelta(request->id(), cachedModelID);
+            if (delta) {
+                data = std::move(delta);
+                response.set_delta_base(cachedModelID);
+                break;
+            }
+        }
+    }
+
+    const char* bytes = data ? data->data() : file->data();
+    int64_t totalSize = data ? int64_t(data->size()) : file->size();
+    int64_t sent = 0;
+    response.set_status(ModelStatus::IN_PROGRESS);
+    response.set_total_size(totalSize);
+    for (int64_t offset = std::min(request->offset(), totalSize); offset < totalSize; offset += chunkSize_) {
+        size_t size = std::min<int64_t>(chunkSize_, totalSize - offset);
+        response.set_offset(offset);
+        response.set_data(bytes + offset, size);
+        if (file) {
+            file->release(offset, size);
+        }
+        if (!writer->Write(response)) {
+            return grpc::Status::CANCELLED;
+        }
+        sent += size;
+        bytesSent_ += size;
+        if (breakTransfer(sent)) {
+            return brokenStatus();
+        }
+    }
+    response.clear_data();
+    response.clear_offset();
+    response.set_status(ModelStatus::OK);
+    writer->Write(response);
+    return grpc::Status::OK;
+}
+
+/**
+ * @brief Returns the model updates received so far.
+ */
+std::vector<fedn::ModelUpdate> StandInCombiner::modelUpdates() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return modelUpdates_;
+}
+
+grpc::Status StandInCombiner::SendHeartbeat(grpc::ServerContext*, const fedn::Heartbeat*, fedn::Response* response) {
+    messages_++;
+    response->set_response("Heartbeat received");
+    return grpc::Status::OK;
+}
+
+grpc::Status StandInCombiner::AcceptingClients(grpc::ServerContext*, const fedn::ConnectionRequest*,
+        fedn::ConnectionResponse* response) {
+    response->set_status(fedn::ConnectionStatus::ACCEPTING);
+    return grpc::Status::OK;
+}
+
+grpc::Status StandInCombiner::SendModelUpdate(grpc::ServerContext*, const fedn::ModelUpdate* request, fedn::Response* response) {
+    messages_++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    modelUpdates_.push_back(*request);
+    response->set_response("Model update received");
+    return grpc::Status::OK;
+}
+
+grpc::Status StandInCombiner::SendModelValidation(grpc::ServerContext*, const fedn::ModelValidation*,
+        fedn::Response* response) {
+    messages_++;
+    response->set_response("Validation received");
+    return grpc::Status::OK;
+}
+
+grpc::Status StandInCombiner::SendModelPrediction(grpc::ServerContext*, const fedn::ModelPrediction*,
+        fedn::Response* response) {
+    messages_++;
+    response->set_response("Prediction received");
+    return grpc::Status::OK;
+}
+
+grpc::Status StandInCombiner::SendModelMetric(grpc::ServerContext*, const fedn::ModelMetric*, fedn::Response* response) {
+    messages_++;
+    response->set_response("Metrics received");
+    return grpc::Status::OK;
+}
+
+grpc::Status StandInCombiner::SendAttributeMessage(grpc::ServerContext*, const fedn::AttributeMessage*,
+        fedn::Response* response) {
+    messages_++;
+    response->set_response("Attributes received");
+    return grpc::Status::OK;
+}
+
+/**
+ * @brief Starts the stand-in combiner on a free port of 127.0.0.1.
+ *
+ * @throws std::runtime_error If the server cannot be started.
+ */
+StandInServer::StandInServer() {
+    int port = 0;
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+    builder.SetMaxReceiveMessageSize(-1);
+    builder.RegisterService(static_cast<fedn::Connector::Service*>(&combiner_));
+    builder.RegisterService(static_cast<fedn::Combiner::Service*>(&combiner_));
+    builder.RegisterService(&modelService_);
+    server_ = builder.BuildAndStart();
+    if (!server_ || port == 0) {
+        throw std::runtime_error("Failed to start the stand-in combiner");
+    }
+    address_ = "127.0.0.1:" + std::to_string(port);
+}
+
+StandInServer::~StandInServer() {
+    server_->Shutdown();
+}
+
+/**
+ * @brief Creates a channel to the stand-in combiner.
+ */
+std::shared_ptr<grpc::Channel> StandInServer::channel() {
+    return grpc::CreateChannel(address_, grpc::InsecureChannelCredentials());
+}
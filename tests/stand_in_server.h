@@ -0,0 +1,132 @@
+#ifndef STAND_IN_SERVER_H
+#define STAND_IN_SERVER_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <optional>
+#include <atomic>
+#include <cstdint>
+#include <grpcpp/grpcpp.h>
+
+#include "fedn.grpc.pb.h"
+#include "fedn.pb.h"
+#include "fednlib/dedup.h"
+
+/**
+ * The ModelService of a combiner as the client expects it, for tests. Models are kept in
+ * memory. Uploads can be resumed: a request with status UNKNOWN asks how many bytes of an
+ * upload the server holds, and chunks carry their offset. Downloads are sent in chunks from
+ * the offset of the request, with the total size of the model.
+ *
+ * With a dedup directory set, uploads are deduplicated like a combiner that supports it
+ * does, see dedup.h: the models held are also kept as files in the directory and indexed in
+ * a ChunkStore, the probe of an upload that lists its chunks is answered with the chunks
+ * that are not held, and an upload that lists its chunks is completed from the store.
+ *
+ * With a delta directory set, a download that names models the client holds is sent as a
+ * delta against the first of them that the service holds too, see delta.h, with the hash of
+ * the model, like a combiner that supports it does.
+ *
+ * With an upload directory set, uploads are written to files in it instead of memory, and
+ * models can be served from files, see setModelFile(), so tests can move models larger than
+ * memory.
+ */
+class StandInModelService : public fedn::ModelService::Service {
+public:
+    void setModel(const std::string& modelID, const std::string& data);
+    std::optional<std::string> model(const std::string& modelID);
+    void setChunkSize(size_t chunkSize);
+    void setDedupDirectory(const std::string& directory);
+    void setDeltaDirectory(const std::string& directory);
+    void setUploadDirectory(const std::string& directory);
+    void setModelFile(const std::string& modelID, const std::string& path);
+    std::string modelFile(const std::string& modelID);
+    void failAfter(int64_t bytes, grpc::StatusCode code = grpc::StatusCode::UNAVAILABLE);
+    void rejectProbes(grpc::StatusCode code);
+    int64_t bytesReceived() const { return bytesReceived_; }
+    int64_t bytesSent() const { return bytesSent_; }
+    void resetCounters();
+
+    grpc::Status Upload(grpc::ServerContext* context, grpc::ServerReader<fedn::ModelRequest>* reader,
+        fedn::ModelResponse* response) override;
+    grpc::Status Download(grpc::ServerContext* context, const fedn::ModelRequest* request,
+        grpc::ServerWriter<fedn::ModelResponse>* writer) override;
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::string> models_;
+    std::map<std::string, std::string> partial_; // Interrupted uploads
+    size_t chunkSize_ = 1024 * 1024;
+    std::atomic<int64_t> failAfter_{0};
+    std::atomic<grpc::StatusCode> failCode_{grpc::StatusCode::UNAVAILABLE};
+    std::atomic<grpc::StatusCode> probeRejection_{grpc::StatusCode::OK};
+    std::atomic<int64_t> bytesReceived_{0};
+    std::atomic<int64_t> bytesSent_{0};
+    std::string dedupDirectory_;
+    ChunkStore chunkStore_;
+    std::string deltaDirectory_;
+    std::string uploadDirectory_;
+    std::map<std::string, std::string> modelFiles_; // Models kept in files, by model ID
+
+    bool breakTransfer(int64_t bytes);
+    grpc::Status brokenStatus() const;
+    bool storeChunks(const std::string& modelID);
+    bool completeChunks(const std::string& modelID, const std::vector<ContentChunk>& chunks, std::string& data);
+    std::optional<std::string> encodeDelta(const std::string& modelID, const std::string& baseID);
+    int64_t heldUploadBytes(const std::string& modelID);
+};
+
+/**
+ * The Connector and Combiner services of a combiner, for tests. Heartbeats, model updates,
+ * validations, predictions, metrics and attributes are answered and counted. The task stream
+ * is not served.
+ */
+class StandInCombiner : public fedn::Connector::Service, public fedn::Combiner::Service {
+public:
+    std::vector<fedn::ModelUpdate> modelUpdates();
+    int64_t messages() const { return messages_; }
+
+    grpc::Status SendHeartbeat(grpc::ServerContext* context, const fedn::Heartbeat* request, fedn::Response* response) override;
+    grpc::Status AcceptingClients(grpc::ServerContext* context, const fedn::ConnectionRequest* request,
+        fedn::ConnectionResponse* response) override;
+    grpc::Status SendModelUpdate(grpc::ServerContext* context, const fedn::ModelUpdate* request, fedn::Response* response) override;
+    grpc::Status SendModelValidation(grpc::ServerContext* context, const fedn::ModelValidation* request,
+        fedn::Response* response) override;
+    grpc::Status SendModelPrediction(grpc::ServerContext* context, const fedn::ModelPrediction* request,
+        fedn::Response* response) override;
+    grpc::Status SendModelMetric(grpc::ServerContext* context, const fedn::ModelMetric* request, fedn::Response* response) override;
+    grpc::Status SendAttributeMessage(grpc::ServerContext* context, const fedn::AttributeMessage* request,
+        fedn::Response* response) override;
+
+private:
+    std::mutex mutex_;
+    std::vector<fedn::ModelUpdate> modelUpdates_;
+    std::atomic<int64_t> messages_{0};
+};
+
+/**
+ * A stand-in combiner in the process of a test, listening on a free port of 127.0.0.1.
+ */
+class StandInServer {
+public:
+    StandInServer();
+    ~StandInServer();
+    StandInServer(const StandInServer&) = delete;
+    StandInServer& operator=(const StandInServer&) = delete;
+
+    std::string address() const { return address_; }
+    std::shared_ptr<grpc::Channel> channel();
+    StandInModelService& modelService() { return modelService_; }
+    StandInCombiner& combiner() { return combiner_; }
+
+private:
+    StandInModelService modelService_;
+    StandInCombiner combiner_;
+    std::unique_ptr<grpc::Server> server_;
+    std::string address_;
+};
+
+#endif // STAND_IN_SERVER_H
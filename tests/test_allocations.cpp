@@ -0,0 +1,137 @@
+// Counts the heap allocations of the RPC and transfer paths of GrpcClient against a stand-in
+// combiner. Messages are built on stack-backed arenas with one shared sender identity, and
+// one message is reused for all the chunks of a transfer, so an RPC allocates nothing for
+// the identity of the client and a transfer allocates nothing per chunk. gRPC itself
+// allocates one buffer per uploaded chunk to copy a message into, or one reference count per
+// uploaded chunk for a zero-copy slice, and three times per RPC to start the call, pick the
+// connection and serialize the request. The text of the reply of an RPC is one more.
+//
+// gRPC sometimes does a little of its own work on the calling thread, so the checks leave a
+// margin of one allocation per RPC and a tenth of one per chunk.
+
+#include <new>
+#include <cstdlib>
+#include <fstream>
+#include <filesystem>
+
+#include "fednlib/grpc.h"
+#include "check.h"
+#include "stand_in_server.h"
+
+namespace {
+
+// The most allocations of an RPC and of an uploaded chunk, see above
+const long kRpcAllocations = 5;
+const double kUploadChunkAllocations = 1.0;
+
+// Allocations are only counted on the thread of the test, not on the threads of the
+// stand-in server or of gRPC
+thread_local bool counting = false;
+thread_local long allocations = 0;
+
+long countAllocations(const std::function<void()>& run) {
+    allocations = 0;
+    counting = true;
+    run();
+    counting = false;
+    return allocations;
+}
+
+void writeFile(const std::string& path, size_t size) {
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+        data[i] = char(i * 131 + (i >> 11));
+    }
+    std::ofstream(path, std::ios::binary) << data;
+}
+
+} // namespace
+
+void* operator new(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    void* memory = std::malloc(size ? size : 1);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+int main() {
+    StandInServer server;
+    GrpcClient client(server.channel());
+    client.heartBeat();
+
+    // The sender identity is built once, a long name costs no allocations per RPC. Both names
+    // are longer than the string buffer of std::string and than what gRPC sends without a
+    // buffer of its own, so a copy of the identity would show.
+    const int calls = 20;
+    std::map<std::string, float> metrics = {{"loss", 0.5f}, {"accuracy", 0.9f}};
+    std::map<size_t, std::pair<long, long>> perName;
+    for (size_t length : {20, 400}) {
+        client.setName(std::string(length, 'n'));
+        client.setId(std::string(length, 'i'));
+        client.heartBeat();
+        client.sendModelMetrics(metrics, "client", "client-id", "model", "1", "session", 0);
+        long heartBeats = countAllocations([&] {
+            for (int i = 0; i < calls; i++) {
+                client.heartBeat();
+            }
+        });
+        long metricCalls = countAllocations([&] {
+            for (int i = 0; i < calls; i++) {
+                client.sendModelMetrics(metrics, "client", "client-id", "model", "1", "session", i);
+            }
+        });
+        std::cout << "name of " << length << " characters: " << double(heartBeats) / calls << " allocations per heartBeat, "
+                  << double(metricCalls) / calls << " per sendModelMetrics" << std::endl;
+        perName[length] = {heartBeats, metricCalls};
+    }
+    CHECK(perName[400].first - perName[20].first < calls / 2);
+    CHECK(perName[400].second - perName[20].second < calls / 2);
+    for (const auto& [length, counts] : perName) {
+        CHECK(counts.first <= kRpcAllocations * calls);
+        CHECK(counts.second <= kRpcAllocations * calls);
+    }
+
+    // Transfers of 4 and of 132 chunks differ by no more than what gRPC allocates per chunk.
+    // Enough chunks that the buffers of a transfer, which grow with its size, do not show.
+    const size_t chunkSize = 64 * 1024;
+    const int extraChunks = 128;
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-allocations").string();
+    std::filesystem::create_directories(directory);
+    writeFile(directory + "/small.bin", 4 * chunkSize);
+    writeFile(directory + "/large.bin", (4 + extraChunks) * chunkSize);
+    client.setChunkSize(chunkSize);
+    server.modelService().setChunkSize(chunkSize);
+    for (bool zeroCopy : {false, true}) {
+        client.setZeroCopyTransfer(zeroCopy);
+        client.uploadModelFromFile("warm-up", directory + "/small.bin");
+        long small = countAllocations([&] { client.uploadModelFromFile("small", directory + "/small.bin"); });
+        long large = countAllocations([&] { client.uploadModelFromFile("large", directory + "/large.bin"); });
+        double perChunk = double(large - small) / extraChunks;
+        std::cout << "upload, zero-copy " << zeroCopy << ": " << perChunk << " allocations per chunk" << std::endl;
+        CHECK(perChunk < kUploadChunkAllocations + 0.1);
+        CHECK(server.modelService().model("large").value_or("").size() == (4 + extraChunks) * chunkSize);
+
+        client.downloadModelToFile("small", directory + "/small.out");
+        small = countAllocations([&] { client.downloadModelToFile("small", directory + "/small.out"); });
+        large = countAllocations([&] { client.downloadModelToFile("large", directory + "/large.out"); });
+        perChunk = double(large - small) / extraChunks;
+        std::cout << "download, zero-copy " << zeroCopy << ": " << perChunk << " allocations per chunk" << std::endl;
+        CHECK(perChunk < 0.1);
+        CHECK(std::filesystem::file_size(directory + "/large.out") == (4 + extraChunks) * chunkSize);
+    }
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
@@ -0,0 +1,193 @@
+// Round trips of codec pipelines, see codec.h. Pipelines parsed from a specification encode a
+// trained model and decode back from the descriptor alone: lossless pipelines give the model
+// bit for bit, and a corrupted encoding fails the checksum. Lossy ones stay within the bounds
+// of their update stage. Specifications with unknown stages, invalid options or an update
+// stage anywhere but first are refused, as are unknown descriptors.
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <random>
+#include <cmath>
+#include <filesystem>
+
+#include "fednlib/codec.h"
+#include "fednlib/tensor.h"
+#include "check.h"
+
+namespace {
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::string& data) {
+    std::ofstream(path, std::ios::binary) << data;
+}
+
+const uint64_t kRows = 256;
+const uint64_t kCols = 64;
+
+bool writeModel(const std::string& path, const std::vector<float>& weights) {
+    const int64_t steps[1] = {5};
+    TensorWriter writer;
+    return writer.open(path) && writer.add<float>("w", {kRows, kCols}, weights.data())
+        && writer.add<int64_t>("steps", {1}, steps) && writer.finish();
+}
+
+std::vector<float> weightsOf(const std::string& path) {
+    std::shared_ptr<TensorReader> reader = TensorReader::open(path);
+    return reader && reader->find("w") ? reader->read<float>("w") : std::vector<float>();
+}
+
+// The largest difference between the decoded and the trained weights, and the L2 norm of it
+std::pair<double, double> decodingError(const std::vector<float>& decoded, const std::vector<float>& trained) {
+    if (decoded.size() != trained.size()) {
+        return {INFINITY, INFINITY};
+    }
+    double largest = 0;
+    double squares = 0;
+    for (size_t i = 0; i < trained.size(); i++) {
+        double error = std::fabs(double(decoded[i]) - double(trained[i]));
+        largest = std::max(largest, error);
+        squares += error * error;
+    }
+    return {largest, std::sqrt(squares)};
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-codec-pipeline").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    std::string basePath = directory + "/base.bin";
+    std::string modelPath = directory + "/model.bin";
+    std::string updatePath = directory + "/update.bin";
+    std::string decodedPath = directory + "/decoded.bin";
+
+    // Fine-tuning that changes every seventh weight a little
+    std::mt19937 random(1);
+    std::normal_distribution<float> normal;
+    std::vector<float> base(kRows * kCols);
+    for (float& value : base) {
+        value = normal(random);
+    }
+    std::vector<float> trained = base;
+    double largestChange = 0;
+    double changeNorm = 0;
+    for (size_t i = 0; i < trained.size(); i += 7) {
+        float change = 1e-3f * normal(random);
+        trained[i] += change;
+        largestChange = std::max(largestChange, std::fabs(double(trained[i]) - double(base[i])));
+        changeNorm += double(change) * change;
+    }
+    changeNorm = std::sqrt(changeNorm);
+    CHECK(writeModel(basePath, base));
+    CHECK(writeModel(modelPath, trained));
+    std::string model = readFile(modelPath);
+
+    CodecContext context;
+    context.baseModelID = "global-1";
+    context.basePath = basePath;
+    context.wordSize = 4;
+
+    // Lossless pipelines, with and without an update stage
+    for (const char* spec : {"delta(mode=xor) | compress | checksum", "delta(mode=arithmetic,word_size=4)|compress(level=9)",
+                             "compress(level=6) | checksum", "checksum"}) {
+        std::shared_ptr<CodecPipeline> pipeline = CodecPipeline::parse(spec);
+        CHECK(pipeline);
+        if (!pipeline) {
+            continue;
+        }
+        CHECK(CodecPipeline::parse(pipeline->spec()) && CodecPipeline::parse(pipeline->spec())->spec() == pipeline->spec());
+        json descriptor;
+        CHECK(pipeline->encode(context, modelPath, updatePath, descriptor));
+        CHECK(descriptor["base_model_id"] == "global-1" && descriptor["pipeline"] == pipeline->spec());
+        CHECK(CodecPipeline::decode(descriptor, basePath, updatePath, decodedPath));
+        CHECK(readFile(decodedPath) == model);
+        std::cout << spec << ": " << std::filesystem::file_size(updatePath) << " of " << model.size() << " bytes" << std::endl;
+
+        CodecBenchmark benchmark;
+        CHECK(pipeline->benchmark(context, modelPath, directory + "/benchmark", benchmark));
+        CHECK(benchmark.modelSize == model.size() && benchmark.updateSize > 0 && benchmark.relativeError == 0);
+    }
+
+    // A corrupted encoding does not decode
+    std::shared_ptr<CodecPipeline> checked = CodecPipeline::parse("delta(mode=xor) | checksum");
+    json descriptor;
+    CHECK(checked && checked->encode(context, modelPath, updatePath, descriptor));
+    std::string encoded = readFile(updatePath);
+    encoded[encoded.size() / 2] ^= 0x10;
+    writeFile(updatePath, encoded);
+    CHECK(!CodecPipeline::decode(descriptor, basePath, updatePath, decodedPath));
+
+    // Lossy pipelines stay within the bounds of their update stage. Quantized weights are within
+    // a step of the range of the update, sparse ones within rounding of the trained weights, and
+    // low-rank factors do not miss more than the whole update. Each starts without the residual
+    // of the others, which its bound does not allow for.
+    struct Lossy {
+        const char* spec;
+        double largestError;
+        double errorNorm;
+        const char* stateFile; // The residual kept for error feedback
+    };
+    const Lossy lossy[] = {
+        {"quantize(bits=8,block_size=64) | compress | checksum", 2 * largestChange / 255 + 1e-6, INFINITY, "quantization-residual.bin"},
+        {"quantize(bits=4) | checksum", 2 * largestChange / 15 + 1e-6, INFINITY, "quantization-residual.bin"},
+        {"sparsify(ratio=1) | compress(level=3)", 1e-6, INFINITY, "sparsification-residual.bin"},
+        {"sparsify(ratio=0.05)", largestChange + 1e-6, changeNorm * 1.001, "sparsification-residual.bin"},
+        {"lowrank(rank=4,min_elements=1024) | compress", INFINITY, changeNorm * 1.001, "lowrank-state.bin"},
+    };
+    context.stateFile = [&](const std::string& name) { return directory + "/state/" + name; };
+    for (const Lossy& stage : lossy) {
+        std::filesystem::remove_all(directory + "/state");
+        std::filesystem::create_directories(directory + "/state");
+        std::shared_ptr<CodecPipeline> pipeline = CodecPipeline::parse(stage.spec);
+        CHECK(pipeline);
+        if (!pipeline) {
+            continue;
+        }
+        json lossyDescriptor;
+        CHECK(pipeline->encode(context, modelPath, updatePath, lossyDescriptor));
+        CHECK(CodecPipeline::decode(lossyDescriptor, basePath, updatePath, decodedPath));
+        std::pair<double, double> error = decodingError(weightsOf(decodedPath), trained);
+        std::cout << stage.spec << ": largest error " << error.first << ", L2 error " << error.second << std::endl;
+        CHECK(error.first <= stage.largestError);
+        CHECK(error.second <= stage.errorNorm);
+        std::shared_ptr<TensorReader> decoded = TensorReader::open(decodedPath);
+        CHECK(decoded && decoded->find("steps") && decoded->read<int64_t>("steps") == std::vector<int64_t>({5}));
+        CHECK(std::filesystem::exists(directory + "/state/" + stage.stateFile));
+    }
+
+    // Invalid specifications
+    for (const char* spec : {"", " | ", "unknown", "compress | quantize(bits=8)", "delta | quantize", "quantize(bits=5)",
+                             "quantize(block_size=24)", "quantize(bits=8", "quantize(bits)", "quantize(bytes=1)",
+                             "sparsify(ratio=0)", "sparsify(ratio=1.5)", "sparsify(ratio=x)", "lowrank(rank=0)",
+                             "delta(mode=or)", "delta(word_size=3)", "compress(level=10)", "checksum(crc=1)"}) {
+        if (CodecPipeline::parse(spec)) {
+            std::cerr << "Invalid pipeline " << spec << " was accepted" << std::endl;
+            checkFailures()++;
+        }
+    }
+    CodecPipeline pipeline;
+    CHECK(!pipeline.addStage("checksum", {{"level", "1"}}));
+    CHECK(pipeline.addStage("compress", {{"level", "1"}}) && !pipeline.addStage("sparsify", {{"ratio", "0.1"}}));
+
+    // Invalid descriptors
+    CHECK(checked && checked->encode(context, modelPath, updatePath, descriptor));
+    json unknownVersion = descriptor;
+    unknownVersion["version"] = 99;
+    CHECK(!CodecPipeline::decode(unknownVersion, basePath, updatePath, decodedPath));
+    json unknownStage = descriptor;
+    unknownStage["stages"][1]["name"] = "encrypt";
+    CHECK(!CodecPipeline::decode(unknownStage, basePath, updatePath, decodedPath));
+    json misplaced = descriptor;
+    std::swap(misplaced["stages"][0], misplaced["stages"][1]);
+    CHECK(!CodecPipeline::decode(misplaced, basePath, updatePath, decodedPath));
+    CHECK(CodecPipeline::decode(descriptor, basePath, updatePath, decodedPath) && readFile(decodedPath) == model);
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
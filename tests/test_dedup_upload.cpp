@@ -0,0 +1,117 @@
+// Deduplicated uploads against a stand-in combiner that holds a global model: a model sent
+// back unchanged carries no data, a model with a changed part carries about that part, a
+// broken upload is retried, and a combiner that does not deduplicate gets the whole model,
+// whether it accepts the probe and ignores the chunks or fails it. A probe that fails for a
+// while is retried instead. The combiner checks every chunk against its hash, so a model stored
+// is the model sent.
+
+#include <string>
+#include <fstream>
+#include <random>
+#include <filesystem>
+
+#include "fednlib/grpc.h"
+#include "check.h"
+#include "stand_in_server.h"
+
+namespace {
+
+void writeFile(const std::string& path, const std::string& data) {
+    std::ofstream(path, std::ios::binary) << data;
+}
+
+std::string randomModel(size_t size, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::string model(size, '\0');
+    for (char& byte : model) {
+        byte = char(random());
+    }
+    return model;
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-dedup-upload").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    StandInServer server;
+    StandInModelService& service = server.modelService();
+    service.setDedupDirectory(directory + "/combiner");
+    const std::string global = randomModel(8 * 1024 * 1024, 1);
+    service.setModel("global", global);
+
+    GrpcClient client(server.channel());
+    client.setDedupUploads(true);
+    client.setTransferRetries(2);
+    client.setChunkSize(256 * 1024);
+
+    // Sent back unchanged, every chunk is held
+    writeFile(directory + "/echo.bin", global);
+    service.resetCounters();
+    CHECK(client.uploadModelFromFile("echo", directory + "/echo.bin"));
+    CHECK(service.model("echo") == global);
+    CHECK(service.bytesReceived() == 0);
+
+    // The last quarter changed, about that quarter is sent
+    std::string changed = global;
+    for (size_t i = changed.size() / 4 * 3; i < changed.size(); i += 7) {
+        changed[i] ^= 1;
+    }
+    writeFile(directory + "/changed.bin", changed);
+    service.resetCounters();
+    CHECK(client.uploadModelFromFile("changed", directory + "/changed.bin"));
+    CHECK(service.model("changed") == changed);
+    std::cout << "Changed quarter: " << service.bytesReceived() << " of " << changed.size() << " bytes sent" << std::endl;
+    CHECK(service.bytesReceived() >= int64_t(changed.size() / 4));
+    CHECK(service.bytesReceived() < int64_t(changed.size() / 4 + 2 * kChunkMaxSize));
+
+    // Broken after 1 MB, the retry asks again for the missing chunks and completes the upload
+    std::string broken = randomModel(4 * 1024 * 1024, 2);
+    writeFile(directory + "/broken.bin", broken);
+    service.resetCounters();
+    service.failAfter(1024 * 1024);
+    CHECK(client.uploadModelFromFile("broken", directory + "/broken.bin"));
+    CHECK(service.model("broken") == broken);
+    CHECK(service.bytesReceived() >= int64_t(broken.size()));
+
+    // An empty model has no chunks
+    writeFile(directory + "/empty.bin", "");
+    CHECK(client.uploadModelFromFile("empty", directory + "/empty.bin"));
+    CHECK(service.model("empty") == std::string());
+
+    // A combiner that does not deduplicate gets the whole model
+    StandInServer plain;
+    GrpcClient plainClient(plain.channel());
+    plainClient.setDedupUploads(true);
+    CHECK(plainClient.uploadModelFromFile("changed", directory + "/changed.bin"));
+    CHECK(plain.modelService().model("changed") == changed);
+    CHECK(plain.modelService().bytesReceived() == int64_t(changed.size()));
+
+    // A combiner that fails the probe, with an exception of a Python handler or because it
+    // does not implement it, also gets the whole model
+    for (grpc::StatusCode code : {grpc::StatusCode::UNKNOWN, grpc::StatusCode::UNIMPLEMENTED}) {
+        service.rejectProbes(code);
+        service.resetCounters();
+        GrpcClient rejectedClient(server.channel());
+        rejectedClient.setDedupUploads(true);
+        std::string modelID = "rejected-" + std::to_string(int(code));
+        CHECK(rejectedClient.uploadModelFromFile(modelID, directory + "/changed.bin"));
+        CHECK(service.model(modelID) == changed);
+        CHECK(service.bytesReceived() == int64_t(changed.size()));
+    }
+
+    // A probe that fails for a while is not taken for a combiner without deduplication
+    service.rejectProbes(grpc::StatusCode::UNAVAILABLE);
+    client.setTransferRetries(1);
+    CHECK(!client.uploadModelFromFile("unavailable", directory + "/echo.bin"));
+    service.rejectProbes(grpc::StatusCode::OK);
+    service.resetCounters();
+    CHECK(client.uploadModelFromFile("unavailable", directory + "/echo.bin"));
+    CHECK(service.model("unavailable") == global);
+    CHECK(service.bytesReceived() == 0);
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
@@ -0,0 +1,129 @@
+// Round trips of model deltas, see delta.h: in either mode and for every word size, the
+// decoded model has the bits of the trained one, also for sizes with bytes past the last
+// whole word, models of more than one block and words whose difference wraps around. A
+// delta does not decode against another base, and models of another size are refused.
+
+#include <string>
+#include <fstream>
+#include <random>
+#include <cstring>
+#include <filesystem>
+
+#include "fednlib/delta.h"
+#include "check.h"
+
+namespace {
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::string& data) {
+    std::ofstream(path, std::ios::binary) << data;
+}
+
+// A model of float32 weights, with the bytes past the last whole weight random
+std::string randomModel(size_t size, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal;
+    std::string model(size, '\0');
+    size_t i = 0;
+    for (; i + sizeof(float) <= size; i += sizeof(float)) {
+        float value = normal(random);
+        memcpy(&model[i], &value, sizeof(float));
+    }
+    for (; i < size; i++) {
+        model[i] = char(random());
+    }
+    return model;
+}
+
+// The model after a round of training: small changes to some weights, the sign of a few
+// flipped and a few bytes replaced outright, so that differences of words wrap around
+std::string trained(std::string model, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal(0.0f, 1e-3f);
+    for (size_t i = 0; i + sizeof(float) <= model.size(); i += 7 * sizeof(float)) {
+        float value;
+        memcpy(&value, &model[i], sizeof(float));
+        value = i % 5 == 0 ? -value : value + normal(random);
+        memcpy(&model[i], &value, sizeof(float));
+    }
+    for (size_t i = 3; i < model.size(); i += 101) {
+        model[i] = char(random());
+    }
+    model[model.size() - 1] ^= 0x5a;
+    return model;
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-delta").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    std::string basePath = directory + "/base.bin";
+    std::string modelPath = directory + "/model.bin";
+    std::string deltaPath = directory + "/model.delta";
+    std::string decodedPath = directory + "/decoded.bin";
+
+    // Whole words, tails of 1 to 7 bytes, and more than one block of 1 MB with a tail
+    const size_t sizes[] = {1, 7, 4096, 4097, 4099, 40003, 1024 * 1024 + 4 * 1000 + 3, 3 * 1024 * 1024 + 5};
+    for (size_t size : sizes) {
+        std::string base = randomModel(size, uint32_t(size));
+        std::string model = trained(base, uint32_t(size) + 1);
+        writeFile(basePath, base);
+        writeFile(modelPath, model);
+        for (DeltaMode mode : {DeltaMode::Xor, DeltaMode::Arithmetic}) {
+            for (uint32_t wordSize : {1u, 2u, 4u, 8u}) {
+                DeltaInfo info;
+                bool encoded = encodeModelDelta(modelPath, basePath, deltaPath, mode, wordSize, &info);
+                CHECK(encoded);
+                CHECK(info.mode == mode && info.wordSize == wordSize && info.modelSize == size);
+                CHECK(info.encodedSize == std::filesystem::file_size(deltaPath));
+                bool decoded = encoded && decodeModelDelta(deltaPath, basePath, decodedPath);
+                CHECK(decoded);
+                if (!decoded || readFile(decodedPath) != model) {
+                    std::cerr << "Delta of " << size << " bytes in mode " << deltaModeName(mode) << " with words of "
+                              << wordSize << " bytes does not round trip" << std::endl;
+                    checkFailures()++;
+                }
+            }
+        }
+    }
+
+    // Fine-tuning changes few bits, so the delta is much smaller than the model
+    std::string base = randomModel(1024 * 1024, 1);
+    std::string model = base;
+    for (size_t i = 0; i < model.size(); i += 4 * 97) {
+        model[i] ^= 1;
+    }
+    writeFile(basePath, base);
+    writeFile(modelPath, model);
+    DeltaInfo info;
+    CHECK(encodeModelDelta(modelPath, basePath, deltaPath, DeltaMode::Xor, 4, &info));
+    std::cout << "Delta of a fine-tuned model: " << info.encodedSize << " of " << model.size() << " bytes" << std::endl;
+    CHECK(info.encodedSize < model.size() / 10);
+    std::string delta = readFile(deltaPath);
+    DeltaInfo read;
+    CHECK(readDeltaInfo(delta.data(), delta.size(), read) && read.modelCrc == info.modelCrc && read.baseCrc == info.baseCrc);
+
+    // Against another base of the same size, the checksums do not match
+    writeFile(directory + "/other.bin", randomModel(base.size(), 2));
+    CHECK(!decodeModelDelta(deltaPath, directory + "/other.bin", decodedPath));
+    CHECK(!std::filesystem::exists(decodedPath));
+
+    // Models of another size than the base, word sizes other than 1, 2, 4 and 8 and deltas
+    // that are cut short are refused
+    writeFile(modelPath, model + "x");
+    CHECK(!encodeModelDelta(modelPath, basePath, deltaPath, DeltaMode::Xor, 4));
+    writeFile(modelPath, model);
+    CHECK(!encodeModelDelta(modelPath, basePath, deltaPath, DeltaMode::Xor, 3));
+    writeFile(deltaPath, delta.substr(0, delta.size() / 2));
+    CHECK(!readDeltaInfo(delta.data(), delta.size() / 2, read));
+    CHECK(!decodeModelDelta(deltaPath, basePath, decodedPath));
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
@@ -0,0 +1,153 @@
+// Downloads of global models as deltas against the models in the model cache, from a
+// stand-in combiner that encodes them with encodeModelDelta(): the first model comes in
+// full, the next ones as small deltas that decode to the same bytes, a cached model that
+// was changed on disk makes the client download in full, and a broken delta download is
+// resumed. Also checks that the cache links models instead of copying them and that it
+// counts against the quota of the workspace.
+
+#include <string>
+#include <fstream>
+#include <random>
+#include <cstring>
+#include <filesystem>
+
+#include "fednlib/grpc.h"
+#include "fednlib/modelcache.h"
+#include "fednlib/workspace.h"
+#include "check.h"
+#include "stand_in_server.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::string& data) {
+    std::ofstream(path, std::ios::binary) << data;
+}
+
+// A model of float32 weights
+std::string randomModel(size_t size, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal;
+    std::string model(size, '\0');
+    for (size_t i = 0; i + sizeof(float) <= size; i += sizeof(float)) {
+        float value = normal(random);
+        memcpy(&model[i], &value, sizeof(float));
+    }
+    return model;
+}
+
+// The model after a round of training that changes every stride-th weight a little
+std::string trained(std::string model, size_t stride, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal(0.0f, 1e-3f);
+    for (size_t i = 0; i + sizeof(float) <= model.size(); i += stride * sizeof(float)) {
+        float value;
+        memcpy(&value, &model[i], sizeof(float));
+        value += normal(random);
+        memcpy(&model[i], &value, sizeof(float));
+    }
+    return model;
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (fs::temp_directory_path() / "fednlib-test-delta-download").string();
+    fs::remove_all(directory);
+    fs::create_directories(directory);
+
+    const size_t size = 4 * 1024 * 1024;
+    std::string global1 = randomModel(size, 1);
+    std::string global2 = trained(global1, 97, 2);
+    std::string global3 = trained(global2, 89, 3);
+    std::string global4 = trained(global3, 83, 4);
+
+    StandInServer server;
+    StandInModelService& service = server.modelService();
+    service.setDeltaDirectory(directory + "/combiner");
+    service.setChunkSize(16 * 1024);
+    service.setModel("global1", global1);
+    service.setModel("global2", global2);
+    service.setModel("global3", global3);
+    service.setModel("global4", global4);
+
+    GrpcClient client(server.channel());
+    client.setTransferRetries(2);
+    std::shared_ptr<ModelCache> cache = std::make_shared<ModelCache>(directory + "/cache", 2);
+    client.setModelCache(cache);
+    std::string modelPath = directory + "/model.bin";
+
+    // Nothing cached, the model comes in full
+    service.resetCounters();
+    CHECK(client.downloadModelToFile("global1", modelPath));
+    CHECK(readFile(modelPath) == global1);
+    CHECK(service.bytesSent() == int64_t(size));
+    CHECK(cache->modelIDs() == std::vector<std::string>({"global1"}));
+
+    // A delta against the cached model
+    service.resetCounters();
+    CHECK(client.downloadModelToFile("global2", modelPath));
+    CHECK(readFile(modelPath) == global2);
+    std::cout << "Delta of global2: " << service.bytesSent() << " of " << size << " bytes" << std::endl;
+    CHECK(service.bytesSent() > 0 && service.bytesSent() < int64_t(size / 2));
+    CHECK(cache->modelIDs() == std::vector<std::string>({"global2", "global1"}));
+
+    // A broken delta download is resumed against the same base
+    service.resetCounters();
+    service.failAfter(32 * 1024);
+    CHECK(client.downloadModelToFile("global3", modelPath));
+    CHECK(readFile(modelPath) == global3);
+    CHECK(service.bytesSent() < int64_t(size / 2));
+
+    // The cached models changed on disk, so the delta does not decode, the model is downloaded
+    // in full and the cached model the delta was against is dropped
+    for (const std::string& modelID : cache->modelIDs()) {
+        std::string corrupted = readFile(cache->path(modelID));
+        corrupted[1000] ^= 1;
+        writeFile(cache->path(modelID), corrupted);
+    }
+    service.resetCounters();
+    CHECK(client.downloadModelToFile("global4", modelPath));
+    CHECK(readFile(modelPath) == global4);
+    CHECK(service.bytesSent() > int64_t(size));
+    CHECK(cache->modelIDs().size() == 2 && cache->modelIDs().front() == "global4");
+
+    // A model is linked into the cache, not copied
+    std::string linkedPath = directory + "/linked.bin";
+    writeFile(linkedPath, global1);
+    CHECK(cache->insert("linked", linkedPath));
+    CHECK(fs::hard_link_count(linkedPath) == 2);
+    CHECK(readFile(cache->path("linked")) == global1);
+
+    // Cached models count against the quota of the workspace, the least recently used are
+    // evicted to make room, and a model larger than the quota is not cached
+    WorkspaceOptions options;
+    options.root = directory + "/workspace";
+    options.quota = 2 * size + size / 2;
+    std::shared_ptr<Workspace> workspace = std::make_shared<Workspace>(options);
+    {
+        ModelCache quotaCache(workspace->stateFile("models"), 10, workspace);
+        for (const char* modelID : {"global1", "global2", "global3"}) {
+            writeFile(linkedPath, service.model(modelID).value_or(""));
+            CHECK(quotaCache.insert(modelID, linkedPath));
+        }
+        CHECK(quotaCache.modelIDs().size() == 2);
+        std::unique_ptr<TaskDirectory> task = workspace->createTask("train");
+        CHECK(task && !task->reserve(size));
+        CHECK(task && task->reserve(size / 2));
+        writeFile(linkedPath, std::string(3 * size, 'x'));
+        CHECK(!quotaCache.insert("large", linkedPath));
+    }
+    // The space of the cache is given back with it
+    std::unique_ptr<TaskDirectory> task = workspace->createTask("train");
+    CHECK(task && task->reserve(2 * size));
+
+    fs::remove_all(directory);
+    return checkFailures() != 0;
+}
@@ -0,0 +1,97 @@
+// A model of more than 5 GB, a sparse file, uploaded to a stand-in combiner that writes it to
+// disk and downloaded back with downloadModelToFile(). Sizes and offsets past 4 GB must not be
+// truncated to 32 bits anywhere on the way, and both transfers stream the model in constant
+// memory, so the peak resident size of the process stays far below the size of the model.
+// The combiner and the download write the model out in full, about 11 GB of disk.
+
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <sys/resource.h>
+
+#include "fednlib/grpc.h"
+#include "check.h"
+#include "stand_in_server.h"
+
+namespace {
+
+const int64_t kGB = int64_t(1) << 30;
+
+// Bytes written into the sparse model, so misplaced data shows
+const int64_t kMarkers[] = {0, 4 * kGB - 1, 4 * kGB, 4 * kGB + 4097, 5 * kGB + 100};
+
+char marker(int64_t offset) {
+    return char(offset % 251 + 1);
+}
+
+bool hasMarkers(const std::string& path, int64_t size) {
+    std::ifstream file(path, std::ios::binary);
+    for (int64_t offset : kMarkers) {
+        char byte = 0;
+        if (!file.seekg(offset) || !file.get(byte) || byte != marker(offset)) {
+            std::cerr << path << " has the wrong byte at offset " << offset << std::endl;
+            return false;
+        }
+    }
+    char last = 0;
+    return file.seekg(size - 1) && file.get(last) && last == marker(size - 1);
+}
+
+long peakResidentMB() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024;
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-large-model").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    // Sparse but for the markers, so it takes no space on disk
+    const int64_t size = 5 * kGB + 12345;
+    std::string modelPath = directory + "/model.bin";
+    std::ofstream(modelPath, std::ios::binary).close();
+    std::filesystem::resize_file(modelPath, size);
+    {
+        std::fstream file(modelPath, std::ios::binary | std::ios::in | std::ios::out);
+        for (int64_t offset : kMarkers) {
+            file.seekp(offset);
+            file.put(marker(offset));
+        }
+        file.seekp(size - 1);
+        file.put(marker(size - 1));
+    }
+    CHECK(hasMarkers(modelPath, size));
+
+    StandInServer server;
+    StandInModelService& service = server.modelService();
+    service.setUploadDirectory(directory + "/combiner");
+    service.setChunkSize(2 * 1024 * 1024);
+    GrpcClient client(server.channel());
+    client.setChunkSize(2 * 1024 * 1024);
+
+    CHECK(client.uploadModelFromFile("large", modelPath));
+    std::string uploadedPath = service.modelFile("large");
+    CHECK(!uploadedPath.empty());
+    CHECK(!uploadedPath.empty() && int64_t(std::filesystem::file_size(uploadedPath)) == size);
+    CHECK(!uploadedPath.empty() && hasMarkers(uploadedPath, size));
+    CHECK(service.bytesReceived() == size);
+    std::filesystem::remove(modelPath);
+
+    std::string downloadedPath = directory + "/downloaded.bin";
+    CHECK(client.downloadModelToFile("large", downloadedPath));
+    CHECK(int64_t(std::filesystem::file_size(downloadedPath)) == size);
+    CHECK(hasMarkers(downloadedPath, size));
+    CHECK(service.bytesSent() == size);
+
+    // Client and stand-in together, a copy of the model in memory would be 5 GB
+    long peakMB = peakResidentMB();
+    std::cout << "Peak resident size: " << peakMB << " MB for a model of " << size / (1024 * 1024) << " MB" << std::endl;
+    CHECK(peakMB < 256);
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
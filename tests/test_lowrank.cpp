@@ -0,0 +1,146 @@
+// Round trips of low-rank model updates, see lowrank.h. An update of rank r is recovered by
+// factors of rank r, in a single round and from random starting vectors, also for a tensor
+// of more than two dimensions and an update of lower rank than the factors. 1D tensors and
+// small ones are sent as they are, and the state carries Q over to the next round.
+
+#include <string>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <filesystem>
+
+#include "fednlib/lowrank.h"
+#include "fednlib/tensor.h"
+#include "check.h"
+
+namespace {
+
+std::vector<float> normalValues(size_t count, float stddev, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal(0.0f, stddev);
+    std::vector<float> values(count);
+    for (float& value : values) {
+        value = normal(random);
+    }
+    return values;
+}
+
+// Adds the sum of rank random outer products to a rows x cols matrix
+void addRankUpdate(std::vector<float>& matrix, size_t rows, size_t cols, size_t rank, uint32_t seed) {
+    std::vector<float> u = normalValues(rank * rows, 0.1f, seed);
+    std::vector<float> v = normalValues(rank * cols, 0.1f, seed + 1);
+    for (size_t c = 0; c < rank; c++) {
+        for (size_t i = 0; i < rows; i++) {
+            for (size_t j = 0; j < cols; j++) {
+                matrix[i * cols + j] += u[c * rows + i] * v[c * cols + j];
+            }
+        }
+    }
+}
+
+struct Model {
+    std::vector<float> w;     // 64 x 48
+    std::vector<float> conv;  // 16 x 4 x 3 x 3, a matrix of 16 x 36
+    std::vector<float> bias;  // 64
+    std::vector<float> small; // 8 x 8
+};
+
+bool writeModel(const std::string& path, const Model& model) {
+    TensorWriter writer;
+    return writer.open(path) && writer.add<float>("w", {64, 48}, model.w.data())
+        && writer.add<float>("conv", {16, 4, 3, 3}, model.conv.data())
+        && writer.add<float>("bias", {64}, model.bias.data())
+        && writer.add<float>("small", {8, 8}, model.small.data()) && writer.finish();
+}
+
+std::vector<float> tensor(const std::string& path, const std::string& name) {
+    std::shared_ptr<TensorReader> reader = TensorReader::open(path);
+    return reader && reader->find(name) ? reader->read<float>(name) : std::vector<float>();
+}
+
+// The largest difference of the decoded tensor to the trained one, relative to the largest change
+double relativeError(const std::vector<float>& decoded, const std::vector<float>& trained, const std::vector<float>& base) {
+    if (decoded.size() != trained.size()) {
+        return INFINITY;
+    }
+    double error = 0;
+    double change = 0;
+    for (size_t i = 0; i < trained.size(); i++) {
+        error = std::max(error, std::fabs(double(decoded[i]) - double(trained[i])));
+        change = std::max(change, std::fabs(double(trained[i]) - double(base[i])));
+    }
+    return error / change;
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-lowrank").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    std::string basePath = directory + "/base.bin";
+    std::string modelPath = directory + "/model.bin";
+    std::string statePath = directory + "/state.bin";
+    std::string updatePath = directory + "/update.bin";
+    std::string decodedPath = directory + "/decoded.bin";
+
+    Model base = {normalValues(64 * 48, 1.0f, 1), normalValues(16 * 36, 1.0f, 2), normalValues(64, 1.0f, 3), normalValues(64, 1.0f, 4)};
+    Model trained = base;
+    addRankUpdate(trained.w, 64, 48, 3, 10);
+    addRankUpdate(trained.conv, 16, 36, 2, 20);
+    for (size_t i = 0; i < trained.bias.size(); i++) {
+        trained.bias[i] += 0.01f * float(i);
+    }
+    addRankUpdate(trained.small, 8, 8, 3, 30);
+    CHECK(writeModel(basePath, base));
+    CHECK(writeModel(modelPath, trained));
+
+    LowRankOptions options;
+    options.rank = 3;
+    options.minElements = 256;
+    for (int round = 0; round < 2; round++) {
+        LowRankReport report;
+        CHECK(lowRankUpdate(modelPath, basePath, statePath, updatePath, options, &report));
+        CHECK(report.factored == 2 && report.raw == 2);
+        std::cout << "Round " << round << ": relative error of the factors " << report.relativeError << std::endl;
+        CHECK(report.relativeError < 1e-4);
+        CHECK(expandLowRankUpdate(updatePath, basePath, decodedPath));
+        CHECK(relativeError(tensor(decodedPath, "w"), trained.w, base.w) < 1e-4);
+        CHECK(relativeError(tensor(decodedPath, "conv"), trained.conv, base.conv) < 1e-4);
+        CHECK(relativeError(tensor(decodedPath, "bias"), trained.bias, base.bias) < 1e-5);
+        CHECK(relativeError(tensor(decodedPath, "small"), trained.small, base.small) < 1e-5);
+
+        // The factors, and the Q kept for the next round
+        std::shared_ptr<TensorReader> update = TensorReader::open(updatePath);
+        const TensorInfo* p = update ? update->find("w.p") : nullptr;
+        const TensorInfo* q = update ? update->find("w.q") : nullptr;
+        CHECK(p && p->shape == std::vector<uint64_t>({3, 64}) && q && q->shape == std::vector<uint64_t>({3, 48}));
+        CHECK(update && update->find("conv.p") && !update->find("bias.p") && !update->find("small.p"));
+        CHECK(tensor(statePath, "w.q") == tensor(updatePath, "w.q"));
+    }
+
+    // A full-rank update is approximated, what the factors miss is kept and sent later
+    Model noisy = base;
+    std::vector<float> noise = normalValues(noisy.w.size(), 0.01f, 40);
+    for (size_t i = 0; i < noise.size(); i++) {
+        noisy.w[i] += noise[i];
+    }
+    CHECK(writeModel(modelPath, noisy));
+    std::filesystem::remove(statePath);
+    LowRankReport report;
+    CHECK(lowRankUpdate(modelPath, basePath, statePath, updatePath, options, &report));
+    CHECK(report.relativeError > 0.5 && report.relativeError < 1);
+    std::vector<float> missed = tensor(statePath, "w");
+    CHECK(expandLowRankUpdate(updatePath, basePath, decodedPath));
+    std::vector<float> decoded = tensor(decodedPath, "w");
+    for (size_t i = 0; i < decoded.size() && missed.size() == decoded.size(); i++) {
+        CHECK(std::fabs((decoded[i] - base.w[i]) + missed[i] - noise[i]) < 1e-5);
+    }
+
+    LowRankOptions rankZero;
+    rankZero.rank = 0;
+    CHECK(!lowRankUpdate(modelPath, basePath, "", updatePath, rankZero));
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
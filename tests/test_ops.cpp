@@ -0,0 +1,201 @@
+// Checks that every kernel of ops.h gives the same bits with the vector kernels the CPU
+// supports as with the portable ones, and with any number of threads, as ops.h promises.
+// The sizes cover empty buffers, the tails of the vector loops, the edges of the chunks and
+// buffers large enough to be split over the threads. Buffers with NaN, infinities and
+// subnormals are checked as well, where the kernels accept them.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "fednlib/ops.h"
+#include "check.h"
+
+using namespace fednlib;
+
+namespace {
+
+std::vector<float> values(size_t count, uint32_t seed, bool special) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal(0.0f, 3.0f);
+    std::vector<float> x(count);
+    for (float& value : x) {
+        value = normal(random);
+    }
+    if (special && count > 16) {
+        x[7] = NAN;
+        x[count / 2] = INFINITY;
+        x[count - 3] = -INFINITY;
+        x[count / 3] = 1e-40f;
+        x[count - 1] = -NAN;
+    }
+    return x;
+}
+
+template <typename T>
+std::string bytes(const T* data, size_t count) {
+    return std::string(reinterpret_cast<const char*>(data), count * sizeof(T));
+}
+
+template <typename T>
+std::string bytes(const std::vector<T>& data) {
+    return bytes(data.data(), data.size());
+}
+
+template <typename T>
+std::string bytes(const T& value) {
+    return bytes(&value, 1);
+}
+
+// Runs every operation on buffers of count elements and returns its results by name
+std::map<std::string, std::string> runAll(size_t count) {
+    std::map<std::string, std::string> results;
+    for (bool special : {false, true}) {
+        std::string suffix = special ? " non-finite" : "";
+        std::vector<float> x = values(count, 1, special);
+        std::vector<float> y = values(count, 2, special);
+        std::vector<float> z = values(count, 3, false);
+        std::vector<float> out(count);
+
+        ops::Stats stats = ops::stats(x.data(), count);
+        results["stats" + suffix] = bytes(stats.sumSquares) + bytes(stats.maxAbs) + bytes(stats.nonFinite);
+        results["allFinite" + suffix] = bytes(ops::allFinite(x.data(), count));
+        std::vector<float> result = y;
+        ops::axpy(0.37f, x.data(), result.data(), count);
+        results["axpy" + suffix] = bytes(result);
+        result = y;
+        ops::axpby(0.9f, x.data(), -0.1f, result.data(), count);
+        results["axpby" + suffix] = bytes(result);
+        result = x;
+        ops::scale(1.7f, result.data(), count);
+        results["scale" + suffix] = bytes(result);
+        ops::sub(x.data(), y.data(), out.data(), count);
+        results["sub" + suffix] = bytes(out);
+        result = x;
+        ops::clamp(result.data(), count, -2.5f, 1.25f);
+        results["clamp" + suffix] = bytes(result);
+        const float* inputs[3] = {x.data(), y.data(), z.data()};
+        const float weights[3] = {0.2f, 0.5f, 0.3f};
+        ops::weightedSum(inputs, weights, 3, out.data(), count);
+        results["weightedSum" + suffix] = bytes(out);
+        results["dot" + suffix] = bytes(ops::dot(x.data(), y.data(), count));
+        results["squaredDistance" + suffix] = bytes(ops::squaredDistance(x.data(), y.data(), count));
+    }
+
+    // The rest only take finite values
+    std::vector<float> x = values(count, 4, false);
+    std::vector<float> result = x;
+    double norm = ops::clipL2(result.data(), count, 10.0);
+    results["clipL2"] = bytes(result) + bytes(norm);
+    results["maxAbs"] = bytes(ops::maxAbs(x.data(), count));
+    result = x;
+    ops::addGaussianNoise(result.data(), count, 0.5f, 42, 3, 5);
+    results["addGaussianNoise"] = bytes(result);
+    std::vector<int32_t> fixed(count);
+    ops::toFixedPoint(x.data(), fixed.data(), count, 65536.0f, 4.0f);
+    results["toFixedPoint"] = bytes(fixed);
+    const uint8_t key[32] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    ops::addMask(fixed.data(), count, key, 9, false, 3);
+    results["addMask"] = bytes(fixed);
+    ops::addMask(fixed.data(), count, key, 9, true, 3);
+    results["addMask subtract"] = bytes(fixed);
+
+    for (unsigned bits : {4u, 8u}) {
+        for (size_t blockSize : {size_t(0), size_t(64)}) {
+            std::string name = std::to_string(bits) + " bits, blocks of " + std::to_string(blockSize);
+            std::vector<float> error(count, 0.0f);
+            std::vector<uint8_t> codes(ops::quantizedSize(count, bits));
+            std::vector<float> params(2 * ops::quantizedBlocks(count, blockSize));
+            bool quantized = ops::quantize(x.data(), error.data(), count, bits, blockSize, 7, codes.data(), params.data());
+            results["quantize " + name] = bytes(quantized) + bytes(codes) + bytes(params) + bytes(error);
+            std::vector<float> decoded(count);
+            bool dequantized = ops::dequantize(codes.data(), params.data(), count, bits, blockSize, decoded.data());
+            results["dequantize " + name] = bytes(dequantized) + bytes(decoded);
+        }
+    }
+
+    size_t k = count / 10 + 1;
+    std::vector<uint64_t> indices(k);
+    size_t selected = ops::topK(x.data(), count, k, 11, indices.data());
+    results["topK"] = bytes(selected) + bytes(indices.data(), selected);
+
+    // A matrix of about count elements, with 3 vectors
+    size_t rows = std::max<size_t>(1, count / 97);
+    size_t cols = std::max<size_t>(1, count / rows);
+    std::vector<float> a = values(rows * cols, 5, false);
+    std::vector<float> p = values(3 * rows, 6, false);
+    std::vector<float> q = values(3 * cols, 7, false);
+    std::vector<float> products(3 * rows);
+    ops::multiply(a.data(), rows, cols, q.data(), 3, products.data());
+    results["multiply"] = bytes(products);
+    products.resize(3 * cols);
+    ops::multiplyTransposed(a.data(), rows, cols, p.data(), 3, products.data());
+    results["multiplyTransposed"] = bytes(products);
+    ops::addOuter(0.25f, p.data(), q.data(), 3, a.data(), rows, cols);
+    results["addOuter"] = bytes(a);
+    return results;
+}
+
+} // namespace
+
+int main() {
+    std::cout << "Default kernels: " << ops::kernels() << std::endl;
+    std::vector<std::string> kernels = {"scalar"};
+    for (const char* name : {"avx2", "avx512", "neon"}) {
+        if (ops::setKernels(name)) {
+            kernels.push_back(name);
+        }
+    }
+
+    const size_t sizes[] = {0, 1, 7, 15, 16, 17, 33, 1000, 262143, 262144, 262145, 1048575, 1048576, 3000001};
+    const unsigned threads[] = {1, 3, 8};
+    for (size_t count : sizes) {
+        ops::setKernels("scalar");
+        ops::setThreads(1);
+        std::map<std::string, std::string> expected = runAll(count);
+        for (const std::string& name : kernels) {
+            ops::setKernels(name);
+            for (unsigned threadCount : threads) {
+                ops::setThreads(threadCount);
+                std::map<std::string, std::string> results = runAll(count);
+                for (const auto& [op, result] : expected) {
+                    if (results[op] != result) {
+                        std::cerr << op << " of " << count << " elements differs with " << name << " kernels on "
+                                  << threadCount << " threads" << std::endl;
+                    }
+                    CHECK(results[op] == result);
+                }
+            }
+        }
+        std::cout << count << " elements checked with " << kernels.size() << " kernels" << std::endl;
+    }
+
+    // Operations from several threads share the pool and give the same results
+    ops::setThreads(4);
+    std::vector<float> large = values(3000001, 8, false);
+    double expected = ops::l2Norm(large.data(), large.size());
+    std::atomic<int> matches{0};
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 4; i++) {
+        callers.emplace_back([&] {
+            for (int j = 0; j < 10; j++) {
+                if (ops::l2Norm(large.data(), large.size()) == expected) {
+                    matches++;
+                }
+            }
+        });
+    }
+    for (std::thread& caller : callers) {
+        caller.join();
+    }
+    CHECK(matches == 40);
+
+    ops::setThreads(0);
+    return checkFailures() != 0;
+}
@@ -0,0 +1,131 @@
+// Round trips of partial models, see partial.h. A partial model carries only the tensors
+// named, its manifest lists them and counts the tensors of the whole model, also for a
+// partial model of a partial one, and merging it into the base model gives the trained
+// tensors back with the untouched ones of the base, bit for bit, in the order of the base.
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <random>
+#include <filesystem>
+
+#include "fednlib/partial.h"
+#include "fednlib/tensor.h"
+#include "fednlib/convert.h"
+#include "check.h"
+
+namespace {
+
+std::vector<float> normalValues(size_t count, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal;
+    std::vector<float> values(count);
+    for (float& value : values) {
+        value = normal(random);
+    }
+    return values;
+}
+
+// A model of four tensors, the values of each drawn from its own seed
+bool writeModel(const std::string& path, uint32_t seed) {
+    std::vector<float> embedding = normalValues(100 * 8, seed);
+    std::vector<float> hidden = normalValues(8 * 8, seed + 1);
+    std::vector<float> head = normalValues(8 * 3, seed + 2);
+    const int64_t steps[1] = {seed};
+    TensorWriter writer;
+    return writer.open(path) && writer.add<float>("embedding", {100, 8}, embedding.data())
+        && writer.add<float>("hidden", {8, 8}, hidden.data()) && writer.add<int64_t>("steps", {1}, steps)
+        && writer.add<float>("head", {8, 3}, head.data()) && writer.finish();
+}
+
+std::vector<std::string> tensorNames(const std::string& path) {
+    std::shared_ptr<TensorReader> reader = TensorReader::open(path);
+    std::vector<std::string> names;
+    for (const TensorInfo& tensor : reader ? reader->tensors() : std::vector<TensorInfo>()) {
+        names.push_back(tensor.name);
+    }
+    return names;
+}
+
+// The bytes of a tensor, empty if there is none
+std::string tensorBytes(const std::string& path, const std::string& name) {
+    std::shared_ptr<TensorReader> reader = TensorReader::open(path);
+    const TensorInfo* tensor = reader ? reader->find(name) : nullptr;
+    if (!tensor) {
+        return "";
+    }
+    TensorSpan<const uint8_t> bytes = reader->bytes(*tensor);
+    return std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-partial").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    std::string basePath = directory + "/base.bin";
+    std::string modelPath = directory + "/model.bin";
+    std::string partialPath = directory + "/partial.bin";
+    std::string mergedPath = directory + "/merged.bin";
+    CHECK(writeModel(basePath, 1));
+    CHECK(writeModel(modelPath, 100));
+    const std::vector<std::string> all = {"embedding", "hidden", "steps", "head"};
+
+    // Only the fine-tuned tensors, listed in the order of the model
+    json manifest;
+    CHECK(writePartialModel(modelPath, {"head", "steps"}, "global-1", partialPath, &manifest));
+    CHECK(manifest["tensors"] == json({"steps", "head"}));
+    CHECK(manifest["model_tensors"] == 4 && manifest["base_model_id"] == "global-1");
+    CHECK(readPartialManifest(partialPath) == manifest);
+    CHECK(tensorNames(partialPath) == std::vector<std::string>({"steps", "head", kPartialManifestTensor}));
+    CHECK(!readPartialManifest(modelPath));
+
+    // Merged into the base, the untouched tensors are those of the base
+    CHECK(mergePartialModel(basePath, partialPath, mergedPath));
+    CHECK(tensorNames(mergedPath) == all);
+    for (const std::string& name : all) {
+        bool trained = name == "head" || name == "steps";
+        CHECK(tensorBytes(mergedPath, name) == tensorBytes(trained ? modelPath : basePath, name));
+    }
+    CHECK(!readPartialManifest(mergedPath));
+
+    // A partial model of a partial model still counts the tensors of the whole model
+    std::string nestedPath = directory + "/nested.bin";
+    CHECK(writePartialModel(partialPath, {"head"}, "global-1", nestedPath, &manifest));
+    CHECK(manifest["tensors"] == json({"head"}) && manifest["model_tensors"] == 4);
+    CHECK(mergePartialModel(basePath, nestedPath, mergedPath));
+    CHECK(tensorBytes(mergedPath, "head") == tensorBytes(modelPath, "head"));
+    CHECK(tensorBytes(mergedPath, "steps") == tensorBytes(basePath, "steps"));
+
+    // A tensor uploaded as bfloat16 is converted back to the dtype of the base
+    std::vector<float> head = normalValues(8 * 3, 7);
+    std::vector<uint16_t> halves(head.size());
+    CHECK(convertDType(head.data(), DType::F32, halves.data(), DType::BF16, head.size()));
+    std::string bf16Path = directory + "/bf16.bin";
+    {
+        TensorWriter writer;
+        CHECK(writer.open(bf16Path) && writer.add("head", DType::BF16, {8, 3}, halves.data(), halves.size() * 2) && writer.finish());
+    }
+    CHECK(writePartialModel(bf16Path, {"head"}, "global-1", partialPath, nullptr, 4));
+    CHECK(mergePartialModel(basePath, partialPath, mergedPath));
+    std::shared_ptr<TensorReader> merged = TensorReader::open(mergedPath);
+    std::vector<float> expected(head.size());
+    CHECK(convertDType(halves.data(), DType::BF16, expected.data(), DType::F32, head.size()));
+    CHECK(merged && merged->find("head") && merged->find("head")->dtype == DType::F32 && merged->read<float>("head") == expected);
+    CHECK(tensorBytes(mergedPath, "embedding") == tensorBytes(basePath, "embedding"));
+
+    // Tensors the model lacks, tensors of another shape and models that are not partial are refused
+    CHECK(!writePartialModel(modelPath, {"head", "missing"}, "global-1", partialPath));
+    std::string reshapedPath = directory + "/reshaped.bin";
+    {
+        TensorWriter writer;
+        CHECK(writer.open(reshapedPath) && writer.add<float>("head", {3, 8}, head.data()) && writer.finish());
+    }
+    CHECK(writePartialModel(reshapedPath, {"head"}, "global-1", partialPath));
+    CHECK(!mergePartialModel(basePath, partialPath, mergedPath));
+    CHECK(!mergePartialModel(basePath, modelPath, mergedPath));
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
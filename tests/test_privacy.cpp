@@ -0,0 +1,158 @@
+// Differentially private model updates, see privacy.h. An update larger than the clipping
+// norm is scaled down to it over all the tensors, a smaller one is kept, the noise has the
+// standard deviation asked for, and the same seed gives the same model. Tensors that are not
+// floating point are copied, and updates that are not finite are refused.
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <random>
+#include <cmath>
+#include <filesystem>
+
+#include "fednlib/privacy.h"
+#include "fednlib/tensor.h"
+#include "check.h"
+
+namespace {
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+std::vector<float> normalValues(size_t count, float stddev, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal(0.0f, stddev);
+    std::vector<float> values(count);
+    for (float& value : values) {
+        value = normal(random);
+    }
+    return values;
+}
+
+bool writeModel(const std::string& path, const std::vector<float>& weights, const std::vector<float>& bias) {
+    const int64_t steps[1] = {3};
+    TensorWriter writer;
+    return writer.open(path) && writer.add<float>("w", {weights.size()}, weights.data())
+        && writer.add<int64_t>("steps", {1}, steps) && writer.add<float>("b", {bias.size()}, bias.data()) && writer.finish();
+}
+
+// The update of a private model against the base, over both float tensors
+std::vector<float> update(const std::string& path, const std::vector<float>& weights, const std::vector<float>& bias) {
+    std::shared_ptr<TensorReader> reader = TensorReader::open(path);
+    if (!reader || !reader->find("w") || !reader->find("b")) {
+        return {};
+    }
+    std::vector<float> values = reader->read<float>("w");
+    std::vector<float> biasValues = reader->read<float>("b");
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] -= weights[i];
+    }
+    for (size_t i = 0; i < biasValues.size(); i++) {
+        values.push_back(biasValues[i] - bias[i]);
+    }
+    return values;
+}
+
+double norm(const std::vector<float>& values) {
+    double sum = 0;
+    for (float value : values) {
+        sum += double(value) * value;
+    }
+    return std::sqrt(sum);
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-privacy").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    std::string basePath = directory + "/base.bin";
+    std::string modelPath = directory + "/model.bin";
+    std::string privatePath = directory + "/private.bin";
+
+    const size_t count = 200000;
+    std::vector<float> baseWeights = normalValues(count, 1.0f, 1);
+    std::vector<float> baseBias = normalValues(100, 1.0f, 2);
+    std::vector<float> change = normalValues(count + 100, 0.01f, 3);
+    std::vector<float> weights = baseWeights;
+    std::vector<float> bias = baseBias;
+    for (size_t i = 0; i < count; i++) {
+        weights[i] += change[i];
+    }
+    for (size_t i = 0; i < bias.size(); i++) {
+        bias[i] += change[count + i];
+    }
+    CHECK(writeModel(basePath, baseWeights, baseBias));
+    CHECK(writeModel(modelPath, weights, bias));
+    std::vector<float> trained = update(modelPath, baseWeights, baseBias);
+    double trainedNorm = norm(trained);
+
+    // Clipped to the norm over all tensors, in the same direction, without noise
+    PrivacyOptions options;
+    options.clipNorm = trainedNorm / 4;
+    options.noiseMultiplier = 0;
+    double reported = 0;
+    CHECK(privatizeUpdate(modelPath, basePath, privatePath, options, &reported));
+    CHECK(std::fabs(reported - trainedNorm) < 1e-4 * trainedNorm);
+    std::vector<float> clipped = update(privatePath, baseWeights, baseBias);
+    CHECK(clipped.size() == trained.size());
+    CHECK(std::fabs(norm(clipped) - options.clipNorm) < 1e-3 * options.clipNorm);
+    for (size_t i = 0; i < clipped.size() && clipped.size() == trained.size(); i += 997) {
+        CHECK(std::fabs(clipped[i] - trained[i] / 4) < 1e-6);
+    }
+    std::shared_ptr<TensorReader> reader = TensorReader::open(privatePath);
+    CHECK(reader && reader->find("steps") && reader->read<int64_t>("steps") == std::vector<int64_t>({3}));
+
+    // An update within the norm is kept
+    options.clipNorm = trainedNorm * 2;
+    CHECK(privatizeUpdate(modelPath, basePath, privatePath, options));
+    std::vector<float> kept = update(privatePath, baseWeights, baseBias);
+    for (size_t i = 0; i < kept.size() && kept.size() == trained.size(); i += 997) {
+        CHECK(std::fabs(kept[i] - trained[i]) < 1e-6);
+    }
+
+    // Noise of noiseMultiplier * clipNorm per element, the same for the same seed
+    options.clipNorm = trainedNorm / 4;
+    options.noiseMultiplier = 0.5;
+    options.seed = 1234;
+    CHECK(privatizeUpdate(modelPath, basePath, privatePath, options));
+    std::string first = readFile(privatePath);
+    std::vector<float> noisy = update(privatePath, baseWeights, baseBias);
+    CHECK(noisy.size() == clipped.size());
+    double sum = 0;
+    double squares = 0;
+    for (size_t i = 0; i < noisy.size() && noisy.size() == clipped.size(); i++) {
+        double noise = double(noisy[i]) - clipped[i];
+        sum += noise;
+        squares += noise * noise;
+    }
+    double mean = sum / double(noisy.size());
+    double stddev = std::sqrt(squares / double(noisy.size()) - mean * mean);
+    double expected = options.noiseMultiplier * options.clipNorm;
+    std::cout << "Noise: mean " << mean << ", standard deviation " << stddev << " of " << expected << std::endl;
+    CHECK(std::fabs(stddev - expected) < 0.02 * expected);
+    CHECK(std::fabs(mean) < 0.02 * expected);
+    CHECK(privatizeUpdate(modelPath, basePath, privatePath, options));
+    CHECK(readFile(privatePath) == first);
+    options.seed = 1235;
+    CHECK(privatizeUpdate(modelPath, basePath, privatePath, options));
+    CHECK(readFile(privatePath) != first);
+
+    // Updates that are not finite and parameters out of range are refused
+    std::vector<float> broken = weights;
+    broken[10] = INFINITY;
+    CHECK(writeModel(directory + "/broken.bin", broken, bias));
+    CHECK(!privatizeUpdate(directory + "/broken.bin", basePath, privatePath, options));
+    for (auto [clipNorm, noiseMultiplier] : {std::pair<double, double>{0, 1}, {-1, 1}, {1, -0.5}, {NAN, 1}}) {
+        PrivacyOptions invalid;
+        invalid.clipNorm = clipNorm;
+        invalid.noiseMultiplier = noiseMultiplier;
+        CHECK(!privatizeUpdate(modelPath, basePath, privatePath, invalid));
+    }
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
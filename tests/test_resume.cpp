@@ -0,0 +1,100 @@
+// Plain uploads and downloads against a stand-in combiner that breaks them part way: the
+// client asks how much of an upload the combiner holds and continues from there, and a
+// download continues from the last byte received, so a broken transfer moves less than twice
+// the model and the result is the model sent. A stream that ends early without an error is
+// resumed too, and an error of the combiner itself is not retried.
+
+#include <string>
+#include <fstream>
+#include <random>
+#include <filesystem>
+
+#include "fednlib/grpc.h"
+#include "check.h"
+#include "stand_in_server.h"
+
+namespace {
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::string& data) {
+    std::ofstream(path, std::ios::binary) << data;
+}
+
+std::string randomModel(size_t size, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::string model(size, '\0');
+    for (char& byte : model) {
+        byte = char(random());
+    }
+    return model;
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-resume").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    const size_t size = 6 * 1024 * 1024;
+    const std::string model = randomModel(size, 1);
+    writeFile(directory + "/model.bin", model);
+
+    StandInServer server;
+    StandInModelService& service = server.modelService();
+    service.setChunkSize(256 * 1024);
+    GrpcClient client(server.channel());
+    client.setChunkSize(256 * 1024);
+    client.setTransferRetries(2);
+
+    for (bool zeroCopy : {false, true}) {
+        client.setZeroCopyTransfer(zeroCopy);
+        std::string name = zeroCopy ? "zero-copy" : "plain";
+
+        // Broken after 2 MB, the retry continues where the combiner stopped
+        service.resetCounters();
+        service.failAfter(2 * 1024 * 1024);
+        CHECK(client.uploadModelFromFile(name, directory + "/model.bin"));
+        CHECK(service.model(name) == model);
+        std::cout << name << " upload: " << service.bytesReceived() << " of " << size << " bytes received" << std::endl;
+        CHECK(service.bytesReceived() >= int64_t(size) && service.bytesReceived() < int64_t(2 * size));
+
+        service.resetCounters();
+        service.failAfter(3 * 1024 * 1024);
+        CHECK(client.downloadModelToFile(name, directory + "/" + name + ".out"));
+        CHECK(readFile(directory + "/" + name + ".out") == model);
+        std::cout << name << " download: " << service.bytesSent() << " of " << size << " bytes sent" << std::endl;
+        CHECK(service.bytesSent() >= int64_t(size) && service.bytesSent() < int64_t(2 * size));
+    }
+
+    // Into memory
+    client.setZeroCopyTransfer(false);
+    service.resetCounters();
+    service.failAfter(1024 * 1024);
+    CHECK(client.downloadModel("plain") == model);
+    CHECK(service.bytesSent() < int64_t(2 * size));
+
+    // A stream that ends without an error before the last chunk is resumed
+    service.resetCounters();
+    service.failAfter(1024 * 1024, grpc::StatusCode::OK);
+    CHECK(client.downloadModel("plain") == model);
+    CHECK(service.bytesSent() < int64_t(2 * size));
+
+    // An exception in the combiner is not a broken connection and is not retried
+    service.resetCounters();
+    service.failAfter(1024 * 1024, grpc::StatusCode::UNKNOWN);
+    CHECK(client.downloadModel("plain").empty());
+    CHECK(service.bytesSent() == 1024 * 1024);
+    service.resetCounters();
+    service.failAfter(1024 * 1024, grpc::StatusCode::INTERNAL);
+    CHECK(!client.uploadModelFromFile("rejected", directory + "/model.bin"));
+    CHECK(service.bytesReceived() == 1024 * 1024);
+    CHECK(!service.model("rejected"));
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
@@ -0,0 +1,206 @@
+// Secure aggregation, see secagg.h. X25519 and HKDF-SHA256 give the known answers of RFC 7748
+// and RFC 5869. Clients that share a directory key exchange mask their models so that no
+// masked tensor is the plain fixed-point encoding, and the sum of the masked models decodes
+// to the sum of the plain ones. Models that are not finite, a client publishing another key
+// for a round and a peer key of small order are refused.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <thread>
+#include <random>
+#include <cmath>
+#include <filesystem>
+
+#include "fednlib/secagg.h"
+#include "fednlib/tensor.h"
+#include "check.h"
+
+namespace {
+
+std::string fromHex(const std::string& hex) {
+    std::string bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        bytes += char(std::stoi(hex.substr(i, 2), nullptr, 16));
+    }
+    return bytes;
+}
+
+std::string x25519Hex(const std::string& scalarHex, const std::string& pointHex) {
+    std::string scalar = fromHex(scalarHex);
+    std::string point = fromHex(pointHex);
+    uint8_t out[32];
+    x25519(out, reinterpret_cast<const uint8_t*>(scalar.data()), reinterpret_cast<const uint8_t*>(point.data()));
+    return std::string(reinterpret_cast<const char*>(out), sizeof(out));
+}
+
+std::string toString(const std::array<uint8_t, 32>& bytes) {
+    return std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+std::vector<float> normalValues(size_t count, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::normal_distribution<float> normal;
+    std::vector<float> values(count);
+    for (float& value : values) {
+        value = normal(random);
+    }
+    return values;
+}
+
+bool writeModel(const std::string& path, const std::vector<float>& weights) {
+    const int64_t steps[1] = {7};
+    TensorWriter writer;
+    return writer.open(path) && writer.add<float>("w", {weights.size()}, weights.data())
+        && writer.add<int64_t>("steps", {1}, steps) && writer.finish();
+}
+
+// Hands out the keys it was given, whatever the client publishes
+class FixedKeyExchange : public KeyExchange {
+public:
+    explicit FixedKeyExchange(std::map<std::string, std::string> peerKeys) : peerKeys_(std::move(peerKeys)) {}
+
+    std::optional<std::map<std::string, std::string>> exchange(const std::string&, const std::string& clientID,
+            const std::string& publicKey) override {
+        std::map<std::string, std::string> keys = peerKeys_;
+        keys[clientID] = publicKey;
+        return keys;
+    }
+
+private:
+    std::map<std::string, std::string> peerKeys_;
+};
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-secagg").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    // RFC 7748, section 5.2
+    CHECK(x25519Hex("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+                    "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c")
+          == fromHex("c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552"));
+    CHECK(x25519Hex("4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d",
+                    "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493")
+          == fromHex("95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957"));
+    uint8_t k[32] = {9};
+    uint8_t u[32] = {9};
+    for (int i = 1; i <= 1000; i++) {
+        uint8_t result[32];
+        x25519(result, k, u);
+        std::copy(k, k + 32, u);
+        std::copy(result, result + 32, k);
+        if (i == 1) {
+            CHECK(std::string(reinterpret_cast<const char*>(k), 32) == fromHex("422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079"));
+        }
+    }
+    CHECK(std::string(reinterpret_cast<const char*>(k), 32) == fromHex("684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51"));
+
+    // RFC 7748, section 6.1
+    const std::string basePoint = "0900000000000000000000000000000000000000000000000000000000000000";
+    const std::string alice = "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a";
+    const std::string bob = "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb";
+    const std::string alicePublic = "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a";
+    const std::string bobPublic = "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f";
+    const std::string shared = fromHex("4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+    CHECK(x25519Hex(alice, basePoint) == fromHex(alicePublic));
+    CHECK(x25519Hex(bob, basePoint) == fromHex(bobPublic));
+    CHECK(x25519Hex(alice, bobPublic) == shared);
+    CHECK(x25519Hex(bob, alicePublic) == shared);
+
+    // RFC 5869, test case 1, the first 32 of the 42 bytes
+    CHECK(toString(hkdfSha256(std::string(22, '\x0b'), fromHex("000102030405060708090a0b0c"), fromHex("f0f1f2f3f4f5f6f7f8f9")))
+          == fromHex("3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf"));
+
+    // Clients of a round, each in its own thread, mask their models and the sum unmasks them
+    const size_t clients = 3;
+    const size_t count = 10000;
+    const int fractionalBits = 16;
+    std::shared_ptr<KeyExchange> exchange = std::make_shared<DirectoryKeyExchange>(directory + "/keys", clients, std::chrono::seconds(30));
+    std::vector<std::vector<float>> weights;
+    std::vector<std::string> maskedPaths;
+    for (size_t c = 0; c < clients; c++) {
+        weights.push_back(normalValues(count, uint32_t(c + 1)));
+        CHECK(writeModel(directory + "/model" + std::to_string(c) + ".bin", weights[c]));
+        maskedPaths.push_back(directory + "/masked" + std::to_string(c) + ".bin");
+    }
+    std::vector<char> masked(clients, false);
+    std::vector<std::thread> threads;
+    for (size_t c = 0; c < clients; c++) {
+        threads.emplace_back([&, c] {
+            std::string clientID = "client-" + std::to_string(c);
+            std::optional<std::vector<MaskKey>> keys = agreeMaskKeys(*exchange, "round-1", clientID);
+            masked[c] = keys && keys->size() == clients - 1
+                && maskModel(directory + "/model" + std::to_string(c) + ".bin", maskedPaths[c], *keys, fractionalBits);
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (size_t c = 0; c < clients; c++) {
+        CHECK(masked[c]);
+        std::shared_ptr<TensorReader> reader = TensorReader::open(maskedPaths[c]);
+        const TensorInfo* tensor = reader ? reader->find("w") : nullptr;
+        CHECK(tensor && tensor->dtype == DType::I32 && reader->find(kMaskManifestTensor));
+        CHECK(reader && reader->find("steps") && reader->read<int64_t>("steps") == std::vector<int64_t>({7}));
+        if (!tensor || tensor->dtype != DType::I32) {
+            continue;
+        }
+        std::vector<int32_t> values = reader->read<int32_t>("w");
+        size_t plain = 0;
+        for (size_t i = 0; i < count; i++) {
+            plain += values[i] == int32_t(std::lround(std::ldexp(weights[c][i], fractionalBits)));
+        }
+        CHECK(plain < count / 1000);
+    }
+    std::string sumPath = directory + "/sum.bin";
+    CHECK(sumMaskedModels(maskedPaths, sumPath));
+    std::shared_ptr<TensorReader> sum = TensorReader::open(sumPath);
+    CHECK(sum && sum->find("w") && sum->find("w")->dtype == DType::F32 && !sum->find(kMaskManifestTensor));
+    CHECK(sum && sum->find("steps") && sum->read<int64_t>("steps") == std::vector<int64_t>({7}));
+    std::vector<float> summed = sum && sum->find("w") ? sum->read<float>("w") : std::vector<float>();
+    CHECK(summed.size() == count);
+    double largestError = 0;
+    for (size_t i = 0; i < summed.size(); i++) {
+        double expected = 0;
+        for (size_t c = 0; c < clients; c++) {
+            expected += weights[c][i];
+        }
+        largestError = std::max(largestError, std::fabs(summed[i] - expected));
+    }
+    std::cout << "Largest error of the sum " << largestError << std::endl;
+    CHECK(largestError <= std::ldexp(1.0, -fractionalBits) * clients);
+    CHECK(!sumMaskedModels({maskedPaths[0], directory + "/model0.bin"}, sumPath));
+
+    // A model that is not finite is not masked
+    std::vector<float> broken = weights[0];
+    broken[100] = NAN;
+    CHECK(writeModel(directory + "/broken.bin", broken));
+    CHECK(!maskModel(directory + "/broken.bin", directory + "/masked-broken.bin", {}, fractionalBits));
+    broken[100] = INFINITY;
+    CHECK(writeModel(directory + "/broken.bin", broken));
+    CHECK(!maskModel(directory + "/broken.bin", directory + "/masked-broken.bin", {}, fractionalBits));
+    CHECK(!std::filesystem::exists(directory + "/masked-broken.bin"));
+
+    // A published key is not replaced, publishing it again is fine
+    DirectoryKeyExchange single(directory + "/keys", 1, std::chrono::seconds(1));
+    CHECK(single.exchange("round-2", "client-0", std::string(32, 'a')));
+    CHECK(!single.exchange("round-2", "client-0", std::string(32, 'b')));
+    std::optional<std::map<std::string, std::string>> again = single.exchange("round-2", "client-0", std::string(32, 'a'));
+    CHECK(again && again->at("client-0") == std::string(32, 'a'));
+
+    // Peer keys of small order, which give a secret the peer knows, and of the wrong size
+    FixedKeyExchange zeroKey({{"client-1", std::string(32, '\0')}});
+    CHECK(!agreeMaskKeys(zeroKey, "round-3", "client-0"));
+    FixedKeyExchange shortKey({{"client-1", std::string(31, '\x09')}});
+    CHECK(!agreeMaskKeys(shortKey, "round-3", "client-0"));
+    FixedKeyExchange validKey({{"client-1", fromHex(bobPublic)}});
+    std::optional<std::vector<MaskKey>> keys = agreeMaskKeys(validKey, "round-3", "client-0");
+    CHECK(keys && keys->size() == 1 && keys->at(0).peerID == "client-1" && !keys->at(0).subtract);
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}
@@ -0,0 +1,131 @@
+// Round trips of sparse model updates, see sparsify.h. With a ratio of 1 the decoded model is
+// the trained one, bit for bit. With a smaller ratio the largest entries are sent exactly, the
+// others are kept in the residual and added to the next update, so that together the updates
+// send the whole change. The weights are multiples of powers of two, so all the sums are exact.
+
+#include <string>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <filesystem>
+
+#include "fednlib/sparsify.h"
+#include "fednlib/tensor.h"
+#include "check.h"
+
+namespace {
+
+// Multiples of 1/scale that float32 holds exactly
+std::vector<float> exactValues(size_t count, float scale, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> steps(-1000, 1000);
+    std::vector<float> values(count);
+    for (float& value : values) {
+        value = float(steps(random)) / scale;
+    }
+    return values;
+}
+
+bool writeModel(const std::string& path, const std::vector<float>& weights) {
+    const int64_t steps[1] = {12};
+    TensorWriter writer;
+    return writer.open(path) && writer.add<float>("w", {weights.size() / 10, 10}, weights.data())
+        && writer.add<int64_t>("steps", {1}, steps) && writer.finish();
+}
+
+std::vector<float> tensor(const std::string& path, const std::string& name) {
+    std::shared_ptr<TensorReader> reader = TensorReader::open(path);
+    return reader && reader->find(name) ? reader->read<float>(name) : std::vector<float>();
+}
+
+size_t nonZeros(const std::vector<float>& values) {
+    return std::count_if(values.begin(), values.end(), [](float value) { return value != 0.0f; });
+}
+
+} // namespace
+
+int main() {
+    std::string directory = (std::filesystem::temp_directory_path() / "fednlib-test-sparsify").string();
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    std::string basePath = directory + "/base.bin";
+    std::string modelPath = directory + "/model.bin";
+    std::string residualPath = directory + "/residual.bin";
+    std::string updatePath = directory + "/update.bin";
+    std::string decodedPath = directory + "/decoded.bin";
+
+    const size_t count = 2000;
+    std::vector<float> base = exactValues(count, 64.0f, 1);
+    std::vector<float> change = exactValues(count, 1024.0f, 2);
+    std::vector<float> weights(count);
+    for (size_t i = 0; i < count; i++) {
+        weights[i] = base[i] + change[i];
+    }
+    CHECK(writeModel(basePath, base));
+    CHECK(writeModel(modelPath, weights));
+
+    // Everything sent, nothing left over
+    SparsifyOptions all;
+    all.ratio = 1.0;
+    CHECK(sparsifyUpdate(modelPath, basePath, residualPath, updatePath, all));
+    CHECK(densifyUpdate(updatePath, basePath, decodedPath));
+    CHECK(tensor(decodedPath, "w") == weights);
+    CHECK(nonZeros(tensor(residualPath, "w")) == 0);
+    std::shared_ptr<TensorReader> decoded = TensorReader::open(decodedPath);
+    CHECK(decoded && decoded->find("steps") && decoded->read<int64_t>("steps") == std::vector<int64_t>({12}));
+
+    // A tenth per round, the largest first, the rest carried over in the residual
+    std::filesystem::remove(residualPath);
+    SparsifyOptions tenth;
+    tenth.ratio = 0.1;
+    std::vector<float> sent(count, 0.0f);
+    std::vector<float> carried(count, 0.0f);
+    for (int round = 0; round < 3; round++) {
+        CHECK(sparsifyUpdate(modelPath, basePath, residualPath, updatePath, tenth));
+        CHECK(densifyUpdate(updatePath, basePath, decodedPath));
+        std::vector<float> model = tensor(decodedPath, "w");
+        std::vector<float> residual = tensor(residualPath, "w");
+        CHECK(model.size() == count && residual.size() == count);
+        if (model.size() != count || residual.size() != count) {
+            break;
+        }
+        std::vector<float> update(count);
+        float smallestSent = INFINITY;
+        float largestKept = 0;
+        for (size_t i = 0; i < count; i++) {
+            update[i] = model[i] - base[i];
+            // This round's update is the change plus what the last round kept, split between
+            // what is sent and what is kept
+            CHECK(update[i] + residual[i] == change[i] + carried[i]);
+            CHECK(update[i] == 0.0f || residual[i] == 0.0f);
+            if (update[i] != 0.0f) {
+                smallestSent = std::min(smallestSent, std::fabs(update[i]));
+            }
+            largestKept = std::max(largestKept, std::fabs(residual[i]));
+            sent[i] += update[i];
+        }
+        CHECK(nonZeros(update) <= count / 10);
+        CHECK(smallestSent >= largestKept);
+        carried = residual;
+    }
+    // Over the rounds, the sent updates and the residual add up to three changes
+    for (size_t i = 0; i < count; i++) {
+        CHECK(sent[i] + carried[i] == 3 * change[i]);
+    }
+
+    // Without a residual file, what is not sent is dropped
+    CHECK(sparsifyUpdate(modelPath, basePath, "", updatePath, tenth));
+    CHECK(densifyUpdate(updatePath, basePath, decodedPath));
+    CHECK(tensor(decodedPath, "w").size() == count);
+
+    // Ratios outside (0, 1] are refused
+    for (double ratio : {0.0, -0.5, 1.5, double(NAN)}) {
+        SparsifyOptions invalid;
+        invalid.ratio = ratio;
+        CHECK(!sparsifyUpdate(modelPath, basePath, residualPath, updatePath, invalid));
+    }
+
+    std::filesystem::remove_all(directory);
+    return checkFailures() != 0;
+}